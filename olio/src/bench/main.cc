@@ -0,0 +1,450 @@
+// ======================================================================
+// Olio: Simple renderer
+// Copyright (C) 2022 by Hadi Fadaifard
+//
+// Author: Hadi Fadaifard, 2022
+// ======================================================================
+
+//! \file       main.cc
+//! \brief      Integrator benchmark: renders scenes with each integrator
+//!             and reports the achieved ray throughput
+
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <spdlog/spdlog.h>
+
+#include "core/types.h"
+#include "core/node.h"
+#include "core/camera/camera.h"
+#include "core/geometry/surface.h"
+#include "core/parser/raytra_parser.h"
+#include "core/renderer/raytracer.h"
+#include "core/utils/segfault_handler.h"
+#include "core/utils/perf_counter.h"
+#include "core/light/light.h"
+#include "core/geometry/surface_list.h"
+#include "core/geometry/sphere.h"
+#include "core/geometry/instance.h"
+#include "core/geometry/bvh_node.h"
+#include "core/geometry/trimesh_bvh.h"
+
+using namespace olio::core;
+using namespace std;
+namespace po = boost::program_options;
+
+//! \struct Arguments
+//! \brief Command line arguments
+struct Arguments {
+  std::vector<std::string> scene_names;  //!< input scene files
+  uint samples_per_pixel{4};      //!< samples per pixel
+  uint shadow_samples{4};         //!< area light shadow samples
+  uint image_height{0};           //!< image height (0: scene's)
+  uint tile_size{32};             //!< render tile edge length
+  uint num_threads{0};            //!< render threads (0: all cores)
+  uint wavefront_size{4096};      //!< max paths per wavefront
+  uint packet_size{16};           //!< wavefront rays per packet
+  std::string bvh_builder{"sah"}; //!< BVH split method
+  uint bvh_bins{16};              //!< SAH bins per axis
+  uint bvh_morton_bits{63};       //!< LBVH Morton code bits
+  Real bvh_max_duplication{0.5};  //!< SBVH extra references (fraction)
+  bool bvh_packed_meshes{true};   //!< store mesh triangles in BVH leaves
+  uint bvh_leaf_size{8};          //!< maximum triangles per mesh BVH leaf
+  bool bvh_quantized{false};      //!< 8-bit mesh BVH node bounds
+  bool bvh_veb_layout{false};     //!< van Emde Boas BVH node order
+  std::string bvh_layout{"linear"};  //!< BVH memory layout
+  std::string bvh_cache_dir;      //!< mesh BVH cache (empty: none)
+  bool bvh_stats{false};          //!< count BVH node visits
+  uint repeat{1};                 //!< renders per scene and integrator
+  uint turntable{0};              //!< turntable frames (0: none)
+};
+
+
+bool ParseArguments(int argc, char **argv, Arguments *args) {
+  po::options_description desc("options");
+  po::positional_options_description positional;
+  positional.add("scenes", -1);
+  try {
+    desc.add_options()
+      ("help,h", "print usage")
+      ("scenes,s",
+       po::value             (&args->scene_names)->multitoken()->required(),
+       "Input scene files")
+      ("samples_per_pixel,a",
+       po::value             (&args->samples_per_pixel)->default_value(4),
+       "Samples per pixel")
+      ("shadow_samples,d",
+       po::value             (&args->shadow_samples)->default_value(4),
+       "Area light shadow samples")
+      ("image_height,r",
+       po::value             (&args->image_height)->default_value(0),
+       "Image height (0: use the scene's image size)")
+      ("tile_size,t",
+       po::value             (&args->tile_size)->default_value(32),
+       "Render tile size in pixels")
+      ("threads,j",
+       po::value             (&args->num_threads)->default_value(0),
+       "Number of render and BVH build threads (0: all cores)")
+      ("wavefront_size",
+       po::value             (&args->wavefront_size)->default_value(4096),
+       "Max paths traced together by the wavefront integrator")
+      ("packet_size",
+       po::value             (&args->packet_size)->default_value(16),
+       "Rays per packet of the wavefront integrator (0 or 1: no packets)")
+      ("bvh_builder",
+       po::value             (&args->bvh_builder)->default_value("sah"),
+       "BVH builder: sah (binned surface area heuristic), sbvh (SAH "
+       "with spatial splits of large overlapping surfaces), lbvh (Morton "
+       "code order; fastest build), or median (median split on "
+       "round-robin axes)")
+      ("bvh_bins",
+       po::value             (&args->bvh_bins)->default_value(16),
+       "SAH BVH builder: bins per axis")
+      ("bvh_morton_bits",
+       po::value             (&args->bvh_morton_bits)->default_value(63),
+       "LBVH builder: Morton code bits (30 or 63)")
+      ("bvh_max_duplication",
+       po::value             (&args->bvh_max_duplication)->default_value(0.5),
+       "SBVH builder: extra surface references from spatial splits, as "
+       "a fraction of the surface count (memory cap)")
+      ("bvh_packed_meshes",
+       po::value             (&args->bvh_packed_meshes)->default_value(true),
+       "Linear layout with sah or lbvh builder: store mesh triangles in "
+       "the BVH leaves instead of one surface object per face (0 or 1)")
+      ("bvh_leaf_size",
+       po::value             (&args->bvh_leaf_size)->default_value(8),
+       "Packed mesh BVHs: maximum triangles per leaf (2 to 64); the SAH "
+       "picks the size of each leaf")
+      ("bvh_quantized",
+       po::value             (&args->bvh_quantized)->default_value(false),
+       "Packed mesh BVHs: store 24-byte nodes with 8-bit child bounds "
+       "instead of 32-byte nodes per child; smaller, but looser bounds "
+       "(0 or 1)")
+      ("bvh_veb_layout",
+       po::value             (&args->bvh_veb_layout)->default_value(false),
+       "Wide layouts and quantized mesh BVHs: store the nodes in van "
+       "Emde Boas order instead of depth-first, so that subtrees share "
+       "cache lines and pages (0 or 1)")
+      ("bvh_layout",
+       po::value             (&args->bvh_layout)->default_value("linear"),
+       "BVH layout: linear (flat array of 32-byte nodes), wide4 or "
+       "wide8 (4 or 8 children per node), or tree (linked BVHNode "
+       "objects)")
+      ("bvh_cache_dir",
+       po::value             (&args->bvh_cache_dir),
+       "Packed mesh BVHs: read and store the BVHs of meshes in this "
+       "directory, keyed by a hash of the mesh and the builder settings")
+      ("bvh_stats",
+       po::bool_switch       (&args->bvh_stats),
+       "Count the BVH nodes visited per ray (nodes/ray column); counting "
+       "slows down rendering")
+      ("repeat",
+       po::value             (&args->repeat)->default_value(1),
+       "Renders per scene and integrator (the fastest one is reported)")
+      ("turntable",
+       po::value             (&args->turntable)->default_value(0),
+       "Then render this many frames with the wavefront integrator while "
+       "the spheres and instances orbit the scene's vertical axis; each "
+       "frame refits the BVH, and reports the time of a full rebuild for "
+       "comparison (0: none)");
+
+    // parse arguments
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).
+              positional(positional).run(), vm);
+    if (vm.count("help")) {
+      cout << desc << endl;
+      return false;
+    }
+    po::notify(vm);
+    if (args->bvh_builder != "sah" && args->bvh_builder != "sbvh" &&
+        args->bvh_builder != "lbvh" && args->bvh_builder != "median")
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_builder", args->bvh_builder);
+    if (args->bvh_morton_bits != 30 && args->bvh_morton_bits != 63)
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_morton_bits",
+                                 std::to_string(args->bvh_morton_bits));
+    if (!(args->bvh_max_duplication >= 0))
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_max_duplication",
+                                 std::to_string(args->bvh_max_duplication));
+    if (args->bvh_leaf_size < 2 || args->bvh_leaf_size > 64)
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_leaf_size",
+                                 std::to_string(args->bvh_leaf_size));
+    if (args->bvh_layout != "linear" && args->bvh_layout != "wide4" &&
+        args->bvh_layout != "wide8" && args->bvh_layout != "tree")
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_layout", args->bvh_layout);
+  } catch(std::exception &e) {
+    cout << desc << endl;
+    spdlog::error("{}", e.what());
+    return false;
+  } catch(...) {
+    cout << desc << endl;
+    spdlog::error("Invalid arguments");
+    return false;
+  }
+  return true;
+}
+
+
+//! \brief Apply the render settings shared by all benchmark renders
+//! \param[in] args Command line arguments
+//! \param[in] image_height Image height
+//! \param[out] rt Ray tracer to configure
+void
+ConfigureRayTracer(const Arguments &args, uint image_height, RayTracer &rt)
+{
+  rt.SetNumSamplesPerPixel(args.samples_per_pixel);
+  rt.SetTileSize(args.tile_size);
+  rt.SetNumThreads(args.num_threads);
+  rt.SetWavefrontSize(args.wavefront_size);
+  rt.SetPacketSize(args.packet_size);
+  rt.SetImageHeight(image_height);
+  rt.SetProgressInterval(1e6);
+}
+
+
+//! \brief Render a turntable animation of a scene's spheres and instances
+//! \details Each frame rotates the spheres and instances about the
+//!    vertical (y) axis through the scene center, refits the scene BVH,
+//!    and renders with the wavefront integrator. A rebuild of the BVH
+//!    from scratch is timed (and discarded) for comparison.
+//! \param[in] args Command line arguments
+//! \param[in] scene_name Scene name printed in the table
+//! \param[in] surfaces Surfaces of the scene BVH
+//! \param[in] bvh_tree Scene BVH built by BVHNode::BuildAccelerator()
+//! \param[in] lights Scene lights
+//! \param[in] camera Scene camera
+//! \param[in] image_height Image height
+void
+RenderTurntable(const Arguments &args, const string &scene_name,
+                const vector<Surface::Ptr> &surfaces,
+                const Surface::Ptr &bvh_tree,
+                const vector<Light::Ptr> &lights, const Camera::Ptr &camera,
+                uint image_height)
+{
+  // the moving surfaces, and their poses in the first frame
+  vector<shared_ptr<Sphere>> spheres;
+  vector<Vec3r> centers;
+  vector<shared_ptr<Instance>> instances;
+  vector<Mat4r> xforms;
+  for (const auto &surface : surfaces) {
+    if (auto sphere = dynamic_pointer_cast<Sphere>(surface)) {
+      spheres.push_back(sphere);
+      centers.push_back(sphere->GetCenter());
+    } else if (auto instance = dynamic_pointer_cast<Instance>(surface)) {
+      instances.push_back(instance);
+      xforms.push_back(instance->GetTransform());
+    }
+  }
+  if (spheres.empty() && instances.empty()) {
+    spdlog::warn("{} has no spheres or instances -- skipping turntable",
+                 scene_name);
+    return;
+  }
+
+  cout << fmt::format("{:<32} {:>6} {:>8} {:>10} {:>10} {:>10} {:>10}\n",
+                      "turntable", "frame", "moved", "refit (s)", "rebuilt",
+                      "build (s)", "time (s)");
+  const auto &bvh_options = BVHNode::GetBuildOptions();
+  Vec3r pivot = bvh_tree->GetBoundingBox().GetCenter();
+  for (uint frame = 1; frame <= args.turntable; ++frame) {
+    Real angle = 2 * kPi * static_cast<Real>(frame) /
+      static_cast<Real>(args.turntable);
+    Mat4r rotation = Mat4r::Identity();
+    rotation.block<3, 3>(0, 0) =
+      Eigen::AngleAxis<Real>(angle, Vec3r::UnitY()).toRotationMatrix();
+    Mat4r to_pivot = Mat4r::Identity();
+    to_pivot.block<3, 1>(0, 3) = pivot;
+    Mat4r from_pivot = Mat4r::Identity();
+    from_pivot.block<3, 1>(0, 3) = -pivot;
+    Mat4r orbit = to_pivot * rotation * from_pivot;
+    for (size_t i = 0; i < spheres.size(); ++i)
+      spheres[i]->SetCenter(XformPoint(orbit, centers[i]));
+    for (size_t i = 0; i < instances.size(); ++i)
+      instances[i]->SetTransform(orbit * xforms[i]);
+
+    auto log_level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    auto start_time = chrono::steady_clock::now();
+    BVHRefitStats refit_stats;
+    bool is_refit = BVHNode::RefitAccelerator(bvh_tree, bvh_options,
+                                              refit_stats);
+    auto refit_time = chrono::steady_clock::now();
+    if (!is_refit) {
+      spdlog::set_level(log_level);
+      return;
+    }
+    BVHNode::BuildAccelerator(surfaces, string{"Scene Objects"});
+    auto build_time = chrono::steady_clock::now();
+    RayTracer rt;
+    ConfigureRayTracer(args, image_height, rt);
+    rt.SetIntegrator(Integrator::kWavefront);
+    rt.Render(bvh_tree, lights, camera);
+    spdlog::set_level(log_level);
+    cout << fmt::format("{:<32} {:>6} {:>8} {:>10.4f} {:>10} {:>10.4f} "
+                        "{:>10.3f}\n", boost::filesystem::path(scene_name).
+                        filename().string(), frame,
+                        refit_stats.moved_surfaces, chrono::duration<double>(
+                          refit_time - start_time).count(),
+                        refit_stats.rebuilt_surfaces,
+                        chrono::duration<double>(build_time -
+                                                 refit_time).count(),
+                        rt.GetRenderTime())
+         << flush;
+  }
+}
+
+
+int
+main(int argc, char **argv)
+{
+  utils::InstallSegfaultHandler();
+
+  // parse command line arguments
+  Arguments args;
+  if (!ParseArguments(argc, argv, &args))
+    return -1;
+
+  //! \struct Config
+  //! \brief Integrator configuration to benchmark
+  struct Config {
+    Integrator integrator;  //!< integrator
+    bool sort_rays;         //!< sort secondary rays (wavefront only)
+    std::string name;       //!< name printed in the table
+  };
+  const std::vector<Config> configs = {
+    {Integrator::kRecursive, false, "recursive"},
+    {Integrator::kWavefront, false, "wavefront"},
+    {Integrator::kWavefront, true, "wf+sort"}};
+
+  // the "2nd" and "sort" columns show the thread time of tracing
+  // secondary rays, and of sorting them; "nodes/ray" counts the BVH
+  // nodes visited per camera, secondary, or shadow ray (n/a without
+  // --bvh_stats), and "misses/ray" the hardware cache misses of the
+  // render threads per ray (n/a without hardware counters)
+  utils::CacheMissCounter cache_misses;
+  if (!cache_misses.IsAvailable())
+    spdlog::warn("Hardware cache-miss counters are unavailable");
+  cout << fmt::format("{:<32} {:<10} {:>10} {:>12} {:>10} {:>8} {:>10} "
+                      "{:>10} {:>10} {:>10}\n", "scene", "integrator",
+                      "time (s)", "rays", "Mrays/s", "speedup", "2nd (s)",
+                      "sort (s)", "nodes/ray", "misses/ray");
+  BVHBuildOptions bvh_options;
+  if (args.bvh_builder == "median")
+    bvh_options.split_method = BVHSplitMethod::kMedian;
+  else if (args.bvh_builder == "sbvh")
+    bvh_options.split_method = BVHSplitMethod::kSBVH;
+  else if (args.bvh_builder == "lbvh")
+    bvh_options.split_method = BVHSplitMethod::kLBVH;
+  else
+    bvh_options.split_method = BVHSplitMethod::kSAH;
+  bvh_options.bin_count = args.bvh_bins;
+  bvh_options.morton_bits = args.bvh_morton_bits;
+  bvh_options.max_duplication = args.bvh_max_duplication;
+  bvh_options.packed_meshes = args.bvh_packed_meshes;
+  bvh_options.max_leaf_size = args.bvh_leaf_size;
+  bvh_options.quantized_nodes = args.bvh_quantized;
+  bvh_options.veb_layout = args.bvh_veb_layout;
+  if (args.bvh_layout == "tree")
+    bvh_options.layout = BVHLayout::kTree;
+  else if (args.bvh_layout == "wide4")
+    bvh_options.layout = BVHLayout::kWide4;
+  else if (args.bvh_layout == "wide8")
+    bvh_options.layout = BVHLayout::kWide8;
+  else
+    bvh_options.layout = BVHLayout::kLinear;
+  bvh_options.num_threads = args.num_threads;
+  BVHNode::SetBuildOptions(bvh_options);
+  BVHStats::SetCollectTraversalStats(args.bvh_stats);
+  TriMeshBVH::SetCacheDirectory(args.bvh_cache_dir);
+  for (const auto &scene_name : args.scene_names) {
+    // parse scene and build its BVH
+    Vec2i image_size;
+    Surface::Ptr scene;
+    vector<Light::Ptr> lights;
+    Camera::Ptr camera;
+    if (!RaytraParser::ParseFile(scene_name, scene, lights, camera,
+                                 image_size) || !scene || !camera ||
+        image_size[0] <= 0 || image_size[1] <= 0) {
+      spdlog::error("Failed to parse scene file {} -- skipping it.",
+                    scene_name);
+      continue;
+    }
+    auto scenelist_ptr = dynamic_pointer_cast<SurfaceList>(scene);
+    if (!scenelist_ptr) {
+      spdlog::error("Failed to convert to SurfaceList class -- skipping {}.",
+                    scene_name);
+      continue;
+    }
+    for (auto &light : lights) {
+      auto area_light = dynamic_pointer_cast<AreaLight>(light);
+      if (area_light)
+        area_light->SetShadowSamples(args.shadow_samples);
+    }
+    auto bvh_tree = BVHNode::BuildAccelerator(scenelist_ptr->GetSurfaces(),
+                                              string{"Scene Objects"});
+
+    // render with each integrator
+    auto image_height = args.image_height ? args.image_height :
+      static_cast<uint>(image_size[1]);
+    double baseline_mrays = 0;
+    for (const auto &config : configs) {
+      double best_time = 0;
+      uint64_t rays = 0;
+      WavefrontStats stats;
+      BVHTraversalStats traversal_stats;
+      uint64_t misses = 0;
+      for (uint i = 0; i < std::max(args.repeat, 1u); ++i) {
+        RayTracer rt;
+        ConfigureRayTracer(args, image_height, rt);
+        rt.SetIntegrator(config.integrator);
+        rt.SetSortSecondaryRays(config.sort_rays);
+        auto log_level = spdlog::get_level();
+        spdlog::set_level(spdlog::level::warn);
+        BVHStats::ResetTraversalStats();
+        uint64_t start_misses = cache_misses.GetCount();
+        rt.Render(bvh_tree, lights, camera);
+        uint64_t render_misses = cache_misses.GetCount() - start_misses;
+        spdlog::set_level(log_level);
+        if (i == 0 || rt.GetRenderTime() < best_time) {
+          best_time = rt.GetRenderTime();
+          stats = rt.GetWavefrontStats();
+          traversal_stats = BVHStats::GetTraversalStats();
+          misses = render_misses;
+        }
+        rays = rt.GetNumTracedRays();
+      }
+      double mrays = best_time > 0 ?
+        static_cast<double>(rays) / best_time * 1e-6 : 0;
+      if (config.integrator == Integrator::kRecursive)
+        baseline_mrays = mrays;
+      double speedup = baseline_mrays > 0 ? mrays / baseline_mrays : 0;
+      string node_visits = "n/a";
+      if (args.bvh_stats && traversal_stats.rays)
+        node_visits = fmt::format("{:.1f}", static_cast<double>(
+          traversal_stats.node_visits) /
+          static_cast<double>(traversal_stats.rays));
+      string misses_per_ray = "n/a";
+      if (cache_misses.IsAvailable() && rays)
+        misses_per_ray = fmt::format("{:.2f}", static_cast<double>(misses) /
+                                     static_cast<double>(rays));
+      cout << fmt::format("{:<32} {:<10} {:>10.3f} {:>12} {:>10.3f} {:>7.2f}x "
+                          "{:>10.3f} {:>10.3f} {:>10} {:>10}\n",
+                          boost::filesystem::path(scene_name).filename().
+                          string(), config.name, best_time, rays, mrays,
+                          speedup, stats.secondary_time, stats.sort_time,
+                          node_visits, misses_per_ray)
+           << flush;
+    }
+    if (args.turntable)
+      RenderTurntable(args, scene_name, scenelist_ptr->GetSurfaces(),
+                      bvh_tree, lights, camera, image_height);
+  }
+  return 0;
+}
@@ -55,6 +55,17 @@ AABB::ExpandBy(const AABB &other)
 }
 
 
+Real
+AABB::GetSurfaceArea() const
+{
+  if (!IsValid())
+    return 0;
+  Vec3r extent = max_ - min_;
+  return 2 * (extent[0] * extent[1] + extent[1] * extent[2] +
+              extent[2] * extent[0]);
+}
+
+
 AABB
 AABB::IntersectWith(const AABB &other) const
 {
@@ -88,6 +99,14 @@ AABB::IsPointInside(const Vec3r &point) const
 
 bool
 AABB::Hit(const Ray &ray, Real tmin, Real tmax) const
+{
+  Real t_entry;
+  return Hit(ray, tmin, tmax, t_entry);
+}
+
+
+bool
+AABB::Hit(const Ray &ray, Real tmin, Real tmax, Real &t_entry) const
 {
   if (!IsValid())
     return false;
@@ -108,10 +127,45 @@ AABB::Hit(const Ray &ray, Real tmin, Real tmax) const
     // if (tmax <= tmin)
     //   return false;
   }
+  t_entry = tmin;
   return true;
 }
 
 
+PacketMask
+AABB::HitPacket(const RayPacket &packet, const PacketMask &active, Real tmin,
+                const PacketReal &tmax) const
+{
+  if (!IsValid())
+    return PacketMask::Constant(false);
+
+  // same slab test as Hit(), written as plain loops over the lanes so
+  // that the compiler turns them into SIMD instructions
+  Real lane_tmin[kMaxPacketSize];
+  Real lane_tmax[kMaxPacketSize];
+  for (int lane = 0; lane < kMaxPacketSize; ++lane) {
+    lane_tmin[lane] = tmin;
+    lane_tmax[lane] = tmax[lane];
+  }
+  for (int i = 0; i < 3; ++i) {
+    const Real *origin = packet.GetOrigin(i).data();
+    const Real *dir_inv = packet.GetInvDirection(i).data();
+    for (int lane = 0; lane < kMaxPacketSize; ++lane) {
+      Real t0 = (min_[i] - origin[lane]) * dir_inv[lane];
+      Real t1 = (max_[i] - origin[lane]) * dir_inv[lane];
+      Real t_near = dir_inv[lane] < 0.0f ? t1 : t0;
+      Real t_far = dir_inv[lane] < 0.0f ? t0 : t1;
+      lane_tmin[lane] = t_near > lane_tmin[lane] ? t_near : lane_tmin[lane];
+      lane_tmax[lane] = t_far < lane_tmax[lane] ? t_far : lane_tmax[lane];
+    }
+  }
+  PacketMask hit;
+  for (int lane = 0; lane < kMaxPacketSize; ++lane)
+    hit[lane] = active[lane] && !(lane_tmax[lane] < lane_tmin[lane]);
+  return hit;
+}
+
+
 AABB
 operator*(const Mat4r &xform, const AABB &bbox)
 {
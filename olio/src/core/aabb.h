@@ -7,6 +7,7 @@
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/bundled/ostream.h>
 #include "core/types.h"
+#include "core/ray_packet.h"
 
 namespace olio {
 namespace core {
@@ -50,6 +51,14 @@ public:
   //! \return Intersecting bbox
   AABB IntersectWith(const AABB &other) const;
 
+  //! \brief Get center of bbox
+  //! \return center coordinates
+  inline Vec3r GetCenter() const {return (min_ + max_) * .5;}
+
+  //! \brief Compute surface area of bbox
+  //! \return Surface area (0 if the bbox is invalid)
+  Real GetSurfaceArea() const;
+
   //! \brief Check if point is inside bbox (inclusive)
   //! \param[in] point point to check
   //! \return True if point is inside
@@ -62,6 +71,26 @@ public:
   //! \return True if ray intersected with aabb
   bool Hit(const Ray &ray, Real tmin, Real tmax) const;
 
+  //! \brief Check if ray intersects with aabb, and where it enters it
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[out] t_entry Largest of 'tmin' and the t at which the ray
+  //!    enters the aabb (only set if the ray intersected)
+  //! \return True if ray intersected with aabb
+  bool Hit(const Ray &ray, Real tmin, Real tmax, Real &t_entry) const;
+
+  //! \brief Check which rays of a packet intersect with aabb
+  //! \details Computes the same slab test as Hit() for all lanes at
+  //!    once.
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with aabb
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, const PacketReal &tmax) const;
+
   //! \brief Use * operator to transform min and max coordinates by a matrix
   //! \param[in] xform 4x4 matrix to xform by
   //! \param[in] bbox input bbox
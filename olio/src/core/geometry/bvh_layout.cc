@@ -0,0 +1,79 @@
+//! \file       bvh_layout.cc
+//! \brief      Cache-oblivious BVH node order
+
+#include <algorithm>
+#include "core/geometry/bvh_layout.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! \brief Assign the van Emde Boas order to the top levels of a subtree
+//! \param[in] children Interior child nodes, 'width' slots per node
+//! \param[in] width Child slots per node
+//! \param[in] heights Height of each node's subtree (leaf nodes: 1)
+//! \param[in] root Subtree root
+//! \param[in] height Number of levels to lay out
+//! \param[in,out] order New index of each node
+//! \param[in,out] next_index Next free index
+void LayOutSubtree(const vector<uint32_t> &children, uint width,
+                   const vector<uint> &heights, uint32_t root, uint height,
+                   vector<uint32_t> &order, uint32_t &next_index)
+{
+  if (height <= 1) {
+    order[root] = next_index++;
+    return;
+  }
+
+  // top tree first, then the bottom trees, left to right
+  uint top_height = height / 2;
+  LayOutSubtree(children, width, heights, root, top_height, order,
+                next_index);
+  vector<uint32_t> level{root}, next_level;
+  for (uint depth = 0; depth < top_height; ++depth) {
+    next_level.clear();
+    for (auto node : level) {
+      for (size_t i = node * size_t{width}; i < (node + 1) * size_t{width};
+           ++i) {
+        if (children[i] != kNoChildNode)
+          next_level.push_back(children[i]);
+      }
+    }
+    level.swap(next_level);
+  }
+  for (auto node : level)
+    LayOutSubtree(children, width, heights, node,
+                  std::min(height - top_height, heights[node]), order,
+                  next_index);
+}
+
+}  // namespace
+
+
+std::vector<uint32_t>
+ComputeVanEmdeBoasOrder(const std::vector<uint32_t> &children, uint width)
+{
+  size_t node_count = width ? children.size() / width : 0;
+  vector<uint32_t> order(node_count, kNoChildNode);
+  if (!node_count)
+    return order;
+
+  // children come after their parents, so a backward pass sees the
+  // children's heights first
+  vector<uint> heights(node_count, 1);
+  for (size_t node = node_count; node-- > 0;) {
+    for (size_t i = node * width; i < (node + 1) * width; ++i) {
+      if (children[i] != kNoChildNode)
+        heights[node] = std::max(heights[node], heights[children[i]] + 1);
+    }
+  }
+  uint32_t next_index = 0;
+  LayOutSubtree(children, width, heights, 0, heights[0], order, next_index);
+  return order;
+}
+
+}  // namespace core
+}  // namespace olio
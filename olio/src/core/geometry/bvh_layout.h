@@ -0,0 +1,34 @@
+//! \file       bvh_layout.h
+//! \brief      Cache-oblivious BVH node order
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "core/types.h"
+
+namespace olio {
+namespace core {
+
+//! Child slot without an interior node (leaf or unused slot)
+const uint32_t kNoChildNode = ~uint32_t{0};
+
+//! \brief Compute the van Emde Boas order of a tree's nodes
+//! \details The tree of height h is split into a top tree of the
+//!    upper h/2 levels and the bottom trees below it; the top tree is
+//!    laid out first, then each bottom tree, each of them recursively
+//!    in the same way. Any subtree a traversal descends through is then
+//!    stored in a few contiguous runs, whatever the size of a cache
+//!    line or page, and the top levels of the tree, which every ray
+//!    visits, are packed at the start. Parents stay before their
+//!    children, and the root stays first.
+//! \param[in] children Interior child nodes, 'width' slots per node
+//!    (kNoChildNode: leaf or unused slot); children must come after
+//!    their parents
+//! \param[in] width Child slots per node
+//! \return New index of each node
+std::vector<uint32_t> ComputeVanEmdeBoasOrder(
+  const std::vector<uint32_t> &children, uint width);
+
+}  // namespace core
+}  // namespace olio
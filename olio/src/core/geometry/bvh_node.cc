@@ -1,16 +1,232 @@
 //! \file       bvh_node.cc
 //! \brief      BVHNode class
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+#include <tbb/tbb.h>
 #include <spdlog/spdlog.h>
 #include "core/ray.h"
 #include "core/material/material.h"
 #include "core/geometry/bvh_node.h"
+#include "core/geometry/linear_bvh.h"
+#include "core/geometry/wide_bvh.h"
 
 namespace olio {
 namespace core {
 
 using namespace std;
 
+namespace {
+
+//! Depth down to which BVHNode::Refit() handles the two children of a
+//! node in parallel
+const uint kParallelRefitDepth = 10;
+
+//! Surface count from which the surfaces of a node are binned and
+//! partitioned in parallel
+const size_t kParallelRangeSize = 16384;
+
+//! Surfaces per parallel binning/partition task. The chunks don't
+//! depend on the thread count, which keeps the builds deterministic
+const size_t kParallelGrainSize = 4096;
+
+//! \brief Reduce a range of indices, in parallel if it is large
+//! \param[in] start First index
+//! \param[in] end Index after the last one
+//! \param[in] identity Identity value of the reduction
+//! \param[in] reduce Function (begin, end, value) that reduces the
+//!    indices [begin, end) into 'value' and returns the result
+//! \param[in] join Function that combines two partial results. It must
+//!    be associative (e.g., bbox union, sum of counts)
+//! \return Reduced value
+template <typename T, typename Reduce, typename Join>
+T
+ReduceRange(size_t start, size_t end, const T &identity, Reduce reduce,
+            Join join)
+{
+  if (end - start < kParallelRangeSize)
+    return reduce(start, end, identity);
+  return tbb::parallel_reduce(
+    tbb::blocked_range<size_t>(start, end, kParallelGrainSize), identity,
+    [&](const tbb::blocked_range<size_t> &range, T value) {
+      return reduce(range.begin(), range.end(), value);
+    }, join);
+}
+
+
+//! \brief Stable partition of a range of values, in parallel if it is
+//! large
+//! \details Gives the same result as std::stable_partition().
+//! \param[in,out] values Values to partition
+//! \param[in] start First value of the range
+//! \param[in] end Value after the last one in the range
+//! \param[in] predicate Values for which it returns true go first
+//! \return Index of the first value of the second group
+template <typename T, typename Predicate>
+size_t
+StablePartition(std::vector<T> &values, size_t start, size_t end,
+                Predicate predicate)
+{
+  T *first = values.data() + start;
+  size_t count = end - start;
+  if (count < kParallelRangeSize) {
+    T *middle = std::stable_partition(first, first + count, predicate);
+    return start + static_cast<size_t>(middle - first);
+  }
+
+  // count the values of the first group in fixed-size chunks
+  size_t chunk_count = (count + kParallelGrainSize - 1) / kParallelGrainSize;
+  std::vector<size_t> chunk_offsets(chunk_count + 1, 0);
+  tbb::parallel_for(size_t{0}, chunk_count, [&](size_t chunk) {
+    size_t chunk_end = std::min(count, (chunk + 1) * kParallelGrainSize);
+    size_t first_count = 0;
+    for (size_t i = chunk * kParallelGrainSize; i < chunk_end; ++i) {
+      if (predicate(first[i]))
+        ++first_count;
+    }
+    chunk_offsets[chunk + 1] = first_count;
+  });
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk)
+    chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+  size_t first_group_count = chunk_offsets[chunk_count];
+
+  // scatter the chunks in order, then copy the result back
+  std::vector<T> partitioned(count);
+  tbb::parallel_for(size_t{0}, chunk_count, [&](size_t chunk) {
+    size_t chunk_begin = chunk * kParallelGrainSize;
+    size_t chunk_end = std::min(count, chunk_begin + kParallelGrainSize);
+    size_t first_index = chunk_offsets[chunk];
+    size_t second_index = first_group_count + chunk_begin - first_index;
+    for (size_t i = chunk_begin; i < chunk_end; ++i) {
+      if (predicate(first[i]))
+        partitioned[first_index++] = first[i];
+      else
+        partitioned[second_index++] = first[i];
+    }
+  });
+  tbb::parallel_for(size_t{0}, chunk_count, [&](size_t chunk) {
+    size_t chunk_begin = chunk * kParallelGrainSize;
+    size_t chunk_end = std::min(count, chunk_begin + kParallelGrainSize);
+    std::copy(partitioned.begin() + static_cast<ptrdiff_t>(chunk_begin),
+              partitioned.begin() + static_cast<ptrdiff_t>(chunk_end),
+              first + chunk_begin);
+  });
+  return start + first_group_count;
+}
+
+//! SBVH: overlap of the two halves of an object split, relative to the
+//! root bbox area, above which spatial splits are evaluated
+const Real kSpatialSplitOverlap = 1e-5;
+
+//! Bits per radix sort pass
+const uint kRadixBits = 8;
+
+//! Buckets per radix sort pass
+const size_t kRadixSize = size_t{1} << kRadixBits;
+
+
+//! \brief Spread the lowest 21 bits of a value to every third bit
+//! \param[in] value Value to spread
+//! \return Bit i of 'value' at bit 3 * i
+inline uint64_t
+SpreadBits(uint64_t value)
+{
+  value &= 0x1fffff;
+  value = (value | value << 32) & 0x1f00000000ffffull;
+  value = (value | value << 16) & 0x1f0000ff0000ffull;
+  value = (value | value << 8) & 0x100f00f00f00f00full;
+  value = (value | value << 4) & 0x10c30c30c30c30c3ull;
+  value = (value | value << 2) & 0x1249249249249249ull;
+  return value;
+}
+
+
+//! \brief Stable LSD radix sort, in parallel if the values are many
+//! \details Sorts by 'kRadixBits' bits per pass. Each pass counts the
+//!    digits of fixed-size chunks in parallel, and then scatters the
+//!    chunks in parallel. Passes in which all keys have the same digit
+//!    are skipped.
+//! \param[in,out] values Values to sort
+//! \param[in] first_bit Lowest key bit to sort by
+//! \param[in] end_bit Bit after the highest key bit to sort by
+//! \param[in] key Function that returns the (uint64_t) key of a value
+template <typename T, typename Key>
+void
+RadixSort(std::vector<T> &values, uint first_bit, uint end_bit, Key key)
+{
+  const size_t count = values.size();
+  const size_t chunk_count = std::max<size_t>(
+    1, (count + kParallelGrainSize - 1) / kParallelGrainSize);
+  std::vector<T> sorted(count);
+  std::vector<size_t> offsets(chunk_count * kRadixSize);
+  for (uint shift = first_bit; shift < end_bit; shift += kRadixBits) {
+    // count the digits of each chunk
+    tbb::parallel_for(size_t{0}, chunk_count, [&](size_t chunk) {
+      size_t *chunk_offsets = offsets.data() + chunk * kRadixSize;
+      std::fill(chunk_offsets, chunk_offsets + kRadixSize, 0);
+      size_t chunk_end = std::min(count, (chunk + 1) * kParallelGrainSize);
+      for (size_t i = chunk * kParallelGrainSize; i < chunk_end; ++i)
+        ++chunk_offsets[(key(values[i]) >> shift) & (kRadixSize - 1)];
+    });
+
+    // turn the counts into the output offsets of each chunk's digits:
+    // digit by digit, and chunk by chunk within a digit
+    size_t offset = 0;
+    bool is_sorted = false;
+    for (size_t digit = 0; digit < kRadixSize; ++digit) {
+      size_t digit_count = 0;
+      for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+        size_t &chunk_offset = offsets[chunk * kRadixSize + digit];
+        size_t chunk_digit_count = chunk_offset;
+        chunk_offset = offset;
+        offset += chunk_digit_count;
+        digit_count += chunk_digit_count;
+      }
+      if (digit_count == count)
+        is_sorted = true;
+    }
+    if (is_sorted)
+      continue;
+
+    // scatter
+    tbb::parallel_for(size_t{0}, chunk_count, [&](size_t chunk) {
+      size_t *chunk_offsets = offsets.data() + chunk * kRadixSize;
+      size_t chunk_end = std::min(count, (chunk + 1) * kParallelGrainSize);
+      for (size_t i = chunk * kParallelGrainSize; i < chunk_end; ++i)
+        sorted[chunk_offsets[(key(values[i]) >> shift) & (kRadixSize - 1)]++] =
+          values[i];
+    });
+    values.swap(sorted);
+  }
+}
+
+
+//! Whether built BVHs record their statistics
+bool is_collecting_tree_stats = false;
+
+//! Statistics of the built BVHs (guarded by 'tree_stats_mutex')
+vector<BVHTreeStats> tree_stats;
+std::mutex tree_stats_mutex;
+
+}  // namespace
+
+// initialize static data members
+BVHBuildOptions BVHNode::build_options_;
+
+
+void
+BVHRefitStats::Add(const BVHRefitStats &other)
+{
+  moved_surfaces += other.moved_surfaces;
+  refit_nodes += other.refit_nodes;
+  rebuilt_subtrees += other.rebuilt_subtrees;
+  rebuilt_surfaces += other.rebuilt_surfaces;
+}
+
+
 BVHNode::BVHNode(const std::string &name) :
   Surface{}
 {
@@ -30,6 +246,8 @@ BVHNode::GetBoundingBox(bool force_recompute)
     bbox_.ExpandBy(left_->GetBoundingBox(force_recompute));
   if (right_)
     bbox_.ExpandBy(right_->GetBoundingBox(force_recompute));
+  left_node_ = dynamic_cast<BVHNode*>(left_.get());
+  right_node_ = dynamic_cast<BVHNode*>(right_.get());
   // spdlog::info("{}: {}", GetName(), bbox_);
   bound_dirty_ = false;
   return bbox_;
@@ -43,65 +261,1146 @@ BVHNode::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
   // *** Homework: Implement function
   // ======================================================================
   // ***** START OF YOUR CODE (DO NOT DELETE/MODIFY THIS LINE) *****
-  if (bbox_.Hit(ray, tmin, tmax)) {
-    // if we are a leaf: try to intersect the surface - record hit and
-    // adjust tmax if necessary, and return true or false
-    // if(right_ == nullptr) {
-    //   if(left_->GetBoundingBox().Hit(ray, tmin, tmax)) {
-    //     return left_->Hit(ray, tmin, tmax, hit_record);
-    //   }
-    //   return false;
-    // }
-    // // OTHERWISE:
-    // else {
-
-
-    bool is_hit = false;
-    if(left_ != nullptr && left_->Hit(ray, tmin, tmax, hit_record)) {
+  LocalTraversalStats stats;
+  ++stats.queries;
+  if (!bbox_.Hit(ray, tmin, tmax))
+    return false;
+  return HitChildren(ray, tmin, tmax, hit_record, stats);
+  // ***** END OF YOUR CODE (DO NOT DELETE/MODIFY THIS LINE) *****
+}
+
+
+bool
+BVHNode::HitChildren(const Ray &ray, Real tmin, Real tmax,
+                     HitRecord &hit_record, BVHTraversalStats &stats)
+{
+  ++stats.node_visits;
+
+  // find where the ray enters the child nodes. Leaf surfaces do their
+  // own bounds test, so they are intersected first and right away:
+  // their hits lower tmax before any child node is entered
+  bool is_hit = false;
+  BVHNode *nodes[2];
+  Real t_entry[2];
+  int node_count = 0;
+  for (const auto &child : {left_node_, right_node_}) {
+    if (child && child->bbox_.Hit(ray, tmin, tmax, t_entry[node_count]))
+      nodes[node_count++] = child;
+  }
+  // raw pointers: copying the shared_ptrs would update their
+  // reference counts on every visit
+  Surface *children[2] = {left_.get(), right_.get()};
+  for (Surface *child : children) {
+    if (!child || child == left_node_ || child == right_node_)
+      continue;
+    ++stats.surface_tests;
+    if (child->Hit(ray, tmin, tmax, hit_record)) {
       tmax = hit_record.GetRayT();
       is_hit = true;
     }
-    if(right_ != nullptr && right_->Hit(ray, tmin, tmax, hit_record)) {
+  }
+
+  // visit the nearer child node first; skip the other one if the ray
+  // enters it beyond the closest hit
+  if (node_count == 2 && t_entry[1] < t_entry[0]) {
+    std::swap(nodes[0], nodes[1]);
+    std::swap(t_entry[0], t_entry[1]);
+  }
+  for (int i = 0; i < node_count; ++i) {
+    if (t_entry[i] > tmax) {
+      ++stats.culled_nodes;
+      continue;
+    }
+    if (nodes[i]->HitChildren(ray, tmin, tmax, hit_record, stats)) {
+      tmax = hit_record.GetRayT();
       is_hit = true;
     }
+  }
+  return is_hit;
+}
+
+
+PacketMask
+BVHNode::HitPacket(const RayPacket &packet, const PacketMask &active,
+                   Real tmin, PacketReal &tmax, HitRecord *hit_records)
+{
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  return HitPacketSubtree(packet, active, tmin, tmax, hit_records, stats);
+}
+
+
+PacketMask
+BVHNode::HitPacketSubtree(const RayPacket &packet, const PacketMask &active,
+                           Real tmin, PacketReal &tmax,
+                           HitRecord *hit_records, BVHTraversalStats &stats)
+{
+  // find the rays that enter the node
+  PacketMask lanes = bbox_.HitPacket(packet, active, tmin, tmax);
+  auto lane_count = lanes.count();
+  if (!lane_count)
+    return lanes;
+
+  // the packet has diverged: trace the remaining rays one by one
+  PacketMask is_hit = PacketMask::Constant(false);
+  if (lane_count < kMinPacketActiveRays) {
+    for (int lane = 0; lane < packet.GetSize(); ++lane) {
+      if (lanes[lane] && HitChildren(packet.GetRay(lane), tmin, tmax[lane],
+                                     hit_records[lane], stats)) {
+        tmax[lane] = hit_records[lane].GetRayT();
+        is_hit[lane] = true;
+      }
+    }
     return is_hit;
+  }
 
-      
-    // }
+  // node visits and surface tests are counted once per lane. tmax of
+  // each lane is lowered by hits in the left subtree before the right
+  // subtree is visited
+  stats.node_visits += static_cast<uint64_t>(lane_count);
+  Surface *children[2] = {left_.get(), right_.get()};
+  for (Surface *child : children) {
+    if (!child)
+      continue;
+    PacketMask hit;
+    if (child == left_node_ || child == right_node_) {
+      hit = static_cast<BVHNode*>(child)->HitPacketSubtree(
+        packet, lanes, tmin, tmax, hit_records, stats);
+    } else {
+      stats.surface_tests += static_cast<uint64_t>(lane_count);
+      hit = child->HitPacket(packet, lanes, tmin, tmax, hit_records);
+    }
+    is_hit = is_hit || hit;
   }
-  else {
+  return is_hit;
+}
+
+
+bool
+BVHNode::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  LocalTraversalStats stats;
+  ++stats.queries;
+  if (!bbox_.Hit(ray, tmin, tmax))
     return false;
+  return OccludedChildren(ray, tmin, tmax, stats);
+}
+
+
+bool
+BVHNode::OccludedChildren(const Ray &ray, Real tmin, Real tmax,
+                          BVHTraversalStats &stats)
+{
+  ++stats.node_visits;
+
+  // leaf surfaces are cheaper to test than child subtrees, so they
+  // are tested first (through raw pointers, see HitChildren())
+  Surface *children[2] = {left_.get(), right_.get()};
+  for (Surface *child : children) {
+    if (!child || child == left_node_ || child == right_node_)
+      continue;
+    ++stats.surface_tests;
+    if (child->Occluded(ray, tmin, tmax))
+      return true;
   }
-  return false;  //!< remove this line and add your own code
-  // ***** END OF YOUR CODE (DO NOT DELETE/MODIFY THIS LINE) *****
+  for (BVHNode *child : {left_node_, right_node_}) {
+    if (child && child->bbox_.Hit(ray, tmin, tmax) &&
+        child->OccludedChildren(ray, tmin, tmax, stats))
+      return true;
+  }
+  return false;
+}
+
+
+PacketMask
+BVHNode::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                        Real tmin, const PacketReal &tmax)
+{
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  return OccludedPacketSubtree(packet, active, tmin, tmax, stats);
+}
+
+
+PacketMask
+BVHNode::OccludedPacketSubtree(const RayPacket &packet,
+                               const PacketMask &active, Real tmin,
+                               const PacketReal &tmax,
+                               BVHTraversalStats &stats)
+{
+  // find the rays that enter the node
+  PacketMask lanes = bbox_.HitPacket(packet, active, tmin, tmax);
+  auto lane_count = lanes.count();
+  PacketMask occluded = PacketMask::Constant(false);
+  if (!lane_count)
+    return occluded;
+
+  // the packet has diverged: trace the remaining rays one by one
+  if (lane_count < kMinPacketActiveRays) {
+    for (int lane = 0; lane < packet.GetSize(); ++lane) {
+      if (lanes[lane] && OccludedChildren(packet.GetRay(lane), tmin,
+                                          tmax[lane], stats))
+        occluded[lane] = true;
+    }
+    return occluded;
+  }
+
+  // blocked lanes don't take part in the tests of the remaining
+  // children
+  stats.node_visits += static_cast<uint64_t>(lane_count);
+  Surface *children[2] = {left_.get(), right_.get()};
+  for (Surface *child : children) {
+    if (!child || !lanes.any())
+      continue;
+    if (child == left_node_ || child == right_node_) {
+      occluded = occluded || static_cast<BVHNode*>(child)->
+        OccludedPacketSubtree(packet, lanes, tmin, tmax, stats);
+    } else {
+      stats.surface_tests += static_cast<uint64_t>(lanes.count());
+      occluded = occluded || child->OccludedPacket(packet, lanes, tmin, tmax);
+    }
+    lanes = lanes && !occluded;
+  }
+  return occluded;
+}
+
+
+Real
+BVHNode::ComputeSAHCost(const BVHBuildOptions &options) const
+{
+  // each child is tested (or traversed) by the rays that hit this
+  // node's bbox; rays reach a child node's own tests only if they also
+  // hit its bbox
+  Real area = bbox_.GetSurfaceArea();
+  Real cost = options.traversal_cost;
+  for (const auto &child : {left_, right_}) {
+    if (!child)
+      continue;
+    auto child_node = dynamic_pointer_cast<BVHNode>(child);
+    if (!child_node) {
+      cost += options.intersection_cost;
+      continue;
+    }
+    Real child_area = child_node->bbox_.GetSurfaceArea();
+    Real probability = area > 0 ? child_area / area : 1;
+    cost += probability * child_node->ComputeSAHCost(options);
+  }
+  return cost;
+}
+
+
+BVHTreeStats
+BVHNode::ComputeTreeStats(const BVHBuildOptions &options) const
+{
+  BVHTreeStats stats;
+  stats.name = name_;
+  stats.type = "BVHNode";
+  CollectTreeStats(1, stats);
+  stats.sah_cost = ComputeSAHCost(options);
+  stats.memory_bytes = stats.node_count * sizeof(BVHNode);
+  return stats;
+}
+
+
+void
+BVHNode::CollectTreeStats(uint depth, BVHTreeStats &stats) const
+{
+  ++stats.node_count;
+  for (const auto &child : {left_, right_}) {
+    if (!child)
+      continue;
+    auto child_node = dynamic_pointer_cast<BVHNode>(child);
+    if (child_node)
+      child_node->CollectTreeStats(depth + 1, stats);
+    else
+      stats.AddLeaf(depth + 1, 1);
+  }
+}
+
+
+BVHRefitStats
+BVHNode::Refit()
+{
+  return Refit(build_options_);
+}
+
+
+BVHRefitStats
+BVHNode::Refit(const BVHBuildOptions &options)
+{
+  BVHRefitStats stats;
+  RunInArena(options, [&] {
+    // the bounds are still the built ones the first time
+    if (build_sah_cost_ < 0)
+      ResetSAHCosts(options);
+
+    // mark the dirty nodes, then update the moved surfaces one at a
+    // time, since SBVH leaves may share them
+    tbb::concurrent_vector<Surface*> dirty_surfaces;
+    if (!MarkDirty(0, dirty_surfaces))
+      return;
+    unordered_set<Surface*> moved_surfaces(dirty_surfaces.begin(),
+                                           dirty_surfaces.end());
+    for (auto surface : moved_surfaces)
+      surface->GetBoundingBox();
+    stats.moved_surfaces = moved_surfaces.size();
+    stats.refit_nodes = RefitDirty(0, options);
+    stats.Add(RebuildDegraded(0, options));
+  });
+  stats.sah_cost = sah_cost_;
+  stats.build_sah_cost = build_sah_cost_;
+  spdlog::debug("Refit BVH ({}): {} moved surfaces, {} refit nodes, {} "
+                "rebuilt subtrees ({} surfaces), SAH cost {:.3f} (built "
+                "{:.3f})", GetName(), stats.moved_surfaces, stats.refit_nodes,
+                stats.rebuilt_subtrees, stats.rebuilt_surfaces,
+                stats.sah_cost, stats.build_sah_cost);
+  return stats;
+}
+
+
+bool
+BVHNode::MarkDirty(uint depth,
+                   tbb::concurrent_vector<Surface*> &dirty_surfaces)
+{
+  auto mark_child = [&](const Surface::Ptr &child, BVHNode *child_node) {
+    if (child_node)
+      return child_node->MarkDirty(depth + 1, dirty_surfaces);
+    if (!child || !child->IsBoundDirty())
+      return false;
+    dirty_surfaces.push_back(child.get());
+    return true;
+  };
+  bool is_left_dirty = false, is_right_dirty = false;
+  if (depth < kParallelRefitDepth && left_node_ && right_node_) {
+    tbb::parallel_invoke(
+      [&] {is_left_dirty = mark_child(left_, left_node_);},
+      [&] {is_right_dirty = mark_child(right_, right_node_);});
+  } else {
+    is_left_dirty = mark_child(left_, left_node_);
+    is_right_dirty = mark_child(right_, right_node_);
+  }
+  bound_dirty_ = is_left_dirty || is_right_dirty;
+  return bound_dirty_;
+}
+
+
+size_t
+BVHNode::RefitDirty(uint depth, const BVHBuildOptions &options)
+{
+  if (!bound_dirty_)
+    return 0;
+  size_t left_count = 0, right_count = 0;
+  if (depth < kParallelRefitDepth && left_node_ && right_node_) {
+    tbb::parallel_invoke(
+      [&] {left_count = left_node_->RefitDirty(depth + 1, options);},
+      [&] {right_count = right_node_->RefitDirty(depth + 1, options);});
+  } else {
+    if (left_node_)
+      left_count = left_node_->RefitDirty(depth + 1, options);
+    if (right_node_)
+      right_count = right_node_->RefitDirty(depth + 1, options);
+  }
+
+  // children are up to date: their GetBoundingBox() just returns it
+  bbox_.Reset();
+  if (left_)
+    bbox_.ExpandBy(left_node_ ? left_node_->bbox_ : left_->GetBoundingBox());
+  if (right_)
+    bbox_.ExpandBy(right_node_ ? right_node_->bbox_ :
+                   right_->GetBoundingBox());
+  sah_cost_ = ComputeNodeSAHCost(options);
+  return 1 + left_count + right_count;
+}
+
+
+BVHRefitStats
+BVHNode::RebuildDegraded(uint depth, const BVHBuildOptions &options)
+{
+  BVHRefitStats stats;
+  if (!bound_dirty_)
+    return stats;
+  if (options.rebuild_threshold > 0 &&
+      sah_cost_ > options.rebuild_threshold * build_sah_cost_) {
+    stats.rebuilt_surfaces = RebuildSubtree(options);
+    stats.rebuilt_subtrees = 1;
+    return stats;
+  }
+  BVHRefitStats left_stats, right_stats;
+  if (depth < kParallelRefitDepth && left_node_ && right_node_) {
+    tbb::parallel_invoke(
+      [&] {left_stats = left_node_->RebuildDegraded(depth + 1, options);},
+      [&] {right_stats = right_node_->RebuildDegraded(depth + 1, options);});
+  } else {
+    if (left_node_)
+      left_stats = left_node_->RebuildDegraded(depth + 1, options);
+    if (right_node_)
+      right_stats = right_node_->RebuildDegraded(depth + 1, options);
+  }
+  stats.Add(left_stats);
+  stats.Add(right_stats);
+
+  // rebuilt children are cheaper now
+  if (stats.rebuilt_subtrees)
+    sah_cost_ = ComputeNodeSAHCost(options);
+  bound_dirty_ = false;
+  return stats;
+}
+
+
+size_t
+BVHNode::RebuildSubtree(const BVHBuildOptions &options)
+{
+  // SBVH leaves may share surfaces
+  vector<Surface::Ptr> surfaces;
+  CollectSurfaces(surfaces);
+  if (options.split_method == BVHSplitMethod::kSBVH) {
+    std::sort(surfaces.begin(), surfaces.end());
+    surfaces.erase(std::unique(surfaces.begin(), surfaces.end()),
+                   surfaces.end());
+  }
+
+  // the surface bounds are up to date
+  BVHNode::Ptr subtree;
+  if (options.split_method == BVHSplitMethod::kMedian) {
+    subtree = BuildBVH(surfaces, 0, surfaces.size(), 0);
+  } else {
+    vector<BuildSurface> build_surfaces(surfaces.size());
+    for (size_t i = 0; i < surfaces.size(); ++i) {
+      AABB bbox = surfaces[i]->GetBoundingBox();
+      build_surfaces[i] = {bbox, bbox.GetCenter(), i, 0};
+    }
+    if (options.split_method == BVHSplitMethod::kLBVH)
+      SortMorton(build_surfaces, options);
+    subtree = BuildSplitBVH(surfaces, build_surfaces, 0,
+                            build_surfaces.size(), options);
+  }
+  subtree->GetBoundingBox();
+  left_ = subtree->left_;
+  right_ = subtree->right_;
+  left_node_ = subtree->left_node_;
+  right_node_ = subtree->right_node_;
+  bbox_ = subtree->bbox_;
+  bound_dirty_ = false;
+  ResetSAHCosts(options);
+  return surfaces.size();
+}
+
+
+void
+BVHNode::CollectSurfaces(std::vector<Surface::Ptr> &surfaces) const
+{
+  for (const auto &child : {make_pair(left_, left_node_),
+                            make_pair(right_, right_node_)}) {
+    if (child.second)
+      child.second->CollectSurfaces(surfaces);
+    else if (child.first)
+      surfaces.push_back(child.first);
+  }
+}
+
+
+void
+BVHNode::ResetSAHCosts(const BVHBuildOptions &options)
+{
+  if (left_node_)
+    left_node_->ResetSAHCosts(options);
+  if (right_node_)
+    right_node_->ResetSAHCosts(options);
+  sah_cost_ = ComputeNodeSAHCost(options);
+  build_sah_cost_ = sah_cost_;
+}
+
+
+Real
+BVHNode::ComputeNodeSAHCost(const BVHBuildOptions &options) const
+{
+  // same cost model as ComputeSAHCost(), with the children's costs
+  Real area = bbox_.GetSurfaceArea();
+  Real cost = options.traversal_cost;
+  for (const auto &child : {make_pair(left_, left_node_),
+                            make_pair(right_, right_node_)}) {
+    if (!child.first)
+      continue;
+    if (!child.second) {
+      cost += options.intersection_cost;
+      continue;
+    }
+    Real child_area = child.second->bbox_.GetSurfaceArea();
+    Real probability = area > 0 ? child_area / area : 1;
+    cost += probability * child.second->sah_cost_;
+  }
+  return cost;
 }
 
 
 BVHNode::Ptr
 BVHNode::BuildBVH(std::vector<Surface::Ptr> surfaces, const string &name)
 {
-  spdlog::info("Building BVH ({})", name);
+  return BuildBVH(std::move(surfaces), build_options_, name);
+}
+
+
+BVHNode::Ptr
+BVHNode::BuildBVH(std::vector<Surface::Ptr> surfaces,
+                  const BVHBuildOptions &options, const string &name,
+                  bool quiet)
+{
+  auto log_level = quiet ? spdlog::level::debug : spdlog::level::info;
+  spdlog::log(log_level, "Building BVH ({})", name);
 
   // error checking
   auto surface_count = surfaces.size();
   if (!surface_count)
     return nullptr;
 
-  // make sure we have valid bboxes for surfaces
-  for (auto surface : surfaces) {
-    if (surface)
-      surface->GetBoundingBox();
-  }
+  auto start_time = chrono::steady_clock::now();
+  BVHNode::Ptr bvh_node;
+  RunInArena(options, [&] {
+    // make sure we have valid bboxes for surfaces
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, surface_count, 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        if (surfaces[i])
+          surfaces[i]->GetBoundingBox();
+      }
+    });
 
-  // build bvh
-  uint split_axis = 0;
-  auto bvh_node = BuildBVH(surfaces, 0, surface_count, split_axis, name);
+    // build bvh
+    if (options.split_method != BVHSplitMethod::kMedian) {
+      vector<BuildSurface> build_surfaces;
+      build_surfaces.reserve(surface_count);
+      for (size_t i = 0; i < surface_count; ++i) {
+        if (!surfaces[i])
+          continue;
+        AABB bbox = surfaces[i]->GetBoundingBox();
+        build_surfaces.push_back({bbox, bbox.GetCenter(), i, 0});
+      }
+      if (options.split_method == BVHSplitMethod::kLBVH)
+        SortMorton(build_surfaces, options);
+      if (options.split_method == BVHSplitMethod::kSBVH &&
+          !build_surfaces.empty()) {
+        AABB root_bbox;
+        for (const auto &build_surface : build_surfaces)
+          root_bbox.ExpandBy(build_surface.bbox);
+        size_t valid_count = build_surfaces.size();
+        auto duplication_budget = static_cast<size_t>(
+          std::max(options.max_duplication, Real{0}) *
+          static_cast<Real>(valid_count));
+        size_t reference_count = 0;
+        bvh_node = BuildSpatialBVH(surfaces, std::move(build_surfaces),
+                                   root_bbox.GetSurfaceArea(),
+                                   duplication_budget, options,
+                                   reference_count);
+        spdlog::log(log_level, "Spatial splits ({}): {} references for {} "
+                    "surfaces (+{:.1f}%)", name, reference_count,
+                    valid_count, 100.0 * static_cast<double>(reference_count -
+                                                             valid_count) /
+                    static_cast<double>(valid_count));
+      } else if (!build_surfaces.empty()) {
+        bvh_node = BuildSplitBVH(surfaces, build_surfaces, 0,
+                                 build_surfaces.size(), options);
+      }
+    } else {
+      uint split_axis = 0;
+      bvh_node = BuildBVH(surfaces, 0, surface_count, split_axis, name);
+    }
+  });
+  double build_time = chrono::duration<double>(chrono::steady_clock::now() -
+                                               start_time).count();
 
   // compute bboxes
-  if (bvh_node)
+  if (bvh_node) {
     bvh_node->GetBoundingBox();
+    spdlog::log(log_level, "Done building BVH ({}): {} surfaces, SAH cost "
+                "{:.3f}, {:.3f}s", name, surface_count,
+                bvh_node->ComputeSAHCost(options), build_time);
+  } else {
+    spdlog::log(log_level, "Done building BVH ({})", name);
+  }
+  return bvh_node;
+}
+
+
+Surface::Ptr
+BVHNode::BuildAccelerator(std::vector<Surface::Ptr> surfaces,
+                          const string &name)
+{
+  return BuildAccelerator(std::move(surfaces), build_options_, name);
+}
+
+
+Surface::Ptr
+BVHNode::BuildAccelerator(std::vector<Surface::Ptr> surfaces,
+                          const BVHBuildOptions &options, const string &name)
+{
+  auto start_time = chrono::steady_clock::now();
+  Surface::Ptr bvh;
+  switch (options.layout) {
+  case BVHLayout::kLinear:
+    bvh = LinearBVH::BuildBVH(std::move(surfaces), options, name);
+    break;
+  case BVHLayout::kWide4:
+    bvh = WideBVH4::BuildBVH(std::move(surfaces), options, name);
+    break;
+  case BVHLayout::kWide8:
+    bvh = WideBVH8::BuildBVH(std::move(surfaces), options, name);
+    break;
+  case BVHLayout::kTree:
+    bvh = BuildBVH(std::move(surfaces), options, name);
+    break;
+  }
+  if (!bvh || !is_collecting_tree_stats)
+    return bvh;
+
+  // record the tree statistics
+  double build_time = chrono::duration<double>(chrono::steady_clock::now() -
+                                               start_time).count();
+  BVHTreeStats stats;
+  if (auto linear_bvh = dynamic_pointer_cast<LinearBVH>(bvh))
+    stats = linear_bvh->ComputeTreeStats(options);
+  else if (auto wide_bvh = dynamic_pointer_cast<WideBVH4>(bvh))
+    stats = wide_bvh->ComputeTreeStats(options);
+  else if (auto wide_bvh = dynamic_pointer_cast<WideBVH8>(bvh))
+    stats = wide_bvh->ComputeTreeStats(options);
+  else if (auto tree = dynamic_pointer_cast<BVHNode>(bvh))
+    stats = tree->ComputeTreeStats(options);
+  if (!name.empty())
+    stats.name = name;
+  stats.build_time = build_time;
+  AddTreeStats(stats);
+  return bvh;
+}
+
+
+bool
+BVHNode::RefitAccelerator(const Surface::Ptr &accelerator,
+                          const BVHBuildOptions &options,
+                          BVHRefitStats &stats)
+{
+  if (auto linear_bvh = dynamic_pointer_cast<LinearBVH>(accelerator))
+    stats = linear_bvh->Refit(options);
+  else if (auto wide_bvh = dynamic_pointer_cast<WideBVH4>(accelerator))
+    stats = wide_bvh->Refit(options);
+  else if (auto wide_bvh = dynamic_pointer_cast<WideBVH8>(accelerator))
+    stats = wide_bvh->Refit(options);
+  else if (auto tree = dynamic_pointer_cast<BVHNode>(accelerator))
+    stats = tree->Refit(options);
+  else {
+    spdlog::error("Can't refit {}: not a BVH built by BuildAccelerator()",
+                  accelerator ? accelerator->GetName() : "nullptr");
+    return false;
+  }
+  return true;
+}
+
+
+void
+BVHNode::SetBuildOptions(const BVHBuildOptions &options)
+{
+  build_options_ = options;
+}
+
+
+const BVHBuildOptions&
+BVHNode::GetBuildOptions()
+{
+  return build_options_;
+}
+
+
+void
+BVHNode::SetCollectTreeStats(bool collect)
+{
+  std::lock_guard<std::mutex> lock(tree_stats_mutex);
+  if (collect && !is_collecting_tree_stats)
+    tree_stats.clear();
+  is_collecting_tree_stats = collect;
+}
+
+
+bool
+BVHNode::IsCollectingTreeStats()
+{
+  return is_collecting_tree_stats;
+}
+
+
+void
+BVHNode::AddTreeStats(const BVHTreeStats &stats)
+{
+  std::lock_guard<std::mutex> lock(tree_stats_mutex);
+  tree_stats.push_back(stats);
+}
+
+
+std::vector<BVHTreeStats>
+BVHNode::GetTreeStats()
+{
+  std::lock_guard<std::mutex> lock(tree_stats_mutex);
+  return tree_stats;
+}
+
+
+size_t
+BVHNode::PartitionSAH(std::vector<BuildSurface> &build_surfaces, size_t start,
+                      size_t end, const BVHBuildOptions &options)
+{
+  size_t count = end - start;
 
-  spdlog::info("Done building BVH ({})", name);
+  // bin the surfaces by bbox center along each axis
+  AABB center_bounds = ReduceRange(
+    start, end, AABB{}, [&](size_t begin, size_t range_end, AABB bounds) {
+      for (size_t i = begin; i < range_end; ++i)
+        bounds.ExpandBy(build_surfaces[i].center);
+      return bounds;
+    }, [](AABB bounds, const AABB &other) {
+      bounds.ExpandBy(other);
+      return bounds;
+    });
+  const Vec3r center_min = center_bounds.GetMin();
+  const Vec3r center_extent = center_bounds.GetMax() - center_min;
+  const uint bin_count = std::max(options.bin_count, 2u);
+  auto bin_index = [&](const Vec3r &center, int axis) {
+    auto bin = static_cast<uint>(static_cast<Real>(bin_count) *
+                                 (center[axis] - center_min[axis]) /
+                                 center_extent[axis]);
+    return std::min(bin, bin_count - 1);
+  };
+
+  //! \struct Bin
+  //! \brief Bbox and number of the surfaces in a bin
+  struct Bin {
+    AABB bbox;         //!< union of the surface bboxes
+    size_t count{0};   //!< surface count
+  };
+  // bins of all three axes: bins[axis * bin_count + bin]
+  vector<Bin> bins = ReduceRange(
+    start, end, vector<Bin>(3 * bin_count),
+    [&](size_t begin, size_t range_end, vector<Bin> range_bins) {
+      for (size_t i = begin; i < range_end; ++i) {
+        const auto &build_surface = build_surfaces[i];
+        for (int axis = 0; axis < 3; ++axis) {
+          if (!(center_extent[axis] > 0))
+            continue;
+          auto &bin = range_bins[static_cast<uint>(axis) * bin_count +
+                                 bin_index(build_surface.center, axis)];
+          bin.bbox.ExpandBy(build_surface.bbox);
+          ++bin.count;
+        }
+      }
+      return range_bins;
+    }, [](vector<Bin> range_bins, const vector<Bin> &other) {
+      for (size_t b = 0; b < range_bins.size(); ++b) {
+        range_bins[b].bbox.ExpandBy(other[b].bbox);
+        range_bins[b].count += other[b].count;
+      }
+      return range_bins;
+    });
+  vector<Real> right_areas(bin_count);
+  vector<size_t> right_counts(bin_count);
+
+  // find the bin boundary with the lowest SAH cost. Only the relative
+  // cost of the splits matters here, so the constant node test cost
+  // and the intersection cost factor are left out
+  Real best_cost = kInfinity;
+  int best_axis = -1;
+  uint best_bin = 0;  // bins [0, best_bin] go to the left child
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(center_extent[axis] > 0))
+      continue;
+    const Bin *axis_bins = bins.data() + static_cast<uint>(axis) * bin_count;
+
+    // sweep from the right to get the area and count right of each boundary
+    AABB right_bbox;
+    size_t right_count = 0;
+    for (uint b = bin_count - 1; b > 0; --b) {
+      right_bbox.ExpandBy(axis_bins[b].bbox);
+      right_count += axis_bins[b].count;
+      right_areas[b] = right_bbox.GetSurfaceArea();
+      right_counts[b] = right_count;
+    }
+
+    // sweep from the left, evaluating the split between bins b and b+1
+    AABB left_bbox;
+    size_t left_count = 0;
+    for (uint b = 0; b + 1 < bin_count; ++b) {
+      left_bbox.ExpandBy(axis_bins[b].bbox);
+      left_count += axis_bins[b].count;
+      if (!left_count || !right_counts[b + 1])
+        continue;
+      Real cost = static_cast<Real>(left_count) * left_bbox.GetSurfaceArea() +
+        static_cast<Real>(right_counts[b + 1]) * right_areas[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  // split the range; if all bbox centers coincide, split it in half
+  size_t mid = start + count / 2;
+  if (best_axis >= 0) {
+    mid = StablePartition(
+      build_surfaces, start, end, [&](const BuildSurface &build_surface) {
+        return bin_index(build_surface.center, best_axis) <= best_bin;
+      });
+  }
+  return mid;
+}
+
+
+void
+BVHNode::SortMorton(std::vector<BuildSurface> &build_surfaces,
+                    const BVHBuildOptions &options)
+{
+  // quantize the bbox centers to a grid over their bounds
+  size_t count = build_surfaces.size();
+  AABB center_bounds = ReduceRange(
+    0, count, AABB{}, [&](size_t begin, size_t range_end, AABB bounds) {
+      for (size_t i = begin; i < range_end; ++i)
+        bounds.ExpandBy(build_surfaces[i].center);
+      return bounds;
+    }, [](AABB bounds, const AABB &other) {
+      bounds.ExpandBy(other);
+      return bounds;
+    });
+  const uint axis_bits = std::min(std::max(options.morton_bits, 3u), 63u) / 3;
+  const auto cell_count = static_cast<Real>((uint64_t{1} << axis_bits) - 1);
+  const Vec3r center_min = center_bounds.GetMin();
+  const Vec3r center_extent = center_bounds.GetMax() - center_min;
+  Vec3r scale;
+  for (int axis = 0; axis < 3; ++axis)
+    scale[axis] = center_extent[axis] > 0 ? cell_count / center_extent[axis] :
+      0;
+
+  auto morton_code = [&](const BuildSurface &build_surface) {
+    uint64_t code = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      auto cell = static_cast<uint64_t>(
+        (build_surface.center[axis] - center_min[axis]) * scale[axis]);
+      code |= SpreadBits(cell) << (2 - axis);
+    }
+    return code;
+  };
+  const uint code_bits = 3 * axis_bits;
+  vector<BuildSurface> sorted(count);
+  if (code_bits <= 32 && count <= numeric_limits<uint32_t>::max()) {
+    // short codes: sort 8-byte keys, with the code in the high half and
+    // the surface index in the low half
+    vector<uint64_t> keys(count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, kParallelGrainSize),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+        keys[i] = morton_code(build_surfaces[i]) << 32 | i;
+    });
+    RadixSort(keys, 32, 32 + code_bits, [](uint64_t key) {return key;});
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, kParallelGrainSize),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        sorted[i] = build_surfaces[keys[i] & 0xffffffffu];
+        sorted[i].morton_code = keys[i] >> 32;
+      }
+    });
+  } else {
+    //! \struct MortonKey
+    //! \brief Morton code of a surface
+    struct MortonKey {
+      uint64_t code;  //!< Morton code
+      size_t index;   //!< index in 'build_surfaces'
+    };
+    vector<MortonKey> keys(count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, kParallelGrainSize),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+        keys[i] = {morton_code(build_surfaces[i]), i};
+    });
+    RadixSort(keys, 0, code_bits,
+              [](const MortonKey &key) {return key.code;});
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, count, kParallelGrainSize),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        sorted[i] = build_surfaces[keys[i].index];
+        sorted[i].morton_code = keys[i].code;
+      }
+    });
+  }
+  build_surfaces.swap(sorted);
+}
+
+
+size_t
+BVHNode::PartitionMorton(const std::vector<BuildSurface> &build_surfaces,
+                         size_t start, size_t end)
+{
+  uint64_t first_code = build_surfaces[start].morton_code;
+  uint64_t last_code = build_surfaces[end - 1].morton_code;
+  if (first_code == last_code)
+    return start + (end - start) / 2;
+
+  // the codes are sorted, so the ones with the highest differing bit
+  // set form the end of the range
+  uint64_t split_bit = uint64_t{1} << 63;
+  while (!((first_code ^ last_code) & split_bit))
+    split_bit >>= 1;
+  auto first = build_surfaces.begin() + static_cast<ptrdiff_t>(start);
+  auto last = build_surfaces.begin() + static_cast<ptrdiff_t>(end);
+  auto mid = std::partition_point(first, last,
+                                  [&](const BuildSurface &build_surface) {
+    return !(build_surface.morton_code & split_bit);
+  });
+  return start + static_cast<size_t>(mid - first);
+}
+
+
+size_t
+BVHNode::Partition(std::vector<BuildSurface> &build_surfaces, size_t start,
+                   size_t end, const BVHBuildOptions &options)
+{
+  if (options.split_method == BVHSplitMethod::kLBVH)
+    return PartitionMorton(build_surfaces, start, end);
+  return PartitionSAH(build_surfaces, start, end, options);
+}
+
+
+BVHNode::Ptr
+BVHNode::BuildSplitBVH(const std::vector<Surface::Ptr> &surfaces,
+                       std::vector<BuildSurface> &build_surfaces,
+                       size_t start, size_t end, const BVHBuildOptions &options)
+{
+  BVHNode::Ptr bvh_node = BVHNode::Create();
+  size_t count = end - start;
+  if (count <= 2) {
+    bvh_node->left_ = surfaces[build_surfaces[start].index];
+    if (count == 2)
+      bvh_node->right_ = surfaces[build_surfaces[start + 1].index];
+    bvh_node->GetBoundingBox();
+    return bvh_node;
+  }
+
+  size_t mid = Partition(build_surfaces, start, end, options);
+
+  // build the subtrees (in parallel if they are large) and the node bbox
+  auto build_left = [&] {
+    bvh_node->left_ = BuildSplitBVH(surfaces, build_surfaces, start, mid,
+                                    options);
+  };
+  auto build_right = [&] {
+    bvh_node->right_ = BuildSplitBVH(surfaces, build_surfaces, mid, end,
+                                     options);
+  };
+  if (count >= kParallelSubtreeSize) {
+    tbb::parallel_invoke(build_left, build_right);
+  } else {
+    build_left();
+    build_right();
+  }
+  bvh_node->GetBoundingBox();
+  return bvh_node;
+}
+
+
+void
+BVHNode::SplitReferences(const std::vector<Surface::Ptr> &surfaces,
+                         std::vector<BuildSurface> &references,
+                         Real root_area, size_t duplication_budget,
+                         const BVHBuildOptions &options,
+                         std::vector<BuildSurface> &left,
+                         std::vector<BuildSurface> &right)
+{
+  // object split
+  size_t count = references.size();
+  size_t mid = PartitionSAH(references, 0, count, options);
+  AABB node_bbox, object_left_bbox, object_right_bbox;
+  for (size_t i = 0; i < count; ++i)
+    (i < mid ? object_left_bbox : object_right_bbox).ExpandBy(
+      references[i].bbox);
+  node_bbox.ExpandBy(object_left_bbox);
+  node_bbox.ExpandBy(object_right_bbox);
+  Real best_cost = static_cast<Real>(mid) *
+    object_left_bbox.GetSurfaceArea() + static_cast<Real>(count - mid) *
+    object_right_bbox.GetSurfaceArea();
+
+  // spatial splits only pay off where the halves of the object split
+  // overlap
+  AABB overlap = object_left_bbox.IntersectWith(object_right_bbox);
+  Real overlap_area = overlap.IsValid() ? overlap.GetSurfaceArea() : 0;
+  int best_axis = -1;
+  uint best_bin = 0;  // bins [0, best_bin] are left of the plane
+  const uint bin_count = std::max(options.bin_count, 2u);
+  const Vec3r node_min = node_bbox.GetMin();
+  const Vec3r node_extent = node_bbox.GetMax() - node_min;
+  auto bin_index = [&](Real position, int axis) {
+    Real bin = static_cast<Real>(bin_count) * (position - node_min[axis]) /
+      node_extent[axis];
+    return bin > 0 ? std::min(static_cast<uint>(bin), bin_count - 1) : 0u;
+  };
+  auto plane_position = [&](uint bin, int axis) {
+    return node_min[axis] + node_extent[axis] * static_cast<Real>(bin + 1) /
+      static_cast<Real>(bin_count);
+  };
+  if (duplication_budget && root_area > 0 &&
+      overlap_area / root_area > kSpatialSplitOverlap) {
+    //! \struct SpatialBin
+    //! \brief Clipped references in a bin
+    struct SpatialBin {
+      AABB bbox;           //!< union of the clipped reference bboxes
+      size_t entries{0};   //!< references that start in the bin
+      size_t exits{0};     //!< references that end in the bin
+    };
+    vector<SpatialBin> bins(bin_count);
+    vector<Real> right_areas(bin_count);
+    vector<size_t> right_counts(bin_count);
+    for (int axis = 0; axis < 3; ++axis) {
+      if (!(node_extent[axis] > 0))
+        continue;
+
+      // chop each reference into the bins it overlaps
+      std::fill(bins.begin(), bins.end(), SpatialBin{});
+      for (const auto &reference : references) {
+        uint first_bin = bin_index(reference.bbox.GetMin()[axis], axis);
+        uint last_bin = bin_index(reference.bbox.GetMax()[axis], axis);
+        AABB bbox = reference.bbox;
+        for (uint b = first_bin; b < last_bin; ++b) {
+          AABB left_bbox, right_bbox;
+          surfaces[reference.index]->SplitBoundingBox(
+            bbox, axis, plane_position(b, axis), left_bbox, right_bbox);
+          bins[b].bbox.ExpandBy(left_bbox);
+          bbox = right_bbox;
+        }
+        bins[last_bin].bbox.ExpandBy(bbox);
+        ++bins[first_bin].entries;
+        ++bins[last_bin].exits;
+      }
+
+      // sweep as in PartitionSAH(); references that straddle the plane
+      // count on both sides. A child may get all the references (with
+      // smaller bboxes): each spatial split uses up some of the budget,
+      // so the recursion still ends
+      AABB right_bbox;
+      size_t right_count = 0;
+      for (uint b = bin_count - 1; b > 0; --b) {
+        right_bbox.ExpandBy(bins[b].bbox);
+        right_count += bins[b].exits;
+        right_areas[b] = right_bbox.GetSurfaceArea();
+        right_counts[b] = right_count;
+      }
+      AABB left_bbox;
+      size_t left_count = 0;
+      for (uint b = 0; b + 1 < bin_count; ++b) {
+        left_bbox.ExpandBy(bins[b].bbox);
+        left_count += bins[b].entries;
+        size_t split_right_count = right_counts[b + 1];
+        if (!left_count || !split_right_count ||
+            left_count + split_right_count - count > duplication_budget)
+          continue;
+        Real cost = static_cast<Real>(left_count) *
+          left_bbox.GetSurfaceArea() +
+          static_cast<Real>(split_right_count) * right_areas[b + 1];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = b;
+        }
+      }
+    }
+  }
+
+  left.clear();
+  right.clear();
+  if (best_axis < 0) {
+    left.assign(references.begin(),
+                references.begin() + static_cast<ptrdiff_t>(mid));
+    right.assign(references.begin() + static_cast<ptrdiff_t>(mid),
+                 references.end());
+    return;
+  }
+
+  // spatial split: clip the references that straddle the plane
+  Real position = plane_position(best_bin, best_axis);
+  for (const auto &reference : references) {
+    uint first_bin = bin_index(reference.bbox.GetMin()[best_axis], best_axis);
+    uint last_bin = bin_index(reference.bbox.GetMax()[best_axis], best_axis);
+    if (last_bin <= best_bin) {
+      left.push_back(reference);
+    } else if (first_bin > best_bin) {
+      right.push_back(reference);
+    } else {
+      AABB left_bbox, right_bbox;
+      surfaces[reference.index]->SplitBoundingBox(
+        reference.bbox, best_axis, position, left_bbox, right_bbox);
+      if (left_bbox.IsValid())
+        left.push_back({left_bbox, left_bbox.GetCenter(), reference.index, 0});
+      if (right_bbox.IsValid())
+        right.push_back({right_bbox, right_bbox.GetCenter(), reference.index,
+                         0});
+      if (!left_bbox.IsValid() && !right_bbox.IsValid())
+        left.push_back(reference);
+    }
+  }
+
+  // clipping can (rarely) leave a side empty: use the object split
+  if (left.empty() || right.empty()) {
+    left.assign(references.begin(),
+                references.begin() + static_cast<ptrdiff_t>(mid));
+    right.assign(references.begin() + static_cast<ptrdiff_t>(mid),
+                 references.end());
+  }
+}
+
+
+BVHNode::Ptr
+BVHNode::BuildSpatialBVH(const std::vector<Surface::Ptr> &surfaces,
+                         std::vector<BuildSurface> references,
+                         Real root_area, size_t duplication_budget,
+                         const BVHBuildOptions &options,
+                         size_t &reference_count)
+{
+  BVHNode::Ptr bvh_node = BVHNode::Create();
+  size_t count = references.size();
+  if (count <= 2) {
+    // leaf: the bbox bounds the clipped references
+    bvh_node->left_ = surfaces[references[0].index];
+    if (count == 2)
+      bvh_node->right_ = surfaces[references[1].index];
+    for (const auto &reference : references)
+      bvh_node->bbox_.ExpandBy(reference.bbox);
+    bvh_node->bound_dirty_ = false;
+    reference_count = count;
+    return bvh_node;
+  }
+
+  vector<BuildSurface> left, right;
+  SplitReferences(surfaces, references, root_area, duplication_budget,
+                  options, left, right);
+  vector<BuildSurface>().swap(references);
+
+  // split the remaining budget in proportion to the reference counts
+  size_t split_count = left.size() + right.size();
+  size_t remaining_budget = duplication_budget - (split_count - count);
+  size_t left_budget = static_cast<size_t>(
+    static_cast<Real>(remaining_budget) * static_cast<Real>(left.size()) /
+    static_cast<Real>(split_count));
+  size_t right_budget = remaining_budget - left_budget;
+
+  // build the subtrees (in parallel if they are large) and the node bbox
+  size_t left_count = 0, right_count = 0;
+  auto build_left = [&] {
+    bvh_node->left_ = BuildSpatialBVH(surfaces, std::move(left), root_area,
+                                      left_budget, options, left_count);
+  };
+  auto build_right = [&] {
+    bvh_node->right_ = BuildSpatialBVH(surfaces, std::move(right), root_area,
+                                       right_budget, options, right_count);
+  };
+  if (count >= kParallelSubtreeSize) {
+    tbb::parallel_invoke(build_left, build_right);
+  } else {
+    build_left();
+    build_right();
+  }
+  bvh_node->GetBoundingBox();
+  reference_count = left_count + right_count;
   return bvh_node;
 }
 
@@ -137,9 +1436,21 @@ BVHNode::BuildBVH(std::vector<Surface::Ptr> &surfaces, size_t start,
         return (box_1_along_axis < box_2_along_axis);
     });
     size_t mid = (start+end)/2;
-    bvh_node->left_ = BuildBVH(surfaces, start, mid, (split_axis+1)%3);
-    bvh_node->right_ = BuildBVH(surfaces, mid, end, (split_axis+1)%3);
+    // the two halves are disjoint, so large subtrees are built in parallel
+    auto build_left = [&] {
+      bvh_node->left_ = BuildBVH(surfaces, start, mid, (split_axis+1)%3);
+    };
+    auto build_right = [&] {
+      bvh_node->right_ = BuildBVH(surfaces, mid, end, (split_axis+1)%3);
+    };
+    if (N >= kParallelSubtreeSize) {
+      tbb::parallel_invoke(build_left, build_right);
+    } else {
+      build_left();
+      build_right();
+    }
   }
+  bvh_node->GetBoundingBox();
   return bvh_node;
   // return nullptr;  //!< remove this line and add your own code
   // ***** END OF YOUR CODE (DO NOT DELETE/MODIFY THIS LINE) *****
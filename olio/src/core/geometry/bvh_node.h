@@ -3,10 +3,15 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <set>
+#include <vector>
+#include <tbb/concurrent_vector.h>
+#include <tbb/task_arena.h>
 #include "core/geometry/surface.h"
+#include "core/geometry/bvh_stats.h"
 
 namespace olio {
 namespace core {
@@ -15,6 +20,90 @@ class Ray;
 class HitRecord;
 class Material;
 
+//! \enum BVHSplitMethod
+//! \brief How BVHNode::BuildBVH() splits the surfaces of a node in two
+enum class BVHSplitMethod {
+  kMedian,  //!< sort by bbox min on a round-robin axis, split at the median
+  kSAH,     //!< binned surface area heuristic
+  kLBVH,    //!< sort by Morton code, split at the highest differing bit
+  kSBVH     //!< binned SAH with spatial splits, which may put a surface
+            //!< in both children
+};
+
+
+//! \enum BVHLayout
+//! \brief Memory layout of the BVHs built by BVHNode::BuildAccelerator()
+enum class BVHLayout {
+  kTree,    //!< BVHNode objects linked by shared pointers
+  kLinear,  //!< LinearBVH: flat array of compact nodes
+  kWide4,   //!< WideBVH4: 4 children per node
+  kWide8    //!< WideBVH8: 8 children per node
+};
+
+
+//! Surface count from which the builders build the two subtrees of a
+//! node in parallel
+const size_t kParallelSubtreeSize = 1024;
+
+
+//! \struct BVHBuildOptions
+//! \brief BVH builder settings
+struct BVHBuildOptions {
+  BVHSplitMethod split_method{BVHSplitMethod::kSAH};  //!< split method
+  BVHLayout layout{BVHLayout::kLinear};  //!< BuildAccelerator() layout
+  uint bin_count{16};         //!< SAH bins per axis
+  Real traversal_cost{1};     //!< SAH cost of a node (bbox) test
+  Real intersection_cost{1};  //!< SAH cost of a surface intersection
+  uint num_threads{0};        //!< build threads (0: all cores)
+  uint morton_bits{63};       //!< LBVH Morton code bits (30 or 63)
+  Real max_duplication{0.5};  //!< SBVH: extra surface references, as a
+                              //!< fraction of the surface count
+  bool packed_meshes{true};   //!< linear layout, SAH or LBVH splits: mesh
+                              //!< BVHs store the triangles in their
+                              //!< leaves (see TriMeshBVH)
+  uint max_leaf_size{8};      //!< TriMeshBVH: maximum triangles per leaf
+  bool quantized_nodes{false};  //!< TriMeshBVH: 24-byte nodes with 8-bit
+                                //!< child bounds (smaller, looser bounds;
+                                //!< leaves of up to 255 triangles)
+  bool veb_layout{false};     //!< WideBVH and quantized TriMeshBVH nodes:
+                              //!< van Emde Boas node order instead of
+                              //!< depth-first (see
+                              //!< ComputeVanEmdeBoasOrder())
+  Real rebuild_threshold{1.5};  //!< Refit(): rebuild subtrees whose SAH
+                                //!< cost grew past this factor of their
+                                //!< cost when built (0: never)
+};
+
+
+//! \brief Run a build or refit with the threads requested by its options
+//! \param[in] options Build settings ('num_threads' of 0: all cores)
+//! \param[in] function Work to run in the task arena
+template <typename Function>
+void RunInArena(const BVHBuildOptions &options, const Function &function)
+{
+  int max_threads = options.num_threads ?
+    static_cast<int>(options.num_threads) : tbb::task_arena::automatic;
+  tbb::task_arena arena(max_threads);
+  arena.execute(function);
+}
+
+
+//! \struct BVHRefitStats
+//! \brief Work done by a BVH refit
+struct BVHRefitStats {
+  size_t moved_surfaces{0};    //!< leaf surfaces whose bounds were dirty
+  size_t refit_nodes{0};       //!< nodes whose bounds were recomputed
+  size_t rebuilt_subtrees{0};  //!< subtrees rebuilt for their SAH cost
+  size_t rebuilt_surfaces{0};  //!< surfaces of the rebuilt subtrees
+  Real sah_cost{0};            //!< SAH cost after the refit
+  Real build_sah_cost{0};      //!< SAH cost when (re)built
+
+  //! \brief Add the work of a part of the tree
+  //! \param[in] other Statistics to add (costs are not added)
+  void Add(const BVHRefitStats &other);
+};
+
+
 //! \class BVHNode
 //! \brief BVHNode class
 class BVHNode : public Surface {
@@ -24,16 +113,305 @@ public:
   explicit BVHNode(const std::string &name=std::string());
 
   //! \brief Check if ray intersects with surface
+  //! \details Visits the child that the ray enters first before the
+  //!    other one, and skips the other one if the ray enters it beyond
+  //!    the closest hit found in the first.
   //! \param[in] ray Ray to check intersection against
   //! \param[in] tmin Minimum value for acceptable t
   //! \param[in] tmax Maximum value for acceptable t
   //! \param[in] hit_record Resulting hit record if ray intersected with surface
   //! \return True if ray intersected with surface
   bool Hit(const Ray &ray, Real tmin, Real tmax,HitRecord &hit_record) override;
+
+  //! \brief Check which rays of a packet intersect with surface
+  //! \details Traverses the tree with the whole packet, testing the
+  //!    node boxes for all rays at once. Subtrees that only a few
+  //!    rays of the packet enter (see kMinPacketActiveRays) are
+  //!    traversed one ray at a time. Returns the same hits as Hit().
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane
+  //! \return Mask of the active lanes that intersected with surface
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if any surface of the tree blocks a ray
+  //! \details Children are visited in order, without comparing their
+  //!    entry distances, and traversal stops at the first surface that
+  //!    the ray intersects.
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with a surface
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the tree
+  //! \details Lanes leave the packet as soon as they are blocked.
+  //!    Subtrees that only a few rays of the packet enter are traversed
+  //!    one ray at a time (see kMinPacketActiveRays).
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with a surface
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
   AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Compute the SAH cost of the (sub)tree
+  //! \details The expected cost of tracing a ray through the tree:
+  //!    each node and surface test is weighted by the probability
+  //!    that a ray hitting this node's bbox also hits the bbox it is
+  //!    tested in (the ratio of surface areas). Surfaces that are not
+  //!    BVHNodes (e.g., meshes with their own BVH) count as a single
+  //!    intersection test.
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  Real ComputeSAHCost(const BVHBuildOptions &options) const;
+
+  //! \brief Compute the size and quality of the (sub)tree
+  //! \param[in] options Node and intersection test costs
+  //! \return Tree statistics (without the build time)
+  BVHTreeStats ComputeTreeStats(const BVHBuildOptions &options) const;
+
+  //! \brief Update the bounds of the tree after leaf surfaces moved
+  //! \details Surfaces whose bounds are dirty (e.g., after
+  //!    Sphere::SetCenter()) mark their ancestors dirty, and only the
+  //!    dirty nodes are recomputed, bottom up; large subtrees are refit
+  //!    in parallel. Each node tracks its SAH cost (see
+  //!    ComputeSAHCost()) and its cost when it was built. The highest
+  //!    dirty subtrees whose cost grew past 'options.rebuild_threshold'
+  //!    times their built cost are rebuilt with 'options.split_method'
+  //!    (SBVH subtrees are rebuilt with SAH splits). The set of
+  //!    surfaces can't change: add or remove surfaces with BuildBVH().
+  //! \param[in] options Builder settings
+  //! \return Refit statistics
+  BVHRefitStats Refit(const BVHBuildOptions &options);
+
+  //! \brief Refit with the default builder settings
+  //! \details See Refit(const BVHBuildOptions &) and SetBuildOptions()
+  //! \return Refit statistics
+  BVHRefitStats Refit();
+
+  //! \brief Build a BVH with the default builder settings
+  //! \details See SetBuildOptions()
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] name Tree name
+  //! \return Built tree (nullptr if 'surfaces' is empty)
   static BVHNode::Ptr BuildBVH(std::vector<Surface::Ptr> surfaces,
                                const std::string &name=std::string());
+
+  //! \brief Build a BVH
+  //! \details Large subtrees are built in parallel, and the surfaces
+  //!    of large nodes are binned and partitioned in parallel. The
+  //!    work is split the same way for any thread count, so the tree
+  //!    doesn't depend on 'options.num_threads'.
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] options Builder settings
+  //! \param[in] name Tree name
+  //! \param[in] quiet Log the build at debug level instead of info
+  //!    level (subtrees rebuilt by refits)
+  //! \return Built tree (nullptr if 'surfaces' is empty)
+  static BVHNode::Ptr BuildBVH(std::vector<Surface::Ptr> surfaces,
+                               const BVHBuildOptions &options,
+                               const std::string &name=std::string(),
+                               bool quiet=false);
+
+  //! \brief Build the BVH layout selected by the default builder
+  //! settings
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] name Tree name
+  //! \return BVHNode, LinearBVH, or WideBVH (nullptr if 'surfaces' is
+  //!    empty)
+  static Surface::Ptr BuildAccelerator(std::vector<Surface::Ptr> surfaces,
+                                       const std::string &name=std::string());
+
+  //! \brief Build the BVH layout selected by 'options.layout'
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] options Builder settings
+  //! \param[in] name Tree name
+  //! \return BVHNode, LinearBVH, or WideBVH (nullptr if 'surfaces' is
+  //!    empty)
+  static Surface::Ptr BuildAccelerator(std::vector<Surface::Ptr> surfaces,
+                                       const BVHBuildOptions &options,
+                                       const std::string &name=std::string());
+
+  //! \brief Refit a BVH built by BuildAccelerator() after its surfaces
+  //!    moved
+  //! \details Calls the Refit() of the BVHNode, LinearBVH, or WideBVH.
+  //!    Other surfaces (e.g., a TriMeshBVH, whose triangles can't move)
+  //!    are an error.
+  //! \param[in] accelerator BVH to refit
+  //! \param[in] options Builder settings
+  //! \param[out] stats Refit statistics
+  //! \return True if 'accelerator' could be refit
+  static bool RefitAccelerator(const Surface::Ptr &accelerator,
+                               const BVHBuildOptions &options,
+                               BVHRefitStats &stats);
+
+  //! \brief Set the default builder settings
+  //! \details Used by BuildBVH() calls without options, including the
+  //!    BVHs that TriMesh builds while a scene is parsed.
+  //! \param[in] options Builder settings
+  static void SetBuildOptions(const BVHBuildOptions &options);
+
+  //! \brief Get the default builder settings
+  //! \return Builder settings
+  static const BVHBuildOptions& GetBuildOptions();
+
+  //! \brief Start or stop recording the statistics of built BVHs
+  //! \details While enabled, BuildAccelerator() and
+  //!    TriMeshBVH::BuildBVH() compute the statistics of each BVH they
+  //!    build (see ComputeTreeStats()). Enabling clears the records.
+  //! \param[in] collect True to record
+  static void SetCollectTreeStats(bool collect);
+
+  //! \brief Check if the statistics of built BVHs are recorded
+  //! \return True if recording
+  static bool IsCollectingTreeStats();
+
+  //! \brief Record the statistics of a built BVH
+  //! \param[in] stats Tree statistics
+  static void AddTreeStats(const BVHTreeStats &stats);
+
+  //! \brief Get the recorded statistics of the built BVHs
+  //! \return Tree statistics, in build order
+  static std::vector<BVHTreeStats> GetTreeStats();
+
+  //! \brief Get the left child
+  //! \return Left child (a BVHNode or a leaf surface)
+  inline Surface::Ptr GetLeft() const {return left_;}
+
+  //! \brief Get the right child
+  //! \return Right child (a BVHNode, a leaf surface, or nullptr)
+  inline Surface::Ptr GetRight() const {return right_;}
+
+  //! \struct BuildSurface
+  //! \brief Bbox and bbox center of a surface, cached for SAH and LBVH
+  //!    builds
+  struct BuildSurface {
+    AABB bbox;              //!< surface bbox
+    Vec3r center;           //!< bbox center
+    size_t index;           //!< index of the surface in the input list
+    uint64_t morton_code;   //!< LBVH: Morton code of the bbox center
+  };
+
+  //! \brief Split a range of surfaces in two with binned SAH
+  //! \details The centers of the surface bboxes in [start, end) are
+  //!    sorted into 'options.bin_count' bins along each axis, and the
+  //!    range is partitioned (stably, in place) at the bin boundary
+  //!    with the lowest SAH cost. If all centers coincide, the range is
+  //!    split in half. Large ranges are binned and partitioned in
+  //!    parallel.
+  //! \param[in,out] build_surfaces Bboxes of the surfaces
+  //! \param[in] start Index of the first surface in the range
+  //! \param[in] end Index after the last surface in the range (at
+  //!    least start + 2)
+  //! \param[in] options Builder settings
+  //! \return Index of the first surface of the second half
+  static size_t PartitionSAH(std::vector<BuildSurface> &build_surfaces,
+                             size_t start, size_t end,
+                             const BVHBuildOptions &options);
+
+  //! \brief Sort surfaces by the Morton code of their bbox centers
+  //! \details Sets the 'morton_code' of each surface, with
+  //!    'options.morton_bits' / 3 bits per axis over the bounds of the
+  //!    centers, and sorts the surfaces with a parallel radix sort. The
+  //!    sort is stable, so the order doesn't depend on the thread count.
+  //! \param[in,out] build_surfaces Bboxes of the surfaces
+  //! \param[in] options Builder settings
+  static void SortMorton(std::vector<BuildSurface> &build_surfaces,
+                         const BVHBuildOptions &options);
+
+  //! \brief Split a range of Morton-sorted surfaces in two (LBVH)
+  //! \details Splits at the first surface whose code has the highest
+  //!    bit in which the codes of the range differ, found by binary
+  //!    search. This gives the same tree as building the LBVH bottom
+  //!    up from the sorted codes. If all codes are equal, the range is
+  //!    split in half.
+  //! \param[in] build_surfaces Surfaces sorted by SortMorton()
+  //! \param[in] start Index of the first surface in the range
+  //! \param[in] end Index after the last surface in the range (at
+  //!    least start + 2)
+  //! \return Index of the first surface of the second half
+  static size_t PartitionMorton(const std::vector<BuildSurface>
+                                &build_surfaces, size_t start, size_t end);
+
+  //! \brief Split a range of surfaces with 'options.split_method'
+  //! \details PartitionSAH() or PartitionMorton()
+  //! \param[in,out] build_surfaces Bboxes of the surfaces
+  //! \param[in] start Index of the first surface in the range
+  //! \param[in] end Index after the last surface in the range (at
+  //!    least start + 2)
+  //! \param[in] options Builder settings
+  //! \return Index of the first surface of the second half
+  static size_t Partition(std::vector<BuildSurface> &build_surfaces,
+                          size_t start, size_t end,
+                          const BVHBuildOptions &options);
 protected:
+
+  //! \brief Build a BVH (sub)tree with binned SAH or LBVH splits
+  //! \details Only surfaces in the range [start, end) of 'build_surfaces'
+  //!        are used to build the tree. Nodes are split with
+  //!        Partition(), which may reorder the range in place.
+  //! \param[in] surfaces List of all surfaces
+  //! \param[in,out] build_surfaces Bboxes of the surfaces
+  //! \param[in] start Index of the first surface in the range
+  //! \param[in] end Index after the last surface in the range
+  //! \param[in] options Builder settings
+  //! \return Built (sub)tree
+  static BVHNode::Ptr BuildSplitBVH(const std::vector<Surface::Ptr> &surfaces,
+                                    std::vector<BuildSurface> &build_surfaces,
+                                    size_t start, size_t end,
+                                    const BVHBuildOptions &options);
+
+  //! \brief Split the surface references of a node in two (SBVH)
+  //! \details Finds the best binned SAH split of the bbox centers (see
+  //!    PartitionSAH()). If the bboxes of its two halves overlap
+  //!    noticeably (relative to the root), binned spatial splits are
+  //!    evaluated too: a plane cuts the node bbox, and references that
+  //!    straddle it are clipped (see Surface::SplitBoundingBox()) and
+  //!    go to both children. A spatial split is used if it is cheaper
+  //!    and doesn't add more than 'duplication_budget' references.
+  //!    Both children get at least one reference.
+  //! \param[in] surfaces List of all surfaces
+  //! \param[in,out] references Clipped bboxes of the node's surfaces
+  //!    (at least 3; reordered)
+  //! \param[in] root_area Surface area of the root bbox
+  //! \param[in] duplication_budget Maximum number of added references
+  //! \param[in] options Builder settings
+  //! \param[out] left References of the left child
+  //! \param[out] right References of the right child
+  static void SplitReferences(const std::vector<Surface::Ptr> &surfaces,
+                              std::vector<BuildSurface> &references,
+                              Real root_area, size_t duplication_budget,
+                              const BVHBuildOptions &options,
+                              std::vector<BuildSurface> &left,
+                              std::vector<BuildSurface> &right);
+
+  //! \brief Build a BVH (sub)tree with spatial splits (SBVH)
+  //! \details Nodes are split with SplitReferences(). Node bboxes
+  //!    bound the clipped references, so they can be smaller than the
+  //!    union of their surfaces' bboxes.
+  //! \param[in] surfaces List of all surfaces
+  //! \param[in] references Clipped bboxes of the subtree's surfaces
+  //! \param[in] root_area Surface area of the root bbox
+  //! \param[in] duplication_budget Maximum number of references that
+  //!    the subtree may add
+  //! \param[in] options Builder settings
+  //! \param[out] reference_count Number of references in the leaves
+  //! \return Built (sub)tree
+  static BVHNode::Ptr BuildSpatialBVH(const std::vector<Surface::Ptr>
+                                      &surfaces,
+                                      std::vector<BuildSurface> references,
+                                      Real root_area,
+                                      size_t duplication_budget,
+                                      const BVHBuildOptions &options,
+                                      size_t &reference_count);
+
   //! \brief Build a BVH (sub)tree from the input list of surface in
   //!        the specified range.
   //! \details Only surfaces with indices in the range [start, end)
@@ -49,9 +427,115 @@ protected:
   static BVHNode::Ptr BuildBVH(std::vector<Surface::Ptr> &surfaces,
                                size_t start, size_t end, uint split_axis,
                                const std::string &name=std::string());
+
+  //! \brief Find the closest hit among the children of a node whose
+  //!    bbox the ray intersects
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in] hit_record Resulting hit record if ray intersected
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a surface of the subtree
+  bool HitChildren(const Ray &ray, Real tmin, Real tmax,
+                   HitRecord &hit_record, BVHTraversalStats &stats);
+
+  //! \brief Check which rays of a packet intersect with the subtree
+  //! \details HitPacket() without counting a query
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return Mask of the active lanes that intersected with the subtree
+  PacketMask HitPacketSubtree(const RayPacket &packet,
+                               const PacketMask &active, Real tmin,
+                               PacketReal &tmax, HitRecord *hit_records,
+                               BVHTraversalStats &stats);
+
+  //! \brief Check if any surface among the children of a node whose
+  //!    bbox the ray intersects blocks the ray
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a surface of the subtree
+  bool OccludedChildren(const Ray &ray, Real tmin, Real tmax,
+                        BVHTraversalStats &stats);
+
+  //! \brief Check which rays of a packet are blocked by the subtree
+  //! \details OccludedPacket() without counting a query
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return Mask of the active lanes that intersected with the subtree
+  PacketMask OccludedPacketSubtree(const RayPacket &packet,
+                                   const PacketMask &active, Real tmin,
+                                   const PacketReal &tmax,
+                                   BVHTraversalStats &stats);
+
+  //! \brief Add the nodes and leaves of the subtree to tree statistics
+  //! \param[in] depth Depth of this node (root: 1)
+  //! \param[in,out] stats Tree statistics
+  void CollectTreeStats(uint depth, BVHTreeStats &stats) const;
+
+  //! \brief Mark the nodes above surfaces with dirty bounds dirty
+  //! \param[in] depth Depth of this node (root: 0)
+  //! \param[out] dirty_surfaces Leaf surfaces with dirty bounds
+  //! \return True if the subtree has a surface with dirty bounds
+  bool MarkDirty(uint depth,
+                 tbb::concurrent_vector<Surface*> &dirty_surfaces);
+
+  //! \brief Recompute the bounds and SAH costs of the dirty nodes
+  //! \details The nodes stay marked dirty for RebuildDegraded()
+  //! \param[in] depth Depth of this node (root: 0)
+  //! \param[in] options Node and intersection test costs
+  //! \return Number of recomputed nodes
+  size_t RefitDirty(uint depth, const BVHBuildOptions &options);
+
+  //! \brief Rebuild the highest dirty subtrees whose SAH cost grew
+  //!    too much, update the costs of the other dirty nodes, and clear
+  //!    their dirty marks
+  //! \param[in] depth Depth of this node (root: 0)
+  //! \param[in] options Builder settings
+  //! \return Rebuilt subtrees and surfaces
+  BVHRefitStats RebuildDegraded(uint depth, const BVHBuildOptions &options);
+
+  //! \brief Rebuild the subtree from its leaf surfaces
+  //! \details The node keeps its place in the tree and takes the
+  //!    children of the new subtree
+  //! \param[in] options Builder settings
+  //! \return Number of surfaces in the subtree
+  size_t RebuildSubtree(const BVHBuildOptions &options);
+
+  //! \brief Collect the leaf surfaces of the subtree
+  //! \param[in,out] surfaces List to append the surfaces to
+  void CollectSurfaces(std::vector<Surface::Ptr> &surfaces) const;
+
+  //! \brief Compute the SAH costs of all nodes of the subtree and make
+  //!    them the built costs
+  //! \param[in] options Node and intersection test costs
+  void ResetSAHCosts(const BVHBuildOptions &options);
+
+  //! \brief Compute the SAH cost of the node from its children's costs
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  Real ComputeNodeSAHCost(const BVHBuildOptions &options) const;
+
   Surface::Ptr left_;
   Surface::Ptr right_;
+  BVHNode *left_node_{nullptr};   //!< left_ if it is a BVHNode (set
+                                  //!< with the bbox)
+  BVHNode *right_node_{nullptr};  //!< right_ if it is a BVHNode (set
+                                  //!< with the bbox)
+  Real sah_cost_{0};              //!< Refit(): SAH cost of the subtree
+  Real build_sah_cost_{-1};       //!< Refit(): SAH cost when built (-1:
+                                  //!< not computed yet)
 private:
+  // static data members
+  static BVHBuildOptions build_options_;  //!< default builder settings
 };
 
 }  // namespace core
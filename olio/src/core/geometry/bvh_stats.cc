@@ -0,0 +1,288 @@
+//! \file       bvh_stats.cc
+//! \brief      BVH statistics reports
+
+#include <cmath>
+#include <tbb/enumerable_thread_specific.h>
+#include <spdlog/spdlog.h>
+#include "core/geometry/bvh_stats.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! \struct ThreadTraversalStats
+//! \brief Traversal statistics of a thread, per ray type
+struct ThreadTraversalStats {
+  //! statistics of each ray type
+  BVHTraversalStats by_type[static_cast<size_t>(BVHRayType::kCount)];
+  size_t ray_type{0};  //!< type of the rays being traced
+};
+
+//! Traversal statistics of each thread
+tbb::enumerable_thread_specific<ThreadTraversalStats> traversal_stats;
+
+//! \brief Compute an average, or 0 for an empty count
+//! \param[in] sum Sum of the values
+//! \param[in] count Number of values
+//! \return Average
+inline double Average(uint64_t sum, uint64_t count)
+{
+  return count ? static_cast<double>(sum) / static_cast<double>(count) : 0;
+}
+
+
+//! \brief Compute the average depth of a tree's leaves
+//! \param[in] stats Tree statistics
+//! \return Average leaf depth
+double GetAverageLeafDepth(const BVHTreeStats &stats)
+{
+  uint64_t depth_sum = 0;
+  for (size_t depth = 0; depth < stats.leaf_depths.size(); ++depth)
+    depth_sum += depth * stats.leaf_depths[depth];
+  return Average(depth_sum, stats.leaf_count);
+}
+
+
+//! \brief Quote a string for JSON
+//! \param[in] text String
+//! \return Quoted string, with quotes, backslashes, and control
+//!    characters escaped
+string QuoteJSON(const string &text)
+{
+  string quoted{"\""};
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      quoted += fmt::format("\\u{:04x}", static_cast<int>(c));
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+
+//! \brief Format a number for JSON
+//! \param[in] value Number
+//! \param[in] precision Digits after the decimal point
+//! \return Number, or null if it isn't finite (JSON has no NaN or
+//!    infinity)
+string FormatJSONNumber(double value, int precision)
+{
+  if (!std::isfinite(value))
+    return "null";
+  return fmt::format("{:.{}f}", value, precision);
+}
+
+}  // namespace
+
+// initialize static data members
+bool BVHStats::is_collecting_traversal_stats_ = false;
+
+
+void
+BVHTraversalStats::Add(const BVHTraversalStats &other)
+{
+  rays += other.rays;
+  queries += other.queries;
+  node_visits += other.node_visits;
+  surface_tests += other.surface_tests;
+  culled_nodes += other.culled_nodes;
+}
+
+
+void
+BVHTreeStats::AddLeaf(uint depth, size_t primitives)
+{
+  ++leaf_count;
+  primitive_count += primitives;
+  if (depth >= leaf_depths.size())
+    leaf_depths.resize(depth + 1, 0);
+  ++leaf_depths[depth];
+}
+
+
+BVHTraversalStats
+BVHStats::GetTraversalStats()
+{
+  BVHTraversalStats stats;
+  for (const auto &thread_stats : traversal_stats) {
+    for (const auto &type_stats : thread_stats.by_type)
+      stats.Add(type_stats);
+  }
+  return stats;
+}
+
+
+BVHTraversalStats
+BVHStats::GetTraversalStats(BVHRayType type)
+{
+  BVHTraversalStats stats;
+  for (const auto &thread_stats : traversal_stats)
+    stats.Add(thread_stats.by_type[static_cast<size_t>(type)]);
+  return stats;
+}
+
+
+void
+BVHStats::ResetTraversalStats()
+{
+  for (auto &thread_stats : traversal_stats) {
+    for (auto &type_stats : thread_stats.by_type)
+      type_stats = BVHTraversalStats{};
+  }
+}
+
+
+BVHTraversalStats&
+BVHStats::GetLocalTraversalStats()
+{
+  auto &thread_stats = traversal_stats.local();
+  return thread_stats.by_type[thread_stats.ray_type];
+}
+
+
+void
+BVHStats::SetCollectTraversalStats(bool collect)
+{
+  is_collecting_traversal_stats_ = collect;
+}
+
+
+void
+BVHStats::CountRays(BVHRayType type, uint64_t count)
+{
+  auto &thread_stats = traversal_stats.local();
+  thread_stats.ray_type = static_cast<size_t>(type);
+  thread_stats.by_type[thread_stats.ray_type].rays += count;
+}
+
+
+const char*
+GetRayTypeName(BVHRayType type)
+{
+  switch (type) {
+  case BVHRayType::kCamera:
+    return "camera";
+  case BVHRayType::kSecondary:
+    return "secondary";
+  case BVHRayType::kShadow:
+    return "shadow";
+  case BVHRayType::kCount:
+    break;
+  }
+  return "unknown";
+}
+
+
+std::vector<BVHTraversalStats>
+GetTraversalStatsByRayType()
+{
+  vector<BVHTraversalStats> traversal;
+  for (size_t type = 0; type < static_cast<size_t>(BVHRayType::kCount);
+       ++type)
+    traversal.push_back(BVHStats::GetTraversalStats(
+      static_cast<BVHRayType>(type)));
+  return traversal;
+}
+
+
+std::vector<std::string>
+FormatBVHStats(const std::vector<BVHTreeStats> &trees,
+               const std::vector<BVHTraversalStats> &traversal)
+{
+  vector<string> lines;
+  for (const auto &tree : trees) {
+    // leaf depth distribution, e.g., "3: 2, 4: 10, 5: 7"
+    string leaf_depths;
+    for (size_t depth = 1; depth < tree.leaf_depths.size(); ++depth) {
+      if (!tree.leaf_depths[depth])
+        continue;
+      leaf_depths += (leaf_depths.empty() ? "" : ", ") + to_string(depth) +
+        ": " + to_string(tree.leaf_depths[depth]);
+    }
+    lines.push_back(fmt::format(
+      "BVH stats ({}, {}): {} primitives, {} nodes, {} leaves ({:.2f} "
+      "primitives per leaf), depth {} (average leaf depth {:.1f}; leaves "
+      "per depth {}), SAH cost {:.3f}, {:.1f} KiB, built in {:.3f}s",
+      tree.name, tree.type, tree.primitive_count, tree.node_count,
+      tree.leaf_count, Average(tree.primitive_count, tree.leaf_count),
+      tree.GetDepth(), GetAverageLeafDepth(tree), leaf_depths, tree.sah_cost,
+      static_cast<double>(tree.memory_bytes) / 1024, tree.build_time));
+  }
+  for (size_t type = 0; type < traversal.size(); ++type) {
+    const auto &stats = traversal[type];
+    if (!stats.rays)
+      continue;
+    lines.push_back(fmt::format(
+      "BVH traversal stats ({} rays): {} rays, per ray: {:.2f} BVH "
+      "queries, {:.1f} node visits, {:.1f} primitive tests, {:.2f} nodes "
+      "culled by distance", GetRayTypeName(static_cast<BVHRayType>(type)),
+      stats.rays, Average(stats.queries, stats.rays),
+      Average(stats.node_visits, stats.rays),
+      Average(stats.surface_tests, stats.rays),
+      Average(stats.culled_nodes, stats.rays)));
+  }
+  return lines;
+}
+
+
+void
+LogBVHStats(const std::vector<BVHTreeStats> &trees,
+            const std::vector<BVHTraversalStats> &traversal)
+{
+  for (const auto &line : FormatBVHStats(trees, traversal))
+    spdlog::info(line);
+}
+
+
+std::string
+FormatBVHStatsJSON(const std::vector<BVHTreeStats> &trees,
+                   const std::vector<BVHTraversalStats> &traversal)
+{
+  string json{"{\n  \"bvhs\": ["};
+  for (size_t i = 0; i < trees.size(); ++i) {
+    const auto &tree = trees[i];
+    string leaf_depths;
+    for (size_t depth = 0; depth < tree.leaf_depths.size(); ++depth)
+      leaf_depths += (depth ? ", " : "") + to_string(tree.leaf_depths[depth]);
+    json += fmt::format(
+      "{}\n    {{\"name\": {}, \"type\": {}, \"primitives\": {}, "
+      "\"nodes\": {}, \"leaves\": {}, \"depth\": {}, "
+      "\"average_leaf_depth\": {}, \"leaves_per_depth\": [{}], "
+      "\"sah_cost\": {}, \"memory_bytes\": {}, \"build_time_sec\": {}}}",
+      i ? "," : "", QuoteJSON(tree.name), QuoteJSON(tree.type),
+      tree.primitive_count, tree.node_count, tree.leaf_count,
+      tree.GetDepth(), FormatJSONNumber(GetAverageLeafDepth(tree), 3),
+      leaf_depths, FormatJSONNumber(tree.sah_cost, 6), tree.memory_bytes,
+      FormatJSONNumber(tree.build_time, 6));
+  }
+  json += trees.empty() ? "],\n" : "\n  ],\n";
+  json += "  \"traversal\": {";
+  for (size_t type = 0; type < traversal.size(); ++type) {
+    const auto &stats = traversal[type];
+    json += fmt::format(
+      "{}\n    {}: {{\"rays\": {}, \"queries\": {}, \"node_visits\": {}, "
+      "\"primitive_tests\": {}, \"culled_nodes\": {}, "
+      "\"queries_per_ray\": {}, \"node_visits_per_ray\": {}, "
+      "\"primitive_tests_per_ray\": {}, \"culled_nodes_per_ray\": {}}}",
+      type ? "," : "",
+      QuoteJSON(GetRayTypeName(static_cast<BVHRayType>(type))), stats.rays,
+      stats.queries, stats.node_visits, stats.surface_tests,
+      stats.culled_nodes,
+      FormatJSONNumber(Average(stats.queries, stats.rays), 4),
+      FormatJSONNumber(Average(stats.node_visits, stats.rays), 4),
+      FormatJSONNumber(Average(stats.surface_tests, stats.rays), 4),
+      FormatJSONNumber(Average(stats.culled_nodes, stats.rays), 4));
+  }
+  json += traversal.empty() ? "}\n}\n" : "\n  }\n}\n";
+  return json;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,197 @@
+//! \file       bvh_stats.h
+//! \brief      BVH statistics counters and reports
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "core/types.h"
+
+namespace olio {
+namespace core {
+
+//! \enum BVHRayType
+//! \brief Kinds of rays that the traversal statistics are kept for
+enum class BVHRayType {
+  kCamera,     //!< camera (primary) rays
+  kSecondary,  //!< reflection and refraction rays
+  kShadow,     //!< shadow rays
+  kCount       //!< number of ray types
+};
+
+
+//! \struct BVHTraversalStats
+//! \brief Work done by BVH traversals
+//! \details Counted by the Hit() and Occluded() functions of BVHNode,
+//!    LinearBVH, WideBVH, and TriMeshBVH. The packet variants count
+//!    each node visit and surface test once per lane that takes part
+//!    in it, so packets and single rays compare. Only counted while
+//!    BVHStats::SetCollectTraversalStats() is on.
+struct BVHTraversalStats {
+  uint64_t rays{0};           //!< rays traced (see BVHStats::BeginRays())
+  uint64_t queries{0};        //!< Hit()/Occluded() calls on a BVH root
+  uint64_t node_visits{0};    //!< nodes whose children/surfaces were tested
+  uint64_t surface_tests{0};  //!< Hit()/Occluded() calls on leaf surfaces
+  uint64_t culled_nodes{0};   //!< children skipped because the ray enters
+                              //!< them beyond the closest hit
+
+  //! \brief Add the statistics of another thread
+  //! \param[in] other Statistics to add
+  void Add(const BVHTraversalStats &other);
+};
+
+
+//! \struct BVHTreeStats
+//! \brief Size and quality of a built BVH
+//! \details Leaves are leaf nodes, leaf children of wide or quantized
+//!    nodes, or, in a BVHNode tree, the surfaces below the nodes. A
+//!    leaf's depth counts the root as 1 and the leaf as one more level
+//!    than its parent.
+struct BVHTreeStats {
+  std::string name;                 //!< tree name
+  std::string type;                 //!< BVH class
+  size_t primitive_count{0};        //!< surfaces (or triangles) in leaves
+  size_t node_count{0};             //!< nodes
+  size_t leaf_count{0};             //!< leaves
+  std::vector<size_t> leaf_depths;  //!< leaf counts, indexed by depth
+  Real sah_cost{0};                 //!< SAH cost
+  size_t memory_bytes{0};           //!< memory of the nodes and leaves
+  double build_time{0};             //!< build time in seconds
+
+  //! \brief Count a leaf
+  //! \param[in] depth Leaf depth
+  //! \param[in] primitives Surfaces (or triangles) in the leaf
+  void AddLeaf(uint depth, size_t primitives);
+
+  //! \brief Get the tree depth
+  //! \return Depth of the deepest leaf
+  inline uint GetDepth() const {
+    return leaf_depths.empty() ? 0 :
+      static_cast<uint>(leaf_depths.size() - 1);
+  }
+};
+
+
+//! \class BVHStats
+//! \brief Traversal statistics counters of all threads
+//! \details Kept apart from the BVH classes, so that the integrators
+//!    and lights can count the rays they trace without depending on a
+//!    BVH.
+class BVHStats {
+public:
+  //! \brief Get the traversal statistics, summed over all threads
+  //! \return Statistics since the last ResetTraversalStats()
+  static BVHTraversalStats GetTraversalStats();
+
+  //! \brief Get the traversal statistics of a ray type, summed over
+  //!    all threads
+  //! \param[in] type Ray type
+  //! \return Statistics since the last ResetTraversalStats()
+  static BVHTraversalStats GetTraversalStats(BVHRayType type);
+
+  //! \brief Reset the traversal statistics of all threads
+  static void ResetTraversalStats();
+
+  //! \brief Get the traversal statistics of the calling thread
+  //! \details Counts go to the ray type of the thread's last
+  //!    BeginRays() call. BVH classes count into a
+  //!    LocalTraversalStats, which adds its counts here.
+  //! \return Statistics of the calling thread
+  static BVHTraversalStats& GetLocalTraversalStats();
+
+  //! \brief Start or stop counting traversal statistics
+  //! \details Off by default, so that renders don't pay for looking
+  //!    up the statistics of the calling thread on every query.
+  //! \param[in] collect True to count
+  static void SetCollectTraversalStats(bool collect);
+
+  //! \brief Check if traversal statistics are counted
+  //! \return True if counting
+  static inline bool IsCollectingTraversalStats() {
+    return is_collecting_traversal_stats_;
+  }
+
+  //! \brief Count rays that the calling thread is about to trace
+  //! \details Called by the integrators and lights before they trace
+  //!    the scene. The thread's traversals count toward 'type' until
+  //!    its next call.
+  //! \param[in] type Ray type
+  //! \param[in] count Number of rays (e.g., the lanes of a packet)
+  static inline void BeginRays(BVHRayType type, uint64_t count=1) {
+    if (is_collecting_traversal_stats_)
+      CountRays(type, count);
+  }
+private:
+  //! \brief BeginRays() while traversal statistics are counted
+  //! \param[in] type Ray type
+  //! \param[in] count Number of rays
+  static void CountRays(BVHRayType type, uint64_t count);
+
+  static bool is_collecting_traversal_stats_;  //!< see
+                                               //!< SetCollectTraversalStats()
+};
+
+
+//! \class LocalTraversalStats
+//! \brief Traversal statistics of one BVH query
+//! \details BVH classes count into a local object, which is cheap to
+//!    update. When it goes out of scope, it adds its counts to the
+//!    statistics of the calling thread, if they are being collected
+//!    (see BVHStats::SetCollectTraversalStats()).
+class LocalTraversalStats : public BVHTraversalStats {
+public:
+  LocalTraversalStats() = default;
+  LocalTraversalStats(const LocalTraversalStats&) = delete;
+  LocalTraversalStats& operator=(const LocalTraversalStats&) = delete;
+  ~LocalTraversalStats() {
+    if (BVHStats::IsCollectingTraversalStats())
+      BVHStats::GetLocalTraversalStats().Add(*this);
+  }
+};
+
+
+//! \brief Get the name of a ray type
+//! \param[in] type Ray type
+//! \return Name, e.g., "camera"
+const char* GetRayTypeName(BVHRayType type);
+
+//! \brief Get the traversal statistics of all ray types
+//! \return Statistics since the last BVHStats::ResetTraversalStats(),
+//!    indexed by BVHRayType
+std::vector<BVHTraversalStats> GetTraversalStatsByRayType();
+
+//! \brief Format a report of BVH statistics as text
+//! \details One line per BVH with its node and leaf counts, leaf
+//!    depths, SAH cost, memory, and build time, followed by one line per
+//!    ray type with the node visits and surface tests per ray.
+//! \param[in] trees Statistics of the built BVHs
+//!    (see BVHNode::GetTreeStats())
+//! \param[in] traversal Traversal statistics, indexed by BVHRayType
+//!    (empty: no traversal report)
+//! \return Report lines
+std::vector<std::string> FormatBVHStats(
+  const std::vector<BVHTreeStats> &trees,
+  const std::vector<BVHTraversalStats> &traversal);
+
+//! \brief Log the report of FormatBVHStats(), one line at a time
+//! \param[in] trees Statistics of the built BVHs
+//! \param[in] traversal Traversal statistics, indexed by BVHRayType
+void LogBVHStats(const std::vector<BVHTreeStats> &trees,
+                 const std::vector<BVHTraversalStats> &traversal);
+
+//! \brief Format a report of BVH statistics as JSON
+//! \details Same contents as FormatBVHStats(), as an object with a
+//!    "bvhs" array and a "traversal" object with one entry per ray
+//!    type. Numbers that aren't finite are written as null.
+//! \param[in] trees Statistics of the built BVHs
+//! \param[in] traversal Traversal statistics, indexed by BVHRayType
+//!    (empty: no traversal report)
+//! \return JSON text
+std::string FormatBVHStatsJSON(const std::vector<BVHTreeStats> &trees,
+                               const std::vector<BVHTraversalStats> &
+                               traversal);
+
+}  // namespace core
+}  // namespace olio
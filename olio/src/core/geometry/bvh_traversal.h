@@ -0,0 +1,336 @@
+//! \file       bvh_traversal.h
+//! \brief      Stack and node walks of the iterative BVH traversals
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "core/types.h"
+#include "core/ray_packet.h"
+#include "core/geometry/bvh_stats.h"
+
+namespace olio {
+namespace core {
+
+//! Stack size up to which binary BVH traversals don't allocate their
+//! stack
+const uint kLocalStackSize = 64;
+
+//! Stack size up to which wide BVH traversals don't allocate their
+//! stack (each visited node pushes up to 'Width' children)
+const uint kWideLocalStackSize = 256;
+
+
+//! \class TraversalStack
+//! \brief Nodes that an iterative BVH traversal has yet to visit
+//! \details The entries are kept in an array on the call stack, unless
+//!    the traversal may push more than 'LocalSize' of them, in which
+//!    case they are allocated once on the heap.
+template <typename Entry, uint LocalSize = kLocalStackSize>
+class TraversalStack {
+public:
+  //! \brief Constructor
+  //! \param[in] max_size Most entries the traversal holds at once
+  explicit TraversalStack(size_t max_size) {
+    if (max_size > LocalSize) {
+      heap_entries_.resize(max_size);
+      entries_ = heap_entries_.data();
+    }
+  }
+  TraversalStack(const TraversalStack&) = delete;
+  TraversalStack& operator=(const TraversalStack&) = delete;
+
+  //! \brief Push a node to visit
+  //! \param[in] entry Node
+  inline void Push(const Entry &entry) {entries_[size_++] = entry;}
+
+  //! \brief Pop the node to visit next
+  //! \return Node
+  inline Entry Pop() {return entries_[--size_];}
+
+  //! \brief Check if there are nodes left to visit
+  //! \return True if the stack is empty
+  inline bool IsEmpty() const {return !size_;}
+protected:
+  Entry local_entries_[LocalSize];   //!< entries of shallow trees
+  std::vector<Entry> heap_entries_;  //!< entries of deep trees
+  Entry *entries_{local_entries_};   //!< entries in use
+  uint size_{0};                     //!< number of entries
+};
+
+
+// The walks below traverse binary BVHs stored as arrays of nodes in
+// depth-first order (LinearBVH::LinearNode): the left child of an
+// interior node follows it, 'offset' is the index of its right child,
+// and leaves have a 'count' of items starting at 'offset'. They leave
+// the intersection of the leaf items to the caller.
+
+//! \brief Find the closest hit in a subtree of a binary BVH
+//! \details Visits the child that the ray enters first first, and
+//!    skips the nodes that the ray enters past the closest hit found.
+//! \param[in] nodes Nodes
+//! \param[in] root Index of the subtree's root node
+//! \param[in] depth Depth of the tree
+//! \param[in] ray Ray to check intersection against
+//! \param[in] tmin Minimum value for acceptable t
+//! \param[in] tmax Maximum value for acceptable t
+//! \param[in,out] stats Traversal statistics to add to
+//! \param[in] hit_leaf Function bool(const Node &leaf, Real &tmax) that
+//!    intersects the items of a leaf, lowers 'tmax' to the closest hit
+//!    and returns true if there was one
+//! \return True if ray intersected with an item of the subtree
+template <typename Node, typename HitLeaf>
+bool HitBinaryBVH(const Node *nodes, uint32_t root, uint depth,
+                  const Ray &ray, Real tmin, Real tmax,
+                  BVHTraversalStats &stats, const HitLeaf &hit_leaf)
+{
+  const Vec3r &origin = ray.GetOrigin();
+  const Vec3r &dir = ray.GetDirection();
+  const Vec3r inv_direction{1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  Real root_entry;
+  if (!nodes[root].Hit(origin, inv_direction, tmin, tmax, root_entry))
+    return false;
+
+  //! \struct StackEntry
+  //! \brief Node to visit
+  struct StackEntry {
+    uint32_t index;  //!< node index
+    Real t_entry;    //!< distance at which the ray enters the node
+  };
+
+  // each interior node replaces itself with at most two children, so
+  // the stack never holds more than depth + 1 nodes
+  TraversalStack<StackEntry> stack{depth + 1};
+
+  // children are pushed once the ray is known to enter them, nearer
+  // child last, so that it is visited first
+  bool is_hit = false;
+  stack.Push({root, root_entry});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+    if (entry.t_entry > tmax) {
+      ++stats.culled_nodes;
+      continue;
+    }
+    ++stats.node_visits;
+    const Node &node = nodes[entry.index];
+    if (node.count) {
+      stats.surface_tests += node.count;
+      if (hit_leaf(node, tmax))
+        is_hit = true;
+      continue;
+    }
+    uint32_t left = entry.index + 1;
+    uint32_t right = node.offset;
+    Real left_entry = tmin, right_entry = tmin;
+    bool enters_left = nodes[left].Hit(origin, inv_direction, tmin, tmax,
+                                       left_entry);
+    bool enters_right = nodes[right].Hit(origin, inv_direction, tmin, tmax,
+                                         right_entry);
+    if (enters_left && enters_right) {
+      if (right_entry < left_entry) {
+        stack.Push({left, left_entry});
+        stack.Push({right, right_entry});
+      } else {
+        stack.Push({right, right_entry});
+        stack.Push({left, left_entry});
+      }
+    } else if (enters_left) {
+      stack.Push({left, left_entry});
+    } else if (enters_right) {
+      stack.Push({right, right_entry});
+    }
+  }
+  return is_hit;
+}
+
+
+//! \brief Check if any item of a subtree of a binary BVH blocks a ray
+//! \param[in] nodes Nodes
+//! \param[in] root Index of the subtree's root node
+//! \param[in] depth Depth of the tree
+//! \param[in] ray Ray to check intersection against
+//! \param[in] tmin Minimum value for acceptable t
+//! \param[in] tmax Maximum value for acceptable t
+//! \param[in,out] stats Traversal statistics to add to
+//! \param[in] occluded_leaf Function bool(const Node &leaf,
+//!    BVHTraversalStats &stats) that returns true if an item of a leaf
+//!    blocks the ray, counting the items it tests
+//! \return True if ray intersected with an item of the subtree
+template <typename Node, typename OccludedLeaf>
+bool OccludedBinaryBVH(const Node *nodes, uint32_t root, uint depth,
+                       const Ray &ray, Real tmin, Real tmax,
+                       BVHTraversalStats &stats,
+                       const OccludedLeaf &occluded_leaf)
+{
+  const Vec3r &origin = ray.GetOrigin();
+  const Vec3r &dir = ray.GetDirection();
+  const Vec3r inv_direction{1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  Real t_entry;
+  if (!nodes[root].Hit(origin, inv_direction, tmin, tmax, t_entry))
+    return false;
+  TraversalStack<uint32_t> stack{depth + 1};
+
+  // any hit ends the query, so there is no point in visiting the
+  // nearer child first
+  stack.Push(root);
+  while (!stack.IsEmpty()) {
+    uint32_t index = stack.Pop();
+    ++stats.node_visits;
+    const Node &node = nodes[index];
+    if (node.count) {
+      if (occluded_leaf(node, stats))
+        return true;
+      continue;
+    }
+    if (nodes[node.offset].Hit(origin, inv_direction, tmin, tmax, t_entry))
+      stack.Push(node.offset);
+    if (nodes[index + 1].Hit(origin, inv_direction, tmin, tmax, t_entry))
+      stack.Push(index + 1);
+  }
+  return false;
+}
+
+
+//! \brief Find the closest hits of a packet of rays in a binary BVH
+//! \details Lanes drop out of the nodes they miss. Once fewer than
+//!    kMinPacketActiveRays lanes enter a node, each of them traverses
+//!    the node's subtree on its own. Node visits and item tests are
+//!    counted once per lane, so that the statistics compare with
+//!    single-ray traversal.
+//! \param[in] nodes Nodes (not empty)
+//! \param[in] depth Depth of the tree
+//! \param[in] packet Rays to check intersection against
+//! \param[in] active Lanes to trace
+//! \param[in] tmin Minimum value for acceptable t
+//! \param[in] tmax Maximum values for acceptable t, lowered by
+//!    'hit_leaf' and 'hit_lane' to the closest hits
+//! \param[in,out] stats Traversal statistics to add to
+//! \param[in] hit_leaf Function PacketMask(const Node &leaf,
+//!    const PacketMask &lanes) that intersects the items of a leaf with
+//!    the lanes and returns the ones that hit one
+//! \param[in] hit_lane Function bool(uint32_t root, int lane) that finds
+//!    the closest hit of a lane in a subtree
+//! \return Lanes that intersected with an item
+template <typename Node, typename HitLeaf, typename HitLane>
+PacketMask HitBinaryBVHPacket(const Node *nodes, uint depth,
+                              const RayPacket &packet,
+                              const PacketMask &active, Real tmin,
+                              const PacketReal &tmax,
+                              BVHTraversalStats &stats,
+                              const HitLeaf &hit_leaf,
+                              const HitLane &hit_lane)
+{
+  //! \struct StackEntry
+  //! \brief Node to visit, with the lanes that entered its parent
+  struct StackEntry {
+    uint32_t index;    //!< node index
+    PacketMask lanes;  //!< lanes to test against the node
+  };
+  TraversalStack<StackEntry> stack{depth + 1};
+
+  PacketMask is_hit = PacketMask::Constant(false);
+  stack.Push({0, active});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+    const Node &node = nodes[entry.index];
+
+    // find the rays that enter the node
+    PacketMask lanes = node.HitPacket(packet, entry.lanes, tmin, tmax);
+    auto lane_count = lanes.count();
+    if (!lane_count)
+      continue;
+
+    // the packet has diverged: trace the remaining rays one by one
+    if (lane_count < kMinPacketActiveRays) {
+      for (int lane = 0; lane < packet.GetSize(); ++lane) {
+        if (lanes[lane] && hit_lane(entry.index, lane))
+          is_hit[lane] = true;
+      }
+      continue;
+    }
+
+    stats.node_visits += static_cast<uint64_t>(lane_count);
+    if (node.count) {
+      stats.surface_tests += static_cast<uint64_t>(node.count * lane_count);
+      is_hit = is_hit || hit_leaf(node, lanes);
+    } else {
+      stack.Push({node.offset, lanes});
+      stack.Push({entry.index + 1, lanes});
+    }
+  }
+  return is_hit;
+}
+
+
+//! \brief Check which rays of a packet are blocked in a binary BVH
+//! \details Same packet traversal as HitBinaryBVHPacket(); lanes also
+//!    drop out once they are blocked.
+//! \param[in] nodes Nodes (not empty)
+//! \param[in] depth Depth of the tree
+//! \param[in] packet Rays to check intersection against
+//! \param[in] active Lanes to trace
+//! \param[in] tmin Minimum value for acceptable t
+//! \param[in] tmax Maximum values for acceptable t
+//! \param[in,out] stats Traversal statistics to add to
+//! \param[in] occluded_leaf Function PacketMask(const Node &leaf,
+//!    const PacketMask &lanes, BVHTraversalStats &stats) that returns
+//!    the lanes that an item of a leaf blocks, counting the items it
+//!    tests
+//! \param[in] occluded_lane Function bool(uint32_t root, int lane) that
+//!    checks if an item of a subtree blocks a lane
+//! \return Lanes that intersected with an item
+template <typename Node, typename OccludedLeaf, typename OccludedLane>
+PacketMask OccludedBinaryBVHPacket(const Node *nodes, uint depth,
+                                   const RayPacket &packet,
+                                   const PacketMask &active, Real tmin,
+                                   const PacketReal &tmax,
+                                   BVHTraversalStats &stats,
+                                   const OccludedLeaf &occluded_leaf,
+                                   const OccludedLane &occluded_lane)
+{
+  //! \struct StackEntry
+  //! \brief Node to visit, with the lanes that entered its parent
+  struct StackEntry {
+    uint32_t index;    //!< node index
+    PacketMask lanes;  //!< lanes to test against the node
+  };
+  TraversalStack<StackEntry> stack{depth + 1};
+
+  PacketMask occluded = PacketMask::Constant(false);
+  stack.Push({0, active});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+    const Node &node = nodes[entry.index];
+
+    // find the rays that enter the node and aren't blocked yet
+    PacketMask lanes = node.HitPacket(packet, entry.lanes && !occluded, tmin,
+                                      tmax);
+    auto lane_count = lanes.count();
+    if (!lane_count)
+      continue;
+
+    // the packet has diverged: trace the remaining rays one by one
+    if (lane_count < kMinPacketActiveRays) {
+      for (int lane = 0; lane < packet.GetSize(); ++lane) {
+        if (lanes[lane] && occluded_lane(entry.index, lane))
+          occluded[lane] = true;
+      }
+      continue;
+    }
+
+    stats.node_visits += static_cast<uint64_t>(lane_count);
+    if (node.count) {
+      occluded = occluded || occluded_leaf(node, lanes, stats);
+    } else {
+      stack.Push({node.offset, lanes});
+      stack.Push({entry.index + 1, lanes});
+    }
+  }
+  return occluded;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -21,22 +21,99 @@ namespace core {
         return bbox_;
     }
 
+    void BVHTriMeshFace::SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                                          AABB &left_bbox, AABB &right_bbox) {
+        Vec3r points[3];
+        int num_points = 0;
+        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid() && num_points < 3; ++fvit) {
+            points[num_points++] = mesh_->point(*fvit);
+        }
+        if(num_points < 3) {
+            Surface::SplitBoundingBox(bbox, axis, position, left_bbox, right_bbox);
+            return;
+        }
+        Triangle::SplitTriangleBoundingBox(points[0], points[1], points[2], bbox, axis,
+                                           position, left_bbox, right_bbox);
+    }
+
     bool BVHTriMeshFace::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record) {
         if(!bbox_.Hit(ray, tmin, tmax)) {
             return false;
         }
-        std::vector<TriMesh::VertexHandle> points;
-        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid(); ++fvit) {
-            points.push_back(*fvit);
+        TriMesh::VertexHandle points[3];
+        int num_points = 0;
+        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid() && num_points < 3; ++fvit) {
+            points[num_points++] = *fvit;
         }
 
         Real ray_t{0};
         Vec2r uv;
         if (!Triangle::RayTriangleHit(mesh_->point(points[0]), mesh_->point(points[1]), mesh_->point(points[2]), ray, tmin, tmax, ray_t, uv))
             return false;
-        
-        // fill hit_record
 
+        FillHitRecord(ray, ray_t, uv, points, hit_record);
+        return true;
+    }
+
+    PacketMask BVHTriMeshFace::HitPacket(const RayPacket &packet, const PacketMask &active,
+                                         Real tmin, PacketReal &tmax, HitRecord *hit_records) {
+        PacketMask hit = bbox_.HitPacket(packet, active, tmin, tmax);
+        if(!hit.any()) {
+            return hit;
+        }
+        TriMesh::VertexHandle points[3];
+        int num_points = 0;
+        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid() && num_points < 3; ++fvit) {
+            points[num_points++] = *fvit;
+        }
+
+        PacketReal ray_t, u, v;
+        hit = Triangle::RayTriangleHitPacket(mesh_->point(points[0]), mesh_->point(points[1]), mesh_->point(points[2]),
+                                             packet, hit, tmin, tmax, ray_t, u, v);
+        for(int lane = 0; lane < packet.GetSize(); ++lane) {
+            if(!hit[lane]) {
+                continue;
+            }
+            FillHitRecord(packet.GetRay(lane), ray_t[lane], Vec2r{u[lane], v[lane]}, points, hit_records[lane]);
+            tmax[lane] = ray_t[lane];
+        }
+        return hit;
+    }
+
+    bool BVHTriMeshFace::Occluded(const Ray &ray, Real tmin, Real tmax) {
+        if(!bbox_.Hit(ray, tmin, tmax)) {
+            return false;
+        }
+        TriMesh::VertexHandle points[3];
+        int num_points = 0;
+        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid() && num_points < 3; ++fvit) {
+            points[num_points++] = *fvit;
+        }
+
+        Real ray_t{0};
+        Vec2r uv;
+        return Triangle::RayTriangleHit(mesh_->point(points[0]), mesh_->point(points[1]), mesh_->point(points[2]), ray, tmin, tmax, ray_t, uv);
+    }
+
+    PacketMask BVHTriMeshFace::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                                              Real tmin, const PacketReal &tmax) {
+        PacketMask hit = bbox_.HitPacket(packet, active, tmin, tmax);
+        if(!hit.any()) {
+            return hit;
+        }
+        TriMesh::VertexHandle points[3];
+        int num_points = 0;
+        for(auto fvit = mesh_->fv_iter(fh_); fvit.is_valid() && num_points < 3; ++fvit) {
+            points[num_points++] = *fvit;
+        }
+
+        PacketReal ray_t, u, v;
+        return Triangle::RayTriangleHitPacket(mesh_->point(points[0]), mesh_->point(points[1]), mesh_->point(points[2]),
+                                              packet, hit, tmin, tmax, ray_t, u, v);
+    }
+
+    void BVHTriMeshFace::FillHitRecord(const Ray &ray, Real ray_t, const Vec2r &uv,
+                                       const TriMesh::VertexHandle *points, HitRecord &hit_record) {
         const Vec3r &hit_point = ray.At(ray_t);
         hit_record.SetRayT(ray_t);
         hit_record.SetPoint(hit_point);
@@ -70,7 +147,6 @@ namespace core {
         }
 
         hit_record.SetFaceGeoUV(face_geo_uv);
-        return true;
     }
 }  // namespace core
 }  // namespace olio
@@ -17,8 +17,58 @@ public:
   explicit BVHTriMeshFace(TriMesh::Ptr mesh, TriMesh::FaceHandle fh);
 
   bool Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record) override;
+
+  //! \brief Check which rays of a packet intersect with the face
+  //! \details All active rays are tested against the triangle at once
+  //!    (see Triangle::RayTriangleHitPacket)
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Mask of the rays to check
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each ray;
+  //!                updated for the rays that hit the face
+  //! \param[out] hit_records Resulting hit records (one per lane)
+  //! \return Mask of the rays that intersected with the face
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if the face blocks a ray
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with the face
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the face
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Mask of the rays to check
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each ray
+  //! \return Mask of the rays that intersected with the face
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
   AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Split the part of the face inside a bbox by an axis-aligned
+  //!    plane (see Triangle::SplitTriangleBoundingBox)
+  //! \param[in] bbox Part of the face's bbox to split
+  //! \param[in] axis Axis that the plane is perpendicular to
+  //! \param[in] position Position of the plane along 'axis'
+  //! \param[out] left_bbox Bounds of the part below the plane
+  //! \param[out] right_bbox Bounds of the part above the plane
+  void SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                        AABB &left_bbox, AABB &right_bbox) override;
 protected:
+  //! \brief Fill in the hit record of a ray that hit the face
+  //! \param[in] ray Ray that hit the face
+  //! \param[in] ray_t Value of t of the hit point
+  //! \param[in] uv UV coordinates of the hit point inside the face
+  //! \param[in] points Vertex handles of the face
+  //! \param[out] hit_record Hit record to fill in
+  void FillHitRecord(const Ray &ray, Real ray_t, const Vec2r &uv,
+                     const TriMesh::VertexHandle *points,
+                     HitRecord &hit_record);
+
   TriMesh::Ptr mesh_;
   TriMesh::FaceHandle fh_;
 private:
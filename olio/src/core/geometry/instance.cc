@@ -0,0 +1,109 @@
+//! \file       instance.cc
+//! \brief      Instance class
+
+#include "core/geometry/instance.h"
+#include "core/ray.h"
+#include "core/material/material.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+Instance::Instance(const std::string &name) :
+  Surface{}
+{
+  name_ = name.size() ? name : "Instance";
+}
+
+
+Instance::Instance(const Surface::Ptr &surface, const Mat4r &xform,
+                   const std::string &name) :
+  Surface{},
+  surface_{surface}
+{
+  name_ = name.size() ? name : "Instance";
+  SetTransform(xform);
+}
+
+
+bool
+Instance::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
+{
+  if (!surface_)
+    return false;
+
+  // object-space ray; the direction keeps the transform's scale, so t
+  // is the same as in world space
+  Ray object_ray{XformPoint(inverse_xform_, ray.GetOrigin()),
+                 XformVector(inverse_xform_, ray.GetDirection())};
+  if (!surface_->Hit(object_ray, tmin, tmax, hit_record))
+    return false;
+
+  // the normal faces the object-space ray; the inverse transpose
+  // keeps it facing the world-space ray
+  hit_record.SetPoint(ray.At(hit_record.GetRayT()));
+  Vec3r normal = XformVector(normal_xform_, hit_record.GetNormal());
+  hit_record.SetNormal(normal.normalized(), hit_record.IsFrontFace());
+  hit_record.SetSurface(GetPtr());
+  return true;
+}
+
+
+bool
+Instance::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  if (!surface_)
+    return false;
+  Ray object_ray{XformPoint(inverse_xform_, ray.GetOrigin()),
+                 XformVector(inverse_xform_, ray.GetDirection())};
+  return surface_->Occluded(object_ray, tmin, tmax);
+}
+
+
+Material::Ptr
+Instance::GetMaterial()
+{
+  if (!material_ && surface_)
+    return surface_->GetMaterial();
+  return material_;
+}
+
+
+AABB
+Instance::GetBoundingBox(bool force_recompute)
+{
+  // if bound is clean, just return existing bbox_
+  if (!force_recompute && !IsBoundDirty())
+    return bbox_;
+
+  bbox_.Reset();
+  if (surface_) {
+    AABB surface_bbox = surface_->GetBoundingBox(force_recompute);
+    if (surface_bbox.IsValid())
+      bbox_ = xform_ * surface_bbox;
+  }
+  bound_dirty_ = false;
+  return bbox_;
+}
+
+
+void
+Instance::SetSurface(const Surface::Ptr &surface)
+{
+  surface_ = surface;
+  bound_dirty_ = true;
+}
+
+
+void
+Instance::SetTransform(const Mat4r &xform)
+{
+  xform_ = xform;
+  inverse_xform_ = xform.inverse();
+  normal_xform_ = inverse_xform_.transpose();
+  bound_dirty_ = true;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,93 @@
+//! \file       instance.h
+//! \brief      Instance class
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include "core/geometry/surface.h"
+
+namespace olio {
+namespace core {
+
+class Ray;
+class HitRecord;
+class Material;
+
+//! \class Instance
+//! \brief Transformed reference to a surface
+//! \details Places a shared surface (typically a TriMesh with its own
+//!    BVH) in the scene with a transform, so many copies of a mesh
+//!    share one set of triangles and one bottom-level BVH. The scene
+//!    BVH over the instances is the top level. Rays are transformed
+//!    into the surface's object space without normalizing their
+//!    direction, so a hit has the same t in both spaces. Hit records
+//!    refer to the instance, so each instance can have its own
+//!    material.
+class Instance : public Surface {
+public:
+  OLIO_NODE(Instance)
+
+  //! \brief Constructor
+  //! \param[in] name Node name
+  explicit Instance(const std::string &name=std::string());
+
+  //! \brief Constructor
+  //! \param[in] surface Surface to instance
+  //! \param[in] xform Object-to-world transform (must be invertible)
+  //! \param[in] name Node name
+  Instance(const Surface::Ptr &surface, const Mat4r &xform,
+           const std::string &name=std::string());
+
+  //! \brief Check if ray intersects with surface
+  //! \details Intersects the instanced surface with the ray in object
+  //!    space, and transforms the hit point and normal to world space
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t (ray fractional distance)
+  //! \param[in] tmax Maximum value for acceptable t (ray fractional distance)
+  //! \param[out] hit_record Resulting hit record if ray intersected with surface
+  //! \return True if ray intersected with surface
+  bool Hit(const Ray &ray, Real tmin, Real tmax,
+           HitRecord &hit_record) override;
+
+  //! \brief Check if the instance blocks a ray
+  //! \details Occlusion query of the instanced surface in object space
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with the instance
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Get the instance's material
+  //! \return Instance material, or the instanced surface's material
+  //!    if the instance has none
+  std::shared_ptr<Material> GetMaterial() override;
+
+  //! \brief Get/compute the world-space AABB
+  //! \return Bbox of the transformed bbox of the instanced surface
+  AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Set the instanced surface
+  //! \param[in] surface Surface to instance
+  void SetSurface(const Surface::Ptr &surface);
+
+  //! \brief Get the instanced surface
+  //! \return Instanced surface
+  inline Surface::Ptr GetSurface() const {return surface_;}
+
+  //! \brief Set the object-to-world transform
+  //! \param[in] xform Transform (must be invertible)
+  void SetTransform(const Mat4r &xform);
+
+  //! \brief Get the object-to-world transform
+  //! \return Transform
+  inline const Mat4r& GetTransform() const {return xform_;}
+protected:
+  Surface::Ptr surface_;                          //!< instanced surface
+  Mat4r xform_{Mat4r::Identity()};                //!< object to world
+  Mat4r inverse_xform_{Mat4r::Identity()};        //!< world to object
+  Mat4r normal_xform_{Mat4r::Identity()};         //!< inverse transpose
+};
+
+}  // namespace core
+}  // namespace olio
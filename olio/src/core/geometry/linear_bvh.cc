@@ -0,0 +1,854 @@
+//! \file       linear_bvh.cc
+//! \brief      LinearBVH class
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <unordered_set>
+#include <spdlog/spdlog.h>
+#include "core/ray.h"
+#include "core/geometry/linear_bvh.h"
+#include "core/geometry/bvh_traversal.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! Node count from which RefitNodes() refits the two subtrees of a node
+//! in parallel
+const uint32_t kParallelRefitNodeCount = 2048;
+
+//! \brief Round a value to the next float towards -infinity
+//! \param[in] value Value to round
+//! \return Largest float <= 'value'
+inline float
+RoundDown(Real value)
+{
+  auto rounded = static_cast<float>(value);
+  if (static_cast<Real>(rounded) > value)
+    rounded = nextafter(rounded, -numeric_limits<float>::infinity());
+  return rounded;
+}
+
+
+//! \brief Round a value to the next float towards +infinity
+//! \param[in] value Value to round
+//! \return Smallest float >= 'value'
+inline float
+RoundUp(Real value)
+{
+  auto rounded = static_cast<float>(value);
+  if (static_cast<Real>(rounded) < value)
+    rounded = nextafter(rounded, numeric_limits<float>::infinity());
+  return rounded;
+}
+
+
+//! \brief Replace a range of an array with other values
+//! \param[in,out] array Array
+//! \param[in] begin Index of the first value to replace
+//! \param[in] end Index after the last value to replace
+//! \param[in] values New values
+template <typename Array, typename Values>
+void
+Splice(Array &array, size_t begin, size_t end, const Values &values)
+{
+  auto first = array.begin() + static_cast<ptrdiff_t>(begin);
+  first = array.erase(first, array.begin() + static_cast<ptrdiff_t>(end));
+  array.insert(first, values.begin(), values.end());
+}
+
+
+//! \brief Check if a BVHNode (sub)tree has no leaf surfaces
+//! \param[in] surface BVHNode or leaf surface
+//! \return True if 'surface' is a BVHNode without leaf surfaces
+bool
+IsEmptyTree(const Surface::Ptr &surface)
+{
+  auto bvh_node = dynamic_pointer_cast<BVHNode>(surface);
+  if (!bvh_node)
+    return false;
+  for (const auto &child : {bvh_node->GetLeft(), bvh_node->GetRight()}) {
+    if (child && !IsEmptyTree(child))
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+LinearBVH::LinearBVH(const std::string &name) :
+  Surface{}
+{
+  name_ = name.size() ? name : "LinearBVH";
+}
+
+
+void
+LinearBVH::LinearNode::SetBounds(const AABB &bbox)
+{
+  const Vec3r bbox_min = bbox.GetMin();
+  const Vec3r bbox_max = bbox.GetMax();
+  for (int i = 0; i < 3; ++i) {
+    bmin[i] = RoundDown(bbox_min[i]);
+    bmax[i] = RoundUp(bbox_max[i]);
+  }
+}
+
+
+void
+LinearBVH::LinearNode::ExpandBy(const LinearNode &other)
+{
+  for (int i = 0; i < 3; ++i) {
+    bmin[i] = std::min(bmin[i], other.bmin[i]);
+    bmax[i] = std::max(bmax[i], other.bmax[i]);
+  }
+}
+
+
+Real
+LinearBVH::LinearNode::GetSurfaceArea() const
+{
+  return AABB{Vec3r{bmin[0], bmin[1], bmin[2]},
+              Vec3r{bmax[0], bmax[1], bmax[2]}}.GetSurfaceArea();
+}
+
+
+PacketMask
+LinearBVH::LinearNode::HitPacket(const RayPacket &packet,
+                                 const PacketMask &active, Real tmin,
+                                 const PacketReal &tmax) const
+{
+  Real lane_tmin[kMaxPacketSize];
+  Real lane_tmax[kMaxPacketSize];
+  for (int lane = 0; lane < kMaxPacketSize; ++lane) {
+    lane_tmin[lane] = tmin;
+    lane_tmax[lane] = tmax[lane];
+  }
+  for (int i = 0; i < 3; ++i) {
+    const Real *origin = packet.GetOrigin(i).data();
+    const Real *dir_inv = packet.GetInvDirection(i).data();
+    const auto node_min = static_cast<Real>(bmin[i]);
+    const auto node_max = static_cast<Real>(bmax[i]);
+    for (int lane = 0; lane < kMaxPacketSize; ++lane) {
+      Real t0 = (node_min - origin[lane]) * dir_inv[lane];
+      Real t1 = (node_max - origin[lane]) * dir_inv[lane];
+      Real t_near = dir_inv[lane] < 0.0f ? t1 : t0;
+      Real t_far = dir_inv[lane] < 0.0f ? t0 : t1;
+      lane_tmin[lane] = t_near > lane_tmin[lane] ? t_near : lane_tmin[lane];
+      lane_tmax[lane] = t_far < lane_tmax[lane] ? t_far : lane_tmax[lane];
+    }
+  }
+  PacketMask hit;
+  for (int lane = 0; lane < kMaxPacketSize; ++lane)
+    hit[lane] = active[lane] && !(lane_tmax[lane] < lane_tmin[lane]);
+  return hit;
+}
+
+
+bool
+LinearBVH::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
+{
+  if (nodes_.empty())
+    return false;
+  LocalTraversalStats stats;
+  ++stats.queries;
+  return HitSubtree(0, ray, tmin, tmax, hit_record, stats);
+}
+
+
+bool
+LinearBVH::HitSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                      HitRecord &hit_record,
+                      BVHTraversalStats &stats) const
+{
+  return HitBinaryBVH(nodes_.data(), root, depth_, ray, tmin, tmax, stats,
+                      [&](const LinearNode &leaf, Real &leaf_tmax) {
+    bool is_hit = false;
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+      if (surfaces_[i]->Hit(ray, tmin, leaf_tmax, hit_record)) {
+        leaf_tmax = hit_record.GetRayT();
+        is_hit = true;
+      }
+    }
+    return is_hit;
+  });
+}
+
+
+PacketMask
+LinearBVH::HitPacket(const RayPacket &packet, const PacketMask &active,
+                     Real tmin, PacketReal &tmax, HitRecord *hit_records)
+{
+  if (nodes_.empty())
+    return PacketMask::Constant(false);
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  return HitBinaryBVHPacket(nodes_.data(), depth_, packet, active, tmin, tmax,
+                            stats,
+                            [&](const LinearNode &leaf,
+                                const PacketMask &lanes) {
+    PacketMask is_hit = PacketMask::Constant(false);
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i)
+      is_hit = is_hit || surfaces_[i]->HitPacket(packet, lanes, tmin, tmax,
+                                                 hit_records);
+    return is_hit;
+  }, [&](uint32_t root, int lane) {
+    if (!HitSubtree(root, packet.GetRay(lane), tmin, tmax[lane],
+                    hit_records[lane], stats))
+      return false;
+    tmax[lane] = hit_records[lane].GetRayT();
+    return true;
+  });
+}
+
+
+bool
+LinearBVH::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  if (nodes_.empty())
+    return false;
+  LocalTraversalStats stats;
+  ++stats.queries;
+  return OccludedSubtree(0, ray, tmin, tmax, stats);
+}
+
+
+bool
+LinearBVH::OccludedSubtree(uint32_t root, const Ray &ray, Real tmin,
+                           Real tmax, BVHTraversalStats &stats) const
+{
+  return OccludedBinaryBVH(nodes_.data(), root, depth_, ray, tmin, tmax,
+                           stats, [&](const LinearNode &leaf,
+                                      BVHTraversalStats &leaf_stats) {
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+      ++leaf_stats.surface_tests;
+      if (surfaces_[i]->Occluded(ray, tmin, tmax))
+        return true;
+    }
+    return false;
+  });
+}
+
+
+PacketMask
+LinearBVH::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                          Real tmin, const PacketReal &tmax)
+{
+  if (nodes_.empty())
+    return PacketMask::Constant(false);
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  return OccludedBinaryBVHPacket(nodes_.data(), depth_, packet, active, tmin,
+                                 tmax, stats,
+                                 [&](const LinearNode &leaf, PacketMask lanes,
+                                     BVHTraversalStats &leaf_stats) {
+    PacketMask occluded = PacketMask::Constant(false);
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count &&
+           lanes.any(); ++i) {
+      leaf_stats.surface_tests += static_cast<uint64_t>(lanes.count());
+      occluded = occluded || surfaces_[i]->OccludedPacket(packet, lanes, tmin,
+                                                          tmax);
+      lanes = lanes && !occluded;
+    }
+    return occluded;
+  }, [&](uint32_t root, int lane) {
+    return OccludedSubtree(root, packet.GetRay(lane), tmin, tmax[lane], stats);
+  });
+}
+
+
+AABB
+LinearBVH::GetBoundingBox(bool /*force_recompute*/)
+{
+  return bbox_;
+}
+
+
+Real
+LinearBVH::ComputeSAHCost(const BVHBuildOptions &options) const
+{
+  return ComputeSAHCost(nodes_, options);
+}
+
+
+Real
+LinearBVH::ComputeSAHCost(const NodeArray &nodes,
+                          const BVHBuildOptions &options)
+{
+  if (nodes.empty())
+    return 0;
+  Real root_area = nodes[0].GetSurfaceArea();
+  Real cost = 0;
+  for (const auto &node : nodes) {
+    Real probability = root_area > 0 ? node.GetSurfaceArea() / root_area : 1;
+    cost += probability * (options.traversal_cost + options.intersection_cost *
+                           static_cast<Real>(node.count));
+  }
+  return cost;
+}
+
+
+BVHTreeStats
+LinearBVH::ComputeTreeStats(const BVHBuildOptions &options) const
+{
+  BVHTreeStats stats;
+  stats.name = name_;
+  stats.type = "LinearBVH";
+  CollectTreeStats(nodes_, stats);
+  stats.sah_cost = ComputeSAHCost(options);
+  stats.memory_bytes = GetMemoryUsage();
+  return stats;
+}
+
+
+void
+LinearBVH::CollectTreeStats(const NodeArray &nodes, BVHTreeStats &stats)
+{
+  // children are stored after their parents
+  stats.node_count += nodes.size();
+  vector<uint> depths(nodes.size(), 1);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const auto &node = nodes[i];
+    if (node.count) {
+      stats.AddLeaf(depths[i], node.count);
+    } else {
+      depths[i + 1] = depths[i] + 1;
+      depths[node.offset] = depths[i] + 1;
+    }
+  }
+}
+
+
+size_t
+LinearBVH::GetMemoryUsage() const
+{
+  return nodes_.capacity() * sizeof(LinearNode) +
+    surfaces_.capacity() * sizeof(Surface::Ptr) +
+    (sah_costs_.capacity() + build_sah_costs_.capacity()) * sizeof(float);
+}
+
+
+BVHRefitStats
+LinearBVH::Refit(const BVHBuildOptions &options)
+{
+  BVHRefitStats stats;
+  if (nodes_.empty())
+    return stats;
+  RunInArena(options, [&] {
+    // the node bounds are still the built ones the first time
+    auto node_count = static_cast<uint32_t>(nodes_.size());
+    if (sah_costs_.size() != nodes_.size()) {
+      sah_costs_.resize(nodes_.size());
+      build_sah_costs_.resize(nodes_.size());
+      ResetSAHCosts(0, node_count, options);
+    }
+
+    // find the moved surfaces, then update them one at a time, since
+    // SBVH leaves may share surfaces
+    vector<char> dirty_slots(surfaces_.size(), 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, surfaces_.size(), 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+        dirty_slots[i] = surfaces_[i]->IsBoundDirty();
+    });
+    unordered_set<const Surface*> moved_surfaces;
+    for (size_t i = 0; i < surfaces_.size(); ++i) {
+      if (dirty_slots[i] && moved_surfaces.insert(surfaces_[i].get()).second)
+        surfaces_[i]->GetBoundingBox();
+    }
+    stats.moved_surfaces = moved_surfaces.size();
+    if (!stats.moved_surfaces)
+      return;
+
+    // refit bottom up, then rebuild the degraded subtrees from the
+    // last one, so that splicing doesn't move the ones still to do
+    vector<char> dirty_nodes(nodes_.size(), 0);
+    stats.refit_nodes = RefitNodes(0, node_count, dirty_slots, dirty_nodes,
+                                   options);
+    vector<pair<uint32_t, uint32_t>> subtrees;
+    FindDegraded(0, node_count, dirty_nodes, options, subtrees);
+    for (auto it = subtrees.rbegin(); it != subtrees.rend(); ++it) {
+      stats.rebuilt_surfaces += RebuildSubtree(it->first, it->second,
+                                               options, dirty_nodes);
+      ++stats.rebuilt_subtrees;
+    }
+    UpdateDirtySAHCosts(0, static_cast<uint32_t>(nodes_.size()),
+                        dirty_nodes, options);
+
+    // rebuilt subtrees may be deeper; children follow their parents
+    if (!subtrees.empty()) {
+      vector<uint> depths(nodes_.size(), 1);
+      depth_ = 1;
+      for (size_t i = 0; i < nodes_.size(); ++i) {
+        depth_ = std::max(depth_, depths[i]);
+        if (!nodes_[i].count)
+          depths[i + 1] = depths[nodes_[i].offset] = depths[i] + 1;
+      }
+    }
+    bbox_.Reset();
+    bbox_.ExpandBy(Vec3r{nodes_[0].bmin[0], nodes_[0].bmin[1],
+                         nodes_[0].bmin[2]});
+    bbox_.ExpandBy(Vec3r{nodes_[0].bmax[0], nodes_[0].bmax[1],
+                         nodes_[0].bmax[2]});
+  });
+  stats.sah_cost = sah_costs_.empty() ? 0 : sah_costs_[0];
+  stats.build_sah_cost = build_sah_costs_.empty() ? 0 : build_sah_costs_[0];
+  spdlog::debug("Refit linear BVH ({}): {} moved surfaces, {} refit nodes, "
+                "{} rebuilt subtrees ({} surfaces), SAH cost {:.3f} (built "
+                "{:.3f})", GetName(), stats.moved_surfaces, stats.refit_nodes,
+                stats.rebuilt_subtrees, stats.rebuilt_surfaces,
+                stats.sah_cost, stats.build_sah_cost);
+  return stats;
+}
+
+
+size_t
+LinearBVH::RefitNodes(uint32_t index, uint32_t end,
+                      const std::vector<char> &dirty_slots,
+                      std::vector<char> &dirty_nodes,
+                      const BVHBuildOptions &options)
+{
+  auto &node = nodes_[index];
+  if (node.count) {
+    bool is_dirty = false;
+    for (uint32_t i = node.offset; i < node.offset + node.count; ++i)
+      is_dirty = is_dirty || dirty_slots[i];
+    if (!is_dirty)
+      return 0;
+    AABB bbox;
+    for (uint32_t i = node.offset; i < node.offset + node.count; ++i)
+      bbox.ExpandBy(surfaces_[i]->GetBoundingBox());
+    node.SetBounds(bbox);
+    dirty_nodes[index] = 1;
+    return 1;
+  }
+
+  // the left subtree is [index + 1, right), the right one [right, end)
+  uint32_t right = node.offset;
+  size_t left_count = 0, right_count = 0;
+  if (end - index >= kParallelRefitNodeCount) {
+    tbb::parallel_invoke(
+      [&] {
+        left_count = RefitNodes(index + 1, right, dirty_slots, dirty_nodes,
+                                options);
+      }, [&] {
+        right_count = RefitNodes(right, end, dirty_slots, dirty_nodes,
+                                 options);
+      });
+  } else {
+    left_count = RefitNodes(index + 1, right, dirty_slots, dirty_nodes,
+                            options);
+    right_count = RefitNodes(right, end, dirty_slots, dirty_nodes, options);
+  }
+  if (!left_count && !right_count)
+    return 0;
+  node = nodes_[index + 1];
+  node.ExpandBy(nodes_[right]);
+  node.offset = right;
+  node.count = 0;
+  sah_costs_[index] = ComputeNodeSAHCost(index, options);
+  dirty_nodes[index] = 1;
+  return 1 + left_count + right_count;
+}
+
+
+void
+LinearBVH::FindDegraded(uint32_t index, uint32_t end,
+                        const std::vector<char> &dirty_nodes,
+                        const BVHBuildOptions &options,
+                        std::vector<std::pair<uint32_t, uint32_t>> &subtrees)
+  const
+{
+  const auto &node = nodes_[index];
+  if (!dirty_nodes[index] || node.count)
+    return;
+  if (options.rebuild_threshold > 0 && sah_costs_[index] >
+      options.rebuild_threshold * build_sah_costs_[index]) {
+    subtrees.emplace_back(index, end);
+    return;
+  }
+  FindDegraded(index + 1, node.offset, dirty_nodes, options, subtrees);
+  FindDegraded(node.offset, end, dirty_nodes, options, subtrees);
+}
+
+
+size_t
+LinearBVH::RebuildSubtree(uint32_t index, uint32_t end,
+                          const BVHBuildOptions &options,
+                          std::vector<char> &dirty_nodes)
+{
+  // the leaves of a subtree refer to a contiguous range of surfaces,
+  // from its leftmost to its rightmost leaf
+  uint32_t first = index, last = index;
+  while (!nodes_[first].count)
+    ++first;
+  while (!nodes_[last].count)
+    last = nodes_[last].offset;
+  size_t surface_begin = nodes_[first].offset;
+  size_t surface_count = nodes_[last].offset + nodes_[last].count -
+    surface_begin;
+
+  // SBVH leaves may share surfaces
+  vector<Surface::Ptr> surfaces(surfaces_.begin() +
+                                static_cast<ptrdiff_t>(surface_begin),
+                                surfaces_.begin() +
+                                static_cast<ptrdiff_t>(surface_begin +
+                                                       surface_count));
+  if (options.split_method == BVHSplitMethod::kSBVH) {
+    std::sort(surfaces.begin(), surfaces.end());
+    surfaces.erase(std::unique(surfaces.begin(), surfaces.end()),
+                   surfaces.end());
+  }
+  size_t rebuilt_count = surfaces.size();
+
+  // build the new nodes and surfaces, with offsets relative to the
+  // subtree. Median and spatial splits flatten a BVHNode tree, as in
+  // BuildBVH()
+  NodeArray subtree;
+  vector<Surface::Ptr> subtree_surfaces;
+  if (options.split_method == BVHSplitMethod::kMedian ||
+      options.split_method == BVHSplitMethod::kSBVH) {
+    // quietly, since refits may rebuild subtrees every frame
+    auto flattened = Flatten(BVHNode::BuildBVH(std::move(surfaces), options,
+                                               GetName(), true),
+                             GetName(), true);
+    subtree = std::move(flattened->nodes_);
+    subtree_surfaces = std::move(flattened->surfaces_);
+  } else {
+    vector<BVHNode::BuildSurface> build_surfaces(rebuilt_count);
+    for (size_t i = 0; i < rebuilt_count; ++i) {
+      AABB bbox = surfaces[i]->GetBoundingBox();
+      build_surfaces[i] = {bbox, bbox.GetCenter(), i, 0};
+    }
+    if (options.split_method == BVHSplitMethod::kLBVH)
+      BVHNode::SortMorton(build_surfaces, options);
+    subtree.reserve(2 * rebuilt_count);
+    BuildNodes(build_surfaces, 0, rebuilt_count, options, 2, subtree);
+    subtree_surfaces.resize(rebuilt_count);
+    for (size_t i = 0; i < rebuilt_count; ++i)
+      subtree_surfaces[i] = surfaces[build_surfaces[i].index];
+  }
+  for (auto &node : subtree) {
+    node.offset += node.count ? static_cast<uint32_t>(surface_begin) :
+      index;
+  }
+
+  // shift the right child indices past the subtree, and the leaf
+  // offsets past its surfaces, then splice
+  auto old_size = static_cast<int64_t>(end - index);
+  auto shift = static_cast<int64_t>(subtree.size()) - old_size;
+  size_t surface_end = surface_begin + surface_count;
+  auto surface_shift = static_cast<int64_t>(subtree_surfaces.size()) -
+    static_cast<int64_t>(surface_count);
+  if (shift || surface_shift) {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      auto &node = nodes_[i];
+      if (i >= index && i < end)
+        continue;
+      if (!node.count && node.offset >= end)
+        node.offset = static_cast<uint32_t>(node.offset + shift);
+      else if (node.count && node.offset >= surface_end)
+        node.offset = static_cast<uint32_t>(node.offset + surface_shift);
+    }
+  }
+  Splice(surfaces_, surface_begin, surface_end, subtree_surfaces);
+  Splice(nodes_, index, end, subtree);
+  Splice(sah_costs_, index, end, vector<float>(subtree.size(), 0));
+  Splice(build_sah_costs_, index, end, vector<float>(subtree.size(), 0));
+  Splice(dirty_nodes, index, end, vector<char>(subtree.size(), 0));
+  ResetSAHCosts(index, index + static_cast<uint32_t>(subtree.size()),
+                options);
+  return rebuilt_count;
+}
+
+
+void
+LinearBVH::ResetSAHCosts(uint32_t index, uint32_t end,
+                         const BVHBuildOptions &options)
+{
+  const auto &node = nodes_[index];
+  if (!node.count) {
+    ResetSAHCosts(index + 1, node.offset, options);
+    ResetSAHCosts(node.offset, end, options);
+  }
+  sah_costs_[index] = ComputeNodeSAHCost(index, options);
+  build_sah_costs_[index] = sah_costs_[index];
+}
+
+
+void
+LinearBVH::UpdateDirtySAHCosts(uint32_t index, uint32_t end,
+                               std::vector<char> &dirty_nodes,
+                               const BVHBuildOptions &options)
+{
+  if (!dirty_nodes[index])
+    return;
+  const auto &node = nodes_[index];
+  if (!node.count) {
+    UpdateDirtySAHCosts(index + 1, node.offset, dirty_nodes, options);
+    UpdateDirtySAHCosts(node.offset, end, dirty_nodes, options);
+    sah_costs_[index] = ComputeNodeSAHCost(index, options);
+  }
+  dirty_nodes[index] = 0;
+}
+
+
+float
+LinearBVH::ComputeNodeSAHCost(uint32_t index,
+                              const BVHBuildOptions &options) const
+{
+  const auto &node = nodes_[index];
+  Real cost = options.traversal_cost;
+  if (node.count)
+    return static_cast<float>(cost + options.intersection_cost *
+                              static_cast<Real>(node.count));
+  uint32_t left = index + 1, right = node.offset;
+  Real area = node.GetSurfaceArea();
+  Real left_cost = sah_costs_[left], right_cost = sah_costs_[right];
+  if (area > 0) {
+    cost += (nodes_[left].GetSurfaceArea() * left_cost +
+             nodes_[right].GetSurfaceArea() * right_cost) / area;
+  } else {
+    cost += left_cost + right_cost;
+  }
+  return static_cast<float>(cost);
+}
+
+
+LinearBVH::Ptr
+LinearBVH::BuildBVH(std::vector<Surface::Ptr> surfaces,
+                    const BVHBuildOptions &options, const std::string &name,
+                    bool quiet)
+{
+  // median and spatial splits: flatten a BVHNode tree
+  if (options.split_method == BVHSplitMethod::kMedian ||
+      options.split_method == BVHSplitMethod::kSBVH) {
+    auto tree = BVHNode::BuildBVH(std::move(surfaces), options, name, quiet);
+    return Flatten(tree, name, quiet);
+  }
+
+  auto log_level = quiet ? spdlog::level::debug : spdlog::level::info;
+  spdlog::log(log_level, "Building linear BVH ({})", name);
+  auto start_time = chrono::steady_clock::now();
+  auto surface_count = surfaces.size();
+  LinearBVH::Ptr bvh;
+  RunInArena(options, [&] {
+    // cache surface bboxes
+    vector<BVHNode::BuildSurface> build_surfaces(surface_count);
+    vector<char> is_valid(surface_count, 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, surface_count, 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        if (!surfaces[i])
+          continue;
+        AABB bbox = surfaces[i]->GetBoundingBox();
+        build_surfaces[i] = {bbox, bbox.GetCenter(), i, 0};
+        is_valid[i] = 1;
+      }
+    });
+    size_t valid_count = 0;
+    for (size_t i = 0; i < surface_count; ++i) {
+      if (is_valid[i])
+        build_surfaces[valid_count++] = build_surfaces[i];
+    }
+    build_surfaces.resize(valid_count);
+    if (build_surfaces.empty())
+      return;
+    if (options.split_method == BVHSplitMethod::kLBVH)
+      BVHNode::SortMorton(build_surfaces, options);
+
+    // build the nodes, then list the surfaces in leaf order
+    bvh = LinearBVH::Create(name);
+    bvh->nodes_.reserve(2 * valid_count);
+    bvh->depth_ = BuildNodes(build_surfaces, 0, valid_count, options, 2,
+                             bvh->nodes_);
+    bvh->nodes_.shrink_to_fit();
+    bvh->surfaces_.resize(valid_count);
+    for (size_t i = 0; i < valid_count; ++i) {
+      bvh->surfaces_[i] = surfaces[build_surfaces[i].index];
+      bvh->bbox_.ExpandBy(build_surfaces[i].bbox);
+    }
+    bvh->bound_dirty_ = false;
+  });
+  if (!bvh) {
+    spdlog::log(log_level, "Done building linear BVH ({})", name);
+    return nullptr;
+  }
+  double build_time = chrono::duration<double>(chrono::steady_clock::now() -
+                                               start_time).count();
+  spdlog::log(log_level, "Done building linear BVH ({}): {} surfaces, {} "
+              "nodes, {:.1f} KiB ({} bytes per node, vs. {} per BVHNode "
+              "object), SAH cost {:.3f}, {:.3f}s", name, surface_count,
+              bvh->GetNodeCount(),
+              static_cast<double>(bvh->GetMemoryUsage()) / 1024,
+              sizeof(LinearNode), sizeof(BVHNode),
+              bvh->ComputeSAHCost(options), build_time);
+  return bvh;
+}
+
+
+uint
+LinearBVH::BuildNodes(std::vector<BVHNode::BuildSurface> &build_surfaces,
+                      size_t start, size_t end, const BVHBuildOptions &options,
+                      uint max_leaf_size, NodeArray &nodes)
+{
+  size_t index = nodes.size();
+  nodes.emplace_back();
+  size_t count = end - start;
+  auto make_leaf = [&] {
+    AABB bbox;
+    for (size_t i = start; i < end; ++i)
+      bbox.ExpandBy(build_surfaces[i].bbox);
+    auto &node = nodes[index];
+    node.SetBounds(bbox);
+    node.offset = static_cast<uint32_t>(start);
+    node.count = static_cast<uint32_t>(count);
+    return 1u;
+  };
+
+  // leaf node: one or two surfaces, as in BVHNode::BuildBVH()
+  if (count <= 2)
+    return make_leaf();
+
+  // small ranges stay a leaf if that is cheaper than the best split
+  size_t mid = BVHNode::Partition(build_surfaces, start, end, options);
+  if (count <= max_leaf_size) {
+    AABB bbox, left_bbox, right_bbox;
+    for (size_t i = start; i < end; ++i)
+      (i < mid ? left_bbox : right_bbox).ExpandBy(build_surfaces[i].bbox);
+    bbox.ExpandBy(left_bbox);
+    bbox.ExpandBy(right_bbox);
+    Real area = bbox.GetSurfaceArea();
+    Real split_cost = options.traversal_cost + (area > 0 ?
+      options.intersection_cost * (
+        static_cast<Real>(mid - start) * left_bbox.GetSurfaceArea() +
+        static_cast<Real>(end - mid) * right_bbox.GetSurfaceArea()) / area :
+      options.intersection_cost * static_cast<Real>(count));
+    if (options.intersection_cost * static_cast<Real>(count) <= split_cost)
+      return make_leaf();
+  }
+
+  // interior node: the left subtree follows the node, the right
+  // subtree follows the left one. Large right subtrees are built into
+  // a separate array in parallel with the left one, and then appended
+  uint left_depth = 0, right_depth = 0;
+  size_t right_index = 0;
+  if (count >= kParallelSubtreeSize) {
+    NodeArray right_nodes;
+    tbb::parallel_invoke(
+      [&] {
+        left_depth = BuildNodes(build_surfaces, start, mid, options,
+                                max_leaf_size, nodes);
+      }, [&] {
+        right_depth = BuildNodes(build_surfaces, mid, end, options,
+                                 max_leaf_size, right_nodes);
+      });
+    right_index = nodes.size();
+    for (auto &node : right_nodes) {
+      if (!node.count)
+        node.offset += static_cast<uint32_t>(right_index);
+      nodes.push_back(node);
+    }
+  } else {
+    left_depth = BuildNodes(build_surfaces, start, mid, options,
+                            max_leaf_size, nodes);
+    right_index = nodes.size();
+    right_depth = BuildNodes(build_surfaces, mid, end, options,
+                             max_leaf_size, nodes);
+  }
+  auto &node = nodes[index];
+  node = nodes[index + 1];
+  node.ExpandBy(nodes[right_index]);
+  node.offset = static_cast<uint32_t>(right_index);
+  node.count = 0;
+  return 1 + std::max(left_depth, right_depth);
+}
+
+
+LinearBVH::Ptr
+LinearBVH::Flatten(const BVHNode::Ptr &tree, const std::string &name,
+                   bool quiet)
+{
+  if (!tree)
+    return nullptr;
+  // a tree without surfaces has no nodes, like an empty LinearBVH
+  auto bvh = LinearBVH::Create(name);
+  if (!IsEmptyTree(tree))
+    bvh->FlattenNode(tree, 1);
+  bvh->nodes_.shrink_to_fit();
+  bvh->surfaces_.shrink_to_fit();
+  bvh->bbox_ = tree->GetBoundingBox();
+  bvh->bound_dirty_ = false;
+  spdlog::log(quiet ? spdlog::level::debug : spdlog::level::info,
+              "Flattened BVH ({}): {} nodes, {:.1f} KiB ({} bytes per node, "
+              "vs. {} per BVHNode object)", name, bvh->GetNodeCount(),
+              static_cast<double>(bvh->GetMemoryUsage()) / 1024,
+              sizeof(LinearNode), sizeof(BVHNode));
+  return bvh;
+}
+
+
+uint32_t
+LinearBVH::FlattenNode(const Surface::Ptr &surface, uint depth)
+{
+  depth_ = std::max(depth_, depth);
+  auto index = static_cast<uint32_t>(nodes_.size());
+  auto bvh_node = dynamic_pointer_cast<BVHNode>(surface);
+
+  // leaf surface
+  if (!bvh_node) {
+    LinearNode node;
+    node.SetBounds(surface->GetBoundingBox());
+    node.offset = static_cast<uint32_t>(surfaces_.size());
+    node.count = 1;
+    nodes_.push_back(node);
+    surfaces_.push_back(surface);
+    return index;
+  }
+
+  // empty subtrees are skipped. They have no node encoding: a node
+  // with count 0 is an interior node
+  vector<Surface::Ptr> children;
+  for (const auto &child : {bvh_node->GetLeft(), bvh_node->GetRight()}) {
+    if (child && !IsEmptyTree(child))
+      children.push_back(child);
+  }
+  // a single BVHNode child replaces the node. A single leaf surface
+  // becomes a leaf node below, with the node's bbox, which can be
+  // smaller than the surface's (see BVHNode::BuildSpatialBVH())
+  if (children.size() == 1 && dynamic_pointer_cast<BVHNode>(children[0]))
+    return FlattenNode(children[0], depth);
+
+  // BVHNode with only leaf surfaces: leaf node
+  bool is_leaf = true;
+  for (const auto &child : children)
+    is_leaf = is_leaf && !dynamic_pointer_cast<BVHNode>(child);
+  if (is_leaf) {
+    LinearNode node;
+    node.SetBounds(bvh_node->GetBoundingBox());
+    node.offset = static_cast<uint32_t>(surfaces_.size());
+    node.count = static_cast<uint32_t>(children.size());
+    nodes_.push_back(node);
+    surfaces_.insert(surfaces_.end(), children.begin(), children.end());
+    return index;
+  }
+
+  // interior node
+  nodes_.emplace_back();
+  FlattenNode(children[0], depth + 1);
+  uint32_t right_index = FlattenNode(children[1], depth + 1);
+  auto &node = nodes_[index];
+  node = nodes_[index + 1];
+  node.ExpandBy(nodes_[right_index]);
+  node.offset = right_index;
+  node.count = 0;
+  return index;
+}
+
+}  // namespace core
+}  // namespace olio
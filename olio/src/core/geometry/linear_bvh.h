@@ -0,0 +1,366 @@
+//! \file       linear_bvh.h
+//! \brief      LinearBVH class
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/tbb.h>
+#include "core/geometry/surface.h"
+#include "core/geometry/bvh_node.h"
+
+namespace olio {
+namespace core {
+
+class Ray;
+class HitRecord;
+
+//! \class LinearBVH
+//! \brief BVH stored as one flat array of 32-byte nodes
+//! \details Nodes are stored in depth-first order: the left child of
+//!    an interior node directly follows it, and the node stores the
+//!    index of its right child. Leaf nodes store a range of the leaf
+//!    surface list, so the surfaces of a leaf are contiguous. Node
+//!    bounds are single precision, rounded outwards so that they
+//!    always contain the exact (double precision) bounds: rays are
+//!    never culled wrongly, and hits are the same as with BVHNode.
+//!    Traversal is iterative, with an explicit stack of node indices.
+//!    As in BVHNode::Hit(), the child that the ray enters first is
+//!    visited first, and children that the ray enters beyond the
+//!    closest hit are skipped.
+class LinearBVH : public Surface {
+public:
+  OLIO_NODE(LinearBVH)
+
+  explicit LinearBVH(const std::string &name=std::string());
+
+  //! \brief Check if ray intersects with surface
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in] hit_record Resulting hit record if ray intersected with surface
+  //! \return True if ray intersected with surface
+  bool Hit(const Ray &ray, Real tmin, Real tmax,
+           HitRecord &hit_record) override;
+
+  //! \brief Check which rays of a packet intersect with surface
+  //! \details Traverses the nodes with the whole packet, testing the
+  //!    node bounds for all rays at once. Subtrees that only a few
+  //!    rays of the packet enter (see kMinPacketActiveRays) are
+  //!    traversed one ray at a time. Returns the same hits as Hit().
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane
+  //! \return Mask of the active lanes that intersected with surface
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if any surface of the BVH blocks a ray
+  //! \details Children are visited in order, without sorting them by
+  //!    entry distance, and traversal stops at the first surface that
+  //!    the ray intersects.
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with a surface
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the BVH
+  //! \details Same packet traversal as HitPacket(); lanes drop out of
+  //!    the packet once they are blocked.
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with a surface
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
+
+  AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Compute the SAH cost of the BVH
+  //! \details Same cost model as BVHNode::ComputeSAHCost(), using the
+  //!    (rounded) node bounds.
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  Real ComputeSAHCost(const BVHBuildOptions &options) const;
+
+  //! \brief Compute the size and quality of the BVH
+  //! \param[in] options Node and intersection test costs
+  //! \return Tree statistics (without the build time)
+  BVHTreeStats ComputeTreeStats(const BVHBuildOptions &options) const;
+
+  //! \brief Update the node bounds after leaf surfaces moved
+  //! \details Same as BVHNode::Refit(): only the nodes above surfaces
+  //!    with dirty bounds are recomputed, bottom up and in parallel,
+  //!    and the highest dirty subtrees whose SAH cost grew past
+  //!    'options.rebuild_threshold' times their built cost are rebuilt
+  //!    (with SAH splits, or LBVH splits if 'options.split_method' is
+  //!    kLBVH). A rebuilt subtree is spliced into the node array in
+  //!    place, so the nodes stay depth-first. The per-node costs are
+  //!    allocated by the first refit, so static scenes don't pay for
+  //!    them.
+  //! \param[in] options Builder settings
+  //! \return Refit statistics
+  BVHRefitStats Refit(const BVHBuildOptions &options);
+
+  //! \brief Get the number of nodes
+  //! \return Node count
+  inline size_t GetNodeCount() const {return nodes_.size();}
+
+  //! \brief Get the memory used by the nodes and the leaf surface list
+  //! \return Memory in bytes
+  size_t GetMemoryUsage() const;
+
+  //! \brief Build a linear BVH
+  //! \details With SAH and LBVH splits, the nodes are written
+  //!    directly into the array (see BVHNode::Partition()); large
+  //!    subtrees are built in parallel. With median and spatial (SBVH)
+  //!    splits, a BVHNode tree is built and flattened. Either way, the
+  //!    tree matches the one BVHNode::BuildBVH() builds with the same
+  //!    options.
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] options Builder settings
+  //! \param[in] name Tree name
+  //! \param[in] quiet Log the build at debug level instead of info
+  //!    level (subtrees rebuilt by refits)
+  //! \return Built BVH (nullptr if 'surfaces' has no surfaces)
+  static LinearBVH::Ptr BuildBVH(std::vector<Surface::Ptr> surfaces,
+                                 const BVHBuildOptions &options,
+                                 const std::string &name=std::string(),
+                                 bool quiet=false);
+
+  //! \brief Flatten a BVHNode tree into a linear BVH
+  //! \details BVHNodes whose children are all leaf surfaces become
+  //!    leaf nodes. Subtrees without surfaces are dropped, so a tree
+  //!    without any gives a BVH without nodes. The tree is left
+  //!    unchanged.
+  //! \param[in] tree Tree to flatten
+  //! \param[in] name Name of the linear BVH
+  //! \param[in] quiet Log at debug level instead of info level
+  //! \return Linear BVH (nullptr if 'tree' is nullptr)
+  static LinearBVH::Ptr Flatten(const BVHNode::Ptr &tree,
+                                const std::string &name=std::string(),
+                                bool quiet=false);
+
+  //! \struct LinearNode
+  //! \brief 32-byte BVH node
+  struct LinearNode {
+    float bmin[3];    //!< min coordinates (rounded down)
+    float bmax[3];    //!< max coordinates (rounded up)
+    uint32_t offset;  //!< leaf: first surface; interior: right child
+    uint32_t count;   //!< leaf: number of surfaces; interior: 0
+
+    //! \brief Set the bounds to a bbox, rounded outwards
+    //! \param[in] bbox Exact bounds
+    void SetBounds(const AABB &bbox);
+
+    //! \brief Expand the bounds by another node's bounds
+    //! \param[in] other Node to expand by
+    void ExpandBy(const LinearNode &other);
+
+    //! \brief Compute the surface area of the bounds
+    //! \return Surface area
+    Real GetSurfaceArea() const;
+
+    //! \brief Check if a ray intersects with the node bounds
+    //! \details Same slab test as AABB::Hit()
+    //! \param[in] origin Ray origin
+    //! \param[in] inv_direction 1 / ray direction
+    //! \param[in] tmin Minimum value for acceptable t
+    //! \param[in] tmax Maximum value for acceptable t
+    //! \param[out] t_entry Largest of 'tmin' and the t at which the ray
+    //!    enters the bounds (only set if the ray intersected)
+    //! \return True if ray intersects with the bounds
+    inline bool Hit(const Vec3r &origin, const Vec3r &inv_direction,
+                    Real tmin, Real tmax, Real &t_entry) const {
+      for (int i = 0; i < 3; ++i) {
+        Real t0 = (static_cast<Real>(bmin[i]) - origin[i]) * inv_direction[i];
+        Real t1 = (static_cast<Real>(bmax[i]) - origin[i]) * inv_direction[i];
+        if (inv_direction[i] < 0.0f)
+          std::swap(t0, t1);
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmax < tmin)
+          return false;
+      }
+      t_entry = tmin;
+      return true;
+    }
+
+    //! \brief Check which rays of a packet intersect with the bounds
+    //! \details Same slab test as AABB::HitPacket()
+    //! \param[in] packet Rays to check intersection against
+    //! \param[in] active Lanes to test
+    //! \param[in] tmin Minimum value for acceptable t
+    //! \param[in] tmax Maximum value for acceptable t of each lane
+    //! \return Mask of the active lanes that intersect with the bounds
+    PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                         Real tmin, const PacketReal &tmax) const;
+  };
+  static_assert(sizeof(LinearNode) == 32, "LinearNode must be 32 bytes");
+
+  //! Node array; cache-line aligned, so that no node straddles two lines
+  using NodeArray = std::vector<LinearNode,
+                                tbb::cache_aligned_allocator<LinearNode>>;
+
+  //! \brief Get the nodes
+  //! \return Nodes, depth-first (the root is the first node)
+  inline const NodeArray& GetNodes() const {return nodes_;}
+
+  //! \brief Get the leaf surfaces
+  //! \return Surfaces, in the order the leaf nodes refer to them
+  inline const std::vector<Surface::Ptr>& GetSurfaces() const {
+    return surfaces_;
+  }
+
+  //! \brief Get the tree depth
+  //! \return Depth (a single leaf node has depth 1)
+  inline uint GetDepth() const {return depth_;}
+
+  //! \brief Compute the SAH cost of a node array
+  //! \param[in] nodes Nodes, depth-first (the root is the first node)
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  static Real ComputeSAHCost(const NodeArray &nodes,
+                             const BVHBuildOptions &options);
+
+  //! \brief Add the nodes and leaves of a node array to tree statistics
+  //! \param[in] nodes Nodes, depth-first (the root is the first node)
+  //! \param[in,out] stats Tree statistics
+  static void CollectTreeStats(const NodeArray &nodes, BVHTreeStats &stats);
+
+  //! \brief Append the nodes of a subtree built with SAH or LBVH splits
+  //! \details Leaf nodes refer to ranges of 'build_surfaces', which
+  //!    is reordered in place (see BVHNode::Partition()). Interior
+  //!    nodes store the index of their right child within 'nodes'.
+  //!    Ranges of one or two surfaces are always leaves, as in
+  //!    BVHNode::BuildBVH(). Ranges of up to 'max_leaf_size' surfaces
+  //!    become leaves if testing all their surfaces has a lower SAH
+  //!    cost than splitting them.
+  //! \param[in,out] build_surfaces Bboxes of the surfaces
+  //! \param[in] start Index of the first surface in the range
+  //! \param[in] end Index after the last surface in the range
+  //! \param[in] options Builder settings
+  //! \param[in] max_leaf_size Maximum number of surfaces per leaf
+  //! \param[in,out] nodes Array to append the nodes to
+  //! \return Depth of the subtree
+  static uint BuildNodes(std::vector<BVHNode::BuildSurface> &build_surfaces,
+                         size_t start, size_t end,
+                         const BVHBuildOptions &options, uint max_leaf_size,
+                         NodeArray &nodes);
+protected:
+  //! \brief Append the nodes of a BVHNode (sub)tree
+  //! \param[in] surface BVHNode or leaf surface (not a BVHNode tree
+  //!    without surfaces)
+  //! \param[in] depth Depth of 'surface' in the tree
+  //! \return Index of the (sub)tree's root node
+  uint32_t FlattenNode(const Surface::Ptr &surface, uint depth);
+
+  //! \brief Find the closest hit in a subtree
+  //! \param[in] root Index of the subtree's root node
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in] hit_record Resulting hit record if ray intersected
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a surface of the subtree
+  bool HitSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                  HitRecord &hit_record, BVHTraversalStats &stats) const;
+
+  //! \brief Check if any surface of a subtree blocks a ray
+  //! \param[in] root Index of the subtree's root node
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a surface of the subtree
+  bool OccludedSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                       BVHTraversalStats &stats) const;
+
+  //! \brief Recompute the bounds and SAH costs of the nodes above
+  //!    moved surfaces
+  //! \param[in] index Index of the subtree's root node
+  //! \param[in] end Index after the subtree's last node
+  //! \param[in] dirty_slots Flags of the moved leaf surfaces
+  //! \param[out] dirty_nodes Flags of the recomputed nodes
+  //! \param[in] options Node and intersection test costs
+  //! \return Number of recomputed nodes
+  size_t RefitNodes(uint32_t index, uint32_t end,
+                    const std::vector<char> &dirty_slots,
+                    std::vector<char> &dirty_nodes,
+                    const BVHBuildOptions &options);
+
+  //! \brief Find the highest dirty subtrees whose SAH cost grew past
+  //!    'options.rebuild_threshold' times their built cost
+  //! \param[in] index Index of the subtree's root node
+  //! \param[in] end Index after the subtree's last node
+  //! \param[in] dirty_nodes Flags of the recomputed nodes
+  //! \param[in] options Builder settings
+  //! \param[in,out] subtrees List to append the [index, end) ranges of
+  //!    the degraded subtrees to, in depth-first order
+  void FindDegraded(uint32_t index, uint32_t end,
+                    const std::vector<char> &dirty_nodes,
+                    const BVHBuildOptions &options,
+                    std::vector<std::pair<uint32_t, uint32_t>> &subtrees)
+    const;
+
+  //! \brief Rebuild a subtree and splice its new nodes in place
+  //! \details Uses options.split_method, like
+  //!    BVHNode::RebuildSubtree(). The nodes after the subtree shift if
+  //!    the new subtree has a different number of nodes, and the right
+  //!    child indices that point past the subtree are shifted with
+  //!    them. The same goes for the surfaces, which SBVH subtrees may
+  //!    duplicate differently, and the leaf offsets past them.
+  //! \param[in] index Index of the subtree's root node
+  //! \param[in] end Index after the subtree's last node
+  //! \param[in] options Builder settings
+  //! \param[in,out] dirty_nodes Flags of the recomputed nodes
+  //! \return Number of surfaces in the subtree
+  size_t RebuildSubtree(uint32_t index, uint32_t end,
+                        const BVHBuildOptions &options,
+                        std::vector<char> &dirty_nodes);
+
+  //! \brief Compute the SAH costs of all nodes of a subtree and make
+  //!    them the built costs
+  //! \param[in] index Index of the subtree's root node
+  //! \param[in] end Index after the subtree's last node
+  //! \param[in] options Node and intersection test costs
+  void ResetSAHCosts(uint32_t index, uint32_t end,
+                     const BVHBuildOptions &options);
+
+  //! \brief Update the SAH costs of the dirty nodes (after subtree
+  //!    rebuilds) and clear their flags
+  //! \param[in] index Index of the subtree's root node
+  //! \param[in] end Index after the subtree's last node
+  //! \param[in,out] dirty_nodes Flags of the recomputed nodes
+  //! \param[in] options Node and intersection test costs
+  void UpdateDirtySAHCosts(uint32_t index, uint32_t end,
+                           std::vector<char> &dirty_nodes,
+                           const BVHBuildOptions &options);
+
+  //! \brief Compute the SAH cost of a node from its children's costs
+  //! \details Same cost model as ComputeSAHCost(), relative to the
+  //!    node's own area
+  //! \param[in] index Node index
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost of the subtree
+  float ComputeNodeSAHCost(uint32_t index,
+                           const BVHBuildOptions &options) const;
+
+  NodeArray nodes_;                    //!< nodes, depth-first
+  std::vector<Surface::Ptr> surfaces_; //!< leaf surfaces, in leaf order
+  uint depth_{0};                      //!< tree depth (root: 1)
+  std::vector<float> sah_costs_;       //!< Refit(): SAH cost of each
+                                       //!< subtree
+  std::vector<float> build_sah_costs_; //!< Refit(): SAH cost of each
+                                       //!< subtree when built
+};
+
+}  // namespace core
+}  // namespace olio
@@ -61,22 +61,8 @@ Sphere::GetBoundingBox(bool force_recompute)
 bool
 Sphere::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
 {
-  auto p0 = ray.GetOrigin() - center_;
-  auto v = ray.GetDirection();
-  auto a = v.squaredNorm();
-  auto b = 2 * p0.dot(v);
-  auto c = p0.squaredNorm() - radius_ * radius_;
-
-  // solve quadratic equation to find t
-  auto a2 = 2 * a;
-  auto discriminant = b * b - 2 * a2 * c;
-  if (discriminant < 0)
-    return false;
-  auto s = static_cast<Real>(sqrt(discriminant));
-  auto t = (-b - s) / a2;
-  if (t < tmin)
-    t = (-b + s) / a2;
-  if (t < tmin || t > tmax)
+  Real t;
+  if (!Intersect(ray, tmin, tmax, t))
     return false;
 
   // fill hit record
@@ -96,5 +82,38 @@ Sphere::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
   return true;
 }
 
+
+bool
+Sphere::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  Real t;
+  return Intersect(ray, tmin, tmax, t);
+}
+
+
+bool
+Sphere::Intersect(const Ray &ray, Real tmin, Real tmax, Real &ray_t) const
+{
+  Vec3r p0 = ray.GetOrigin() - center_;
+  auto v = ray.GetDirection();
+  auto a = v.squaredNorm();
+  auto b = 2 * p0.dot(v);
+  auto c = p0.squaredNorm() - radius_ * radius_;
+
+  // solve quadratic equation to find t
+  auto a2 = 2 * a;
+  auto discriminant = b * b - 2 * a2 * c;
+  if (discriminant < 0)
+    return false;
+  auto s = static_cast<Real>(sqrt(discriminant));
+  auto t = (-b - s) / a2;
+  if (t < tmin)
+    t = (-b + s) / a2;
+  if (t < tmin || t > tmax)
+    return false;
+  ray_t = t;
+  return true;
+}
+
 }  // namespace core
 }  // namespace olio
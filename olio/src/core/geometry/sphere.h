@@ -40,6 +40,14 @@ public:
   bool Hit(const Ray &ray, Real tmin, Real tmax,
            HitRecord &hit_record) override;
 
+  //! \brief Check if the sphere blocks a ray
+  //! \details Same intersection test as Hit(), without the hit record
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with the sphere
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
   //! \brief Set sphere position
   //! \param[in] center Sphere center/position
   void SetCenter(const Vec3r &center);
@@ -60,6 +68,14 @@ public:
   //! \return Surface's AABB
   AABB GetBoundingBox(bool force_recompute=false) override;
 protected:
+  //! \brief Find where a ray intersects with the sphere
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[out] ray_t t of the nearest intersection in [tmin, tmax]
+  //! \return True if ray intersected with the sphere
+  bool Intersect(const Ray &ray, Real tmin, Real tmax, Real &ray_t) const;
+
   Vec3r center_{0, 0, 0};  //!< sphere position
   Real radius_{0};         //!< sphere radius
 private:
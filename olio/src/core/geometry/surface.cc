@@ -36,11 +36,66 @@ Surface::Hit(const Ray &, Real, Real, HitRecord &)
 }
 
 
+PacketMask
+Surface::HitPacket(const RayPacket &packet, const PacketMask &active,
+                   Real tmin, PacketReal &tmax, HitRecord *hit_records)
+{
+  PacketMask hit = PacketMask::Constant(false);
+  for (int lane = 0; lane < packet.GetSize(); ++lane) {
+    if (!active[lane])
+      continue;
+    if (Hit(packet.GetRay(lane), tmin, tmax[lane], hit_records[lane])) {
+      tmax[lane] = hit_records[lane].GetRayT();
+      hit[lane] = true;
+    }
+  }
+  return hit;
+}
+
+
+bool
+Surface::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  HitRecord hit_record;
+  return Hit(ray, tmin, tmax, hit_record);
+}
+
+
+PacketMask
+Surface::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                        Real tmin, const PacketReal &tmax)
+{
+  PacketMask occluded = PacketMask::Constant(false);
+  for (int lane = 0; lane < packet.GetSize(); ++lane) {
+    if (active[lane])
+      occluded[lane] = Occluded(packet.GetRay(lane), tmin, tmax[lane]);
+  }
+  return occluded;
+}
+
+
 AABB
 Surface::GetBoundingBox(bool /*force_recompute*/)
 {
   return bbox_;
 }
 
+
+void
+Surface::SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                          AABB &left_bbox, AABB &right_bbox)
+{
+  Vec3r left_max = bbox.GetMax();
+  Vec3r right_min = bbox.GetMin();
+  left_max[axis] = std::min(left_max[axis], position);
+  right_min[axis] = std::max(right_min[axis], position);
+  left_bbox.Reset();
+  right_bbox.Reset();
+  if (bbox.GetMin()[axis] <= position)
+    left_bbox = AABB{bbox.GetMin(), left_max};
+  if (bbox.GetMax()[axis] >= position)
+    right_bbox = AABB{right_min, bbox.GetMax()};
+}
+
 }  // namespace core
 }  // namespace olio
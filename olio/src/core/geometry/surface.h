@@ -36,6 +36,46 @@ public:
   virtual bool Hit(const Ray &ray, Real tmin, Real tmax,
                    HitRecord &hit_record);
 
+  //! \brief Check which rays of a packet intersect with surface
+  //! \details For each active lane, behaves like Hit() with the
+  //!    lane's tmax: if the ray hits the surface, the lane's hit
+  //!    record is filled in and its tmax is lowered to the hit's t.
+  //!    The default implementation traces the rays one at a time;
+  //!    surfaces that can test several rays at once override it.
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane (array of
+  //!             kMaxPacketSize)
+  //! \return Mask of the active lanes that intersected with surface
+  virtual PacketMask HitPacket(const RayPacket &packet,
+                               const PacketMask &active, Real tmin,
+                               PacketReal &tmax, HitRecord *hit_records);
+
+  //! \brief Check if anything on the surface blocks a ray
+  //! \details Any-hit query for shadow rays: returns at the first
+  //!    intersection found, without looking for the closest one or
+  //!    filling in a hit record. The default implementation calls
+  //!    Hit().
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with surface
+  virtual bool Occluded(const Ray &ray, Real tmin, Real tmax);
+
+  //! \brief Check which rays of a packet are blocked by the surface
+  //! \details Any-hit version of HitPacket(). The default
+  //!    implementation calls Occluded() for each active lane.
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with surface
+  virtual PacketMask OccludedPacket(const RayPacket &packet,
+                                    const PacketMask &active, Real tmin,
+                                    const PacketReal &tmax);
+
   //! \brief Set surface's material
   //! \param[in] material Material to set
   virtual void SetMaterial(std::shared_ptr<Material> material);
@@ -56,6 +96,23 @@ public:
   //! \return Surface's AABB
   virtual AABB GetBoundingBox(bool force_recompute=false);
 
+  //! \brief Split the part of the surface inside a bbox by an
+  //!    axis-aligned plane
+  //! \details Used by spatial-split BVH builds (see
+  //!    BVHSplitMethod::kSBVH). Computes the bboxes of the parts of the
+  //!    surface that lie inside 'bbox', on either side of the plane.
+  //!    The default implementation splits 'bbox' itself, which is
+  //!    conservative for any surface.
+  //! \param[in] bbox Part of the surface's bbox to split
+  //! \param[in] axis Axis that the plane is perpendicular to
+  //! \param[in] position Position of the plane along 'axis'
+  //! \param[out] left_bbox Bbox of the part below the plane (invalid if
+  //!    there is none)
+  //! \param[out] right_bbox Bbox of the part above the plane (invalid
+  //!    if there is none)
+  virtual void SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                                AABB &left_bbox, AABB &right_bbox);
+
   //! \brief Check if bounds are dirty and need to be recomputed
   //! \return Whether node bounds are dirty
   virtual bool IsBoundDirty() const {return bound_dirty_;}
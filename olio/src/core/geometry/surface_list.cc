@@ -66,5 +66,16 @@ SurfaceList::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
   return !first_hit;
 }
 
+
+bool
+SurfaceList::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  for (const auto &surface : surfaces_) {
+    if (surface && surface->Occluded(ray, tmin, tmax))
+      return true;
+  }
+  return false;
+}
+
 }  // namespace core
 }  // namespace olio
@@ -35,6 +35,13 @@ public:
   bool Hit(const Ray &ray, Real tmin, Real tmax,
            HitRecord &hit_record) override;
 
+  //! \brief Check if any surface of the list blocks a ray
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with a surface
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
   //! \brief Get/compute surface's AABB
   //! \return Surface's AABB
   AABB GetBoundingBox(bool force_recompute=false) override;
@@ -100,7 +100,111 @@ Triangle::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
                       tmin, tmax, ray_t, uv))
     return false;
 
-  // fill hit_record
+  FillHitRecord(ray, ray_t, uv, hit_record);
+  return true;
+}
+
+
+PacketMask
+Triangle::RayTriangleHitPacket(const Vec3r &p0, const Vec3r &p1,
+                               const Vec3r &p2, const RayPacket &packet,
+                               const PacketMask &active, Real tmin,
+                               const PacketReal &tmax, PacketReal &ray_t,
+                               PacketReal &u, PacketReal &v)
+{
+  // same computations as RayTriangleHit(), written as plain loops over
+  // the lanes so that the compiler turns them into SIMD instructions
+  Real a = p0[0] - p1[0];
+  Real b = p0[1] - p1[1];
+  Real c = p0[2] - p1[2];
+  Real d = p0[0] - p2[0];
+  Real e = p0[1] - p2[1];
+  Real f = p0[2] - p2[2];
+  const Real *dir_x = packet.GetDirection(0).data();
+  const Real *dir_y = packet.GetDirection(1).data();
+  const Real *dir_z = packet.GetDirection(2).data();
+  const Real *origin_x = packet.GetOrigin(0).data();
+  const Real *origin_y = packet.GetOrigin(1).data();
+  const Real *origin_z = packet.GetOrigin(2).data();
+  PacketMask hit;
+  for (int lane = 0; lane < kMaxPacketSize; ++lane) {
+    Real g = dir_x[lane];
+    Real h = dir_y[lane];
+    Real i = dir_z[lane];
+    Real j = p0[0] - origin_x[lane];
+    Real k = p0[1] - origin_y[lane];
+    Real l = p0[2] - origin_z[lane];
+    Real ei_minus_hf = e * i - h * f;
+    Real gf_minus_di = g * f - d * i;
+    Real dh_minus_eg = d * h - e * g;
+    Real ak_minus_jb = a * k - j * b;
+    Real jc_minus_al = j * c - a * l;
+    Real bl_minus_kc = b * l - k * c;
+    Real M = a * ei_minus_hf + b * gf_minus_di + c * dh_minus_eg;
+    Real t = -(f * ak_minus_jb + e * jc_minus_al + d * bl_minus_kc) / M;
+    Real gamma = (i * ak_minus_jb + h * jc_minus_al + g * bl_minus_kc) / M;
+    Real beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / M;
+    hit[lane] = active[lane] && !(fabs(M) < kEpsilon) &&
+      !(t < tmin || t > tmax[lane]) && !(gamma < 0 || gamma > 1) &&
+      !(beta < 0 || beta > 1 - gamma);
+    ray_t[lane] = t;
+    u[lane] = beta;
+    v[lane] = gamma;
+  }
+  return hit;
+}
+
+
+PacketMask
+Triangle::HitPacket(const RayPacket &packet, const PacketMask &active,
+                    Real tmin, PacketReal &tmax, HitRecord *hit_records)
+{
+  if (points_.size() < 3)
+    return PacketMask::Constant(false);
+
+  PacketReal ray_t, u, v;
+  PacketMask hit = RayTriangleHitPacket(points_[0], points_[1], points_[2],
+                                        packet, active, tmin, tmax, ray_t, u,
+                                        v);
+  for (int lane = 0; lane < packet.GetSize(); ++lane) {
+    if (!hit[lane])
+      continue;
+    FillHitRecord(packet.GetRay(lane), ray_t[lane], Vec2r{u[lane], v[lane]},
+                  hit_records[lane]);
+    tmax[lane] = ray_t[lane];
+  }
+  return hit;
+}
+
+
+bool
+Triangle::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  if (points_.size() < 3)
+    return false;
+  Real ray_t;
+  Vec2r uv;
+  return RayTriangleHit(points_[0], points_[1], points_[2], ray, tmin, tmax,
+                        ray_t, uv);
+}
+
+
+PacketMask
+Triangle::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                         Real tmin, const PacketReal &tmax)
+{
+  if (points_.size() < 3)
+    return PacketMask::Constant(false);
+  PacketReal ray_t, u, v;
+  return RayTriangleHitPacket(points_[0], points_[1], points_[2], packet,
+                              active, tmin, tmax, ray_t, u, v);
+}
+
+
+void
+Triangle::FillHitRecord(const Ray &ray, Real ray_t, const Vec2r &uv,
+                        HitRecord &hit_record)
+{
   const Vec3r &hit_point = ray.At(ray_t);
   hit_record.SetRayT(ray_t);
   hit_record.SetPoint(hit_point);
@@ -109,8 +213,6 @@ Triangle::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
 
   FaceGeoUV face_geo_uv{0, uv, Vec2r{-1, -1}};
   hit_record.SetFaceGeoUV(face_geo_uv);
-
-  return true;
 }
 
 
@@ -130,6 +232,50 @@ Triangle::GetBoundingBox(bool force_recompute)
 }
 
 
+void
+Triangle::SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                           AABB &left_bbox, AABB &right_bbox)
+{
+  if (points_.size() != 3) {
+    Surface::SplitBoundingBox(bbox, axis, position, left_bbox, right_bbox);
+    return;
+  }
+  SplitTriangleBoundingBox(points_[0], points_[1], points_[2], bbox, axis,
+                           position, left_bbox, right_bbox);
+}
+
+
+void
+Triangle::SplitTriangleBoundingBox(const Vec3r &p0, const Vec3r &p1,
+                                   const Vec3r &p2, const AABB &bbox,
+                                   int axis, Real position, AABB &left_bbox,
+                                   AABB &right_bbox)
+{
+  AABB left, right;
+  const Vec3r *points[3] = {&p0, &p1, &p2};
+  for (int i = 0; i < 3; ++i) {
+    const Vec3r &start = *points[i];
+    const Vec3r &end = *points[(i + 1) % 3];
+    if (start[axis] <= position)
+      left.ExpandBy(start);
+    if (start[axis] >= position)
+      right.ExpandBy(start);
+
+    // the edge crosses the plane
+    if ((start[axis] < position && end[axis] > position) ||
+        (start[axis] > position && end[axis] < position)) {
+      Real t = (position - start[axis]) / (end[axis] - start[axis]);
+      Vec3r crossing = start + t * (end - start);
+      crossing[axis] = position;
+      left.ExpandBy(crossing);
+      right.ExpandBy(crossing);
+    }
+  }
+  left_bbox = left.IntersectWith(bbox);
+  right_bbox = right.IntersectWith(bbox);
+}
+
+
 bool
 Triangle::SetPoints(const std::vector<Vec3r> &points)
 {
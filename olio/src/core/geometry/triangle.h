@@ -48,6 +48,28 @@ public:
                              const Ray &ray, Real tmin, Real tmax,
                              Real &ray_t, Vec2r &uv);
 
+  //! \brief Packet version of RayTriangleHit()
+  //! \details Computes the same intersection test for all lanes of
+  //!    the packet at once (SIMD), with identical results.
+  //! \param[in] p0 first triangle point
+  //! \param[in] p1 second triangle point
+  //! \param[in] p2 third triangle point
+  //! \param[in] packet Input rays
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum acceptable value for ray_t
+  //! \param[in] tmax Maximum acceptable value for ray_t of each lane
+  //! \param[out] ray_t Value of t of the hit points
+  //! \param[out] u First UV coordinate of the hit points
+  //! \param[out] v Second UV coordinate of the hit points
+  //! \return Mask of the active lanes that intersected with the triangle
+  static PacketMask RayTriangleHitPacket(const Vec3r &p0, const Vec3r &p1,
+                                         const Vec3r &p2,
+                                         const RayPacket &packet,
+                                         const PacketMask &active, Real tmin,
+                                         const PacketReal &tmax,
+                                         PacketReal &ray_t, PacketReal &u,
+                                         PacketReal &v);
+
   //! \brief Check if ray intersects with surface
   //! \details If the ray intersections the surface, the function
   //!          should fill in the 'hit_record' (i.e., information
@@ -60,6 +82,33 @@ public:
   bool Hit(const Ray &ray, Real tmin, Real tmax,
            HitRecord &hit_record) override;
 
+  //! \brief Check which rays of a packet intersect with surface
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane
+  //! \return Mask of the active lanes that intersected with surface
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if the triangle blocks a ray
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with the triangle
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the triangle
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with the triangle
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
+
   //! \brief Set triangle points
   //! \details The function returns false if the number of input
   //! points is fewer than 3. The function should also compute/update
@@ -80,11 +129,50 @@ public:
   //! \brief Get/compute surface's AABB
   //! \return Surface's AABB
   AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Split the part of the triangle inside a bbox by an
+  //!    axis-aligned plane
+  //! \details See SplitTriangleBoundingBox()
+  //! \param[in] bbox Part of the triangle's bbox to split
+  //! \param[in] axis Axis that the plane is perpendicular to
+  //! \param[in] position Position of the plane along 'axis'
+  //! \param[out] left_bbox Bbox of the part below the plane
+  //! \param[out] right_bbox Bbox of the part above the plane
+  void SplitBoundingBox(const AABB &bbox, int axis, Real position,
+                        AABB &left_bbox, AABB &right_bbox) override;
+
+  //! \brief Split the part of a triangle inside a bbox by an
+  //!    axis-aligned plane
+  //! \details Clips the triangle's edges against the plane: the
+  //!    vertices and edge crossings on each side bound that side's
+  //!    part of the triangle, which is then intersected with 'bbox'.
+  //! \param[in] p0 first triangle point
+  //! \param[in] p1 second triangle point
+  //! \param[in] p2 third triangle point
+  //! \param[in] bbox Part of the triangle's bbox to split
+  //! \param[in] axis Axis that the plane is perpendicular to
+  //! \param[in] position Position of the plane along 'axis'
+  //! \param[out] left_bbox Bbox of the part below the plane (invalid if
+  //!    there is none)
+  //! \param[out] right_bbox Bbox of the part above the plane (invalid
+  //!    if there is none)
+  static void SplitTriangleBoundingBox(const Vec3r &p0, const Vec3r &p1,
+                                       const Vec3r &p2, const AABB &bbox,
+                                       int axis, Real position,
+                                       AABB &left_bbox, AABB &right_bbox);
 protected:
   //! \brief Compute/update triangle normal
   //! \return True if triangle has three points
   bool ComputeNormal();
 
+  //! \brief Fill in the hit record of a ray that hit the triangle
+  //! \param[in] ray Ray that hit the triangle
+  //! \param[in] ray_t Value of t of the hit point
+  //! \param[in] uv UV coordinates of the hit point inside the triangle
+  //! \param[out] hit_record Hit record to fill in
+  void FillHitRecord(const Ray &ray, Real ray_t, const Vec2r &uv,
+                     HitRecord &hit_record);
+
   std::vector<Vec3r> points_;  //!< triangle points
   Vec3r normal_{0, 0, 0};      //!< triangle normal
 private:
@@ -2,12 +2,14 @@
 //! \brief      TriMesh class
 
 #include "core/geometry/trimesh.h"
+#include <tbb/tbb.h>
 #include <spdlog/spdlog.h>
 #include "core/ray.h"
 #include "core/material/material.h"
 #include "core/geometry/triangle.h"
 #include "core/face_geouv.h"
 #include "core/geometry/bvh_trimesh_face.h"
+#include "core/geometry/trimesh_bvh.h"
 #include <vector>
 
 namespace olio {
@@ -47,11 +49,35 @@ bool TriMesh::Hit(const Ray &ray, Real tmin, Real tmax,HitRecord &hit_record){
   }
   return had_hit;
 }
+PacketMask TriMesh::HitPacket(const RayPacket &packet, const PacketMask &active, Real tmin,
+                              PacketReal &tmax, HitRecord *hit_records){
+  if(bvh_ == nullptr)
+    return Surface::HitPacket(packet, active, tmin, tmax, hit_records);
+  return bvh_->HitPacket(packet, active, tmin, tmax, hit_records);
+}
+bool TriMesh::Occluded(const Ray &ray, Real tmin, Real tmax){
+  if(bvh_ != nullptr)
+    return bvh_->Occluded(ray, tmin, tmax);
+  if(!GetBoundingBox().Hit(ray, tmin, tmax))
+    return false;
+  HitRecord hit_record;
+  for (auto fit = this->faces_begin(); fit != this->faces_end(); ++fit) {
+    if(RayFaceHit(*fit, ray, tmin, tmax, hit_record))
+      return true;
+  }
+  return false;
+}
+PacketMask TriMesh::OccludedPacket(const RayPacket &packet, const PacketMask &active, Real tmin,
+                                   const PacketReal &tmax){
+  if(bvh_ == nullptr)
+    return Surface::OccludedPacket(packet, active, tmin, tmax);
+  return bvh_->OccludedPacket(packet, active, tmin, tmax);
+}
 bool TriMesh::RayFaceHit(TriMesh::FaceHandle fh, const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record){
-  std::vector<TriMesh::VertexHandle> points;
-
-  for(auto fvit = this->fv_iter(fh); fvit.is_valid(); ++fvit) {
-    points.push_back(*fvit);
+  TriMesh::VertexHandle points[3];
+  int num_points = 0;
+  for(auto fvit = this->fv_iter(fh); fvit.is_valid() && num_points < 3; ++fvit) {
+    points[num_points++] = *fvit;
   }
 
   Real ray_t{0};
@@ -60,6 +86,18 @@ bool TriMesh::RayFaceHit(TriMesh::FaceHandle fh, const Ray &ray, Real tmin, Real
                       tmin, tmax, ray_t, uv))
     return false;
 
+  FillFaceHitRecord(fh, ray, ray_t, uv, hit_record);
+  return true;
+}
+
+void TriMesh::FillFaceHitRecord(TriMesh::FaceHandle fh, const Ray &ray, Real ray_t, const Vec2r &uv,
+                                HitRecord &hit_record){
+  TriMesh::VertexHandle points[3];
+  int num_points = 0;
+  for(auto fvit = this->fv_iter(fh); fvit.is_valid() && num_points < 3; ++fvit) {
+    points[num_points++] = *fvit;
+  }
+
   // fill hit_record
   const Vec3r &hit_point = ray.At(ray_t);
   hit_record.SetRayT(ray_t);
@@ -94,7 +132,6 @@ bool TriMesh::RayFaceHit(TriMesh::FaceHandle fh, const Ray &ray, Real tmin, Real
   }
 
   hit_record.SetFaceGeoUV(face_geo_uv);
-  return true;
 }
 
 bool TriMesh::Load(const boost::filesystem::path &filepath) {
@@ -122,6 +159,7 @@ bool TriMesh::Load(const boost::filesystem::path &filepath) {
     release_vertex_texcoords2D();
 
   // build BVH tree
+  filepath_ = filepath;
   BuildBVH();
 
   return status;
@@ -208,13 +246,29 @@ bool TriMesh::ComputeVertexNormals() {
 }
 
 void TriMesh::BuildBVH() {
-  std::vector<Surface::Ptr> mesh_faces;
-  TriMesh::Ptr mesh = this->GetPtr();
-  for(auto fit = this->faces_begin(); fit != this->faces_end(); ++fit) {
-    BVHTriMeshFace::Ptr mesh_face = make_shared<BVHTriMeshFace>(mesh, *fit);
-    mesh_faces.push_back(mesh_face);
+  string name{"Triangle Mesh"};
+  if (!filepath_.empty())
+    name += " " + filepath_.filename().string();
+  const auto &options = BVHNode::GetBuildOptions();
+  if (options.packed_meshes && options.layout == BVHLayout::kLinear &&
+      (options.split_method == BVHSplitMethod::kSAH ||
+       options.split_method == BVHSplitMethod::kLBVH)) {
+    bvh_ = TriMeshBVH::BuildBVH(*this, options, name);
+    return;
   }
-  bvh_ = BVHNode::BuildBVH(mesh_faces, string{"Triangle Mesh"});
+
+  // faces are created in parallel; face i is stored at index i, as in
+  // a serial loop over the faces
+  TriMesh::Ptr mesh = this->GetPtr();
+  std::vector<Surface::Ptr> mesh_faces(this->n_faces());
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, mesh_faces.size(), 1024),
+                    [&](const tbb::blocked_range<size_t> &range) {
+    for (size_t i = range.begin(); i < range.end(); ++i) {
+      TriMesh::FaceHandle fh{static_cast<int>(i)};
+      mesh_faces[i] = make_shared<BVHTriMeshFace>(mesh, fh);
+    }
+  });
+  bvh_ = BVHNode::BuildAccelerator(mesh_faces, name);
 }
 // ***** END OF YOUR CODE (DO NOT DELETE/MODIFY THIS LINE) *****
 
@@ -46,6 +46,40 @@ public:
   bool Hit(const Ray &ray, Real tmin, Real tmax,
            HitRecord &hit_record) override;
 
+  //! \brief Check which rays of a packet intersect with the mesh
+  //! \details Uses the mesh's BVH when it has one; otherwise, each ray
+  //!    is checked on its own
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Mask of the rays to check
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each ray;
+  //!                updated for the rays that hit the mesh
+  //! \param[out] hit_records Resulting hit records (one per lane)
+  //! \return Mask of the rays that intersected with the mesh
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if the mesh blocks a ray
+  //! \details Any-hit query of the mesh's BVH when it has one;
+  //!    otherwise, stops at the first face the ray intersects
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with the mesh
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the mesh
+  //! \details Uses the mesh's BVH when it has one; otherwise, each ray
+  //!    is checked on its own
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Mask of the rays to check
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each ray
+  //! \return Mask of the rays that intersected with the mesh
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
+
   //! \brief Check if input ray intersects with input face in the mesh
   //! \param[in] fh Handle of face to check for intersection
   //! \param[in] ray Input ray to check for intersection
@@ -56,6 +90,15 @@ public:
   bool RayFaceHit(TriMesh::FaceHandle fh, const Ray &ray, Real tmin,
                   Real tmax, HitRecord &hit_record);
 
+  //! \brief Fill in the hit record of a ray that hit a face
+  //! \param[in] fh Handle of the face that was hit
+  //! \param[in] ray Ray that hit the face
+  //! \param[in] ray_t Value of t of the hit point
+  //! \param[in] uv UV coordinates of the hit point inside the face
+  //! \param[out] hit_record Hit record to fill in
+  void FillFaceHitRecord(TriMesh::FaceHandle fh, const Ray &ray, Real ray_t,
+                         const Vec2r &uv, HitRecord &hit_record);
+
   //! \brief Load mesh from file
   //! \param[in] filepath Path of mesh file to read
   //! \return True on success
@@ -92,10 +135,20 @@ public:
   Vec3r FaceNormal(TriMesh::FaceHandle fh, bool is_normalize=true);
   Vec3r VertexNormal(TriMesh::VertexHandle vh, bool is_normalize=true);
 
+  //! \brief Build the BVH over the faces
+  //! \details With the linear layout and SAH or LBVH splits, a
+  //!    TriMeshBVH that stores the triangles in its leaves (unless
+  //!    BVHBuildOptions::packed_meshes is off). Otherwise, a
+  //!    BVHNode::BuildAccelerator() BVH over one BVHTriMeshFace per face.
   void BuildBVH();
+
+  //! \brief Get the BVH over the faces
+  //! \return TriMeshBVH, BVHNode::BuildAccelerator() BVH, or nullptr
+  //!    before BuildBVH()
+  inline Surface::Ptr GetBVH() const {return bvh_;}
 protected:
   boost::filesystem::path filepath_;
-  BVHNode::Ptr bvh_ = nullptr;
+  Surface::Ptr bvh_ = nullptr;  //!< BVH over the faces (see BuildBVH())
 };
 
 
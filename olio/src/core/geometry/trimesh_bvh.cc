@@ -0,0 +1,968 @@
+//! \file       trimesh_bvh.cc
+//! \brief      TriMeshBVH class
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <spdlog/spdlog.h>
+#include "core/ray.h"
+#include "core/geometry/triangle.h"
+#include "core/geometry/trimesh.h"
+#include "core/geometry/bvh_trimesh_face.h"
+#include "core/geometry/trimesh_bvh.h"
+#include "core/geometry/bvh_traversal.h"
+#include "core/geometry/bvh_layout.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace {
+
+//! \struct BVHCacheHeader
+//! \brief Header of a BVH cache file, followed by the nodes and the
+//!    triangles
+struct BVHCacheHeader {
+  char magic[8];            //!< "OLIOBVHC"
+  uint32_t version;         //!< file format version
+  uint32_t real_size;       //!< sizeof(Real)
+  uint64_t key;             //!< TriMeshBVH::ComputeCacheKey()
+  uint64_t node_count;      //!< number of nodes
+  uint64_t triangle_count;  //!< number of triangles
+};
+const char kBVHCacheMagic[8] = {'O', 'L', 'I', 'O', 'B', 'V', 'H', 'C'};
+
+//! Version of the cache file format and of the tree it stores: bump it
+//! when the builder changes the trees it builds, so old files miss
+const uint32_t kBVHCacheVersion = 1;
+
+//! \brief Add a value to a hash
+//! \details Mixes the value's bits in with the splitmix64 finalizer
+//! \param[in,out] hash Hash
+//! \param[in] value Value (at most 8 bytes)
+template <typename T>
+inline void HashValue(uint64_t &hash, const T &value)
+{
+  static_assert(sizeof(T) <= sizeof(uint64_t), "value too large to hash");
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(T));
+  uint64_t x = hash ^ bits;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  hash = x + 0x9e3779b97f4a7c15ULL;
+}
+
+//! Flag of QuantizedNode children that are leaves
+const uint32_t kQuantizedLeaf = 0x80000000u;
+
+//! Most triangles that a QuantizedNode leaf child can hold
+const uint32_t kMaxQuantizedLeafSize = 255;
+
+//! Step of the 8-bit grid over a quantized node's bounds, as a fraction
+//! of the bounds: slightly more than 1/255, so that code 255 reaches
+//! past the bounds despite rounding errors
+const Real kQuantizationStep = (1 + Real{1} / 65536) / 255;
+
+//! \brief Check if a ray intersects with decoded bounds
+//! \details Same slab test as LinearBVH::LinearNode::Hit()
+//! \param[in] bmin Min coordinates
+//! \param[in] bmax Max coordinates
+//! \param[in] origin Ray origin
+//! \param[in] inv_direction 1 / ray direction
+//! \param[in] tmin Minimum value for acceptable t
+//! \param[in] tmax Maximum value for acceptable t
+//! \param[out] t_entry Largest of 'tmin' and the t at which the ray
+//!    enters the bounds (only set if the ray intersected)
+//! \return True if ray intersects with the bounds
+inline bool HitBounds(const Vec3r &bmin, const Vec3r &bmax,
+                      const Vec3r &origin, const Vec3r &inv_direction,
+                      Real tmin, Real tmax, Real &t_entry)
+{
+  for (int i = 0; i < 3; ++i) {
+    Real t0 = (bmin[i] - origin[i]) * inv_direction[i];
+    Real t1 = (bmax[i] - origin[i]) * inv_direction[i];
+    if (inv_direction[i] < 0.0f)
+      std::swap(t0, t1);
+    tmin = t0 > tmin ? t0 : tmin;
+    tmax = t1 < tmax ? t1 : tmax;
+    if (tmax < tmin)
+      return false;
+  }
+  t_entry = tmin;
+  return true;
+}
+
+//! \brief Decode a quantized coordinate
+//! \param[in] lo Min coordinate of the grid
+//! \param[in] step Grid step
+//! \param[in] code 8-bit code
+//! \return Coordinate
+inline Real DecodeCoordinate(Real lo, Real step, uint8_t code)
+{
+  return lo + static_cast<Real>(code) * step;
+}
+
+//! \brief Encode the bounds of a linear node on a grid, rounded outwards
+//! \param[in] node Linear node
+//! \param[in] lo Min corner of the grid
+//! \param[in] step Grid step
+//! \param[out] qmin Min codes
+//! \param[out] qmax Max codes
+//! \return False if rounding errors keep the decoded bounds from
+//!    containing the node's bounds
+bool QuantizeBounds(const LinearBVH::LinearNode &node, const Vec3r &lo,
+                    const Vec3r &step, uint8_t qmin[3], uint8_t qmax[3])
+{
+  for (int i = 0; i < 3; ++i) {
+    Real bmin = node.bmin[i], bmax = node.bmax[i];
+    Real code_min = 0, code_max = 0;
+    if (step[i] > 0) {
+      code_min = std::floor((bmin - lo[i]) / step[i]);
+      code_max = std::ceil((bmax - lo[i]) / step[i]);
+    }
+    qmin[i] = static_cast<uint8_t>(std::min<Real>(std::max<Real>(code_min, 0),
+                                                  255));
+    qmax[i] = static_cast<uint8_t>(std::min<Real>(std::max<Real>(code_max, 0),
+                                                  255));
+
+    // fix up the codes with the decoding arithmetic
+    while (qmin[i] > 0 && DecodeCoordinate(lo[i], step[i], qmin[i]) > bmin)
+      --qmin[i];
+    while (qmax[i] < 255 && DecodeCoordinate(lo[i], step[i], qmax[i]) < bmax)
+      ++qmax[i];
+    if (DecodeCoordinate(lo[i], step[i], qmin[i]) > bmin ||
+        DecodeCoordinate(lo[i], step[i], qmax[i]) < bmax)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::string TriMeshBVH::cache_directory_;
+
+TriMeshBVH::TriMeshBVH(const std::string &name) :
+  Surface{}
+{
+  name_ = name.size() ? name : "TriMeshBVH";
+}
+
+
+bool
+TriMeshBVH::Hit(const Ray &ray, Real tmin, Real tmax, HitRecord &hit_record)
+{
+  ClosestHit closest;
+  LocalTraversalStats stats;
+  ++stats.queries;
+  if (IsQuantized()) {
+    if (!HitQuantized(ray, tmin, tmax, closest, stats))
+      return false;
+  } else if (nodes_.empty() ||
+             !HitSubtree(0, ray, tmin, tmax, closest, stats)) {
+    return false;
+  }
+  mesh_->FillFaceHitRecord(TriMesh::FaceHandle{closest.face}, ray,
+                           closest.ray_t, closest.uv, hit_record);
+  return true;
+}
+
+
+bool
+TriMeshBVH::HitSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                       ClosestHit &closest, BVHTraversalStats &stats) const
+{
+  return HitBinaryBVH(nodes_.data(), root, depth_, ray, tmin, tmax, stats,
+                      [&](const LinearBVH::LinearNode &leaf,
+                          Real &leaf_tmax) {
+    return HitTriangles(leaf.offset, leaf.count, ray, tmin, leaf_tmax,
+                        closest, false);
+  });
+}
+
+
+bool
+TriMeshBVH::OccludedSubtree(uint32_t root, const Ray &ray, Real tmin,
+                            Real tmax, BVHTraversalStats &stats) const
+{
+  return OccludedBinaryBVH(nodes_.data(), root, depth_, ray, tmin, tmax,
+                           stats, [&](const LinearBVH::LinearNode &leaf,
+                                      BVHTraversalStats &leaf_stats) {
+    ClosestHit closest;
+    Real leaf_tmax = tmax;
+    leaf_stats.surface_tests += leaf.count;
+    return HitTriangles(leaf.offset, leaf.count, ray, tmin, leaf_tmax,
+                        closest, true);
+  });
+}
+
+
+bool
+TriMeshBVH::HitTriangles(uint32_t first, uint32_t count, const Ray &ray,
+                         Real tmin, Real &tmax, ClosestHit &closest,
+                         bool any_hit) const
+{
+  bool is_hit = false;
+  const PackedTriangle *triangle = triangles_.data() + first;
+  const PackedTriangle *end = triangle + count;
+  for (; triangle != end; ++triangle) {
+    Real ray_t;
+    Vec2r uv;
+    if (Triangle::RayTriangleHit(triangle->p0, triangle->p1, triangle->p2,
+                                 ray, tmin, tmax, ray_t, uv)) {
+      tmax = ray_t;
+      closest.face = triangle->face;
+      closest.ray_t = ray_t;
+      closest.uv = uv;
+      if (any_hit)
+        return true;
+      is_hit = true;
+    }
+  }
+  return is_hit;
+}
+
+
+bool
+TriMeshBVH::HitQuantized(const Ray &ray, Real tmin, Real tmax,
+                         ClosestHit &closest, BVHTraversalStats &stats,
+                         bool any_hit) const
+{
+  const Vec3r &origin = ray.GetOrigin();
+  const Vec3r &dir = ray.GetDirection();
+  const Vec3r inv_direction{1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  Real root_entry;
+  if (!HitBounds(quantized_min_, quantized_max_, origin, inv_direction, tmin,
+                 tmax, root_entry))
+    return false;
+
+  //! \struct StackEntry
+  //! \brief Node or leaf to visit
+  struct StackEntry {
+    uint32_t child;  //!< QuantizedNode::child
+    uint32_t count;  //!< QuantizedNode::count
+    Real t_entry;    //!< distance at which the ray enters the node
+    Vec3r lo;        //!< interior node: min corner of its bounds
+    Vec3r step;      //!< interior node: grid step of its bounds
+  };
+  TraversalStack<StackEntry> stack{depth_ + 1};
+
+  bool is_hit = false;
+  stack.Push({0, 0, root_entry, quantized_min_,
+                         (quantized_max_ - quantized_min_) *
+                         kQuantizationStep});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+    if (entry.t_entry > tmax) {
+      ++stats.culled_nodes;
+      continue;
+    }
+    ++stats.node_visits;
+    if (entry.child & kQuantizedLeaf) {
+      stats.surface_tests += entry.count;
+      if (HitTriangles(entry.child & ~kQuantizedLeaf, entry.count, ray, tmin,
+                       tmax, closest, any_hit)) {
+        if (any_hit)
+          return true;
+        is_hit = true;
+      }
+      continue;
+    }
+
+    // decode the children's bounds and test them
+    const QuantizedNode &node = quantized_nodes_[entry.child];
+    StackEntry children[2];
+    bool enters[2];
+    for (int c = 0; c < 2; ++c) {
+      Vec3r bmin, bmax;
+      for (int i = 0; i < 3; ++i) {
+        bmin[i] = DecodeCoordinate(entry.lo[i], entry.step[i],
+                                   node.qmin[c][i]);
+        bmax[i] = DecodeCoordinate(entry.lo[i], entry.step[i],
+                                   node.qmax[c][i]);
+      }
+      children[c].child = node.child[c];
+      children[c].count = node.count[c];
+      children[c].t_entry = tmin;
+      enters[c] = HitBounds(bmin, bmax, origin, inv_direction, tmin, tmax,
+                            children[c].t_entry);
+
+      // leaves don't use their grid, but copying the entry reads it
+      children[c].lo = bmin;
+      children[c].step = (bmax - bmin) * kQuantizationStep;
+    }
+    if (enters[0] && enters[1]) {
+      int near = children[1].t_entry < children[0].t_entry ? 1 : 0;
+      stack.Push(children[1 - near]);
+      stack.Push(children[near]);
+    } else if (enters[0]) {
+      stack.Push(children[0]);
+    } else if (enters[1]) {
+      stack.Push(children[1]);
+    }
+  }
+  return is_hit;
+}
+
+
+bool
+TriMeshBVH::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  ClosestHit closest;
+  LocalTraversalStats stats;
+  ++stats.queries;
+  if (IsQuantized())
+    return HitQuantized(ray, tmin, tmax, closest, stats, true);
+  return !nodes_.empty() && OccludedSubtree(0, ray, tmin, tmax, stats);
+}
+
+
+PacketMask
+TriMeshBVH::HitPacket(const RayPacket &packet, const PacketMask &active,
+                      Real tmin, PacketReal &tmax, HitRecord *hit_records)
+{
+  // quantized nodes trace each ray on its own
+  if (IsQuantized())
+    return Surface::HitPacket(packet, active, tmin, tmax, hit_records);
+  if (nodes_.empty())
+    return PacketMask::Constant(false);
+
+  // hit records are filled in at the end, for the closest hit of
+  // each lane
+  ClosestHit closest[kMaxPacketSize];
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  PacketMask is_hit = HitBinaryBVHPacket(nodes_.data(), depth_, packet,
+                                         active, tmin, tmax, stats,
+                                         [&](const LinearBVH::LinearNode &leaf,
+                                             const PacketMask &lanes) {
+    PacketMask leaf_hit = PacketMask::Constant(false);
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+      const PackedTriangle &triangle = triangles_[i];
+      PacketReal ray_t, u, v;
+      PacketMask hit = Triangle::RayTriangleHitPacket(
+        triangle.p0, triangle.p1, triangle.p2, packet, lanes, tmin, tmax,
+        ray_t, u, v);
+      if (!hit.any())
+        continue;
+      for (int lane = 0; lane < packet.GetSize(); ++lane) {
+        if (!hit[lane])
+          continue;
+        tmax[lane] = ray_t[lane];
+        closest[lane].face = triangle.face;
+        closest[lane].ray_t = ray_t[lane];
+        closest[lane].uv = Vec2r{u[lane], v[lane]};
+      }
+      leaf_hit = leaf_hit || hit;
+    }
+    return leaf_hit;
+  }, [&](uint32_t root, int lane) {
+    if (!HitSubtree(root, packet.GetRay(lane), tmin, tmax[lane],
+                    closest[lane], stats))
+      return false;
+    tmax[lane] = closest[lane].ray_t;
+    return true;
+  });
+
+  for (int lane = 0; lane < packet.GetSize(); ++lane) {
+    if (!is_hit[lane])
+      continue;
+    mesh_->FillFaceHitRecord(TriMesh::FaceHandle{closest[lane].face},
+                             packet.GetRay(lane), closest[lane].ray_t,
+                             closest[lane].uv, hit_records[lane]);
+  }
+  return is_hit;
+}
+
+
+PacketMask
+TriMeshBVH::OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                           Real tmin, const PacketReal &tmax)
+{
+  // quantized nodes trace each ray on its own
+  if (IsQuantized())
+    return Surface::OccludedPacket(packet, active, tmin, tmax);
+  if (nodes_.empty())
+    return PacketMask::Constant(false);
+  LocalTraversalStats stats;
+  stats.queries += static_cast<uint64_t>(active.count());
+  return OccludedBinaryBVHPacket(nodes_.data(), depth_, packet, active, tmin,
+                                 tmax, stats,
+                                 [&](const LinearBVH::LinearNode &leaf,
+                                     PacketMask lanes,
+                                     BVHTraversalStats &leaf_stats) {
+    PacketMask occluded = PacketMask::Constant(false);
+    for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count &&
+           lanes.any(); ++i) {
+      const PackedTriangle &triangle = triangles_[i];
+      PacketReal ray_t, u, v;
+      leaf_stats.surface_tests += static_cast<uint64_t>(lanes.count());
+      occluded = occluded || Triangle::RayTriangleHitPacket(
+        triangle.p0, triangle.p1, triangle.p2, packet, lanes, tmin, tmax,
+        ray_t, u, v);
+      lanes = lanes && !occluded;
+    }
+    return occluded;
+  }, [&](uint32_t root, int lane) {
+    return OccludedSubtree(root, packet.GetRay(lane), tmin, tmax[lane],
+                           stats);
+  });
+}
+
+
+AABB
+TriMeshBVH::GetBoundingBox(bool /*force_recompute*/)
+{
+  return bbox_;
+}
+
+
+Real
+TriMeshBVH::ComputeSAHCost(const BVHBuildOptions &options) const
+{
+  if (IsQuantized())
+    return LinearBVH::ComputeSAHCost(DecodeQuantizedNodes(), options);
+  return LinearBVH::ComputeSAHCost(nodes_, options);
+}
+
+
+BVHTreeStats
+TriMeshBVH::ComputeTreeStats(const BVHBuildOptions &options) const
+{
+  BVHTreeStats stats;
+  stats.name = name_;
+  if (IsQuantized()) {
+    auto decoded_nodes = DecodeQuantizedNodes();
+    stats.type = "TriMeshBVH (quantized)";
+    LinearBVH::CollectTreeStats(decoded_nodes, stats);
+    stats.node_count = quantized_nodes_.size();
+    stats.sah_cost = LinearBVH::ComputeSAHCost(decoded_nodes, options);
+  } else {
+    stats.type = "TriMeshBVH";
+    LinearBVH::CollectTreeStats(nodes_, stats);
+    stats.sah_cost = ComputeSAHCost(options);
+  }
+  stats.memory_bytes = GetMemoryUsage();
+  return stats;
+}
+
+
+size_t
+TriMeshBVH::GetMemoryUsage() const
+{
+  return nodes_.capacity() * sizeof(LinearBVH::LinearNode) +
+    quantized_nodes_.capacity() * sizeof(QuantizedNode) +
+    triangles_.capacity() * sizeof(PackedTriangle);
+}
+
+
+std::vector<size_t>
+TriMeshBVH::GetLeafSizeHistogram() const
+{
+  vector<size_t> histogram;
+  if (IsQuantized()) {
+    for (const auto &node : quantized_nodes_) {
+      for (int c = 0; c < 2; ++c) {
+        if (!(node.child[c] & kQuantizedLeaf))
+          continue;
+        if (node.count[c] >= histogram.size())
+          histogram.resize(node.count[c] + 1u, 0);
+        ++histogram[node.count[c]];
+      }
+    }
+    return histogram;
+  }
+  for (const auto &node : nodes_) {
+    if (!node.count)
+      continue;
+    if (node.count >= histogram.size())
+      histogram.resize(node.count + 1, 0);
+    ++histogram[node.count];
+  }
+  return histogram;
+}
+
+
+TriMeshBVH::Ptr
+TriMeshBVH::BuildBVH(TriMesh &mesh, const BVHBuildOptions &options,
+                     const std::string &name)
+{
+  spdlog::info("Building mesh BVH ({})", name);
+  auto start_time = chrono::steady_clock::now();
+  size_t face_count = mesh.n_faces();
+  if (!face_count) {
+    spdlog::info("Done building mesh BVH ({})", name);
+    return nullptr;
+  }
+  auto bvh = TriMeshBVH::Create(name);
+  bvh->mesh_ = &mesh;
+  string cache_path;
+  bool is_cached = false;
+  RunInArena(options, [&] {
+    // gather the face vertices
+    vector<PackedTriangle> triangles(face_count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, face_count, 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        TriMesh::FaceHandle fh{static_cast<int>(i)};
+        Vec3r *points[3] = {&triangles[i].p0, &triangles[i].p1,
+                            &triangles[i].p2};
+        int num_points = 0;
+        for (auto fvit = mesh.fv_iter(fh); fvit.is_valid() && num_points < 3;
+             ++fvit)
+          *points[num_points++] = mesh.point(*fvit);
+        triangles[i].face = fh.idx();
+      }
+    });
+
+    // look the BVH up in the cache
+    uint64_t cache_key = 0;
+    if (!cache_directory_.empty()) {
+      cache_key = ComputeCacheKey(triangles, options);
+      cache_path = (fs::path(cache_directory_) /
+                    fmt::format("{:016x}.bvh", cache_key)).string();
+      if (bvh->ReadCache(cache_path, cache_key, triangles)) {
+        is_cached = true;
+        return;
+      }
+    }
+
+    // face bboxes
+    vector<BVHNode::BuildSurface> build_surfaces(face_count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, face_count, 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i) {
+        AABB bbox;
+        bbox.ExpandBy(triangles[i].p0);
+        bbox.ExpandBy(triangles[i].p1);
+        bbox.ExpandBy(triangles[i].p2);
+        build_surfaces[i] = {bbox, bbox.GetCenter(), i, 0};
+      }
+    });
+    if (options.split_method == BVHSplitMethod::kLBVH)
+      BVHNode::SortMorton(build_surfaces, options);
+
+    // build the nodes, then store the triangles in leaf order
+    bvh->nodes_.reserve(2 * face_count);
+    bvh->depth_ = LinearBVH::BuildNodes(
+      build_surfaces, 0, face_count, options,
+      std::max(options.max_leaf_size, 2u), bvh->nodes_);
+    bvh->nodes_.shrink_to_fit();
+    bvh->triangles_.resize(face_count);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, face_count, 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+        bvh->triangles_[i] = triangles[build_surfaces[i].index];
+    });
+    for (const auto &build_surface : build_surfaces)
+      bvh->bbox_.ExpandBy(build_surface.bbox);
+    bvh->bound_dirty_ = false;
+    if (!cache_path.empty())
+      bvh->WriteCache(cache_path, cache_key);
+  });
+  if (options.quantized_nodes)
+    bvh->Quantize(options);
+  double build_time = chrono::duration<double>(chrono::steady_clock::now() -
+                                               start_time).count();
+
+  // leaf size distribution, e.g., "1: 10, 2: 300, 3: 120"
+  auto histogram = bvh->GetLeafSizeHistogram();
+  string leaf_sizes;
+  size_t leaf_count = 0;
+  for (size_t size = 1; size < histogram.size(); ++size) {
+    if (!histogram[size])
+      continue;
+    leaf_sizes += (leaf_sizes.empty() ? "" : ", ") + to_string(size) + ": " +
+      to_string(histogram[size]);
+    leaf_count += histogram[size];
+  }
+  spdlog::info("Done {} mesh BVH ({}): {} triangles, {} {}nodes "
+               "({} leaves; triangles per leaf {}), {:.1f} KiB ({} bytes "
+               "per node, {} per triangle, vs. {} per BVHTriMeshFace "
+               "object), SAH cost {:.3f}, {:.3f}s",
+               is_cached ? "reading cached" : "building", name, face_count,
+               bvh->GetNodeCount(), bvh->IsQuantized() ? "quantized " : "",
+               leaf_count, leaf_sizes,
+               static_cast<double>(bvh->GetMemoryUsage()) / 1024,
+               bvh->IsQuantized() ? sizeof(QuantizedNode) :
+               sizeof(LinearBVH::LinearNode), sizeof(PackedTriangle),
+               sizeof(BVHTriMeshFace), bvh->ComputeSAHCost(options),
+               build_time);
+  if (BVHNode::IsCollectingTreeStats()) {
+    auto stats = bvh->ComputeTreeStats(options);
+    stats.build_time = build_time;
+    BVHNode::AddTreeStats(stats);
+  }
+  return bvh;
+}
+
+
+bool
+TriMeshBVH::Quantize(const BVHBuildOptions &options)
+{
+  static_assert(sizeof(QuantizedNode) == 24,
+                "QuantizedNode should be 24 bytes");
+  // a single leaf has nothing to quantize
+  if (nodes_.size() < 2)
+    return false;
+  if (triangles_.size() > ~kQuantizedLeaf) {
+    spdlog::warn("TriMeshBVH ({}): too many triangles to quantize the nodes",
+                 name_);
+    return false;
+  }
+  for (const auto &node : nodes_) {
+    if (node.count > kMaxQuantizedLeafSize) {
+      spdlog::warn("TriMeshBVH ({}): leaves of more than {} triangles "
+                   "can't be quantized, keeping the linear nodes", name_,
+                   kMaxQuantizedLeafSize);
+      return false;
+    }
+  }
+
+  // root bounds are stored as is; all other bounds are codes
+  const auto &root = nodes_[0];
+  quantized_min_ = Vec3r{root.bmin[0], root.bmin[1], root.bmin[2]};
+  quantized_max_ = Vec3r{root.bmax[0], root.bmax[1], root.bmax[2]};
+  quantized_nodes_.reserve(nodes_.size() / 2);
+  if (!QuantizeSubtree(0, quantized_min_,
+                       (quantized_max_ - quantized_min_) *
+                       kQuantizationStep)) {
+    spdlog::warn("TriMeshBVH ({}): bounds too small to quantize, keeping "
+                 "the linear nodes", name_);
+    vector<QuantizedNode>().swap(quantized_nodes_);
+    return false;
+  }
+  quantized_nodes_.shrink_to_fit();
+  if (options.veb_layout)
+    ReorderQuantizedNodes();
+  Real linear_sah_cost = LinearBVH::ComputeSAHCost(nodes_, options);
+  size_t linear_size = nodes_.capacity() * sizeof(LinearBVH::LinearNode);
+  LinearBVH::NodeArray().swap(nodes_);
+  spdlog::info("Quantized mesh BVH nodes ({}): {:.1f} KiB -> {:.1f} KiB, "
+               "SAH cost {:.3f} -> {:.3f}", name_,
+               static_cast<double>(linear_size) / 1024,
+               static_cast<double>(quantized_nodes_.size() *
+                                   sizeof(QuantizedNode)) / 1024,
+               linear_sah_cost, ComputeSAHCost(options));
+  return true;
+}
+
+
+bool
+TriMeshBVH::QuantizeSubtree(uint32_t index, const Vec3r &lo,
+                            const Vec3r &step)
+{
+  auto quantized_index = quantized_nodes_.size();
+  quantized_nodes_.push_back(QuantizedNode{});
+  const uint32_t children[2] = {index + 1, nodes_[index].offset};
+  for (int c = 0; c < 2; ++c) {
+    const auto &child = nodes_[children[c]];
+    uint8_t qmin[3], qmax[3];
+    if (!QuantizeBounds(child, lo, step, qmin, qmax))
+      return false;
+    uint32_t child_ref;
+    if (child.count) {
+      child_ref = kQuantizedLeaf | child.offset;
+    } else {
+      // the child's grid spans its decoded bounds
+      Vec3r child_lo, child_hi;
+      for (int i = 0; i < 3; ++i) {
+        child_lo[i] = DecodeCoordinate(lo[i], step[i], qmin[i]);
+        child_hi[i] = DecodeCoordinate(lo[i], step[i], qmax[i]);
+      }
+      child_ref = static_cast<uint32_t>(quantized_nodes_.size());
+      if (!QuantizeSubtree(children[c], child_lo,
+                           (child_hi - child_lo) * kQuantizationStep))
+        return false;
+    }
+    auto &node = quantized_nodes_[quantized_index];
+    std::copy(qmin, qmin + 3, node.qmin[c]);
+    std::copy(qmax, qmax + 3, node.qmax[c]);
+    node.child[c] = child_ref;
+    node.count[c] = static_cast<uint8_t>(child.count);
+  }
+  return true;
+}
+
+
+void
+TriMeshBVH::ReorderQuantizedNodes()
+{
+  vector<uint32_t> children(2 * quantized_nodes_.size(), kNoChildNode);
+  for (size_t i = 0; i < quantized_nodes_.size(); ++i) {
+    for (size_t c = 0; c < 2; ++c) {
+      uint32_t child = quantized_nodes_[i].child[c];
+      if (!(child & kQuantizedLeaf))
+        children[2 * i + c] = child;
+    }
+  }
+  auto order = ComputeVanEmdeBoasOrder(children, 2);
+  vector<QuantizedNode> nodes(quantized_nodes_.size());
+  for (size_t i = 0; i < quantized_nodes_.size(); ++i) {
+    QuantizedNode &node = nodes[order[i]];
+    node = quantized_nodes_[i];
+    for (size_t c = 0; c < 2; ++c) {
+      if (children[2 * i + c] != kNoChildNode)
+        node.child[c] = order[node.child[c]];
+    }
+  }
+  quantized_nodes_.swap(nodes);
+}
+
+
+LinearBVH::NodeArray
+TriMeshBVH::DecodeQuantizedNodes() const
+{
+  //! \struct DecodeEntry
+  //! \brief Quantized node child to decode
+  struct DecodeEntry {
+    uint32_t child;   //!< QuantizedNode::child
+    uint32_t count;   //!< QuantizedNode::count
+    Vec3r bmin;       //!< decoded min coordinates
+    Vec3r bmax;       //!< decoded max coordinates
+    size_t parent;    //!< linear parent index (right children only)
+  };
+  LinearBVH::NodeArray nodes;
+  nodes.reserve(2 * quantized_nodes_.size() + 1);
+
+  // depth-first, like LinearBVH::BuildNodes(): a left child follows its
+  // parent, and the right child's index is set once it's reached
+  const size_t kNoParent = ~size_t{0};
+  vector<DecodeEntry> stack;
+  stack.push_back({0, 0, quantized_min_, quantized_max_, kNoParent});
+  while (!stack.empty()) {
+    DecodeEntry entry = stack.back();
+    stack.pop_back();
+    if (entry.parent != kNoParent)
+      nodes[entry.parent].offset = static_cast<uint32_t>(nodes.size());
+    AABB bbox;
+    bbox.ExpandBy(entry.bmin);
+    bbox.ExpandBy(entry.bmax);
+    LinearBVH::LinearNode node;
+    node.SetBounds(bbox);
+    if (entry.child & kQuantizedLeaf) {
+      node.offset = entry.child & ~kQuantizedLeaf;
+      node.count = entry.count;
+      nodes.push_back(node);
+      continue;
+    }
+    node.offset = 0;
+    node.count = 0;
+    size_t index = nodes.size();
+    nodes.push_back(node);
+    const QuantizedNode &quantized_node = quantized_nodes_[entry.child];
+    Vec3r step = (entry.bmax - entry.bmin) * kQuantizationStep;
+    DecodeEntry children[2];
+    for (int c = 0; c < 2; ++c) {
+      for (int i = 0; i < 3; ++i) {
+        children[c].bmin[i] = DecodeCoordinate(entry.bmin[i], step[i],
+                                               quantized_node.qmin[c][i]);
+        children[c].bmax[i] = DecodeCoordinate(entry.bmin[i], step[i],
+                                               quantized_node.qmax[c][i]);
+      }
+      children[c].child = quantized_node.child[c];
+      children[c].count = quantized_node.count[c];
+    }
+    children[0].parent = kNoParent;
+    children[1].parent = index;
+    stack.push_back(children[1]);
+    stack.push_back(children[0]);
+  }
+  return nodes;
+}
+
+
+void
+TriMeshBVH::SetCacheDirectory(const std::string &directory)
+{
+  cache_directory_ = directory;
+}
+
+
+uint64_t
+TriMeshBVH::ComputeCacheKey(const std::vector<PackedTriangle> &triangles,
+                            const BVHBuildOptions &options)
+{
+  // builder settings that change the tree (not, e.g., the thread count)
+  uint64_t key = 0;
+  HashValue(key, kBVHCacheVersion);
+  HashValue(key, static_cast<uint32_t>(sizeof(Real)));
+  HashValue(key, static_cast<uint32_t>(options.split_method));
+  HashValue(key, options.bin_count);
+  HashValue(key, options.traversal_cost);
+  HashValue(key, options.intersection_cost);
+  HashValue(key, options.morton_bits);
+  HashValue(key, std::max(options.max_leaf_size, 2u));
+
+  // mesh triangles
+  HashValue(key, static_cast<uint64_t>(triangles.size()));
+  for (const auto &triangle : triangles) {
+    for (const Vec3r *point : {&triangle.p0, &triangle.p1, &triangle.p2}) {
+      HashValue(key, (*point)[0]);
+      HashValue(key, (*point)[1]);
+      HashValue(key, (*point)[2]);
+    }
+  }
+  return key;
+}
+
+
+bool
+TriMeshBVH::ReadCache(const std::string &filepath, uint64_t key,
+                      const std::vector<PackedTriangle> &triangles)
+{
+  boost::system::error_code ec;
+  if (!fs::exists(filepath, ec))
+    return false;
+
+  // map the file and copy the nodes and triangles out of it
+  BVHCacheHeader header;
+  try {
+    bip::file_mapping file(filepath.c_str(), bip::read_only);
+    bip::mapped_region region(file, bip::read_only);
+    auto data = static_cast<const char*>(region.get_address());
+    size_t size = region.get_size();
+    if (size < sizeof(header)) {
+      spdlog::warn("TriMeshBVH: ignoring truncated cache file {}", filepath);
+      return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, kBVHCacheMagic, sizeof(header.magic)) ||
+        header.version != kBVHCacheVersion ||
+        header.real_size != sizeof(Real) || header.key != key ||
+        header.triangle_count != triangles.size() || !header.node_count ||
+        header.node_count > 2 * header.triangle_count ||
+        size != sizeof(header) +
+        header.node_count * sizeof(LinearBVH::LinearNode) +
+        header.triangle_count * sizeof(PackedTriangle)) {
+      spdlog::warn("TriMeshBVH: ignoring stale or corrupt cache file {}",
+                   filepath);
+      return false;
+    }
+    data += sizeof(header);
+    nodes_.resize(header.node_count);
+    memcpy(nodes_.data(), data,
+           header.node_count * sizeof(LinearBVH::LinearNode));
+    data += header.node_count * sizeof(LinearBVH::LinearNode);
+    triangles_.resize(header.triangle_count);
+    memcpy(static_cast<void*>(triangles_.data()), data,
+           header.triangle_count * sizeof(PackedTriangle));
+  } catch (const bip::interprocess_exception &e) {
+    spdlog::warn("TriMeshBVH: failed to map cache file {}: {}", filepath,
+                 e.what());
+    return false;
+  }
+
+  // the triangles must be a permutation of the mesh faces (this also
+  // catches hash collisions), and every node must point inside the
+  // arrays, with children stored after their parents
+  auto reject = [&] {
+    spdlog::warn("TriMeshBVH: cache file {} doesn't match the mesh",
+                 filepath);
+    nodes_.clear();
+    triangles_.clear();
+    return false;
+  };
+  vector<bool> is_face_seen(triangles.size(), false);
+  for (const auto &triangle : triangles_) {
+    auto face = static_cast<size_t>(triangle.face);
+    if (triangle.face < 0 || face >= triangles.size() ||
+        is_face_seen[face] || triangle.p0 != triangles[face].p0 ||
+        triangle.p1 != triangles[face].p1 ||
+        triangle.p2 != triangles[face].p2)
+      return reject();
+    is_face_seen[face] = true;
+  }
+  vector<uint> depths(nodes_.size(), 0);
+  depths[0] = 1;
+  depth_ = 0;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    const auto &node = nodes_[i];
+    if (!depths[i])
+      return reject();
+    depth_ = std::max(depth_, depths[i]);
+    if (node.count) {
+      if (node.offset + static_cast<uint64_t>(node.count) > triangles_.size())
+        return reject();
+    } else {
+      if (i + 1 >= nodes_.size() || node.offset <= i + 1 ||
+          node.offset >= nodes_.size() || depths[i + 1] ||
+          depths[node.offset])
+        return reject();
+      depths[i + 1] = depths[node.offset] = depths[i] + 1;
+    }
+  }
+  bbox_.Reset();
+  for (const auto &triangle : triangles_) {
+    bbox_.ExpandBy(triangle.p0);
+    bbox_.ExpandBy(triangle.p1);
+    bbox_.ExpandBy(triangle.p2);
+  }
+  bound_dirty_ = false;
+  return true;
+}
+
+
+bool
+TriMeshBVH::WriteCache(const std::string &filepath, uint64_t key) const
+{
+  boost::system::error_code ec;
+  fs::path path{filepath};
+  fs::create_directories(path.parent_path(), ec);
+  if (ec) {
+    spdlog::warn("TriMeshBVH: failed to create cache directory {}: {}",
+                 path.parent_path().string(), ec.message());
+    return false;
+  }
+  BVHCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kBVHCacheMagic, sizeof(header.magic));
+  header.version = kBVHCacheVersion;
+  header.real_size = sizeof(Real);
+  header.key = key;
+  header.node_count = nodes_.size();
+  header.triangle_count = triangles_.size();
+
+  // write to a uniquely named temporary file and rename it, so that
+  // concurrent runs never read a partial file
+  auto tmp_path = path.parent_path() /
+    fs::unique_path(path.filename().string() + ".%%%%%%%%.tmp");
+  {
+    std::ofstream out(tmp_path.string(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(nodes_.data()),
+              static_cast<streamsize>(nodes_.size() *
+                                      sizeof(LinearBVH::LinearNode)));
+    out.write(reinterpret_cast<const char*>(triangles_.data()),
+              static_cast<streamsize>(triangles_.size() *
+                                      sizeof(PackedTriangle)));
+    if (!out.flush()) {
+      spdlog::warn("TriMeshBVH: failed to write cache file {}",
+                   tmp_path.string());
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+  }
+  fs::rename(tmp_path, path, ec);
+  if (ec) {
+    spdlog::warn("TriMeshBVH: failed to rename {} to {}: {}",
+                 tmp_path.string(), filepath, ec.message());
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,298 @@
+//! \file       trimesh_bvh.h
+//! \brief      TriMeshBVH class
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "core/geometry/surface.h"
+#include "core/geometry/bvh_node.h"
+#include "core/geometry/linear_bvh.h"
+
+namespace olio {
+namespace core {
+
+class Ray;
+class HitRecord;
+class TriMesh;
+
+//! \class TriMeshBVH
+//! \brief Linear BVH over the faces of a triangle mesh, with the
+//!    triangles stored in the leaves
+//! \details Nodes are LinearBVH nodes (see LinearBVH::BuildNodes()).
+//!    Instead of one BVHTriMeshFace object per face, the vertices of
+//!    the faces are copied into one array, in leaf order, so the
+//!    triangles of a leaf are contiguous. Leaves hold up to
+//!    'BVHBuildOptions::max_leaf_size' triangles; the SAH picks the
+//!    size of each leaf. A leaf is tested with a plain loop over its
+//!    triangles (Triangle::RayTriangleHit(), no virtual calls), and the
+//!    hit record is only filled in for the closest hit, once
+//!    traversal is done.
+//!    With 'BVHBuildOptions::quantized_nodes', the nodes are stored as
+//!    QuantizedNode's instead, with 8-bit child bounds that are decoded
+//!    during traversal, and 'BVHBuildOptions::veb_layout' puts them in
+//!    van Emde Boas order.
+class TriMeshBVH : public Surface {
+public:
+  OLIO_NODE(TriMeshBVH)
+
+  explicit TriMeshBVH(const std::string &name=std::string());
+
+  //! \brief Check if ray intersects with surface
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in] hit_record Resulting hit record if ray intersected with surface
+  //! \return True if ray intersected with surface
+  bool Hit(const Ray &ray, Real tmin, Real tmax,
+           HitRecord &hit_record) override;
+
+  //! \brief Check which rays of a packet intersect with surface
+  //! \details Same traversal as LinearBVH::HitPacket(); leaf triangles
+  //!    are tested with Triangle::RayTriangleHitPacket(). Returns the
+  //!    same hits as Hit().
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t of each lane
+  //! \param[out] hit_records Hit records, one per lane
+  //! \return Mask of the active lanes that intersected with surface
+  PacketMask HitPacket(const RayPacket &packet, const PacketMask &active,
+                       Real tmin, PacketReal &tmax,
+                       HitRecord *hit_records) override;
+
+  //! \brief Check if any triangle of the mesh blocks a ray
+  //! \details Same traversal as Hit(), stopping at the first triangle
+  //!    that the ray intersects
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with a triangle
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  //! \brief Check which rays of a packet are blocked by the mesh
+  //! \details Same traversal as HitPacket(); lanes drop out of the
+  //!    packet once they are blocked.
+  //! \param[in] packet Rays to check intersection against
+  //! \param[in] active Lanes to test
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t of each lane
+  //! \return Mask of the active lanes that intersected with a triangle
+  PacketMask OccludedPacket(const RayPacket &packet, const PacketMask &active,
+                            Real tmin, const PacketReal &tmax) override;
+
+  AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Compute the SAH cost of the BVH
+  //! \details Same cost model as LinearBVH::ComputeSAHCost()
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  Real ComputeSAHCost(const BVHBuildOptions &options) const;
+
+  //! \brief Compute the size and quality of the BVH
+  //! \details Quantized trees are measured with their decoded bounds
+  //! \param[in] options Node and intersection test costs
+  //! \return Tree statistics (without the build time)
+  BVHTreeStats ComputeTreeStats(const BVHBuildOptions &options) const;
+
+  //! \brief Get the number of nodes
+  //! \return Node count (quantized nodes: interior nodes only)
+  inline size_t GetNodeCount() const {
+    return IsQuantized() ? quantized_nodes_.size() : nodes_.size();
+  }
+
+  //! \brief Check if the nodes are quantized
+  //! \return True if the BVH stores QuantizedNode's
+  inline bool IsQuantized() const {return !quantized_nodes_.empty();}
+
+  //! \brief Get the memory used by the nodes and the triangles
+  //! \return Memory in bytes
+  size_t GetMemoryUsage() const;
+
+  //! \brief Get the number of leaves of each size
+  //! \return Leaf counts, indexed by triangle count
+  std::vector<size_t> GetLeafSizeHistogram() const;
+
+  //! \brief Get the tree depth
+  //! \return Depth (a single leaf node has depth 1)
+  inline uint GetDepth() const {return depth_;}
+
+  //! \brief Build a BVH over the faces of a mesh
+  //! \details Uses the SAH or LBVH splits of 'options.split_method'
+  //!    (other split methods use SAH splits). The BVH refers to the
+  //!    mesh to fill in hit records, so it must not outlive it.
+  //! \param[in] mesh Triangle mesh
+  //! \param[in] options Builder settings
+  //! \param[in] name Tree name
+  //! \return Built BVH (nullptr if the mesh has no faces)
+  static TriMeshBVH::Ptr BuildBVH(TriMesh &mesh,
+                                  const BVHBuildOptions &options,
+                                  const std::string &name=std::string());
+
+  //! \brief Set the directory of the BVH cache
+  //! \details BuildBVH() looks up each mesh in this directory before
+  //!    building its BVH, and stores the BVHs it builds there. Cache
+  //!    files are named after a hash of the triangles and of the
+  //!    builder settings that affect the tree, so a changed mesh or
+  //!    builder setting misses the cache instead of reading a stale
+  //!    BVH. An empty directory disables the cache.
+  //! \param[in] directory Cache directory (created if needed)
+  static void SetCacheDirectory(const std::string &directory);
+
+  //! \brief Get the directory of the BVH cache
+  //! \return Cache directory (empty: no cache)
+  static const std::string& GetCacheDirectory() {return cache_directory_;}
+protected:
+  //! \struct PackedTriangle
+  //! \brief Vertices of a mesh face
+  struct PackedTriangle {
+    Vec3r p0;       //!< first vertex
+    Vec3r p1;       //!< second vertex
+    Vec3r p2;       //!< third vertex
+    int face;       //!< face index in the mesh
+  };
+
+  //! \struct QuantizedNode
+  //! \brief 24-byte interior node, with the bounds of both children
+  //! \details Child bounds are 8-bit codes on a grid over the node's
+  //!    own bounds, rounded outwards. A node's bounds are decoded from
+  //!    its parent's codes during traversal; only the root bounds are
+  //!    stored as coordinates. Leaves are stored in their parent, so
+  //!    there is one node per interior node of the linear tree.
+  struct QuantizedNode {
+    uint8_t qmin[2][3];  //!< child min codes (rounded down)
+    uint8_t qmax[2][3];  //!< child max codes (rounded up)
+    uint32_t child[2];   //!< leaf: kQuantizedLeaf | first triangle;
+                         //!< interior: node index
+    uint8_t count[2];    //!< leaf: number of triangles
+    uint8_t padding[2];  //!< unused
+  };
+
+  //! \struct ClosestHit
+  //! \brief Closest triangle hit found so far
+  struct ClosestHit {
+    int face{-1};   //!< face index (-1: no hit)
+    Real ray_t{0};  //!< t of the hit point
+    Vec2r uv;       //!< UV coordinates of the hit point inside the face
+  };
+
+  //! \brief Find the closest hit among the triangles of a leaf
+  //! \param[in] first Index of the leaf's first triangle
+  //! \param[in] count Number of triangles of the leaf
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in,out] tmax Maximum value for acceptable t; lowered to the
+  //!    t of each hit found
+  //! \param[in,out] closest Closest hit; updated if a closer one is found
+  //! \param[in] any_hit Stop at the first hit found
+  //! \return True if ray intersected with a triangle of the leaf
+  bool HitTriangles(uint32_t first, uint32_t count, const Ray &ray,
+                    Real tmin, Real &tmax, ClosestHit &closest,
+                    bool any_hit) const;
+
+  //! \brief Find the closest hit in a subtree
+  //! \details Same traversal as LinearBVH (see HitBinaryBVH())
+  //! \param[in] root Index of the subtree's root node
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in,out] closest Closest hit; updated if a closer one is found
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a triangle of the subtree
+  bool HitSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                  ClosestHit &closest, BVHTraversalStats &stats) const;
+
+  //! \brief Check if any triangle of a subtree blocks a ray
+  //! \details Same traversal as LinearBVH (see OccludedBinaryBVH())
+  //! \param[in] root Index of the subtree's root node
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \return True if ray intersected with a triangle of the subtree
+  bool OccludedSubtree(uint32_t root, const Ray &ray, Real tmin, Real tmax,
+                       BVHTraversalStats &stats) const;
+
+  //! \brief Find the closest hit in the quantized nodes
+  //! \details Same node order as HitSubtree(); the bounds of each
+  //!    node's children are decoded from the codes when the node is
+  //!    visited.
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in,out] closest Closest hit; updated if a closer one is found
+  //! \param[in,out] stats Traversal statistics to add to
+  //! \param[in] any_hit Stop at the first hit found (see Occluded())
+  //! \return True if ray intersected with a triangle
+  bool HitQuantized(const Ray &ray, Real tmin, Real tmax,
+                    ClosestHit &closest, BVHTraversalStats &stats,
+                    bool any_hit=false) const;
+
+  //! \brief Replace the linear nodes with quantized nodes
+  //! \details Keeps the linear nodes if the tree is a single leaf, if
+  //!    a leaf has more triangles than its 8-bit count can hold, or if
+  //!    rounding errors keep some bounds from being encoded
+  //!    conservatively.
+  //! \param[in] options Node and intersection test costs (for the log)
+  //! \return True if the nodes were quantized
+  bool Quantize(const BVHBuildOptions &options);
+
+  //! \brief Encode an interior linear node and its subtree
+  //! \param[in] index Linear node index
+  //! \param[in] lo Min corner of the node's decoded bounds
+  //! \param[in] step Grid step of the node's decoded bounds
+  //! \return False if some bounds can't be encoded conservatively
+  bool QuantizeSubtree(uint32_t index, const Vec3r &lo, const Vec3r &step);
+
+  //! \brief Put the quantized nodes in van Emde Boas order
+  //! \details QuantizeSubtree() stores the nodes depth-first; the tree
+  //!    is unchanged, only the node indices are (see
+  //!    ComputeVanEmdeBoasOrder()).
+  void ReorderQuantizedNodes();
+
+  //! \brief Decode the quantized nodes into linear nodes
+  //! \details The decoded bounds are the (looser) bounds traversal
+  //!    tests, e.g., to compute the SAH cost of the quantized tree.
+  //! \return Linear nodes, depth-first
+  LinearBVH::NodeArray DecodeQuantizedNodes() const;
+
+  //! \brief Compute the cache key of a mesh BVH
+  //! \param[in] triangles Mesh triangles, in face order
+  //! \param[in] options Builder settings
+  //! \return 64-bit hash of the triangles and of the settings
+  static uint64_t ComputeCacheKey(const std::vector<PackedTriangle> &triangles,
+                                  const BVHBuildOptions &options);
+
+  //! \brief Read the nodes and triangles from a cache file
+  //! \details The file is memory-mapped and checked against the key
+  //!    and the mesh triangles before it is copied into the BVH.
+  //! \param[in] filepath Cache file
+  //! \param[in] key Cache key of the mesh and builder settings
+  //! \param[in] triangles Mesh triangles, in face order
+  //! \return False if the file is missing, stale, or corrupt
+  bool ReadCache(const std::string &filepath, uint64_t key,
+                 const std::vector<PackedTriangle> &triangles);
+
+  //! \brief Write the nodes and triangles to a cache file
+  //! \param[in] filepath Cache file
+  //! \param[in] key Cache key of the mesh and builder settings
+  //! \return True on success
+  bool WriteCache(const std::string &filepath, uint64_t key) const;
+
+  static std::string cache_directory_;     //!< BVH cache (empty: none)
+
+  TriMesh *mesh_{nullptr};                 //!< mesh of the triangles
+  LinearBVH::NodeArray nodes_;             //!< nodes, depth-first
+  std::vector<QuantizedNode> quantized_nodes_;  //!< quantized nodes,
+                                                //!< depth-first (replace
+                                                //!< 'nodes_')
+  Vec3r quantized_min_;                    //!< root bounds min
+  Vec3r quantized_max_;                    //!< root bounds max
+  std::vector<PackedTriangle> triangles_;  //!< triangles, in leaf order
+  uint depth_{0};                          //!< tree depth (root: 1)
+};
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,975 @@
+//! \file       wide_bvh.cc
+//! \brief      WideBVH class
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <unordered_set>
+#include <spdlog/spdlog.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "core/ray.h"
+#include "core/geometry/wide_bvh.h"
+#include "core/geometry/bvh_traversal.h"
+#include "core/geometry/bvh_layout.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! Depth up to which Refit() refits the children of a node in parallel
+const uint kParallelRefitDepth = 3;
+
+#if defined(__AVX__) && !defined(OLIO_USE_SINGLE_PRECISION)
+//! \brief Clip the ray intervals of four children to their slabs on
+//!    one axis
+//! \param[in] near_bounds Near planes of the children
+//! \param[in] far_bounds Far planes of the children
+//! \param[in] origin Ray origin on the axis
+//! \param[in] inv_direction 1 / ray direction on the axis
+//! \param[in,out] t_near Entry distances
+//! \param[in,out] t_far Exit distances
+inline void
+ClipSlab4(const float *near_bounds, const float *far_bounds,
+          __m256d origin, __m256d inv_direction, __m256d &t_near,
+          __m256d &t_far)
+{
+  // _mm256_max_pd(a, b) is a > b ? a : b and _mm256_min_pd(a, b) is
+  // a < b ? a : b, so NaNs (0 * inf) are dropped exactly like in the
+  // scalar slab test
+  __m256d t0 = _mm256_mul_pd(
+    _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(near_bounds)), origin),
+    inv_direction);
+  __m256d t1 = _mm256_mul_pd(
+    _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(far_bounds)), origin),
+    inv_direction);
+  t_near = _mm256_max_pd(t0, t_near);
+  t_far = _mm256_min_pd(t1, t_far);
+}
+#elif defined(__SSE2__) && !defined(OLIO_USE_SINGLE_PRECISION)
+//! \brief Load two floats and convert them to doubles
+//! \param[in] values Values (need not be aligned)
+//! \return Converted values
+inline __m128d
+LoadFloat2(const float *values)
+{
+  return _mm_cvtps_pd(_mm_castsi128_ps(
+    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values))));
+}
+
+
+//! \brief Clip the ray intervals of two children to their slabs on
+//!    one axis (see the AVX version)
+inline void
+ClipSlab2(const float *near_bounds, const float *far_bounds,
+          __m128d origin, __m128d inv_direction, __m128d &t_near,
+          __m128d &t_far)
+{
+  __m128d t0 = _mm_mul_pd(_mm_sub_pd(LoadFloat2(near_bounds), origin),
+                          inv_direction);
+  __m128d t1 = _mm_mul_pd(_mm_sub_pd(LoadFloat2(far_bounds), origin),
+                          inv_direction);
+  t_near = _mm_max_pd(t0, t_near);
+  t_far = _mm_min_pd(t1, t_far);
+}
+#elif defined(__SSE2__)
+#if defined(__AVX__)
+//! \brief Clip the ray intervals of eight children to their slabs on
+//!    one axis (see the double precision version)
+inline void
+ClipSlab8(const float *near_bounds, const float *far_bounds,
+          __m256 origin, __m256 inv_direction, __m256 &t_near,
+          __m256 &t_far)
+{
+  __m256 t0 = _mm256_mul_ps(
+    _mm256_sub_ps(_mm256_loadu_ps(near_bounds), origin), inv_direction);
+  __m256 t1 = _mm256_mul_ps(
+    _mm256_sub_ps(_mm256_loadu_ps(far_bounds), origin), inv_direction);
+  t_near = _mm256_max_ps(t0, t_near);
+  t_far = _mm256_min_ps(t1, t_far);
+}
+#endif
+
+
+//! \brief Clip the ray intervals of four children to their slabs on
+//!    one axis (see the double precision version)
+inline void
+ClipSlab4(const float *near_bounds, const float *far_bounds,
+          __m128 origin, __m128 inv_direction, __m128 &t_near,
+          __m128 &t_far)
+{
+  __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_bounds), origin),
+                         inv_direction);
+  __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_bounds), origin),
+                         inv_direction);
+  t_near = _mm_max_ps(t0, t_near);
+  t_far = _mm_min_ps(t1, t_far);
+}
+#endif
+
+}  // namespace
+
+template <uint Width>
+WideBVH<Width>::WideBVH(const std::string &name) :
+  Surface{}
+{
+  name_ = name.size() ? name : "WideBVH";
+}
+
+
+template <uint Width>
+bool
+WideBVH<Width>::Hit(const Ray &ray, Real tmin, Real tmax,
+                    HitRecord &hit_record)
+{
+  if (nodes_.empty())
+    return false;
+  const Vec3r &origin = ray.GetOrigin();
+  const Vec3r &dir = ray.GetDirection();
+  const Vec3r inv_direction{1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  //! \struct StackEntry
+  //! \brief Child to visit
+  struct StackEntry {
+    uint32_t offset;  //!< leaf: first surface; interior: node
+    uint32_t count;   //!< leaf: number of surfaces; interior: 0
+    Real t_entry;     //!< distance at which the ray enters the child
+  };
+
+  // each visited node replaces itself with at most 'Width' children
+  TraversalStack<StackEntry, kWideLocalStackSize> stack{
+    static_cast<size_t>(Width - 1) * depth_ + 1};
+
+  LocalTraversalStats stats;
+  ++stats.queries;
+  bool is_hit = false;
+  stack.Push({0, 0, tmin});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+
+    // the ray enters the child beyond the closest hit found since the
+    // child was pushed
+    if (entry.t_entry > tmax) {
+      ++stats.culled_nodes;
+      continue;
+    }
+
+    ++stats.node_visits;
+    if (entry.count) {
+      stats.surface_tests += entry.count;
+      for (uint32_t i = entry.offset; i < entry.offset + entry.count; ++i) {
+        if (surfaces_[i]->Hit(ray, tmin, tmax, hit_record)) {
+          tmax = hit_record.GetRayT();
+          is_hit = true;
+        }
+      }
+      continue;
+    }
+
+    // slab test against all children at once
+    const WideNode &node = nodes_[entry.offset];
+    Real t_near[Width];
+    Real t_far[Width];
+    HitChildren(node, origin, inv_direction, tmin, tmax, t_near, t_far);
+
+    // sort the entered children by entry distance, and push them so
+    // that the nearest one is visited first
+    uint order[Width];
+    uint hit_count = 0;
+    for (uint j = 0; j < Width; ++j) {
+      if (t_far[j] < t_near[j])
+        continue;
+      uint k = hit_count++;
+      for (; k > 0 && t_near[order[k - 1]] > t_near[j]; --k)
+        order[k] = order[k - 1];
+      order[k] = j;
+    }
+    while (hit_count) {
+      uint j = order[--hit_count];
+      stack.Push({node.offset[j], node.count[j], t_near[j]});
+    }
+  }
+  return is_hit;
+}
+
+
+template <uint Width>
+bool
+WideBVH<Width>::Occluded(const Ray &ray, Real tmin, Real tmax)
+{
+  if (nodes_.empty())
+    return false;
+  const Vec3r &origin = ray.GetOrigin();
+  const Vec3r &dir = ray.GetDirection();
+  const Vec3r inv_direction{1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]};
+
+  //! \struct StackEntry
+  //! \brief Child to visit
+  struct StackEntry {
+    uint32_t offset;  //!< leaf: first surface; interior: node
+    uint32_t count;   //!< leaf: number of surfaces; interior: 0
+  };
+  TraversalStack<StackEntry, kWideLocalStackSize> stack{
+    static_cast<size_t>(Width - 1) * depth_ + 1};
+
+  // any hit ends the query, so the entered children aren't sorted
+  LocalTraversalStats stats;
+  ++stats.queries;
+  stack.Push({0, 0});
+  while (!stack.IsEmpty()) {
+    const StackEntry entry = stack.Pop();
+    ++stats.node_visits;
+    if (entry.count) {
+      for (uint32_t i = entry.offset; i < entry.offset + entry.count; ++i) {
+        ++stats.surface_tests;
+        if (surfaces_[i]->Occluded(ray, tmin, tmax))
+          return true;
+      }
+      continue;
+    }
+    const WideNode &node = nodes_[entry.offset];
+    Real t_near[Width];
+    Real t_far[Width];
+    HitChildren(node, origin, inv_direction, tmin, tmax, t_near, t_far);
+    for (uint j = Width; j-- > 0;) {
+      if (t_far[j] >= t_near[j])
+        stack.Push({node.offset[j], node.count[j]});
+    }
+  }
+  return false;
+}
+
+
+template <uint Width>
+AABB
+WideBVH<Width>::GetBoundingBox(bool /*force_recompute*/)
+{
+  return bbox_;
+}
+
+
+template <uint Width>
+size_t
+WideBVH<Width>::GetMemoryUsage() const
+{
+  return nodes_.capacity() * sizeof(WideNode) +
+    surfaces_.capacity() * sizeof(Surface::Ptr);
+}
+
+
+template <uint Width>
+inline void
+WideBVH<Width>::HitChildren(const WideNode &node, const Vec3r &origin,
+                            const Vec3r &inv_direction, Real tmin, Real tmax,
+                            Real *t_near, Real *t_far)
+{
+  // the near and far planes of each axis only depend on the ray
+  // direction
+  const float *near_bounds[3];
+  const float *far_bounds[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    bool is_negative = inv_direction[axis] < 0.0f;
+    near_bounds[axis] = is_negative ? node.bmax[axis] : node.bmin[axis];
+    far_bounds[axis] = is_negative ? node.bmin[axis] : node.bmax[axis];
+  }
+
+#if defined(__AVX__) && !defined(OLIO_USE_SINGLE_PRECISION)
+  // four children per register
+  static_assert(Width % 4 == 0, "Width must be a multiple of 4");
+  const __m256d origin_x = _mm256_set1_pd(origin[0]);
+  const __m256d origin_y = _mm256_set1_pd(origin[1]);
+  const __m256d origin_z = _mm256_set1_pd(origin[2]);
+  const __m256d inv_direction_x = _mm256_set1_pd(inv_direction[0]);
+  const __m256d inv_direction_y = _mm256_set1_pd(inv_direction[1]);
+  const __m256d inv_direction_z = _mm256_set1_pd(inv_direction[2]);
+  for (uint j = 0; j < Width; j += 4) {
+    __m256d near = _mm256_set1_pd(tmin);
+    __m256d far = _mm256_set1_pd(tmax);
+    ClipSlab4(near_bounds[0] + j, far_bounds[0] + j, origin_x,
+              inv_direction_x, near, far);
+    ClipSlab4(near_bounds[1] + j, far_bounds[1] + j, origin_y,
+              inv_direction_y, near, far);
+    ClipSlab4(near_bounds[2] + j, far_bounds[2] + j, origin_z,
+              inv_direction_z, near, far);
+    _mm256_storeu_pd(t_near + j, near);
+    _mm256_storeu_pd(t_far + j, far);
+  }
+#elif defined(__SSE2__) && !defined(OLIO_USE_SINGLE_PRECISION)
+  // two children per register
+  static_assert(Width % 2 == 0, "Width must be a multiple of 2");
+  const __m128d origin_x = _mm_set1_pd(origin[0]);
+  const __m128d origin_y = _mm_set1_pd(origin[1]);
+  const __m128d origin_z = _mm_set1_pd(origin[2]);
+  const __m128d inv_direction_x = _mm_set1_pd(inv_direction[0]);
+  const __m128d inv_direction_y = _mm_set1_pd(inv_direction[1]);
+  const __m128d inv_direction_z = _mm_set1_pd(inv_direction[2]);
+  for (uint j = 0; j < Width; j += 2) {
+    __m128d near = _mm_set1_pd(tmin);
+    __m128d far = _mm_set1_pd(tmax);
+    ClipSlab2(near_bounds[0] + j, far_bounds[0] + j, origin_x,
+              inv_direction_x, near, far);
+    ClipSlab2(near_bounds[1] + j, far_bounds[1] + j, origin_y,
+              inv_direction_y, near, far);
+    ClipSlab2(near_bounds[2] + j, far_bounds[2] + j, origin_z,
+              inv_direction_z, near, far);
+    _mm_storeu_pd(t_near + j, near);
+    _mm_storeu_pd(t_far + j, far);
+  }
+#elif defined(__SSE2__)
+  // four children per register (eight with AVX, for 8-wide nodes)
+  static_assert(Width % 4 == 0, "Width must be a multiple of 4");
+#if defined(__AVX__)
+  if (Width % 8 == 0) {
+    const __m256 origin_x = _mm256_set1_ps(origin[0]);
+    const __m256 origin_y = _mm256_set1_ps(origin[1]);
+    const __m256 origin_z = _mm256_set1_ps(origin[2]);
+    const __m256 inv_direction_x = _mm256_set1_ps(inv_direction[0]);
+    const __m256 inv_direction_y = _mm256_set1_ps(inv_direction[1]);
+    const __m256 inv_direction_z = _mm256_set1_ps(inv_direction[2]);
+    for (uint j = 0; j < Width; j += 8) {
+      __m256 near = _mm256_set1_ps(tmin);
+      __m256 far = _mm256_set1_ps(tmax);
+      ClipSlab8(near_bounds[0] + j, far_bounds[0] + j, origin_x,
+                inv_direction_x, near, far);
+      ClipSlab8(near_bounds[1] + j, far_bounds[1] + j, origin_y,
+                inv_direction_y, near, far);
+      ClipSlab8(near_bounds[2] + j, far_bounds[2] + j, origin_z,
+                inv_direction_z, near, far);
+      _mm256_storeu_ps(t_near + j, near);
+      _mm256_storeu_ps(t_far + j, far);
+    }
+    return;
+  }
+#endif
+  const __m128 origin_x = _mm_set1_ps(origin[0]);
+  const __m128 origin_y = _mm_set1_ps(origin[1]);
+  const __m128 origin_z = _mm_set1_ps(origin[2]);
+  const __m128 inv_direction_x = _mm_set1_ps(inv_direction[0]);
+  const __m128 inv_direction_y = _mm_set1_ps(inv_direction[1]);
+  const __m128 inv_direction_z = _mm_set1_ps(inv_direction[2]);
+  for (uint j = 0; j < Width; j += 4) {
+    __m128 near = _mm_set1_ps(tmin);
+    __m128 far = _mm_set1_ps(tmax);
+    ClipSlab4(near_bounds[0] + j, far_bounds[0] + j, origin_x,
+              inv_direction_x, near, far);
+    ClipSlab4(near_bounds[1] + j, far_bounds[1] + j, origin_y,
+              inv_direction_y, near, far);
+    ClipSlab4(near_bounds[2] + j, far_bounds[2] + j, origin_z,
+              inv_direction_z, near, far);
+    _mm_storeu_ps(t_near + j, near);
+    _mm_storeu_ps(t_far + j, far);
+  }
+#else
+  for (uint j = 0; j < Width; ++j) {
+    t_near[j] = tmin;
+    t_far[j] = tmax;
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    const Real axis_origin = origin[axis];
+    const Real axis_inv_direction = inv_direction[axis];
+    for (uint j = 0; j < Width; ++j) {
+      Real t0 = (static_cast<Real>(near_bounds[axis][j]) - axis_origin) *
+        axis_inv_direction;
+      Real t1 = (static_cast<Real>(far_bounds[axis][j]) - axis_origin) *
+        axis_inv_direction;
+      t_near[j] = t0 > t_near[j] ? t0 : t_near[j];
+      t_far[j] = t1 < t_far[j] ? t1 : t_far[j];
+    }
+  }
+#endif
+}
+
+
+template <uint Width>
+Real
+WideBVH<Width>::GetChildSurfaceArea(const WideNode &node, uint child)
+{
+  if (node.bmin[0][child] > node.bmax[0][child])
+    return 0;
+  Real extent[3];
+  for (int axis = 0; axis < 3; ++axis)
+    extent[axis] = static_cast<Real>(node.bmax[axis][child]) -
+      static_cast<Real>(node.bmin[axis][child]);
+  return 2 * (extent[0] * extent[1] + extent[1] * extent[2] +
+              extent[2] * extent[0]);
+}
+
+
+template <uint Width>
+AABB
+WideBVH<Width>::GetChildrenBounds(const WideNode &node)
+{
+  AABB bbox;
+  for (uint j = 0; j < Width; ++j) {
+    if (node.bmin[0][j] > node.bmax[0][j])
+      continue;
+    bbox.ExpandBy(Vec3r{node.bmin[0][j], node.bmin[1][j], node.bmin[2][j]});
+    bbox.ExpandBy(Vec3r{node.bmax[0][j], node.bmax[1][j], node.bmax[2][j]});
+  }
+  return bbox;
+}
+
+
+template <uint Width>
+Real
+WideBVH<Width>::ComputeSAHCost(const BVHBuildOptions &options) const
+{
+  if (nodes_.empty())
+    return 0;
+
+  Real root_area = GetChildrenBounds(nodes_[0]).GetSurfaceArea();
+  auto probability = [root_area](Real area) {
+    return root_area > 0 ? area / root_area : 1;
+  };
+
+  // nodes with the surface areas of their bounds
+  Real cost = 0;
+  vector<pair<uint32_t, Real>> stack{{0, root_area}};
+  while (!stack.empty()) {
+    auto entry = stack.back();
+    stack.pop_back();
+    cost += probability(entry.second) * options.traversal_cost;
+    const WideNode &node = nodes_[entry.first];
+    for (uint j = 0; j < Width; ++j) {
+      if (node.bmin[0][j] > node.bmax[0][j])
+        continue;
+      Real area = GetChildSurfaceArea(node, j);
+      if (node.count[j])
+        cost += probability(area) * options.intersection_cost *
+          static_cast<Real>(node.count[j]);
+      else
+        stack.emplace_back(node.offset[j], area);
+    }
+  }
+  return cost;
+}
+
+
+template <uint Width>
+BVHTreeStats
+WideBVH<Width>::ComputeTreeStats(const BVHBuildOptions &options) const
+{
+  BVHTreeStats stats;
+  stats.name = name_;
+  stats.type = "WideBVH" + to_string(Width);
+  stats.node_count = nodes_.size();
+  vector<pair<uint32_t, uint>> stack;
+  if (!nodes_.empty())
+    stack.emplace_back(0, 1);
+  while (!stack.empty()) {
+    auto entry = stack.back();
+    stack.pop_back();
+    const WideNode &node = nodes_[entry.first];
+    for (uint j = 0; j < Width; ++j) {
+      if (node.count[j])
+        stats.AddLeaf(entry.second + 1, node.count[j]);
+      else if (node.bmin[0][j] <= node.bmax[0][j])
+        stack.emplace_back(node.offset[j], entry.second + 1);
+    }
+  }
+  stats.sah_cost = ComputeSAHCost(options);
+  stats.memory_bytes = GetMemoryUsage();
+  return stats;
+}
+
+
+template <uint Width>
+typename WideBVH<Width>::Ptr
+WideBVH<Width>::BuildBVH(std::vector<Surface::Ptr> surfaces,
+                         const BVHBuildOptions &options,
+                         const std::string &name)
+{
+  auto bvh = LinearBVH::BuildBVH(std::move(surfaces), options, name);
+  if (!bvh)
+    return nullptr;
+  auto wide_bvh = Collapse(bvh, name);
+  if (wide_bvh && options.veb_layout)
+    wide_bvh->ReorderNodes();
+  return wide_bvh;
+}
+
+
+template <uint Width>
+typename WideBVH<Width>::Ptr
+WideBVH<Width>::Collapse(const LinearBVH::Ptr &bvh, const std::string &name,
+                         bool quiet)
+{
+  if (!bvh || bvh->GetNodes().empty())
+    return nullptr;
+  const auto &binary_nodes = bvh->GetNodes();
+  auto start_time = chrono::steady_clock::now();
+  auto wide_bvh = WideBVH::Create(name);
+  wide_bvh->surfaces_ = bvh->GetSurfaces();
+  wide_bvh->bbox_ = bvh->GetBoundingBox();
+  wide_bvh->bound_dirty_ = false;
+  if (binary_nodes[0].count) {
+    // the binary root is a leaf: one node with a single leaf child
+    WideNode node;
+    for (int axis = 0; axis < 3; ++axis) {
+      fill(node.bmin[axis], node.bmin[axis] + Width,
+           numeric_limits<float>::infinity());
+      fill(node.bmax[axis], node.bmax[axis] + Width,
+           -numeric_limits<float>::infinity());
+      node.bmin[axis][0] = binary_nodes[0].bmin[axis];
+      node.bmax[axis][0] = binary_nodes[0].bmax[axis];
+    }
+    fill(node.offset, node.offset + Width, 0);
+    fill(node.count, node.count + Width, 0);
+    node.offset[0] = binary_nodes[0].offset;
+    node.count[0] = binary_nodes[0].count;
+    wide_bvh->nodes_.push_back(node);
+    wide_bvh->depth_ = 1;
+  } else {
+    wide_bvh->nodes_.reserve(binary_nodes.size() / (Width / 2) + 1);
+    wide_bvh->CollapseNode(*bvh, 0, 1);
+    wide_bvh->nodes_.shrink_to_fit();
+  }
+  double collapse_time = chrono::duration<double>(
+    chrono::steady_clock::now() - start_time).count();
+  spdlog::log(quiet ? spdlog::level::debug : spdlog::level::info,
+              "Collapsed BVH ({}) to {}-wide: {} nodes (binary: {}), "
+              "depth {} (binary: {}), {:.1f} KiB ({} bytes per node), "
+              "{:.3f}s", name, Width, wide_bvh->GetNodeCount(),
+              binary_nodes.size(), wide_bvh->depth_, bvh->GetDepth(),
+              static_cast<double>(wide_bvh->GetMemoryUsage()) / 1024,
+              sizeof(WideNode), collapse_time);
+  return wide_bvh;
+}
+
+
+template <uint Width>
+uint32_t
+WideBVH<Width>::CollapseNode(const LinearBVH &bvh, uint32_t binary_index,
+                             uint depth)
+{
+  depth_ = std::max(depth_, depth);
+  const auto &binary_nodes = bvh.GetNodes();
+
+  // pull up the grandchildren of the largest interior children
+  vector<uint32_t> children{binary_index + 1,
+                            binary_nodes[binary_index].offset};
+  while (children.size() < static_cast<size_t>(Width)) {
+    int best = -1;
+    Real best_area = -1;
+    for (size_t i = 0; i < children.size(); ++i) {
+      const auto &child = binary_nodes[children[i]];
+      if (child.count || child.bmin[0] > child.bmax[0])
+        continue;
+      Real area = child.GetSurfaceArea();
+      if (area > best_area) {
+        best_area = area;
+        best = static_cast<int>(i);
+      }
+    }
+    if (best < 0)
+      break;
+    auto best_index = static_cast<size_t>(best);
+    uint32_t expanded = children[best_index];
+    children[best_index] = expanded + 1;
+    children.insert(children.begin() + best + 1,
+                    binary_nodes[expanded].offset);
+  }
+
+  // fill in the node; interior children get their index below
+  WideNode node;
+  for (int axis = 0; axis < 3; ++axis) {
+    fill(node.bmin[axis], node.bmin[axis] + Width,
+         numeric_limits<float>::infinity());
+    fill(node.bmax[axis], node.bmax[axis] + Width,
+         -numeric_limits<float>::infinity());
+  }
+  fill(node.offset, node.offset + Width, 0);
+  fill(node.count, node.count + Width, 0);
+  for (size_t j = 0; j < children.size(); ++j) {
+    const auto &child = binary_nodes[children[j]];
+    if (!child.count && child.bmin[0] > child.bmax[0])
+      continue;  // empty subtree: leave the slot unused
+    for (int axis = 0; axis < 3; ++axis) {
+      node.bmin[axis][j] = child.bmin[axis];
+      node.bmax[axis][j] = child.bmax[axis];
+    }
+    node.offset[j] = child.offset;
+    node.count[j] = child.count;
+  }
+  auto index = static_cast<uint32_t>(nodes_.size());
+  nodes_.push_back(node);
+  for (size_t j = 0; j < children.size(); ++j) {
+    if (nodes_[index].count[j] || nodes_[index].bmin[0][j] >
+        nodes_[index].bmax[0][j])
+      continue;
+    uint32_t child_index = CollapseNode(bvh, children[j], depth + 1);
+    nodes_[index].offset[j] = child_index;
+  }
+  return index;
+}
+
+
+template <uint Width>
+void
+WideBVH<Width>::ReorderNodes()
+{
+  auto start_time = chrono::steady_clock::now();
+  vector<uint32_t> children(nodes_.size() * Width, kNoChildNode);
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    const WideNode &node = nodes_[i];
+    for (uint j = 0; j < Width; ++j) {
+      if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+        children[i * Width + j] = node.offset[j];
+    }
+  }
+  auto order = ComputeVanEmdeBoasOrder(children, Width);
+  NodeArray nodes(nodes_.size());
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    WideNode &node = nodes[order[i]];
+    node = nodes_[i];
+    for (uint j = 0; j < Width; ++j) {
+      if (children[i * Width + j] != kNoChildNode)
+        node.offset[j] = order[node.offset[j]];
+    }
+  }
+  nodes_.swap(nodes);
+
+  // the SAH costs of a refit BVH move with their nodes
+  if (!sah_costs_.empty()) {
+    vector<float> sah_costs(sah_costs_.size());
+    vector<float> build_sah_costs(build_sah_costs_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      sah_costs[order[i]] = sah_costs_[i];
+      build_sah_costs[order[i]] = build_sah_costs_[i];
+    }
+    sah_costs_.swap(sah_costs);
+    build_sah_costs_.swap(build_sah_costs);
+  }
+  spdlog::info("Reordered {}-wide BVH nodes ({}) to van Emde Boas order: "
+               "{:.3f}s", Width, name_, chrono::duration<double>(
+                 chrono::steady_clock::now() - start_time).count());
+}
+
+
+template <uint Width>
+BVHRefitStats
+WideBVH<Width>::Refit(const BVHBuildOptions &options)
+{
+  BVHRefitStats stats;
+  if (nodes_.empty())
+    return stats;
+  RunInArena(options, [&] {
+    // the node bounds are still the built ones the first time
+    if (sah_costs_.size() != nodes_.size()) {
+      sah_costs_.resize(nodes_.size());
+      build_sah_costs_.resize(nodes_.size());
+      ResetSAHCosts(0, options);
+    }
+
+    // find the moved surfaces, then update them one at a time, since
+    // SBVH leaves may share surfaces
+    vector<char> dirty_slots(surfaces_.size(), 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, surfaces_.size(), 1024),
+                      [&](const tbb::blocked_range<size_t> &range) {
+      for (size_t i = range.begin(); i < range.end(); ++i)
+        dirty_slots[i] = surfaces_[i]->IsBoundDirty();
+    });
+    unordered_set<const Surface*> moved_surfaces;
+    for (size_t i = 0; i < surfaces_.size(); ++i) {
+      if (dirty_slots[i] && moved_surfaces.insert(surfaces_[i].get()).second)
+        surfaces_[i]->GetBoundingBox();
+    }
+    stats.moved_surfaces = moved_surfaces.size();
+    if (!stats.moved_surfaces)
+      return;
+
+    // refit bottom up, then rebuild the degraded subtrees and drop the
+    // nodes they replaced
+    vector<char> dirty_nodes(nodes_.size(), 0);
+    stats.refit_nodes = RefitNode(0, dirty_slots, 1, options, dirty_nodes,
+                                  bbox_);
+    vector<uint32_t> subtrees;
+    FindDegraded(0, dirty_nodes, options, subtrees);
+    if (subtrees.empty())
+      return;
+    for (auto index : subtrees) {
+      stats.rebuilt_surfaces += RebuildSubtree(index, options);
+      ++stats.rebuilt_subtrees;
+    }
+    dirty_nodes.resize(nodes_.size(), 0);
+    UpdateDirtySAHCosts(0, dirty_nodes, options);
+    CompactNodes();
+  });
+  stats.sah_cost = sah_costs_[0];
+  stats.build_sah_cost = build_sah_costs_[0];
+  spdlog::debug("Refit {}-wide BVH ({}): {} moved surfaces, {} refit nodes, "
+                "{} rebuilt subtrees ({} surfaces), SAH cost {:.3f} (built "
+                "{:.3f})", Width, GetName(), stats.moved_surfaces,
+                stats.refit_nodes, stats.rebuilt_subtrees,
+                stats.rebuilt_surfaces, stats.sah_cost, stats.build_sah_cost);
+  return stats;
+}
+
+
+template <uint Width>
+size_t
+WideBVH<Width>::RefitNode(uint32_t index, const vector<char> &dirty_slots,
+                          uint depth, const BVHBuildOptions &options,
+                          vector<char> &dirty_nodes, AABB &bbox)
+{
+  // each slot is refit on its own: 'below' counts the refit nodes under
+  // an interior slot, 'is_changed' tells whether the slot's bounds did
+  WideNode &node = nodes_[index];
+  size_t below[Width] = {};
+  bool is_changed[Width] = {};
+  auto refit_child = [&](uint j) {
+    AABB child_bbox;
+    if (node.count[j]) {
+      uint32_t end = node.offset[j] + node.count[j];
+      bool is_dirty = false;
+      for (uint32_t i = node.offset[j]; i < end && !is_dirty; ++i)
+        is_dirty = dirty_slots[i] != 0;
+      if (!is_dirty)
+        return;
+      for (uint32_t i = node.offset[j]; i < end; ++i)
+        child_bbox.ExpandBy(surfaces_[i]->GetBoundingBox());
+    } else if (node.bmin[0][j] <= node.bmax[0][j]) {
+      below[j] = RefitNode(node.offset[j], dirty_slots, depth + 1, options,
+                           dirty_nodes, child_bbox);
+      if (!below[j])
+        return;
+    } else {
+      return;  // unused slot
+    }
+    LinearBVH::LinearNode bounds;
+    bounds.SetBounds(child_bbox);
+    for (int axis = 0; axis < 3; ++axis) {
+      node.bmin[axis][j] = bounds.bmin[axis];
+      node.bmax[axis][j] = bounds.bmax[axis];
+    }
+    is_changed[j] = true;
+  };
+  if (depth < kParallelRefitDepth)
+    tbb::parallel_for(0u, Width, refit_child);
+  else
+    for (uint j = 0; j < Width; ++j)
+      refit_child(j);
+
+  size_t count = 0;
+  bool is_node_changed = false;
+  for (uint j = 0; j < Width; ++j) {
+    count += below[j];
+    is_node_changed = is_node_changed || is_changed[j];
+  }
+  bbox = GetChildrenBounds(node);
+  if (!is_node_changed)
+    return 0;
+  sah_costs_[index] = ComputeNodeSAHCost(index, options);
+  dirty_nodes[index] = 1;
+  return count + 1;
+}
+
+
+template <uint Width>
+float
+WideBVH<Width>::ComputeNodeSAHCost(uint32_t index,
+                                   const BVHBuildOptions &options) const
+{
+  const WideNode &node = nodes_[index];
+  Real area = GetChildrenBounds(node).GetSurfaceArea();
+  Real cost = options.traversal_cost;
+  for (uint j = 0; j < Width; ++j) {
+    if (node.bmin[0][j] > node.bmax[0][j])
+      continue;
+    Real child_cost = node.count[j] ?
+      options.intersection_cost * static_cast<Real>(node.count[j]) :
+      static_cast<Real>(sah_costs_[node.offset[j]]);
+    cost += area > 0 ? GetChildSurfaceArea(node, j) * child_cost / area :
+      child_cost;
+  }
+  return static_cast<float>(cost);
+}
+
+
+template <uint Width>
+void
+WideBVH<Width>::ResetSAHCosts(uint32_t index, const BVHBuildOptions &options)
+{
+  const WideNode &node = nodes_[index];
+  for (uint j = 0; j < Width; ++j) {
+    if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+      ResetSAHCosts(node.offset[j], options);
+  }
+  sah_costs_[index] = ComputeNodeSAHCost(index, options);
+  build_sah_costs_[index] = sah_costs_[index];
+}
+
+
+template <uint Width>
+void
+WideBVH<Width>::UpdateDirtySAHCosts(uint32_t index,
+                                    const vector<char> &dirty_nodes,
+                                    const BVHBuildOptions &options)
+{
+  if (!dirty_nodes[index])
+    return;
+  const WideNode &node = nodes_[index];
+  for (uint j = 0; j < Width; ++j) {
+    if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+      UpdateDirtySAHCosts(node.offset[j], dirty_nodes, options);
+  }
+  sah_costs_[index] = ComputeNodeSAHCost(index, options);
+}
+
+
+template <uint Width>
+void
+WideBVH<Width>::FindDegraded(uint32_t index, const vector<char> &dirty_nodes,
+                             const BVHBuildOptions &options,
+                             vector<uint32_t> &subtrees) const
+{
+  if (!dirty_nodes[index])
+    return;
+  if (options.rebuild_threshold > 0 && sah_costs_[index] >
+      options.rebuild_threshold * build_sah_costs_[index]) {
+    subtrees.push_back(index);
+    return;
+  }
+  const WideNode &node = nodes_[index];
+  for (uint j = 0; j < Width; ++j) {
+    if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+      FindDegraded(node.offset[j], dirty_nodes, options, subtrees);
+  }
+}
+
+
+template <uint Width>
+size_t
+WideBVH<Width>::RebuildSubtree(uint32_t index, const BVHBuildOptions &options)
+{
+  // the leaves of a subtree refer to a contiguous range of surfaces
+  auto surface_begin = static_cast<uint32_t>(surfaces_.size());
+  uint32_t surface_end = 0;
+  vector<uint32_t> stack{index};
+  while (!stack.empty()) {
+    const WideNode &node = nodes_[stack.back()];
+    stack.pop_back();
+    for (uint j = 0; j < Width; ++j) {
+      if (node.count[j]) {
+        surface_begin = std::min(surface_begin, node.offset[j]);
+        surface_end = std::max(surface_end, node.offset[j] + node.count[j]);
+      } else if (node.bmin[0][j] <= node.bmax[0][j]) {
+        stack.push_back(node.offset[j]);
+      }
+    }
+  }
+
+  // SBVH leaves may share surfaces
+  vector<Surface::Ptr> surfaces(surfaces_.begin() + surface_begin,
+                                surfaces_.begin() + surface_end);
+  if (options.split_method == BVHSplitMethod::kSBVH) {
+    std::sort(surfaces.begin(), surfaces.end());
+    surfaces.erase(std::unique(surfaces.begin(), surfaces.end()),
+                   surfaces.end());
+  }
+  size_t rebuilt_count = surfaces.size();
+
+  // build the subtree quietly, since refits may rebuild subtrees every
+  // frame
+  auto subtree = Collapse(LinearBVH::BuildBVH(std::move(surfaces), options,
+                                              name_, true), name_, true);
+
+  // shift the leaf offsets past the subtree's surfaces, then splice
+  auto surface_shift = static_cast<int64_t>(subtree->surfaces_.size()) -
+    static_cast<int64_t>(surface_end - surface_begin);
+  if (surface_shift) {
+    for (auto &node : nodes_) {
+      for (uint j = 0; j < Width; ++j) {
+        if (node.count[j] && node.offset[j] >= surface_end)
+          node.offset[j] = static_cast<uint32_t>(node.offset[j] +
+                                                 surface_shift);
+      }
+    }
+  }
+  surfaces_.erase(surfaces_.begin() + surface_begin,
+                  surfaces_.begin() + surface_end);
+  surfaces_.insert(surfaces_.begin() + surface_begin,
+                   subtree->surfaces_.begin(), subtree->surfaces_.end());
+
+  // the new root replaces the old one, the other new nodes follow the
+  // existing ones
+  auto first_appended = static_cast<uint32_t>(nodes_.size());
+  for (size_t i = 0; i < subtree->nodes_.size(); ++i) {
+    WideNode node = subtree->nodes_[i];
+    for (uint j = 0; j < Width; ++j) {
+      if (node.count[j])
+        node.offset[j] += surface_begin;
+      else if (node.bmin[0][j] <= node.bmax[0][j])
+        node.offset[j] += first_appended - 1;
+    }
+    if (i)
+      nodes_.push_back(node);
+    else
+      nodes_[index] = node;
+  }
+  sah_costs_.resize(nodes_.size());
+  build_sah_costs_.resize(nodes_.size());
+  ResetSAHCosts(index, options);
+  return rebuilt_count;
+}
+
+
+template <uint Width>
+void
+WideBVH<Width>::CompactNodes()
+{
+  // find the reachable nodes and the tree depth
+  vector<uint32_t> new_index(nodes_.size(), kNoChildNode);
+  vector<pair<uint32_t, uint>> stack{{0, 1}};
+  depth_ = 1;
+  while (!stack.empty()) {
+    auto entry = stack.back();
+    stack.pop_back();
+    new_index[entry.first] = 0;
+    depth_ = std::max(depth_, entry.second);
+    const WideNode &node = nodes_[entry.first];
+    for (uint j = 0; j < Width; ++j) {
+      if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+        stack.emplace_back(node.offset[j], entry.second + 1);
+    }
+  }
+
+  // number them in their current order, then move them
+  uint32_t count = 0;
+  for (auto &i : new_index) {
+    if (i != kNoChildNode)
+      i = count++;
+  }
+  if (count == nodes_.size())
+    return;
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    if (new_index[i] == kNoChildNode)
+      continue;
+    WideNode node = nodes_[i];
+    for (uint j = 0; j < Width; ++j) {
+      if (!node.count[j] && node.bmin[0][j] <= node.bmax[0][j])
+        node.offset[j] = new_index[node.offset[j]];
+    }
+    nodes_[new_index[i]] = node;
+    sah_costs_[new_index[i]] = sah_costs_[i];
+    build_sah_costs_[new_index[i]] = build_sah_costs_[i];
+  }
+  nodes_.resize(count);
+  nodes_.shrink_to_fit();
+  sah_costs_.resize(count);
+  build_sah_costs_.resize(count);
+}
+
+
+// instantiate the supported widths
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+}  // namespace core
+}  // namespace olio
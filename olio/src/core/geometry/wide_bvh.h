@@ -0,0 +1,254 @@
+//! \file       wide_bvh.h
+//! \brief      WideBVH class
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tbb/tbb.h>
+#include "core/geometry/surface.h"
+#include "core/geometry/bvh_node.h"
+#include "core/geometry/linear_bvh.h"
+
+namespace olio {
+namespace core {
+
+class Ray;
+class HitRecord;
+
+//! \class WideBVH
+//! \brief BVH with up to 'Width' children per node
+//! \details Made by collapsing a binary LinearBVH: starting from a
+//!    node's two children, the interior child with the largest surface
+//!    area is repeatedly replaced by its own two children, until the
+//!    node has 'Width' children or only leaf children. The bounds of
+//!    all children of a node are stored as structure of arrays, so a
+//!    ray is tested against all of them with SIMD instructions (see
+//!    HitChildren()). Children that the ray enters are
+//!    visited in order of entry distance, and children that the ray
+//!    enters beyond the closest hit found so far are skipped. Leaf
+//!    children are stored in their parent as ranges of the surface
+//!    list. Bounds use the (outward-rounded) single precision bounds of
+//!    the LinearBVH, and the slab test is done in Real precision, so
+//!    no ray is culled wrongly. Instantiated for widths 4 and 8.
+template <uint Width>
+class WideBVH : public Surface {
+public:
+  OLIO_NODE(WideBVH)
+
+  explicit WideBVH(const std::string &name=std::string());
+
+  //! \brief Check if ray intersects with surface
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[in] hit_record Resulting hit record if ray intersected with surface
+  //! \return True if ray intersected with surface
+  bool Hit(const Ray &ray, Real tmin, Real tmax,
+           HitRecord &hit_record) override;
+
+  //! \brief Check if any surface of the BVH blocks a ray
+  //! \details Children are visited in slot order, without sorting them
+  //!    by entry distance, and traversal stops at the first surface
+  //!    that the ray intersects.
+  //! \param[in] ray Ray to check intersection against
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \return True if ray intersected with a surface
+  bool Occluded(const Ray &ray, Real tmin, Real tmax) override;
+
+  AABB GetBoundingBox(bool force_recompute=false) override;
+
+  //! \brief Get the number of nodes
+  //! \return Node count
+  inline size_t GetNodeCount() const {return nodes_.size();}
+
+  //! \brief Get the memory used by the nodes and the leaf surface list
+  //! \return Memory in bytes
+  size_t GetMemoryUsage() const;
+
+  //! \brief Compute the SAH cost of the BVH
+  //! \details Same cost model as LinearBVH::ComputeSAHCost(), with one
+  //!    node test for all children of a node
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost
+  Real ComputeSAHCost(const BVHBuildOptions &options) const;
+
+  //! \brief Compute the size and quality of the BVH
+  //! \param[in] options Node and intersection test costs
+  //! \return Tree statistics (without the build time)
+  BVHTreeStats ComputeTreeStats(const BVHBuildOptions &options) const;
+
+  //! \brief Build a wide BVH
+  //! \details Builds a LinearBVH with the same options and collapses
+  //!    it. With 'options.veb_layout', the nodes are then put in van
+  //!    Emde Boas order (see ReorderNodes()).
+  //! \param[in] surfaces Surfaces to put in the BVH
+  //! \param[in] options Builder settings
+  //! \param[in] name Tree name
+  //! \return Built BVH (nullptr if 'surfaces' has no surfaces)
+  static typename WideBVH::Ptr BuildBVH(std::vector<Surface::Ptr> surfaces,
+                                        const BVHBuildOptions &options,
+                                        const std::string &name=
+                                        std::string());
+
+  //! \brief Collapse a binary linear BVH into a wide BVH
+  //! \details The linear BVH is left unchanged; the wide BVH shares its
+  //!    surfaces.
+  //! \param[in] bvh Binary BVH to collapse
+  //! \param[in] name Name of the wide BVH
+  //! \param[in] quiet Log at debug level instead of info level
+  //! \return Wide BVH (nullptr if 'bvh' is nullptr or empty)
+  static typename WideBVH::Ptr Collapse(const LinearBVH::Ptr &bvh,
+                                        const std::string &name=
+                                        std::string(), bool quiet=false);
+
+  //! \brief Put the nodes in van Emde Boas order
+  //! \details Collapse() stores the nodes depth-first, so a node's
+  //!    last children are far from it in memory. The tree is unchanged;
+  //!    only the node indices are (see ComputeVanEmdeBoasOrder()).
+  void ReorderNodes();
+
+  //! \brief Update the node bounds after leaf surfaces moved
+  //! \details Like LinearBVH::Refit(), only the children above
+  //!    surfaces with dirty bounds are recomputed, bottom up, with the
+  //!    top levels in parallel, and the highest dirty nodes whose SAH
+  //!    cost grew past 'options.rebuild_threshold' times their cost
+  //!    when built are rebuilt from their surfaces with 'options'. A
+  //!    rebuilt subtree's root stays in place and its other nodes are
+  //!    appended; the nodes of the old subtree are then dropped,
+  //!    keeping the order of the others.
+  //! \param[in] options Builder settings
+  //! \return Refit statistics
+  BVHRefitStats Refit(const BVHBuildOptions &options);
+protected:
+  //! \struct WideNode
+  //! \brief Node with up to 'Width' children
+  //! \details Unused child slots have empty bounds (min > max), which
+  //!    no ray enters.
+  struct WideNode {
+    float bmin[3][Width];      //!< child min coordinates, per axis
+    float bmax[3][Width];      //!< child max coordinates, per axis
+    uint32_t offset[Width];    //!< leaf: first surface; interior: node
+    uint32_t count[Width];     //!< leaf: number of surfaces; interior: 0
+  };
+
+  //! Node array, cache-line aligned
+  using NodeArray = std::vector<WideNode,
+                                tbb::cache_aligned_allocator<WideNode>>;
+
+  //! \brief Compute the surface area of a child's bounds
+  //! \param[in] node Node
+  //! \param[in] child Child slot
+  //! \return Surface area (0 for unused slots)
+  static Real GetChildSurfaceArea(const WideNode &node, uint child);
+
+  //! \brief Slab test of a ray against all children of a node
+  //! \details The ray enters child j if t_far[j] >= t_near[j]. With
+  //!    SSE2, each instruction tests two children (four with
+  //!    OLIO_USE_SINGLE_PRECISION); with AVX (see OLIO_USE_AVX2 in
+  //!    CMake), four (eight for 8-wide nodes with
+  //!    OLIO_USE_SINGLE_PRECISION). Other targets test them one by one.
+  //! \param[in] node Node
+  //! \param[in] origin Ray origin
+  //! \param[in] inv_direction 1 / ray direction
+  //! \param[in] tmin Minimum value for acceptable t
+  //! \param[in] tmax Maximum value for acceptable t
+  //! \param[out] t_near Entry distance of each child
+  //! \param[out] t_far Exit distance of each child
+  static void HitChildren(const WideNode &node, const Vec3r &origin,
+                          const Vec3r &inv_direction, Real tmin, Real tmax,
+                          Real *t_near, Real *t_far);
+
+  //! \brief Compute the bounds of a node
+  //! \param[in] node Node
+  //! \return Union of the bounds of the node's children
+  static AABB GetChildrenBounds(const WideNode &node);
+
+  //! \brief Append the wide nodes of a binary subtree
+  //! \param[in] bvh Binary BVH
+  //! \param[in] binary_index Index of the subtree root in 'bvh' (an
+  //!    interior node)
+  //! \param[in] depth Depth of the new node
+  //! \return Index of the new node
+  uint32_t CollapseNode(const LinearBVH &bvh, uint32_t binary_index,
+                        uint depth);
+
+  //! \brief Recompute the child bounds and SAH costs of a subtree
+  //!    above moved surfaces
+  //! \param[in] index Index of the subtree root
+  //! \param[in] dirty_slots Whether each entry of surfaces_ moved
+  //! \param[in] depth Depth of the subtree root (root: 1)
+  //! \param[in] options Node and intersection test costs
+  //! \param[out] dirty_nodes Flags of the recomputed nodes
+  //! \param[out] bbox Bounds of the subtree
+  //! \return Number of nodes whose child bounds changed
+  size_t RefitNode(uint32_t index, const std::vector<char> &dirty_slots,
+                   uint depth, const BVHBuildOptions &options,
+                   std::vector<char> &dirty_nodes, AABB &bbox);
+
+  //! \brief Compute the SAH cost of a node from the costs of its
+  //!    interior children
+  //! \details Same cost model as ComputeSAHCost(), relative to the
+  //!    node's bounds
+  //! \param[in] index Node index
+  //! \param[in] options Node and intersection test costs
+  //! \return SAH cost of the subtree
+  float ComputeNodeSAHCost(uint32_t index,
+                           const BVHBuildOptions &options) const;
+
+  //! \brief Set the current and built SAH costs of a subtree
+  //! \param[in] index Index of the subtree root
+  //! \param[in] options Node and intersection test costs
+  void ResetSAHCosts(uint32_t index, const BVHBuildOptions &options);
+
+  //! \brief Recompute the SAH costs of dirty nodes, bottom up
+  //! \param[in] index Index of the subtree root
+  //! \param[in] dirty_nodes Flags of the recomputed nodes
+  //! \param[in] options Node and intersection test costs
+  void UpdateDirtySAHCosts(uint32_t index,
+                           const std::vector<char> &dirty_nodes,
+                           const BVHBuildOptions &options);
+
+  //! \brief Find the highest dirty subtrees whose SAH cost grew past
+  //!    'options.rebuild_threshold' times their built cost
+  //! \param[in] index Index of the subtree root
+  //! \param[in] dirty_nodes Flags of the recomputed nodes
+  //! \param[in] options Builder settings
+  //! \param[in,out] subtrees List to append the roots of the degraded
+  //!    subtrees to
+  void FindDegraded(uint32_t index, const std::vector<char> &dirty_nodes,
+                    const BVHBuildOptions &options,
+                    std::vector<uint32_t> &subtrees) const;
+
+  //! \brief Rebuild a subtree from its surfaces
+  //! \details The new root replaces the old one at 'index', and the
+  //!    other new nodes are appended; the old ones are left unreachable
+  //!    (see CompactNodes()). The new leaves replace the subtree's
+  //!    range of surfaces_.
+  //! \param[in] index Index of the subtree root
+  //! \param[in] options Builder settings
+  //! \return Number of distinct surfaces in the subtree
+  size_t RebuildSubtree(uint32_t index, const BVHBuildOptions &options);
+
+  //! \brief Drop the nodes that can't be reached from the root
+  //! \details Keeps the order of the other nodes, and recomputes the
+  //!    tree depth.
+  void CompactNodes();
+
+  NodeArray nodes_;                    //!< nodes (the root is the first one)
+  std::vector<Surface::Ptr> surfaces_; //!< leaf surfaces, in leaf order
+  uint depth_{0};                      //!< tree depth (root: 1)
+  std::vector<float> sah_costs_;       //!< Refit(): SAH cost of each
+                                       //!< node's subtree (empty: not
+                                       //!< computed yet)
+  std::vector<float> build_sah_costs_; //!< Refit(): the costs when built
+};
+
+using WideBVH4 = WideBVH<4>;  //!< 4-wide BVH
+using WideBVH8 = WideBVH<8>;  //!< 8-wide BVH
+
+}  // namespace core
+}  // namespace olio
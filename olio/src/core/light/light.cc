@@ -3,13 +3,10 @@
 
 #include "core/light/light.h"
 #include "core/ray.h"
+#include "core/geometry/bvh_stats.h"
 #include "core/material/phong_material.h"
+#include "core/sampler/sampler.h"
 #include <cmath>
-// #include <random>
-
-// std::random_device rd;  
-// std::mt19937 gen(rd()); 
-// std::uniform_real_distribution<> dis(0, 1.0);
 
 namespace olio {
 namespace core {
@@ -24,10 +21,34 @@ Light::Light(const std::string &name) :
 
 
 Vec3r
-Light::Illuminate(const HitRecord &/*hit_record*/, const Vec3r &/*view_vec*/,
-                  Surface::Ptr /*scene*/) const
+Light::Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
+                  Surface::Ptr scene, Sampler &sampler,
+                  size_t &shadow_rays) const
+{
+  // sample the light (reusing the buffer of the calling thread)
+  static thread_local std::vector<LightSample> samples;
+  samples.clear();
+  Sample(hit_record, view_vec, sampler, samples);
+
+  // sum the samples that are visible from the hit point
+  Vec3r color{0, 0, 0};
+  for (const auto &sample : samples) {
+    if (sample.test_visibility) {
+      ++shadow_rays;
+      BVHStats::BeginRays(BVHRayType::kShadow);
+      if (scene->Occluded(sample.shadow_ray, kEpsilon, 1))
+        continue;
+    }
+    color += sample.radiance;
+  }
+  return color;
+}
+
+
+void
+Light::Sample(const HitRecord &/*hit_record*/, const Vec3r &/*view_vec*/,
+              Sampler &/*sampler*/, std::vector<LightSample> &/*samples*/) const
 {
-  return Vec3r{0, 0, 0};
 }
 
 
@@ -46,19 +67,25 @@ AmbientLight::AmbientLight(const Vec3r &ambient, const std::string &name) :
 }
 
 
-Vec3r
-AmbientLight::Illuminate(const HitRecord &hit_record, const Vec3r &/*view_vec*/,
-                         Surface::Ptr /*scene*/) const
+void
+AmbientLight::Sample(const HitRecord &hit_record, const Vec3r &/*view_vec*/,
+                     Sampler &/*sampler*/,
+                     std::vector<LightSample> &samples) const
 {
   // only process phong materials
   auto surface = hit_record.GetSurface();
   if (!surface)
-    return Vec3r{0, 0, 0};
+    return;
   auto phong_material = dynamic_pointer_cast<PhongMaterial>(surface->
                                                             GetMaterial());
   if (!phong_material)
-    return Vec3r{0, 0, 0};
-  return ambient_.cwiseProduct(phong_material->GetAmbient());
+    return;
+
+  // ambient light reaches every point
+  LightSample sample;
+  sample.radiance = ambient_.cwiseProduct(phong_material->GetAmbient());
+  sample.test_visibility = false;
+  samples.push_back(sample);
 }
 
 
@@ -79,29 +106,24 @@ PointLight::PointLight(const Vec3r &position, const Vec3r &intensity,
 }
 
 
-Vec3r
-PointLight::Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
-                       Surface::Ptr scene) const
+void
+PointLight::Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+                   Sampler &/*sampler*/,
+                   std::vector<LightSample> &samples) const
 {
-  // evaluate hit points material
-  Vec3r black{0, 0, 0};
-
-  // create a shadow ray to the point light and check for occlusion
-  const auto &hit_position = hit_record.GetPoint();
-  Ray shadow_ray{hit_position, GetPosition() - hit_position};
-  HitRecord shadow_record;
-  if (scene->Hit(shadow_ray, kEpsilon, 1, shadow_record)) {
-    return black;
-  }
-
   // only process phong materials
   auto surface = hit_record.GetSurface();
   if (!surface)
-    return black;
+    return;
   auto phong_material = dynamic_pointer_cast<PhongMaterial>(surface->
                                                             GetMaterial());
   if (!phong_material)
-    return black;
+    return;
+
+  // create a shadow ray to the point light
+  const auto &hit_position = hit_record.GetPoint();
+  LightSample sample;
+  sample.shadow_ray = Ray{hit_position, GetPosition() - hit_position};
 
   // compute irradiance at hit point
   const Vec3r &normal = hit_record.GetNormal();
@@ -114,7 +136,8 @@ PointLight::Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
   // compute how much the material absorts light
   const Vec3r &attenuation = phong_material->Evaluate(hit_record, light_vec,
                                                       view_vec);
-  return irradiance.cwiseProduct(attenuation);
+  sample.radiance = irradiance.cwiseProduct(attenuation);
+  samples.push_back(sample);
 }
 
 
@@ -130,7 +153,7 @@ AreaLight::AreaLight(const Vec3r &center, const Vec3r &normal, const Vec3r &u, R
   v_ = (u_.cross(normal_)).normalized();
 }
 
-std::vector<Vec3r> AreaLight::GeneratePoints() const {
+std::vector<Vec3r> AreaLight::GeneratePoints(Sampler &sampler) const {
   int size_grid = static_cast<int>(round(sqrt(shadow_samples_)));
   std::vector<Vec3r> points;
   points.reserve(static_cast<unsigned long>(size_grid*size_grid));
@@ -138,47 +161,36 @@ std::vector<Vec3r> AreaLight::GeneratePoints() const {
   for(int i=1; i<=size_grid; i++) {
     for(int j=1; j<=size_grid; j++) {
       Vec3r left_top = center_ - len_*(0.5*u_ + 0.5*v_);
-      Vec3r u_shift = ((i-1) + static_cast<Real>(rand())/(RAND_MAX+1.0f))*u_*len_*fraction;
-      Vec3r v_shift = ((j-1) + static_cast<Real>(rand())/(RAND_MAX+1.0f))*v_*len_*fraction;
-      // Vec3r u_shift = ((i-1)*fraction + i*fraction*dis(gen))*u_*len_;
-      // Vec3r v_shift = ((j-1)*fraction + j*fraction*dis(gen))*v_*len_;
+      Vec2r jitter = sampler.Get2D();
+      Vec3r u_shift = ((i-1) + jitter[0])*u_*len_*fraction;
+      Vec3r v_shift = ((j-1) + jitter[1])*v_*len_*fraction;
       points.push_back(left_top + u_shift + v_shift);
     }
   }
   return points;
 }
 
-Vec3r
-AreaLight::Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
-                       Surface::Ptr scene) const
+void
+AreaLight::Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+                  Sampler &sampler, std::vector<LightSample> &samples) const
 {
-  // evaluate hit points material
-  Vec3r black{0, 0, 0};
-
-  // create a shadow ray to the point light and check for occlusion
-  const auto hit_position = hit_record.GetPoint();
-
-  std::vector<Vec3r> points = this->GeneratePoints();
-  Real S = pow(len_, 2);
-  int N = static_cast<int>(pow(round(sqrt(shadow_samples_)), 2));
-
-  Vec3r color{0, 0, 0};
-
   // only process phong materials
   auto surface = hit_record.GetSurface();
   if (!surface)
-    return black;
+    return;
   auto phong_material = dynamic_pointer_cast<PhongMaterial>(surface->
                                                             GetMaterial());
   if (!phong_material)
-    return black;
+    return;
 
+  // create a shadow ray to each (jittered) point on the light
+  const auto hit_position = hit_record.GetPoint();
+  std::vector<Vec3r> points = this->GeneratePoints(sampler);
+  Real S = pow(len_, 2);
+  int N = static_cast<int>(pow(round(sqrt(shadow_samples_)), 2));
   for(auto & point: points) {
-    Ray shadow_ray{hit_position, point - hit_position};
-    HitRecord shadow_record;
-    if (scene->Hit(shadow_ray, kEpsilon, 1, shadow_record)) {
-      continue;
-    }
+    LightSample sample;
+    sample.shadow_ray = Ray{hit_position, point - hit_position};
 
     const Vec3r &normal = hit_record.GetNormal();
     Vec3r light_vec = point - hit_position;
@@ -192,13 +204,11 @@ AreaLight::Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
     // compute how much the material absorts light
     const Vec3r &attenuation = phong_material->Evaluate(hit_record, light_vec,
                                                       view_vec);
-    
+
     Vec3r irradiance = intensity_ * fmax(0.0f, cos_theta) * fmax(0.0f, cos_alpha)/denominator;
-    color += attenuation.cwiseProduct(irradiance);
+    sample.radiance = attenuation.cwiseProduct(irradiance) * S / N;
+    samples.push_back(sample);
   }
-
-  color = color * S / N;
-  return color;
 }
 
 
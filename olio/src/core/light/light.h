@@ -9,6 +9,7 @@
 #include "core/node.h"
 #include <vector>
 #include "core/geometry/surface.h"
+#include "core/ray.h"
 
 namespace olio {
 namespace core {
@@ -16,6 +17,17 @@ namespace core {
 class Ray;
 class HitRecord;
 class Surface;
+class Sampler;
+
+//! \struct LightSample
+//! \brief Contribution of one light sample to a hit point, before
+//! checking whether the sample is visible from the point
+struct LightSample {
+  Ray shadow_ray;               //!< ray from the hit point to the sample
+                                //!< (visible if nothing is hit for t < 1)
+  Vec3r radiance{0, 0, 0};      //!< radiance leaving the point if visible
+  bool test_visibility{true};   //!< false if the light can't be occluded
+};
 
 //! \class Light
 //! \brief Light class
@@ -32,10 +44,30 @@ public:
   //! \param[in] hit_record Hit record for the point
   //! \param[in] view_vec View vector (points away from the surface)
   //! \param[in] scene Pointer to the whole scene that's being rendered
+  //! \param[in] sampler Sampler of the current pixel sample, used by
+  //!            lights that need random numbers (e.g., area lights)
+  //! \param[in,out] shadow_rays Incremented by the number of traced
+  //!                shadow rays
+  //! \details Sums the light's samples (see Sample()) that are not
+  //!    occluded by the scene
   //! \return Total radiance leaving the point in the direction of
   //!         view_vec
   virtual Vec3r Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
-                           std::shared_ptr<Surface> scene) const;
+                           std::shared_ptr<Surface> scene, Sampler &sampler,
+                           size_t &shadow_rays) const;
+
+  //! \brief Sample the light's contribution to a hit point without
+  //! testing for occlusion
+  //! \details Appends one sample per shadow ray that the light
+  //!    needs. Integrators that trace rays in batches use it to
+  //!    defer the visibility tests.
+  //! \param[in] hit_record Hit record for the point
+  //! \param[in] view_vec View vector (points away from the surface)
+  //! \param[in] sampler Sampler of the current pixel sample
+  //! \param[out] samples Light samples (appended)
+  virtual void Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+                      Sampler &sampler,
+                      std::vector<LightSample> &samples) const;
 protected:
 };
 
@@ -55,15 +87,15 @@ public:
   //! \param[in] name Node name
   AmbientLight(const Vec3r &ambient, const std::string &name=std::string());
 
-  //! \brief Illuminate a hit point by retrieving its Phong material
-  //! and evaluating it with a call to `Material::Eval()`
+  //! \brief Sample the light's contribution to a hit point without
+  //! testing for occlusion
   //! \param[in] hit_record Hit record for the point
   //! \param[in] view_vec View vector (points away from the surface)
-  //! \param[in] scene Pointer to the whole scene that's being rendered
-  //! \return Total radiance leaving the point in the direction of
-  //!         view_vec
-  Vec3r Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
-                   std::shared_ptr<Surface> scene) const override;
+  //! \param[in] sampler Sampler of the current pixel sample
+  //! \param[out] samples Light samples (appended)
+  void Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+              Sampler &sampler,
+              std::vector<LightSample> &samples) const override;
 
   //! \brief Set ambient intensity
   //! \param[in] ambient Ambient intensity
@@ -94,15 +126,15 @@ public:
   PointLight(const Vec3r &position, const Vec3r &intensity,
              const std::string &name=std::string());
 
-  //! \brief Illuminate a hit point by retrieving its Phong material
-  //! and evaluating it with a call to `Material::Eval()`
+  //! \brief Sample the light's contribution to a hit point without
+  //! testing for occlusion
   //! \param[in] hit_record Hit record for the point
   //! \param[in] view_vec View vector (points away from the surface)
-  //! \param[in] scene Pointer to the whole scene that's being rendered
-  //! \return Total radiance leaving the point in the direction of
-  //!         view_vec
-  Vec3r Illuminate(const HitRecord &hit_record, const Vec3r &view_vec,
-                   std::shared_ptr<Surface> scene) const override;
+  //! \param[in] sampler Sampler of the current pixel sample
+  //! \param[out] samples Light samples (appended)
+  void Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+              Sampler &sampler,
+              std::vector<LightSample> &samples) const override;
 
   //! \brief Set light's position
   //! \param[in] position Light position
@@ -152,7 +184,9 @@ public:
   Real GetLen() const {return len_;}
   Vec3r GetIntensity() const  {return intensity_;}
   Real GetShadowSamples() const {return shadow_samples_;}
-  Vec3r Illuminate(const HitRecord &hit_record, const Vec3r &view_vec, Surface::Ptr scene) const override;
+  void Sample(const HitRecord &hit_record, const Vec3r &view_vec,
+              Sampler &sampler,
+              std::vector<LightSample> &samples) const override;
 protected:
   Vec3r intensity_{0, 0, 0};
   Vec3r center_{0, 0, 0};   
@@ -162,7 +196,10 @@ protected:
   Real len_{0};
   uint shadow_samples_;
 
-  std::vector<Vec3r> GeneratePoints() const;
+  //! \brief Generate stratified (jittered) sample points on the light
+  //! \param[in] sampler Sampler used to jitter the points in their strata
+  //! \return Sample points
+  std::vector<Vec3r> GeneratePoints(Sampler &sampler) const;
 };
 
 
@@ -13,6 +13,7 @@
 #include "core/material/phong_material.h"
 #include "core/material/phong_dielectric.h"
 #include "core/geometry/trimesh.h"
+#include "core/geometry/instance.h"
 #include "map"
 #include "core/texture/image_texture.h"
 
@@ -53,6 +54,8 @@ bool RaytraParser::ParseFile(const std::string &filename, Surface::Ptr &scene,
   int material_count = 0;
   vector<Surface::Ptr> surfaces;
   map<int, Texture::Ptr> img_textures;
+  map<fs::path, TriMesh::Ptr> instanced_meshes;
+  size_t instance_count = 0;
 
   // current material that's applied to the next read surface
   PhongMaterial::Ptr current_material;
@@ -165,6 +168,54 @@ bool RaytraParser::ParseFile(const std::string &filename, Surface::Ptr &scene,
         surfaces.push_back(tri_mesh);
         break;
       }
+    case 'x':
+      {
+        // instance of a triangle mesh, with a row-major 3x4 affine
+        // object-to-world transform
+        std::string str_path;
+        Mat4r xform{Mat4r::Identity()};
+        iss >> str_path;
+        for (int row = 0; row < 3; ++row) {
+          for (int col = 0; col < 4; ++col)
+            iss >> xform(row, col);
+        }
+        if (!iss) {
+          spdlog::error("Invalid scene file: bad instance: {}", line);
+          return false;
+        }
+        // only singular transforms are rejected: small-scale instances
+        // have tiny determinants but well-defined inverses
+        if (xform.topLeftCorner<3, 3>().determinant() == 0 ||
+            !xform.inverse().allFinite()) {
+          spdlog::error("Invalid scene file: instance transform is not "
+                        "invertible: {}", line);
+          return false;
+        }
+        fs::path filepath(str_path);
+        if (!filepath.is_absolute())
+          filepath = path_prefix / filepath;
+
+        // instances of the same file share one mesh (and its BVH)
+        auto &tri_mesh = instanced_meshes[filepath];
+        if (!tri_mesh) {
+          tri_mesh = TriMesh::Create();
+          if (!tri_mesh->Load(filepath)) {
+            spdlog::error("Invalid mesh file: cannot load the mesh file: {}",
+                          str_path);
+            return false;
+          }
+        }
+        if (!current_material) {
+          spdlog::error("Invalid scene file: cannot find matching material "
+                        "for surface: {}", line);
+          return false;
+        }
+        auto instance = Instance::Create(tri_mesh, xform);
+        instance->SetMaterial(current_material);
+        surfaces.push_back(instance);
+        ++instance_count;
+        break;
+      }
     case 'd':
       {
         // phong dielectric material
@@ -288,6 +339,9 @@ bool RaytraParser::ParseFile(const std::string &filename, Surface::Ptr &scene,
   scene = SurfaceList::Create(surfaces);
   spdlog::info("Read {} surface(s), {} material(s), & {} point light(s) ",
                surfaces.size(), material_count, light_count);
+  if (instance_count)
+    spdlog::info("Read {} instance(s) of {} mesh(es)", instance_count,
+                 instanced_meshes.size());
   return true;
 }
 
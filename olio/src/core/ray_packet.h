@@ -0,0 +1,111 @@
+//! \file       ray_packet.h
+//! \brief      RayPacket class
+
+#pragma once
+
+#include "core/types.h"
+#include "core/ray.h"
+
+namespace olio {
+namespace core {
+
+//! \brief Max number of rays in a RayPacket
+constexpr int kMaxPacketSize = 16;
+
+//! \brief Packets with fewer active rays than this are traversed one
+//! ray at a time
+constexpr int kMinPacketActiveRays = 3;
+
+//! One value per packet lane
+using PacketReal = Eigen::Array<Real, kMaxPacketSize, 1>;
+
+//! One flag per packet lane
+using PacketMask = Eigen::Array<bool, kMaxPacketSize, 1>;
+
+//! \class RayPacket
+//! \brief Up to kMaxPacketSize rays stored as structure of arrays, so
+//! that the same test (e.g., a ray-box slab test) can be computed for
+//! all rays at once with SIMD instructions
+//! \details Lanes past GetSize() hold unspecified values; the masks
+//!    passed to packet queries must leave them inactive.
+class RayPacket {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  //! \brief Default constructor
+  RayPacket() {
+    for (int axis = 0; axis < 3; ++axis) {
+      origin_[axis].setZero();
+      direction_[axis].setZero();
+      inv_direction_[axis].setZero();
+    }
+  }
+
+  //! \brief Remove all rays from the packet
+  inline void Clear() {size_ = 0;}
+
+  //! \brief Add a ray to the packet; the packet must not be full
+  //! \param[in] origin Ray origin
+  //! \param[in] direction Ray direction
+  //! \return Lane of the added ray
+  inline int Add(const Vec3r &origin, const Vec3r &direction) {
+    for (int axis = 0; axis < 3; ++axis) {
+      origin_[axis][size_] = origin[axis];
+      direction_[axis][size_] = direction[axis];
+      inv_direction_[axis][size_] = 1.0f / direction[axis];
+    }
+    return size_++;
+  }
+
+  //! \brief Get number of rays in the packet
+  //! \return Number of rays
+  inline int GetSize() const {return size_;}
+
+  //! \brief Check if the packet is full
+  //! \return True if no more rays can be added
+  inline bool IsFull() const {return size_ == kMaxPacketSize;}
+
+  //! \brief Get mask of the lanes that hold rays
+  //! \return Mask of lanes [0, size)
+  inline PacketMask GetLaneMask() const {
+    PacketMask mask = PacketMask::Constant(false);
+    mask.head(size_).setConstant(true);
+    return mask;
+  }
+
+  //! \brief Get one ray of the packet
+  //! \param[in] lane Lane of the ray
+  //! \return Ray
+  inline Ray GetRay(int lane) const {
+    return Ray{Vec3r{origin_[0][lane], origin_[1][lane], origin_[2][lane]},
+               Vec3r{direction_[0][lane], direction_[1][lane],
+                     direction_[2][lane]}};
+  }
+
+  //! \brief Get one coordinate of the ray origins
+  //! \param[in] axis Coordinate axis (0: x, 1: y, 2: z)
+  //! \return Origin coordinates of all lanes
+  inline const PacketReal& GetOrigin(int axis) const {return origin_[axis];}
+
+  //! \brief Get one coordinate of the ray directions
+  //! \param[in] axis Coordinate axis (0: x, 1: y, 2: z)
+  //! \return Direction coordinates of all lanes
+  inline const PacketReal& GetDirection(int axis) const {
+    return direction_[axis];
+  }
+
+  //! \brief Get one coordinate of the inverse ray directions
+  //! \param[in] axis Coordinate axis (0: x, 1: y, 2: z)
+  //! \return Inverse direction coordinates of all lanes
+  inline const PacketReal& GetInvDirection(int axis) const {
+    return inv_direction_[axis];
+  }
+protected:
+  PacketReal origin_[3];         //!< ray origins (x, y, z)
+  PacketReal direction_[3];      //!< ray directions (x, y, z)
+  PacketReal inv_direction_[3];  //!< 1 / ray directions (x, y, z)
+  int size_{0};                  //!< number of rays in the packet
+};
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,805 @@
+//! \file       distributed.cc
+//! \brief      RenderJob, RenderCoordinator, and RenderWorker classes
+
+#include "core/renderer/distributed.h"
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifndef WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include <spdlog/spdlog.h>
+#include "core/parser/raytra_parser.h"
+#include "core/geometry/surface_list.h"
+#include "core/geometry/bvh_node.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+#ifndef WIN32
+namespace {
+
+//! \enum MessageType
+//! \brief Types of the messages exchanged by coordinator and workers
+enum class MessageType : uint32_t {
+  kJob = 1,     //!< coordinator -> worker: RenderJob
+  kTile = 2,    //!< coordinator -> worker: tile to render
+  kResult = 3,  //!< worker -> coordinator: rendered tile
+  kDone = 4     //!< coordinator -> worker: frame is done
+};
+
+//! \brief Every message starts with its type and payload size
+struct MessageHeader {
+  uint32_t type;  //!< MessageType
+  uint32_t size;  //!< payload size in bytes
+};
+
+//! \brief Messages larger than this are treated as corrupt
+const uint32_t kMaxMessageSize = 1u << 30;
+
+
+//! \class Message
+//! \brief Message payload with sequential writes and reads
+class Message {
+public:
+  //! \brief Append a value to the payload
+  template <typename T>
+  void Put(const T &value) {
+    auto bytes = reinterpret_cast<const char*>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(T));
+  }
+
+  //! \brief Append an array of values to the payload
+  template <typename T>
+  void PutArray(const T *values, size_t count) {
+    auto bytes = reinterpret_cast<const char*>(values);
+    data_.insert(data_.end(), bytes, bytes + count * sizeof(T));
+  }
+
+  //! \brief Append a string (size first) to the payload
+  void PutString(const string &value) {
+    Put(static_cast<uint32_t>(value.size()));
+    data_.insert(data_.end(), value.begin(), value.end());
+  }
+
+  //! \brief Read the next value of the payload
+  //! \return False if the payload is too short
+  template <typename T>
+  bool Get(T &value) {
+    return GetArray(&value, 1);
+  }
+
+  //! \brief Read the next array of values of the payload
+  //! \return False if the payload is too short
+  template <typename T>
+  bool GetArray(T *values, size_t count) {
+    auto size = count * sizeof(T);
+    if (read_pos_ + size > data_.size())
+      return false;
+    memcpy(values, data_.data() + read_pos_, size);
+    read_pos_ += size;
+    return true;
+  }
+
+  //! \brief Read the next string of the payload
+  //! \return False if the payload is too short
+  bool GetString(string &value) {
+    uint32_t size = 0;
+    if (!Get(size) || read_pos_ + size > data_.size())
+      return false;
+    value.assign(data_.data() + read_pos_, size);
+    read_pos_ += size;
+    return true;
+  }
+
+  //! \brief Get the payload bytes
+  inline vector<char>& GetData() {return data_;}
+protected:
+  vector<char> data_;     //!< payload
+  size_t read_pos_{0};    //!< position of the next read
+};
+
+
+//! \brief Send a message over a (blocking) socket
+//! \return True on success
+bool
+SendMessage(int fd, MessageType type, Message &message)
+{
+  auto &payload = message.GetData();
+  MessageHeader header{static_cast<uint32_t>(type),
+                       static_cast<uint32_t>(payload.size())};
+  vector<char> data(sizeof(header) + payload.size());
+  memcpy(data.data(), &header, sizeof(header));
+  if (!payload.empty())
+    memcpy(data.data() + sizeof(header), payload.data(), payload.size());
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto count = send(fd, data.data() + sent, data.size() - sent,
+                      MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    sent += static_cast<size_t>(count);
+  }
+  return true;
+}
+
+
+//! \brief Read exactly 'size' bytes from a (blocking) socket
+//! \return True on success; false on error or end of stream
+bool
+ReceiveBytes(int fd, char *data, size_t size)
+{
+  size_t received = 0;
+  while (received < size) {
+    auto count = recv(fd, data + received, size - received, 0);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    received += static_cast<size_t>(count);
+  }
+  return true;
+}
+
+
+//! \brief Receive a message from a (blocking) socket
+//! \return True on success
+bool
+ReceiveMessage(int fd, MessageType &type, Message &message)
+{
+  MessageHeader header;
+  if (!ReceiveBytes(fd, reinterpret_cast<char*>(&header), sizeof(header)) ||
+      header.size > kMaxMessageSize)
+    return false;
+  type = static_cast<MessageType>(header.type);
+  message = Message{};
+  message.GetData().resize(header.size);
+  return ReceiveBytes(fd, message.GetData().data(), header.size);
+}
+
+
+//! \brief Remove the first complete message from a receive buffer
+//! \param[in,out] buffer Bytes received so far
+//! \param[out] type Message type
+//! \param[out] message Message payload
+//! \param[out] corrupt Set if the buffer holds an invalid header
+//! \return True if a complete message was removed
+bool
+PopMessage(vector<char> &buffer, MessageType &type, Message &message,
+           bool &corrupt)
+{
+  corrupt = false;
+  if (buffer.size() < sizeof(MessageHeader))
+    return false;
+  MessageHeader header;
+  memcpy(&header, buffer.data(), sizeof(header));
+  if (header.size > kMaxMessageSize) {
+    corrupt = true;
+    return false;
+  }
+  auto size = sizeof(header) + header.size;
+  if (buffer.size() < size)
+    return false;
+  type = static_cast<MessageType>(header.type);
+  message = Message{};
+  message.GetData().assign(buffer.begin() + sizeof(header),
+                           buffer.begin() + static_cast<long>(size));
+  buffer.erase(buffer.begin(), buffer.begin() + static_cast<long>(size));
+  return true;
+}
+
+
+//! \brief Write a tile rectangle to a message
+void
+PutRect(Message &message, const cv::Rect &rect)
+{
+  int32_t values[4] = {rect.x, rect.y, rect.width, rect.height};
+  message.PutArray(values, 4);
+}
+
+
+//! \brief Read a tile rectangle from a message
+//! \return False if the message is too short
+bool
+GetRect(Message &message, cv::Rect &rect)
+{
+  int32_t values[4];
+  if (!message.GetArray(values, 4))
+    return false;
+  rect = cv::Rect{values[0], values[1], values[2], values[3]};
+  return true;
+}
+
+
+//! \brief Serialize a render job
+void
+PutJob(Message &message, const RenderJob &job)
+{
+  message.Put(static_cast<uint32_t>(sizeof(Real)));
+  message.PutString(job.scene_path);
+  message.Put(static_cast<uint32_t>(job.image_height));
+  message.Put(static_cast<uint32_t>(job.samples_per_pixel));
+  message.Put(static_cast<uint32_t>(job.shadow_samples));
+  message.Put(static_cast<uint32_t>(job.tile_size));
+  message.Put(job.seed);
+  message.Put(static_cast<uint32_t>(job.integrator));
+  message.Put(static_cast<uint32_t>(job.packet_size));
+  message.Put(static_cast<uint8_t>(job.sort_rays));
+  message.Put(static_cast<double>(job.adaptive_threshold));
+  message.Put(static_cast<uint32_t>(job.adaptive_min_samples));
+  message.Put(static_cast<uint32_t>(job.bvh_options.split_method));
+  message.Put(static_cast<uint32_t>(job.bvh_options.layout));
+  message.Put(static_cast<uint32_t>(job.bvh_options.bin_count));
+  message.Put(static_cast<double>(job.bvh_options.traversal_cost));
+  message.Put(static_cast<double>(job.bvh_options.intersection_cost));
+  message.Put(static_cast<uint32_t>(job.bvh_options.morton_bits));
+  message.Put(static_cast<double>(job.bvh_options.max_duplication));
+  message.Put(static_cast<uint8_t>(job.bvh_options.packed_meshes));
+  message.Put(static_cast<uint32_t>(job.bvh_options.max_leaf_size));
+  message.Put(static_cast<double>(job.bvh_options.rebuild_threshold));
+  message.Put(static_cast<uint8_t>(job.bvh_options.quantized_nodes));
+  message.Put(static_cast<uint8_t>(job.bvh_options.veb_layout));
+}
+
+
+//! \brief Deserialize a render job
+//! \return False if the message is invalid
+bool
+GetJob(Message &message, RenderJob &job)
+{
+  uint32_t real_size = 0, image_height = 0, samples_per_pixel = 0;
+  uint32_t shadow_samples = 0, tile_size = 0, integrator = 0;
+  uint32_t packet_size = 0, adaptive_min_samples = 0;
+  uint32_t split_method = 0, layout = 0, bin_count = 0, morton_bits = 0;
+  uint32_t max_leaf_size = 0;
+  uint8_t sort_rays = 0, packed_meshes = 0, quantized_nodes = 0;
+  uint8_t veb_layout = 0;
+  double adaptive_threshold = 0, traversal_cost = 0, intersection_cost = 0;
+  double max_duplication = 0, rebuild_threshold = 0;
+  if (!message.Get(real_size) || !message.GetString(job.scene_path) ||
+      !message.Get(image_height) || !message.Get(samples_per_pixel) ||
+      !message.Get(shadow_samples) || !message.Get(tile_size) ||
+      !message.Get(job.seed) || !message.Get(integrator) ||
+      !message.Get(packet_size) || !message.Get(sort_rays) ||
+      !message.Get(adaptive_threshold) ||
+      !message.Get(adaptive_min_samples) || !message.Get(split_method) ||
+      !message.Get(layout) || !message.Get(bin_count) ||
+      !message.Get(traversal_cost) || !message.Get(intersection_cost) ||
+      !message.Get(morton_bits) || !message.Get(max_duplication) ||
+      !message.Get(packed_meshes) || !message.Get(max_leaf_size) ||
+      !message.Get(rebuild_threshold) || !message.Get(quantized_nodes) ||
+      !message.Get(veb_layout))
+    return false;
+  if (real_size != sizeof(Real)) {
+    spdlog::error("RenderWorker: coordinator uses {}-byte reals, worker "
+                  "uses {}-byte reals", real_size, sizeof(Real));
+    return false;
+  }
+  if (integrator > static_cast<uint32_t>(Integrator::kWavefront) ||
+      split_method > static_cast<uint32_t>(BVHSplitMethod::kSBVH) ||
+      layout > static_cast<uint32_t>(BVHLayout::kWide8)) {
+    spdlog::error("RenderWorker: invalid integrator ({}), BVH split method "
+                  "({}), or BVH layout ({})", integrator, split_method,
+                  layout);
+    return false;
+  }
+  job.image_height = image_height;
+  job.samples_per_pixel = samples_per_pixel;
+  job.shadow_samples = shadow_samples;
+  job.tile_size = tile_size;
+  job.integrator = static_cast<Integrator>(integrator);
+  job.packet_size = packet_size;
+  job.sort_rays = sort_rays != 0;
+  job.adaptive_threshold = static_cast<Real>(adaptive_threshold);
+  job.adaptive_min_samples = adaptive_min_samples;
+  job.bvh_options.split_method = static_cast<BVHSplitMethod>(split_method);
+  job.bvh_options.layout = static_cast<BVHLayout>(layout);
+  job.bvh_options.bin_count = bin_count;
+  job.bvh_options.traversal_cost = static_cast<Real>(traversal_cost);
+  job.bvh_options.intersection_cost = static_cast<Real>(intersection_cost);
+  job.bvh_options.morton_bits = morton_bits;
+  job.bvh_options.max_duplication = static_cast<Real>(max_duplication);
+  job.bvh_options.packed_meshes = packed_meshes != 0;
+  job.bvh_options.max_leaf_size = max_leaf_size;
+  job.bvh_options.rebuild_threshold = static_cast<Real>(rebuild_threshold);
+  job.bvh_options.quantized_nodes = quantized_nodes != 0;
+  job.bvh_options.veb_layout = veb_layout != 0;
+  return true;
+}
+
+
+//! \brief Open a TCP socket listening on all interfaces
+//! \return Socket; -1 on error
+int
+Listen(uint port)
+{
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  bool ipv6 = fd >= 0;
+  if (!ipv6)
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    spdlog::error("RenderCoordinator: socket() failed: {}", strerror(errno));
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  int result;
+  if (ipv6) {
+    int off = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(static_cast<uint16_t>(port));
+    result = ::bind(fd, reinterpret_cast<sockaddr*>(&address),
+                    sizeof(address));
+  } else {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    result = ::bind(fd, reinterpret_cast<sockaddr*>(&address),
+                    sizeof(address));
+  }
+  if (result < 0 || listen(fd, 64) < 0) {
+    spdlog::error("RenderCoordinator: failed to listen on port {}: {}", port,
+                  strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+//! \brief Connect to a TCP server, retrying until the timeout expires
+//! \return Socket; -1 on error
+int
+Connect(const string &host, uint port, Real timeout)
+{
+  auto deadline = chrono::steady_clock::now() +
+    chrono::milliseconds(static_cast<long>(timeout * 1000));
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto port_name = to_string(port);
+  while (true) {
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port_name.c_str(), &hints, &addresses) == 0) {
+      for (auto address = addresses; address; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype,
+                        address->ai_protocol);
+        if (fd < 0)
+          continue;
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+          freeaddrinfo(addresses);
+          return fd;
+        }
+        close(fd);
+      }
+      freeaddrinfo(addresses);
+    }
+    if (chrono::steady_clock::now() >= deadline)
+      break;
+    this_thread::sleep_for(chrono::milliseconds(200));
+  }
+  spdlog::error("RenderWorker: failed to connect to {}:{}", host, port);
+  return -1;
+}
+
+
+//! \brief Disable Nagle's algorithm: messages are sent as a whole
+void
+SetNoDelay(int fd)
+{
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+}  // namespace
+#endif
+
+
+bool
+RenderJob::LoadScene(Surface::Ptr &scene, std::vector<Light::Ptr> &lights,
+                     Camera::Ptr &camera, Vec2i &image_size) const
+{
+  BVHNode::SetBuildOptions(bvh_options);
+  Surface::Ptr scene_list;
+  if (!RaytraParser::ParseFile(scene_path, scene_list, lights, camera,
+                               image_size) || !scene_list || !camera ||
+      image_size[0] <= 0 || image_size[1] <= 0) {
+    spdlog::error("Failed to parse scene file {}", scene_path);
+    return false;
+  }
+  auto scenelist_ptr = dynamic_pointer_cast<SurfaceList>(scene_list);
+  if (!scenelist_ptr) {
+    spdlog::error("Failed to convert to SurfaceList class.");
+    return false;
+  }
+  for (auto &light : lights) {
+    auto area_light = dynamic_pointer_cast<AreaLight>(light);
+    if (area_light)
+      area_light->SetShadowSamples(shadow_samples);
+  }
+  scene = BVHNode::BuildAccelerator(scenelist_ptr->GetSurfaces(),
+                                    string{"Scene Objects"});
+  return true;
+}
+
+
+void
+RenderJob::Configure(RayTracer &raytracer) const
+{
+  raytracer.SetNumSamplesPerPixel(samples_per_pixel);
+  raytracer.SetTileSize(tile_size);
+  raytracer.SetSeed(seed);
+  raytracer.SetIntegrator(integrator);
+  raytracer.SetPacketSize(packet_size);
+  raytracer.SetSortSecondaryRays(sort_rays);
+  raytracer.SetAdaptiveSampling(adaptive_threshold, adaptive_min_samples);
+  raytracer.SetImageHeight(image_height);
+}
+
+
+RenderCoordinator::RenderCoordinator(const RenderJob &job, uint port) :
+  job_{job},
+  port_{port}
+{
+}
+
+
+#ifndef WIN32
+bool
+RenderCoordinator::Render(RayTracer &raytracer, Camera::Ptr camera)
+{
+  using Clock = chrono::steady_clock;
+  if (!camera)
+    return false;
+  auto image_size = raytracer.ComputeImageSize(camera);
+  if (image_size[0] <= 0 || image_size[1] <= 0) {
+    spdlog::error("RenderCoordinator: invalid image dimensions");
+    return false;
+  }
+  auto start_time = Clock::now();
+
+  // split the frame into tiles
+  struct TileState {
+    cv::Rect rect;                  //!< tile pixels
+    bool done;                      //!< whether the tile was received
+    bool queued;                    //!< whether the tile is in 'pending'
+    Clock::time_point handout_time; //!< time of the last hand-out
+  };
+  std::vector<TileState> tiles;
+  std::deque<uint32_t> pending;
+  for (const auto &rect : raytracer.ComputeTiles(
+         cv::Rect{0, 0, image_size[0], image_size[1]}, tile_size_)) {
+    pending.push_back(static_cast<uint32_t>(tiles.size()));
+    tiles.push_back(TileState{rect, false, true, Clock::time_point{}});
+  }
+  Film film{image_size[0], image_size[1]};
+
+  // listen for workers
+  int listen_fd = Listen(port_);
+  if (listen_fd < 0)
+    return false;
+  spdlog::info("RenderCoordinator: waiting for workers on port {} ({} "
+               "tiles)", port_, tiles.size());
+
+  struct Connection {
+    int fd;                         //!< socket
+    std::string name;               //!< worker name for log messages
+    int64_t tile;                   //!< tile being rendered (-1: idle)
+    std::vector<char> buffer;       //!< bytes received so far
+    size_t tiles_done;              //!< tiles received from the worker
+  };
+  std::vector<Connection> workers;
+  size_t done_count = 0, next_worker_id = 0;
+  handouts_ = 0;
+  auto drop_worker = [&](Connection &worker, const char *reason) {
+    spdlog::warn("RenderCoordinator: {} {} -- dropping it", worker.name,
+                 reason);
+    if (worker.tile >= 0) {
+      auto &tile = tiles[static_cast<size_t>(worker.tile)];
+      if (!tile.done && !tile.queued) {
+        tile.queued = true;
+        pending.push_front(static_cast<uint32_t>(worker.tile));
+      }
+    }
+    close(worker.fd);
+    worker.fd = -1;
+  };
+
+  while (done_count < tiles.size()) {
+    // hand out tiles to idle workers
+    for (auto &worker : workers) {
+      if (worker.fd < 0 || worker.tile >= 0)
+        continue;
+      while (!pending.empty() && tiles[pending.front()].done) {
+        tiles[pending.front()].queued = false;
+        pending.pop_front();
+      }
+      if (pending.empty())
+        break;
+      auto tile = pending.front();
+      pending.pop_front();
+      tiles[tile].queued = false;
+      Message message;
+      message.Put(tile);
+      PutRect(message, tiles[tile].rect);
+      worker.tile = tile;
+      if (!SendMessage(worker.fd, MessageType::kTile, message)) {
+        drop_worker(worker, "failed to receive a tile");
+        continue;
+      }
+      tiles[tile].handout_time = Clock::now();
+      ++handouts_;
+    }
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                 [](const Connection &worker) {
+                                   return worker.fd < 0;}), workers.end());
+
+    // wait for new workers and results
+    std::vector<pollfd> fds(1 + workers.size());
+    fds[0] = pollfd{listen_fd, POLLIN, 0};
+    for (size_t i = 0; i < workers.size(); ++i)
+      fds[i + 1] = pollfd{workers[i].fd, POLLIN, 0};
+    if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) {
+      spdlog::error("RenderCoordinator: poll() failed: {}", strerror(errno));
+      break;
+    }
+
+    // receive results
+    for (size_t i = 0; i < workers.size(); ++i) {
+      auto &worker = workers[i];
+      if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      char chunk[65536];
+      auto count = recv(worker.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+      if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR))
+        continue;
+      if (count <= 0) {
+        drop_worker(worker, "disconnected");
+        continue;
+      }
+      worker.buffer.insert(worker.buffer.end(), chunk, chunk + count);
+
+      MessageType type;
+      Message message;
+      bool corrupt = false;
+      while (worker.fd >= 0 &&
+             PopMessage(worker.buffer, type, message, corrupt)) {
+        uint32_t tile = 0;
+        cv::Rect rect;
+        if (type != MessageType::kResult || !message.Get(tile) ||
+            !GetRect(message, rect) || tile >= tiles.size() ||
+            rect.x != tiles[tile].rect.x || rect.y != tiles[tile].rect.y ||
+            rect.width != tiles[tile].rect.width ||
+            rect.height != tiles[tile].rect.height) {
+          corrupt = true;
+          break;
+        }
+        auto pixel_count = static_cast<size_t>(rect.area());
+        std::vector<Real> color_sums(3 * pixel_count);
+        std::vector<uint32_t> sample_counts(pixel_count);
+        if (!message.GetArray(color_sums.data(), color_sums.size()) ||
+            !message.GetArray(sample_counts.data(), sample_counts.size())) {
+          corrupt = true;
+          break;
+        }
+        if (worker.tile == static_cast<int64_t>(tile))
+          worker.tile = -1;
+        if (tiles[tile].done)
+          continue;
+
+        // add tile to the film
+        size_t index = 0;
+        for (int y = rect.y; y < rect.y + rect.height; ++y) {
+          for (int x = rect.x; x < rect.x + rect.width; ++x, ++index) {
+            Vec3r color_sum{color_sums[3 * index], color_sums[3 * index + 1],
+                            color_sums[3 * index + 2]};
+            film.MergePixel(x, y, color_sum, sample_counts[index]);
+          }
+        }
+        tiles[tile].done = true;
+        ++worker.tiles_done;
+        ++done_count;
+        if (done_count * 10 / tiles.size() !=
+            (done_count - 1) * 10 / tiles.size())
+          spdlog::info("RenderCoordinator: {}/{} tiles done", done_count,
+                       tiles.size());
+      }
+      if (worker.fd >= 0 && corrupt)
+        drop_worker(worker, "sent an invalid message");
+    }
+
+    // accept new workers
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        SetNoDelay(fd);
+        Connection worker{fd, fmt::format("worker {}", next_worker_id++), -1,
+                          {}, 0};
+        Message message;
+        PutJob(message, job_);
+        if (SendMessage(fd, MessageType::kJob, message)) {
+          spdlog::info("RenderCoordinator: {} connected", worker.name);
+          workers.push_back(worker);
+        } else {
+          close(fd);
+        }
+      }
+    }
+
+    // hand out tiles of slow (or hung) workers again, queuing each
+    // tile at most once until it is handed out
+    auto now = Clock::now();
+    for (auto &worker : workers) {
+      if (worker.fd < 0 || worker.tile < 0)
+        continue;
+      auto &tile = tiles[static_cast<size_t>(worker.tile)];
+      if (tile.done || tile.queued ||
+          chrono::duration<double>(now - tile.handout_time).count() <
+          tile_timeout_)
+        continue;
+      spdlog::warn("RenderCoordinator: {} didn't finish tile {} within {}s "
+                   "-- handing it out again", worker.name, worker.tile,
+                   tile_timeout_);
+      tile.queued = true;
+      pending.push_front(static_cast<uint32_t>(worker.tile));
+    }
+  }
+
+  // tell workers the frame is done
+  for (auto &worker : workers) {
+    if (worker.fd < 0)
+      continue;
+    Message message;
+    SendMessage(worker.fd, MessageType::kDone, message);
+    spdlog::info("RenderCoordinator: {} rendered {} tile(s)", worker.name,
+                 worker.tiles_done);
+    close(worker.fd);
+  }
+  close(listen_fd);
+  if (done_count < tiles.size())
+    return false;
+
+  raytracer.SetFilm(film);
+  spdlog::info("RenderCoordinator: rendered {} tiles ({} hand-outs) in {}s",
+               tiles.size(), handouts_, chrono::duration<double>
+               (Clock::now() - start_time).count());
+  return true;
+}
+#else
+bool
+RenderCoordinator::Render(RayTracer &/*raytracer*/, Camera::Ptr /*camera*/)
+{
+  spdlog::error("RenderCoordinator: distributed rendering needs POSIX "
+                "sockets");
+  return false;
+}
+#endif
+
+
+RenderWorker::RenderWorker(const std::string &host, uint port) :
+  host_{host},
+  port_{port}
+{
+}
+
+
+#ifndef WIN32
+bool
+RenderWorker::Run()
+{
+  int fd = Connect(host_, port_, connect_timeout_);
+  if (fd < 0)
+    return false;
+  SetNoDelay(fd);
+
+  // receive job and load scene
+  MessageType type;
+  Message message;
+  RenderJob job;
+  if (!ReceiveMessage(fd, type, message) || type != MessageType::kJob ||
+      !GetJob(message, job)) {
+    spdlog::error("RenderWorker: failed to receive render job");
+    close(fd);
+    return false;
+  }
+  spdlog::info("RenderWorker: rendering {}", job.scene_path);
+  job.bvh_options.num_threads = num_threads_;
+  Surface::Ptr scene;
+  std::vector<Light::Ptr> lights;
+  Camera::Ptr camera;
+  Vec2i image_size;
+  if (!job.LoadScene(scene, lights, camera, image_size)) {
+    close(fd);
+    return false;
+  }
+  RayTracer raytracer;
+  job.Configure(raytracer);
+  raytracer.SetNumThreads(num_threads_);
+  raytracer.SetShowProgressBar(false);
+
+  // render tiles until the coordinator is done
+  size_t tile_count = 0;
+  bool success = false;
+  while (ReceiveMessage(fd, type, message)) {
+    if (type == MessageType::kDone) {
+      success = true;
+      break;
+    }
+    uint32_t tile = 0;
+    cv::Rect rect;
+    if (type != MessageType::kTile || !message.Get(tile) ||
+        !GetRect(message, rect) || rect.area() <= 0) {
+      spdlog::error("RenderWorker: received an invalid message");
+      break;
+    }
+    raytracer.SetCropWindow(rect);
+    auto log_level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    bool rendered = raytracer.Render(scene, lights, camera);
+    spdlog::set_level(log_level);
+    if (!rendered)
+      break;
+
+    // send color sums and sample counts of the tile
+    const auto &film = raytracer.GetFilm();
+    auto pixel_count = static_cast<size_t>(rect.area());
+    std::vector<Real> color_sums;
+    std::vector<uint32_t> sample_counts;
+    color_sums.reserve(3 * pixel_count);
+    sample_counts.reserve(pixel_count);
+    for (int y = rect.y; y < rect.y + rect.height; ++y) {
+      for (int x = rect.x; x < rect.x + rect.width; ++x) {
+        const auto &color_sum = film.GetColorSum(x, y);
+        color_sums.insert(color_sums.end(), color_sum.data(),
+                          color_sum.data() + 3);
+        sample_counts.push_back(film.GetSampleCount(x, y));
+      }
+    }
+    Message result;
+    result.Put(tile);
+    PutRect(result, rect);
+    result.PutArray(color_sums.data(), color_sums.size());
+    result.PutArray(sample_counts.data(), sample_counts.size());
+    if (!SendMessage(fd, MessageType::kResult, result)) {
+      spdlog::error("RenderWorker: failed to send tile {}", tile);
+      break;
+    }
+    ++tile_count;
+  }
+  close(fd);
+  if (!success)
+    spdlog::error("RenderWorker: lost connection to the coordinator");
+  spdlog::info("RenderWorker: rendered {} tile(s)", tile_count);
+  return success;
+}
+#else
+bool
+RenderWorker::Run()
+{
+  spdlog::error("RenderWorker: distributed rendering needs POSIX sockets");
+  return false;
+}
+#endif
+
+}  // namespace core
+}  // namespace olio
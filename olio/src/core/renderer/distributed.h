@@ -0,0 +1,140 @@
+//! \file       distributed.h
+//! \brief      RenderJob, RenderCoordinator, and RenderWorker classes
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "core/types.h"
+#include "core/geometry/surface.h"
+#include "core/geometry/bvh_node.h"
+#include "core/light/light.h"
+#include "core/camera/camera.h"
+#include "core/renderer/raytracer.h"
+
+namespace olio {
+namespace core {
+
+//! \struct RenderJob
+//! \brief Scene and render settings shared by a coordinator and its
+//! workers
+//! \details Workers load the scene from 'scene_path' themselves, so
+//!    the scene file and the files it references must be readable by
+//!    every worker under the same path (e.g., on the same machine or a
+//!    shared file system).
+struct RenderJob {
+  std::string scene_path;         //!< scene file
+  uint image_height{0};           //!< output image height (0: scene's)
+  uint samples_per_pixel{1};      //!< samples per pixel
+  uint shadow_samples{1};         //!< area light shadow samples
+  uint tile_size{32};             //!< tile size used inside RayTracer
+  uint64_t seed{0};               //!< sampler seed
+  Integrator integrator{Integrator::kRecursive};  //!< ray color integrator
+  uint packet_size{16};           //!< wavefront rays per packet
+  bool sort_rays{false};          //!< sort wavefront secondary rays
+  Real adaptive_threshold{0};     //!< adaptive sampling threshold (0: off)
+  uint adaptive_min_samples{16};  //!< min samples before a pixel converges
+  BVHBuildOptions bvh_options;    //!< BVH builder settings
+
+  //! \brief Parse the scene file and build its BVH
+  //! \details Also makes 'bvh_options' the default BVH builder
+  //!    settings (see BVHNode::SetBuildOptions()), so that they apply
+  //!    to the mesh BVHs too.
+  //! \param[out] scene Scene BVH
+  //! \param[out] lights Scene lights (area lights use 'shadow_samples')
+  //! \param[out] camera Scene camera
+  //! \param[out] image_size Image size specified in the scene file
+  //! \return True on success
+  bool LoadScene(Surface::Ptr &scene, std::vector<Light::Ptr> &lights,
+                 Camera::Ptr &camera, Vec2i &image_size) const;
+
+  //! \brief Apply the render settings to a RayTracer
+  //! \param[in,out] raytracer RayTracer to configure
+  void Configure(RayTracer &raytracer) const;
+};
+
+
+//! \class RenderCoordinator
+//! \brief Renders a frame by handing out its tiles to RenderWorker
+//! processes over TCP
+//! \details The coordinator listens on a port for workers, which may
+//!    connect at any time during the render. Each worker is sent the
+//!    RenderJob and then one tile at a time; it renders the tile with
+//!    a RayTracer and sends back the tile's color sums and sample
+//!    counts, which the coordinator adds to its film. Workers that
+//!    disconnect have their tile handed out again, as do workers that
+//!    don't return a tile within the tile timeout (whichever copy
+//!    arrives first is used). Pixels get the same samples as in a
+//!    local render, so the assembled image is identical to it.
+//!    Messages use the native byte order, so all machines must share
+//!    it. Uses POSIX sockets; on Windows, Render() fails.
+class RenderCoordinator {
+public:
+  //! \brief Constructor
+  //! \param[in] job Render job sent to the workers
+  //! \param[in] port TCP port to listen on
+  RenderCoordinator(const RenderJob &job, uint port);
+
+  //! \brief Set the edge length of the tiles handed out to workers
+  //! \param[in] tile_size Tile edge length in pixels
+  inline void SetTileSize(uint tile_size) {tile_size_ = tile_size;}
+
+  //! \brief Set how long a worker may take to render a tile before
+  //! the tile is also handed out to another worker
+  //! \param[in] seconds Tile timeout in seconds
+  inline void SetTileTimeout(Real seconds) {tile_timeout_ = seconds;}
+
+  //! \brief Render the frame with the connected workers
+  //! \details Blocks until every tile has been rendered. On success,
+  //!    the assembled film is stored in the RayTracer (see
+  //!    RayTracer::SetFilm()), e.g., to be saved with WriteImage().
+  //! \param[in,out] raytracer RayTracer configured with the job
+  //! \param[in] camera Scene camera (determines the image size)
+  //! \return True on success
+  bool Render(RayTracer &raytracer, Camera::Ptr camera);
+
+  //! \brief Get the number of tiles handed out by the last render
+  //! \details Exceeds the tile count when tiles were handed out again
+  //!    (see SetTileTimeout()).
+  //! \return Tile hand-out count
+  inline size_t GetNumHandOuts() const {return handouts_;}
+protected:
+  RenderJob job_;             //!< render job
+  uint port_;                 //!< listening port
+  uint tile_size_{64};        //!< edge length of the handed out tiles
+  Real tile_timeout_{60};     //!< seconds before a tile is handed out again
+  size_t handouts_{0};        //!< tile hand-outs of the last render
+};
+
+
+//! \class RenderWorker
+//! \brief Renders tiles for a RenderCoordinator
+//! \details Uses POSIX sockets; on Windows, Run() fails.
+class RenderWorker {
+public:
+  //! \brief Constructor
+  //! \param[in] host Coordinator host name or address
+  //! \param[in] port Coordinator port
+  RenderWorker(const std::string &host, uint port);
+
+  //! \brief Set the number of render threads
+  //! \param[in] num_threads Thread count (0: all cores)
+  inline void SetNumThreads(uint num_threads) {num_threads_ = num_threads;}
+
+  //! \brief Set how long to keep trying to connect to the coordinator
+  //! \param[in] seconds Connection timeout in seconds
+  inline void SetConnectTimeout(Real seconds) {connect_timeout_ = seconds;}
+
+  //! \brief Connect to the coordinator and render tiles until it
+  //! reports that the frame is done
+  //! \return True on success
+  bool Run();
+protected:
+  std::string host_;          //!< coordinator host
+  uint port_;                 //!< coordinator port
+  uint num_threads_{0};       //!< render threads (0: all cores)
+  Real connect_timeout_{30};  //!< seconds to keep trying to connect
+};
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,167 @@
+//! \file       film.cc
+//! \brief      Film class
+
+#include "core/renderer/film.h"
+#include <cstdint>
+#include <spdlog/spdlog.h>
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! \brief Write the contents of a vector in binary
+template <typename T>
+void
+WriteVector(ostream &out, const vector<T> &values)
+{
+  out.write(reinterpret_cast<const char*>(values.data()),
+            static_cast<streamsize>(values.size() * sizeof(T)));
+}
+
+
+//! \brief Read the contents of a vector (of known size) in binary
+template <typename T>
+bool
+ReadVector(istream &in, vector<T> &values)
+{
+  in.read(reinterpret_cast<char*>(values.data()),
+          static_cast<streamsize>(values.size() * sizeof(T)));
+  return static_cast<bool>(in);
+}
+
+}  // namespace
+
+
+Film::Film(int width, int height)
+{
+  Reset(width, height);
+}
+
+
+void
+Film::Reset(int width, int height)
+{
+  width_ = std::max(width, 0);
+  height_ = std::max(height, 0);
+  auto pixel_count = static_cast<size_t>(width_) * static_cast<size_t>(height_);
+  color_sum_.assign(pixel_count, Vec3r{0, 0, 0});
+  sample_count_.assign(pixel_count, 0);
+  luminance_mean_.assign(pixel_count, 0);
+  luminance_m2_.assign(pixel_count, 0);
+  converged_.assign(pixel_count, 0);
+}
+
+
+void
+Film::Clear(const cv::Rect &region)
+{
+  for (int y = region.y; y < region.y + region.height; ++y) {
+    for (int x = region.x; x < region.x + region.width; ++x) {
+      auto index = GetPixelIndex(x, y);
+      color_sum_[index] = Vec3r{0, 0, 0};
+      sample_count_[index] = 0;
+      luminance_mean_[index] = 0;
+      luminance_m2_[index] = 0;
+      converged_[index] = 0;
+    }
+  }
+}
+
+
+cv::Mat
+Film::Resolve() const
+{
+  cv::Mat image(cv::Size(width_, height_), CV_64FC3, cv::Scalar(0, 0, 0, 0));
+  Resolve(cv::Rect{0, 0, width_, height_}, image);
+  return image;
+}
+
+
+void
+Film::Resolve(const cv::Rect &region, cv::Mat &image) const
+{
+  for (int y = region.y; y < region.y + region.height; ++y) {
+    for (int x = region.x; x < region.x + region.width; ++x) {
+      const Vec3r &color = GetPixel(x, y);
+      image.at<cv::Vec3d>(height_ - y - 1, x) =
+        cv::Vec3d{color[0], color[1], color[2]};
+    }
+  }
+}
+
+
+cv::Mat
+Film::ResolveSampleCount() const
+{
+  cv::Mat image(cv::Size(width_, height_), CV_64FC3, cv::Scalar(0, 0, 0, 0));
+  for (int y = 0; y < height_; ++y) {
+    for (int x = 0; x < width_; ++x) {
+      double count = GetSampleCount(x, y);
+      image.at<cv::Vec3d>(height_ - y - 1, x) = cv::Vec3d{count, count, count};
+    }
+  }
+  return image;
+}
+
+
+
+bool
+Film::Write(ostream &out) const
+{
+  static_assert(sizeof(Vec3r) == 3 * sizeof(Real), "Vec3r must be packed");
+  int32_t size[2] = {width_, height_};
+  out.write(reinterpret_cast<const char*>(size), sizeof(size));
+  WriteVector(out, color_sum_);
+  WriteVector(out, sample_count_);
+  WriteVector(out, luminance_mean_);
+  WriteVector(out, luminance_m2_);
+  WriteVector(out, converged_);
+  return static_cast<bool>(out);
+}
+
+
+bool
+Film::Read(istream &in, int width, int height)
+{
+  // check the stored size before allocating anything for it
+  int32_t size[2] = {0, 0};
+  in.read(reinterpret_cast<char*>(size), sizeof(size));
+  if (!in || size[0] != width || size[1] != height) {
+    spdlog::error("Film: stored film size doesn't match the image size "
+                  "{}x{}", width, height);
+    Reset(width, height);
+    return false;
+  }
+  auto data_start = in.tellg();
+  if (data_start != streampos(-1)) {
+    in.seekg(0, ios::end);
+    auto data_end = in.tellg();
+    in.seekg(data_start);
+    auto pixel_count = static_cast<size_t>(std::max(width, 0)) *
+      static_cast<size_t>(std::max(height, 0));
+    auto pixel_bytes = sizeof(Vec3r) + sizeof(uint) + 2 * sizeof(Real) +
+      sizeof(uchar);
+    if (!in || data_end < data_start || static_cast<size_t>(
+          data_end - data_start) < pixel_count * pixel_bytes) {
+      spdlog::error("Film: truncated film data");
+      Reset(width, height);
+      return false;
+    }
+  }
+
+  Reset(width, height);
+  if (!ReadVector(in, color_sum_) || !ReadVector(in, sample_count_) ||
+      !ReadVector(in, luminance_mean_) || !ReadVector(in, luminance_m2_) ||
+      !ReadVector(in, converged_)) {
+    spdlog::error("Film: truncated film data");
+    Reset(width, height);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,201 @@
+//! \file       film.h
+//! \brief      Film class
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include "core/types.h"
+
+namespace olio {
+namespace core {
+
+//! \class Film
+//! \brief Accumulation buffer that stores the running sum of sample
+//! colors and the number of samples taken for each pixel
+//! \details Pixels are addressed in camera space, i.e., (0, 0) is the
+//!    lower left pixel of the image; the linear pixel index is
+//!    y * width + x. Different threads may add samples concurrently
+//!    as long as they touch different pixels. For adaptive sampling,
+//!    the film also keeps a running mean and variance (Welford's
+//!    algorithm) of the luminance of each pixel's samples.
+class Film {
+public:
+  //! \brief Default constructor
+  Film() = default;
+
+  //! \brief Constructor
+  //! \param[in] width Film width in pixels
+  //! \param[in] height Film height in pixels
+  Film(int width, int height);
+
+  //! \brief Resize the film and clear all pixels
+  //! \param[in] width Film width in pixels
+  //! \param[in] height Film height in pixels
+  void Reset(int width, int height);
+
+  //! \brief Clear the pixels inside a region (same as Reset() for
+  //! those pixels only)
+  //! \param[in] region Pixels to clear (camera space)
+  void Clear(const cv::Rect &region);
+
+  //! \brief Get film width
+  //! \return Film width in pixels
+  inline int GetWidth() const {return width_;}
+
+  //! \brief Get film height
+  //! \return Film height in pixels
+  inline int GetHeight() const {return height_;}
+
+  //! \brief Check if the film has no pixels
+  //! \return True if the film is empty
+  inline bool IsEmpty() const {return color_sum_.empty();}
+
+  //! \brief Get linear index of a pixel
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \return Pixel index
+  inline size_t GetPixelIndex(int x, int y) const {
+    return static_cast<size_t>(y) * static_cast<size_t>(width_) +
+      static_cast<size_t>(x);
+  }
+
+  //! \brief Add a sample to a pixel
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \param[in] color Sample color
+  inline void AddSample(int x, int y, const Vec3r &color) {
+    auto index = GetPixelIndex(x, y);
+    color_sum_[index] += color;
+    auto count = ++sample_count_[index];
+
+    // update running luminance statistics
+    Real luminance = 0.2126f * color[0] + 0.7152f * color[1] +
+      0.0722f * color[2];
+    Real delta = luminance - luminance_mean_[index];
+    luminance_mean_[index] += delta / count;
+    luminance_m2_[index] += delta * (luminance - luminance_mean_[index]);
+  }
+
+  //! \brief Add the samples of a pixel of another film
+  //! \details Only the color sum and sample count are merged; the
+  //!    luminance statistics of the pixel are left unchanged.
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \param[in] color_sum Sum of the sample colors
+  //! \param[in] count Number of samples
+  inline void MergePixel(int x, int y, const Vec3r &color_sum, uint count) {
+    auto index = GetPixelIndex(x, y);
+    color_sum_[index] += color_sum;
+    sample_count_[index] += count;
+  }
+
+  //! \brief Estimate the relative error of a pixel
+  //! \details Returns the half-width of the 95% confidence interval
+  //!    of the pixel's mean luminance, divided by the mean luminance
+  //!    (clamped from below to 'min_luminance' so that dark pixels do
+  //!    not need an unbounded number of samples).
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \param[in] min_luminance Lower bound of the mean used as divisor
+  //! \return Relative error; infinity if the pixel has fewer than two
+  //!         samples
+  inline Real GetRelativeError(int x, int y, Real min_luminance=1/256.0f) const {
+    auto index = GetPixelIndex(x, y);
+    auto count = sample_count_[index];
+    if (count < 2)
+      return kInfinity;
+    Real variance = luminance_m2_[index] / (count - 1);
+    Real half_width = 1.96f * std::sqrt(variance / count);
+    return half_width / std::max(luminance_mean_[index], min_luminance);
+  }
+
+  //! \brief Mark a pixel as converged (no more samples needed)
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  inline void SetConverged(int x, int y) {converged_[GetPixelIndex(x, y)] = 1;}
+
+  //! \brief Check whether a pixel has been marked as converged
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \return True if converged
+  inline bool IsConverged(int x, int y) const {
+    return converged_[GetPixelIndex(x, y)] != 0;
+  }
+
+  //! \brief Get the number of samples accumulated in a pixel
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \return Sample count
+  inline uint GetSampleCount(int x, int y) const {
+    return sample_count_[GetPixelIndex(x, y)];
+  }
+
+  //! \brief Get the sum of the sample colors of a pixel
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \return Color sum
+  inline const Vec3r& GetColorSum(int x, int y) const {
+    return color_sum_[GetPixelIndex(x, y)];
+  }
+
+  //! \brief Get the current estimate (sample mean) of a pixel
+  //! \param[in] x Pixel x coordinate
+  //! \param[in] y Pixel y coordinate (grows upwards)
+  //! \return Pixel color; black if the pixel has no samples
+  inline Vec3r GetPixel(int x, int y) const {
+    auto index = GetPixelIndex(x, y);
+    if (!sample_count_[index])
+      return Vec3r{0, 0, 0};
+    return color_sum_[index] / sample_count_[index];
+  }
+
+  //! \brief Convert the accumulated samples to an image
+  //! \return Image of type CV_64FC3 (RGB) with its first row at the
+  //!         top of the film
+  cv::Mat Resolve() const;
+
+  //! \brief Convert the accumulated samples inside a region to colors
+  //! \param[in] region Pixels to convert (camera space)
+  //! \param[in,out] image Image of type CV_64FC3 and of the size of the
+  //!                film, with its first row at the top of the film
+  void Resolve(const cv::Rect &region, cv::Mat &image) const;
+
+  //! \brief Convert per-pixel sample counts to an image
+  //! \return Image of type CV_64FC3 holding the sample count of each
+  //!         pixel in all three channels, with its first row at the top
+  //!         of the film
+  cv::Mat ResolveSampleCount() const;
+
+  //! \brief Write the film (size and all per-pixel data) in binary
+  //! \details Values are written bit for bit, so a film read back
+  //!    with Read() continues accumulating exactly as this one would.
+  //! \param[out] out Output stream (opened in binary mode)
+  //! \return True on success
+  bool Write(std::ostream &out) const;
+
+  //! \brief Read a film written by Write()
+  //! \details The stored size and the length of the stream are checked
+  //!    before the film is resized, so a damaged file can't make it
+  //!    allocate more than a film of the expected size.
+  //! \param[in] in Input stream (opened in binary mode)
+  //! \param[in] width Expected film width
+  //! \param[in] height Expected film height
+  //! \return True on success; on failure, the film is cleared to the
+  //!    expected size
+  bool Read(std::istream &in, int width, int height);
+protected:
+  int width_{0};                    //!< film width
+  int height_{0};                   //!< film height
+  std::vector<Vec3r> color_sum_;    //!< per-pixel sum of sample colors
+  std::vector<uint> sample_count_;  //!< per-pixel sample count
+  std::vector<Real> luminance_mean_;  //!< per-pixel mean luminance
+  std::vector<Real> luminance_m2_;  //!< per-pixel sum of squared deviations
+  std::vector<uchar> converged_;    //!< per-pixel convergence flag
+};
+
+}  // namespace core
+}  // namespace olio
@@ -4,8 +4,17 @@
 #include "core/renderer/raytracer.h"
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include <boost/filesystem.hpp>
 #include <spdlog/spdlog.h>
+#include "core/geometry/bvh_stats.h"
 #include "core/geometry/sphere.h"
 #include "core/material/phong_material.h"
 #include "core/material/phong_dielectric.h"
@@ -18,15 +27,18 @@ using namespace std;
 bool
 RayTracer::RayColor(const Ray &ray, Surface::Ptr scene,
                     const std::vector<Light::Ptr> &lights, uint ray_depth,
-                    uint max_ray_depth, Vec3r &ray_color)
+                    uint max_ray_depth, Sampler &sampler, Vec3r &ray_color)
 {
   // check for when the ray bounces exceed the limit
   ray_color = Vec3r{0, 0, 0};
   if (ray_depth >= max_ray_depth)
     return false;
+  RenderProgressIncRays();
 
   // check whether ray hits any scene object
   HitRecord hit_record;
+  BVHStats::BeginRays(ray_depth ? BVHRayType::kSecondary :
+                      BVHRayType::kCamera);
   if (!scene->Hit(ray, kEpsilon, kInfinity, hit_record))
     return false;
 
@@ -51,7 +63,7 @@ RayTracer::RayColor(const Ray &ray, Surface::Ptr scene,
       if (refract_ray) {  // refract
         Vec3r refract_color;
         if (RayColor(*refract_ray, scene, lights, ray_depth + 1, max_ray_depth,
-                     refract_color)) {
+                     sampler, refract_color)) {
           ray_color += attenuate.cwiseProduct(refract_color *
                                               (1.0f - schlick_reflectance));
         }
@@ -60,15 +72,18 @@ RayTracer::RayColor(const Ray &ray, Surface::Ptr scene,
       if (reflect_ray) {  // reflect
         Vec3r reflect_color;
         if (RayColor(*reflect_ray, scene, lights, ray_depth + 1, max_ray_depth,
-                     reflect_color)) {
+                     sampler, reflect_color)) {
           ray_color += attenuate.cwiseProduct(reflect_color * schlick_reflectance);
         }
       }
     } else {
       // compute normal Phong shading
       Vec3r view_vec = -ray.GetDirection().normalized();
+      size_t shadow_rays = 0;
       for (auto light : lights)
-        ray_color += light->Illuminate(hit_record, view_vec, scene);
+        ray_color += light->Illuminate(hit_record, view_vec, scene, sampler,
+                                       shadow_rays);
+      RenderProgressIncRays(shadow_rays);
 
       // compute mirror reflections
       const auto &v = ray.GetDirection();
@@ -77,8 +92,8 @@ RayTracer::RayColor(const Ray &ray, Surface::Ptr scene,
       const auto &mirror = phong_material->GetMirror();
       if (!mirror.isZero() && hit_record.IsFrontFace()) {
         Vec3r reflect_color;
-        if (RayColor(Ray{hit_record.GetPoint(), reflect}, scene,
-                     lights, ray_depth + 1, max_ray_depth, reflect_color))
+        if (RayColor(Ray{hit_record.GetPoint(), reflect}, scene, lights,
+                     ray_depth + 1, max_ray_depth, sampler, reflect_color))
           ray_color += mirror.cwiseProduct(reflect_color);
       }
     }
@@ -99,51 +114,122 @@ RayTracer::Render(Surface::Ptr scene, const std::vector<Light::Ptr> &lights,
   auto start_time = chrono::system_clock::now();
 
   // compute output image dimensions
-  auto aspect = camera->GetAspectRatio();
-  auto height = static_cast<int>(image_height_);
-  auto width = static_cast<int>(aspect * static_cast<Real>(height) + 0.5f);
+  auto image_size = ComputeImageSize(camera);
+  auto width = image_size[0];
+  auto height = image_size[1];
   if (height <= 0 || width <= 0) {
     spdlog::error("RayTracer: invalid image dimensions");
     return false;
   }
 
-  // initialize image
-  rendered_image_ = cv::Mat(cv::Size(width, height), CV_64FC3,
-                            cv::Scalar(0, 0, 0, 0));
+  // clip crop window to the image
+  cv::Rect region{0, 0, width, height};
+  if (crop_window_.area() > 0) {
+    int x0 = std::max(crop_window_.x, 0);
+    int y0 = std::max(crop_window_.y, 0);
+    int x1 = std::min(crop_window_.x + crop_window_.width, width);
+    int y1 = std::min(crop_window_.y + crop_window_.height, height);
+    region = cv::Rect{x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0)};
+  }
+
+  // initialize image and accumulation buffer; when rendering a crop
+  // window of the same image again, only the window is cleared
+  if (crop_window_.area() > 0 && film_.GetWidth() == width &&
+      film_.GetHeight() == height && rendered_image_.rows == height &&
+      rendered_image_.cols == width) {
+    film_.Clear(region);
+  } else {
+    rendered_image_ = cv::Mat(cv::Size(width, height), CV_64FC3,
+                              cv::Scalar(0, 0, 0, 0));
+    film_.Reset(width, height);
+  }
+  wavefront_stats_ = WavefrontStats{};
+
+  // checkpoints are written and the time budget is checked between
+  // passes, so long single-pass renders are split into passes
+  uint pass_samples = samples_per_pass_ ? samples_per_pass_ :
+    samples_per_pixel_;
+  if ((!checkpoint_path_.empty() || time_budget_ > 0) && !samples_per_pass_)
+    pass_samples = std::max((samples_per_pixel_ + 15) / 16, 1u);
+
+  // continue from the last checkpoint
+  uint first_sample = 0;
+  uint pass_count = 0;
+  if (resume_ && !checkpoint_path_.empty()) {
+    if (!boost::filesystem::exists(checkpoint_path_)) {
+      spdlog::warn("RayTracer: checkpoint {} not found -- starting a new "
+                   "render", checkpoint_path_);
+    } else if (!ReadCheckpoint(region, pass_samples, first_sample,
+                               pass_count)) {
+      return false;
+    } else {
+      spdlog::info("Resuming render at sample {} (pass {})", first_sample,
+                   pass_count);
+    }
+  }
+  auto last_checkpoint_time = chrono::steady_clock::now();
 
   // start progress bar
   spdlog::info("Rendering...");
-  auto total_pixels = static_cast<size_t>(width * height);
-  RenderProgressStart(total_pixels);
+  auto total_pixels = static_cast<size_t>(region.area());
+  auto total_samples = total_pixels * (samples_per_pixel_ - std::min(
+    first_sample, samples_per_pixel_));
+
+  // split image into tiles and render them in parallel, in one or
+  // more passes
+  auto tiles = ComputeTiles(region);
+  int max_threads = num_threads_ ? static_cast<int>(num_threads_) :
+    tbb::task_arena::automatic;
+  tbb::task_arena arena(max_threads);
+  arena.initialize();
+  RenderProgressStart(total_pixels, total_samples,
+                      static_cast<size_t>(arena.max_concurrency()));
+  uint sample_end = first_sample;
+  for (uint sample_begin = first_sample; sample_begin < samples_per_pixel_;
+       sample_begin += pass_samples) {
+    sample_end = std::min(sample_begin + pass_samples, samples_per_pixel_);
+    arena.execute([&] {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, tiles.size(), 1),
+                        [&](const tbb::blocked_range<size_t> &range) {
+                          for (size_t i = range.begin(); i != range.end(); ++i)
+                            RenderTile(tiles[i], scene, lights, camera,
+                                       sample_begin, sample_end);
+                        });
+    });
+    ++pass_count;
+    if (sample_end == samples_per_pixel_)
+      break;
+
+    // write checkpoint
+    if (!checkpoint_path_.empty() &&
+        chrono::duration<double>(chrono::steady_clock::now() -
+                                 last_checkpoint_time).count() >=
+        checkpoint_interval_) {
+      WriteCheckpoint(region, pass_samples, sample_end, pass_count);
+      last_checkpoint_time = chrono::steady_clock::now();
+    }
 
-  // send rays
-  Real xscale = 1.0 / width;
-  Real yscale = 1.0 / height;
-  
-    for(int y=0;y<height;y++){
-      for(int x=0;x<width;x++){
-        Vec3r ray_color ={0,0,0};
-        if(samples_per_pixel_==1){
-          auto ray = camera->GetRay((x + .5) * xscale, (y + .5) * yscale);
-          RayColor(ray,scene,lights,0,6,ray_color);
-        }
-        else{
-            Vec3r newColor={0,0,0};
-            for(uint p= 0; p<samples_per_pixel_; p++){
-              auto xOffset = (Real)rand()/RAND_MAX;
-              auto yOffset = (Real)rand()/RAND_MAX;
-              auto ray = camera->GetRay((x + xOffset) * xscale, (y + yOffset) * yscale);
-              RayColor(ray, scene, lights, 0, max_ray_depth_, newColor);
-              ray_color+=newColor;
-            }
-        }
-        ray_color /= samples_per_pixel_;
-        rendered_image_.at<cv::Vec3d>((height - y -1), x) =
-          cv::Vec3d{ray_color[0], ray_color[1], ray_color[2]};
-        RenderProgressIncDonePixels();
-      }
+    // write intermediate image
+    if (!preview_image_name_.empty() &&
+        pass_count % std::max(preview_every_passes_, 1u) == 0) {
+      film_.Resolve(region, rendered_image_);
+      WriteImage(preview_image_name_, preview_gamma_);
     }
 
+    // check time budget
+    auto elapsed = chrono::duration_cast<chrono::duration<double>>
+      (chrono::system_clock::now() - start_time).count();
+    if (time_budget_ > 0 && elapsed >= time_budget_) {
+      spdlog::info("RayTracer: time budget of {}s exhausted after {} "
+                   "pass(es) ({} samples per pixel)", time_budget_,
+                   pass_count, sample_end);
+      break;
+    }
+  }
+  film_.Resolve(region, rendered_image_);
+  if (!checkpoint_path_.empty() && sample_end > first_sample)
+    WriteCheckpoint(region, pass_samples, sample_end, pass_count);
+
   // stop progress bar
   RenderProgressEnd();
 
@@ -151,12 +237,382 @@ RayTracer::Render(Surface::Ptr scene, const std::vector<Light::Ptr> &lights,
   auto end_time = std::chrono::system_clock::now();
   auto total_time = chrono::duration_cast<chrono::duration<double>>
     (end_time - start_time).count();
+  uint64_t total_rays = 0;
+  for (const auto &counter : progress_counters_)
+    total_rays += counter.rays.load(std::memory_order_relaxed);
+  render_time_ = total_time;
+  traced_rays_ = total_rays;
   spdlog::info("Total render time: {}", total_time);
+  spdlog::info("Traced {} rays ({:.3f} Mrays/s)", total_rays,
+               static_cast<double>(total_rays) / total_time * 1e-6);
+  if (integrator_ == Integrator::kWavefront &&
+      wavefront_stats_.secondary_rays) {
+    spdlog::info("Secondary rays: {} traced in {:.3f}s, {} sorted in "
+                 "{:.3f}s (thread time)", wavefront_stats_.secondary_rays,
+                 wavefront_stats_.secondary_time,
+                 wavefront_stats_.sorted_rays, wavefront_stats_.sort_time);
+  }
 
   return true;
 }
 
 
+//! \struct CheckpointHeader
+//! \brief Render settings and position stored in front of the film
+//! in a checkpoint file
+struct CheckpointHeader {
+  char magic[8];                  //!< "OLIOCKPT"
+  uint32_t version;               //!< file format version
+  uint32_t samples_per_pixel;     //!< target samples per pixel
+  uint64_t seed;                  //!< sampler seed
+  uint32_t pass_samples;          //!< samples per pixel per pass
+  uint32_t integrator;            //!< Integrator
+  uint32_t max_ray_depth;         //!< max ray depth
+  uint32_t adaptive_min_samples;  //!< min samples before convergence
+  double adaptive_threshold;      //!< adaptive sampling threshold
+  int32_t region[4];              //!< rendered region (x, y, width, height)
+  uint32_t sample_end;            //!< first sample not yet rendered
+  uint32_t pass_count;            //!< rendered passes
+};
+static const char kCheckpointMagic[8] = {'O', 'L', 'I', 'O',
+                                         'C', 'K', 'P', 'T'};
+static const uint32_t kCheckpointVersion = 2;
+
+
+//! \brief Flush a file or directory to disk
+//! \details Directories can't be flushed on Windows; they are skipped.
+//! \param[in] path File or directory path
+//! \param[in] is_directory Whether 'path' is a directory
+//! \return True on success
+static bool
+SyncToDisk(const std::string &path, bool is_directory)
+{
+#ifdef WIN32
+  if (is_directory)
+    return true;
+  int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+  if (fd < 0)
+    return false;
+  bool is_synced = _commit(fd) == 0;
+  _close(fd);
+#else
+  int fd = open(path.c_str(), is_directory ? O_RDONLY | O_DIRECTORY :
+                O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool is_synced = fsync(fd) == 0;
+  close(fd);
+#endif
+  return is_synced;
+}
+
+
+bool
+RayTracer::WriteCheckpoint(const cv::Rect &region, uint pass_samples,
+                           uint sample_end, uint pass_count)
+{
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+  header.version = kCheckpointVersion;
+  header.samples_per_pixel = samples_per_pixel_;
+  header.seed = seed_;
+  header.pass_samples = pass_samples;
+  header.integrator = static_cast<uint32_t>(integrator_);
+  header.max_ray_depth = max_ray_depth_;
+  header.adaptive_min_samples = adaptive_min_samples_;
+  header.adaptive_threshold = adaptive_threshold_;
+  header.region[0] = region.x;
+  header.region[1] = region.y;
+  header.region[2] = region.width;
+  header.region[3] = region.height;
+  header.sample_end = sample_end;
+  header.pass_count = pass_count;
+
+  // write to a uniquely named temporary file, flush it to disk, and
+  // rename it, so that neither a crash nor another render writing the
+  // same checkpoint ever leaves a partial checkpoint behind
+  namespace fs = boost::filesystem;
+  boost::system::error_code ec;
+  fs::path path{checkpoint_path_};
+  auto tmp_path = (path.parent_path() /
+                   fs::unique_path(path.filename().string() +
+                                   ".%%%%%%%%.tmp")).string();
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      spdlog::error("RayTracer: failed to open checkpoint file {}", tmp_path);
+      return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!film_.Write(out) || !out.flush()) {
+      spdlog::error("RayTracer: failed to write checkpoint file {}",
+                    tmp_path);
+      out.close();
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+  }
+  if (!SyncToDisk(tmp_path, false)) {
+    spdlog::error("RayTracer: failed to flush checkpoint file {}", tmp_path);
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  fs::rename(tmp_path, path, ec);
+  if (ec) {
+    spdlog::error("RayTracer: failed to rename {} to {}: {}", tmp_path,
+                  checkpoint_path_, ec.message());
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+
+  // make the rename itself durable
+  auto directory = path.parent_path().empty() ? fs::path{"."} :
+    path.parent_path();
+  if (!SyncToDisk(directory.string(), true))
+    spdlog::warn("RayTracer: failed to flush directory {}", directory.string());
+  spdlog::debug("Wrote checkpoint {} (sample {})", checkpoint_path_,
+                sample_end);
+  return true;
+}
+
+
+bool
+RayTracer::ReadCheckpoint(const cv::Rect &region, uint pass_samples,
+                          uint &sample_begin, uint &pass_count)
+{
+  std::ifstream in(checkpoint_path_, std::ios::binary);
+  if (!in) {
+    spdlog::error("RayTracer: failed to open checkpoint file {}",
+                  checkpoint_path_);
+    return false;
+  }
+  CheckpointHeader header;
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (!in || memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) ||
+      header.version != kCheckpointVersion) {
+    spdlog::error("RayTracer: {} is not a checkpoint file",
+                  checkpoint_path_);
+    return false;
+  }
+
+  // the remaining samples must be taken exactly as the original
+  // render would have taken them
+  if (header.samples_per_pixel != samples_per_pixel_ ||
+      header.seed != seed_ || header.pass_samples != pass_samples ||
+      header.integrator != static_cast<uint32_t>(integrator_) ||
+      header.max_ray_depth != max_ray_depth_ ||
+      header.adaptive_min_samples != adaptive_min_samples_ ||
+      header.adaptive_threshold != adaptive_threshold_) {
+    spdlog::error("RayTracer: checkpoint {} was written with different "
+                  "render settings", checkpoint_path_);
+    return false;
+  }
+  if (header.region[0] != region.x || header.region[1] != region.y ||
+      header.region[2] != region.width || header.region[3] != region.height) {
+    spdlog::error("RayTracer: checkpoint {} was written for crop window "
+                  "({}, {}, {}x{}), not ({}, {}, {}x{})", checkpoint_path_,
+                  header.region[0], header.region[1], header.region[2],
+                  header.region[3], region.x, region.y, region.width,
+                  region.height);
+    return false;
+  }
+  if (!film_.Read(in, film_.GetWidth(), film_.GetHeight())) {
+    spdlog::error("RayTracer: checkpoint {} doesn't match the image size",
+                  checkpoint_path_);
+    return false;
+  }
+  sample_begin = header.sample_end;
+  pass_count = header.pass_count;
+  return true;
+}
+
+
+Vec2i
+RayTracer::ComputeImageSize(Camera::Ptr camera) const
+{
+  auto aspect = camera->GetAspectRatio();
+  auto height = static_cast<int>(image_height_);
+  auto width = static_cast<int>(aspect * static_cast<Real>(height) + 0.5f);
+  return Vec2i{width, height};
+}
+
+
+void
+RayTracer::SetFilm(const Film &film)
+{
+  film_ = film;
+  rendered_image_ = film_.Resolve();
+}
+
+
+std::vector<cv::Rect>
+RayTracer::ComputeTiles(const cv::Rect &region, uint tile_size) const
+{
+  auto edge = static_cast<int>(std::max(tile_size ? tile_size : tile_size_,
+                                        1u));
+  int x_end = region.x + region.width;
+  int y_end = region.y + region.height;
+  std::vector<cv::Rect> tiles;
+  for (int y = region.y; y < y_end; y += edge) {
+    for (int x = region.x; x < x_end; x += edge) {
+      tiles.push_back(cv::Rect{x, y, std::min(edge, x_end - x),
+                               std::min(edge, y_end - y)});
+    }
+  }
+  return tiles;
+}
+
+
+void
+RayTracer::RenderTile(const cv::Rect &tile, Surface::Ptr scene,
+                      const std::vector<Light::Ptr> &lights, Camera::Ptr camera,
+                      uint sample_begin, uint sample_end)
+{
+  if (integrator_ == Integrator::kWavefront) {
+    RenderTileWavefront(tile, scene, lights, camera, sample_begin, sample_end);
+    return;
+  }
+
+  auto width = film_.GetWidth();
+  auto height = film_.GetHeight();
+  Real xscale = 1.0 / width;
+  Real yscale = 1.0 / height;
+  Sampler sampler{seed_};
+  bool adaptive = adaptive_threshold_ > 0;
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    size_t done_pixels = 0, done_samples = 0, skipped_samples = 0;
+    for (int x = tile.x; x < tile.x + tile.width; ++x) {
+      if (adaptive && film_.IsConverged(x, y))
+        continue;
+      auto pixel_index = film_.GetPixelIndex(x, y);
+      Vec3r ray_color{0, 0, 0};
+      if (samples_per_pixel_ == 1) {
+        sampler.StartSample(pixel_index, 0);
+        auto ray = camera->GetRay((x + .5) * xscale, (y + .5) * yscale);
+        RayColor(ray, scene, lights, 0, 6, sampler, ray_color);
+        film_.AddSample(x, y, ray_color);
+        ++done_samples;
+      } else {
+        for (uint p = sample_begin; p < sample_end; ++p) {
+          sampler.StartSample(pixel_index, p);
+          Vec2r offset = sampler.Get2D();
+          auto ray = camera->GetRay((x + offset[0]) * xscale,
+                                    (y + offset[1]) * yscale);
+          RayColor(ray, scene, lights, 0, max_ray_depth_, sampler, ray_color);
+          film_.AddSample(x, y, ray_color);
+          ++done_samples;
+
+          // stop sampling the pixel once its estimate is accurate enough
+          if (adaptive && p + 1 >= adaptive_min_samples_ &&
+              film_.GetRelativeError(x, y) < adaptive_threshold_) {
+            film_.SetConverged(x, y);
+            skipped_samples += samples_per_pixel_ - (p + 1);
+            break;
+          }
+        }
+      }
+      if (sample_end == samples_per_pixel_ || film_.IsConverged(x, y))
+        ++done_pixels;
+    }
+    RenderProgressIncDonePixels(done_pixels, done_samples, skipped_samples);
+  }
+}
+
+
+void
+RayTracer::RenderTileWavefront(const cv::Rect &tile, Surface::Ptr scene,
+                               const std::vector<Light::Ptr> &lights,
+                               Camera::Ptr camera, uint sample_begin,
+                               uint sample_end)
+{
+  auto width = film_.GetWidth();
+  auto height = film_.GetHeight();
+  Real xscale = 1.0 / width;
+  Real yscale = 1.0 / height;
+  Sampler sampler{seed_};
+  WavefrontIntegrator integrator{seed_};
+  integrator.SetPacketSize(packet_size_);
+  integrator.SetSortSecondaryRays(sort_secondary_rays_);
+  bool adaptive = adaptive_threshold_ > 0;
+
+  // single-sample renders shoot one ray through the pixel centers
+  bool pixel_center = samples_per_pixel_ == 1;
+  uint max_ray_depth = pixel_center ? 6 : max_ray_depth_;
+
+  // samples per pixel in each wave; adaptive sampling checks for
+  // convergence after every sample
+  auto tile_pixels = static_cast<uint>(tile.area());
+  uint wave_samples = adaptive ? 1 :
+    std::max(wavefront_size_ / std::max(tile_pixels, 1u), 1u);
+
+  std::vector<cv::Point> wave_pixels;
+  for (uint wave_begin = sample_begin; wave_begin < sample_end;
+       wave_begin += wave_samples) {
+    uint wave_end = std::min(wave_begin + wave_samples, sample_end);
+
+    // generate camera rays
+    integrator.Clear();
+    wave_pixels.clear();
+    for (int y = tile.y; y < tile.y + tile.height; ++y) {
+      for (int x = tile.x; x < tile.x + tile.width; ++x) {
+        if (adaptive && film_.IsConverged(x, y))
+          continue;
+        wave_pixels.push_back(cv::Point{x, y});
+        auto pixel_index = film_.GetPixelIndex(x, y);
+        for (uint p = wave_begin; p < wave_end; ++p) {
+          sampler.StartSample(pixel_index, p);
+          Vec2r offset{0.5f, 0.5f};
+          if (!pixel_center)
+            offset = sampler.Get2D();
+          auto ray = camera->GetRay((x + offset[0]) * xscale,
+                                    (y + offset[1]) * yscale);
+          integrator.AddPath(ray, pixel_index, p, sampler.GetDimension());
+        }
+      }
+    }
+    if (wave_pixels.empty())
+      break;
+
+    // trace paths
+    RenderProgressIncRays(integrator.Trace(scene, lights, max_ray_depth));
+
+    // accumulate path radiance, one pixel at a time
+    size_t done_pixels = 0, done_samples = 0, skipped_samples = 0;
+    uint path = 0;
+    for (const auto &pixel : wave_pixels) {
+      for (uint p = wave_begin; p < wave_end; ++p) {
+        film_.AddSample(pixel.x, pixel.y,
+                        integrator.GetRadiance(path + p - wave_begin));
+        ++done_samples;
+        if (adaptive && p + 1 >= adaptive_min_samples_ &&
+            film_.GetRelativeError(pixel.x, pixel.y) < adaptive_threshold_) {
+          film_.SetConverged(pixel.x, pixel.y);
+          skipped_samples += samples_per_pixel_ - (p + 1);
+          break;
+        }
+      }
+      path += wave_end - wave_begin;
+      if (wave_end == samples_per_pixel_ || film_.IsConverged(pixel.x, pixel.y))
+        ++done_pixels;
+    }
+    RenderProgressIncDonePixels(done_pixels, done_samples, skipped_samples);
+  }
+  std::lock_guard<std::mutex> lock(wavefront_stats_mutex_);
+  wavefront_stats_.Add(integrator.GetStats());
+}
+
+
+void
+RayTracer::SetPreviewOutput(const std::string &image_name, uint every_passes,
+                            Real gamma)
+{
+  preview_image_name_ = image_name;
+  preview_every_passes_ = every_passes;
+  preview_gamma_ = gamma;
+}
+
+
 cv::Mat
 RayTracer::GammaCorrectImage(const cv::Mat &in_image, Real gamma) const
 {
@@ -243,33 +699,174 @@ RayTracer::WriteImage(const std::string &image_name, Real gamma) const
 }
 
 
+bool
+RayTracer::WriteSampleCountImage(const std::string &image_name) const
+{
+  namespace fs = boost::filesystem;
+
+  // check we have a rendered image
+  if (film_.IsEmpty())
+    return false;
+
+  // exr images store raw counts; others counts relative to the max
+  cv::Mat count_image = film_.ResolveSampleCount();
+  cv::Mat out_image;
+  if (fs::path(image_name).extension().string() == ".exr") {
+    out_image = RGBToBGRFloat32(count_image);
+  } else {
+    cv::Mat normalized(count_image.rows, count_image.cols, CV_64FC3);
+    double scale = 1.0 / std::max(samples_per_pixel_, 1u);
+    for (int y = 0; y < count_image.rows; ++y) {
+      for (int x = 0; x < count_image.cols; ++x) {
+        auto count = count_image.at<cv::Vec3d>(y, x);
+        normalized.at<cv::Vec3d>(y, x) = cv::Vec3d{count[0] * scale,
+                                                   count[1] * scale,
+                                                   count[2] * scale};
+      }
+    }
+    out_image = RGBToBGRUChar(normalized);
+  }
+
+  // write image
+  cv::imwrite(image_name, out_image);
+  return true;
+}
+
+
+void
+RayTracer::RenderProgressStart(size_t total_pixels, size_t total_samples,
+                               size_t thread_count)
+{
+  // reset per-thread counters
+  progress_counters_ = decltype(progress_counters_)(std::max(thread_count,
+                                                             size_t{1}));
+  if (show_progress_bar_)
+    progress_bar_ = make_shared<tqdm>();
+  else
+    progress_bar_.reset();
+  progress_total_pixels_ = total_pixels;
+  progress_total_samples_ = total_samples;
+  progress_start_time_ = chrono::steady_clock::now();
+
+  // start reporter thread
+  progress_stop_ = false;
+  progress_thread_ = std::thread([this] {
+    auto interval = chrono::duration<double>(std::max(progress_interval_,
+                                                      Real{0.01}));
+    std::unique_lock<std::mutex> lock(progress_mutex_);
+    while (!progress_cv_.wait_for(lock, interval,
+                                  [this] {return progress_stop_;}))
+      RenderProgressReport(false);
+  });
+}
+
+
+RayTracer::ProgressCounter&
+RayTracer::GetThreadProgressCounter()
+{
+  // threads outside of the render arena share the first counter
+  auto index = tbb::this_task_arena::current_thread_index();
+  if (index < 0 || static_cast<size_t>(index) >= progress_counters_.size())
+    index = 0;
+  return progress_counters_[static_cast<size_t>(index)];
+}
+
+
 void
-RayTracer::RenderProgressStart(size_t total_pixels)
+RayTracer::RenderProgressIncDonePixels(size_t pixels, size_t samples,
+                                       size_t skipped)
 {
-  const std::lock_guard<std::mutex> lock(progress_bar_mutex_);
-  progress_bar_ = make_shared<tqdm>();
-  progress_bar_done_pixels_  = 0;
-  progress_bar_total_pixels_ = total_pixels;
+  if (progress_counters_.empty())
+    return;
+  auto &counter = GetThreadProgressCounter();
+  counter.pixels.fetch_add(pixels, std::memory_order_relaxed);
+  counter.samples.fetch_add(samples, std::memory_order_relaxed);
+  if (skipped)
+    counter.skipped.fetch_add(skipped, std::memory_order_relaxed);
 }
 
 
 void
-RayTracer::RenderProgressIncDonePixels()
+RayTracer::RenderProgressIncRays(size_t rays)
 {
-  const std::lock_guard<std::mutex> lock(progress_bar_mutex_);
-  progress_bar_done_pixels_ = std::min(progress_bar_done_pixels_ + 1,
-                                       progress_bar_total_pixels_);
-  if (!progress_bar_)
+  if (progress_counters_.empty())
     return;
-  progress_bar_->progress(static_cast<int>(progress_bar_done_pixels_),
-                          static_cast<int>(progress_bar_total_pixels_));
+  GetThreadProgressCounter().rays.fetch_add(rays, std::memory_order_relaxed);
+}
+
+
+void
+RayTracer::RenderProgressReport(bool done)
+{
+  // gather counters of all threads
+  uint64_t pixels = 0, samples = 0, rays = 0, skipped = 0;
+  for (const auto &counter : progress_counters_) {
+    pixels += counter.pixels.load(std::memory_order_relaxed);
+    samples += counter.samples.load(std::memory_order_relaxed);
+    rays += counter.rays.load(std::memory_order_relaxed);
+    skipped += counter.skipped.load(std::memory_order_relaxed);
+  }
+  pixels = std::min<uint64_t>(pixels, progress_total_pixels_);
+  samples = std::min<uint64_t>(samples, progress_total_samples_);
+  skipped = std::min<uint64_t>(skipped, progress_total_samples_ - samples);
+
+  // samples skipped by adaptive sampling count as done work
+  double done_fraction = progress_total_samples_ ?
+    static_cast<double>(samples + skipped) /
+    static_cast<double>(progress_total_samples_) : 1;
+
+  // update progress bar (in units of fully sampled pixels)
+  if (progress_bar_)
+    progress_bar_->progress(static_cast<int>(done_fraction * static_cast<double>
+                                             (progress_total_pixels_)),
+                            static_cast<int>(progress_total_pixels_));
+
+  // write a line to the progress stream
+  if (progress_fd_ < 0)
+    return;
+  double elapsed = chrono::duration_cast<chrono::duration<double>>
+    (chrono::steady_clock::now() - progress_start_time_).count();
+  double rays_per_sec = elapsed > 0 ? static_cast<double>(rays) / elapsed : 0;
+  string eta = "null";
+  if (done)
+    eta = "0";
+  else if (samples + skipped) {
+    double remaining = elapsed * (1 - done_fraction) / done_fraction;
+    if (time_budget_ > 0)
+      remaining = std::min(remaining, std::max(time_budget_ - elapsed, 0.0));
+    eta = fmt::format("{:.3f}", remaining);
+  }
+  auto line = fmt::format("{{\"pixels_done\": {}, \"pixels_total\": {}, "
+                          "\"samples_done\": {}, \"samples_skipped\": {}, "
+                          "\"rays\": {}, "
+                          "\"rays_per_sec\": {:.1f}, \"elapsed_sec\": {:.3f}, "
+                          "\"eta_sec\": {}, \"done\": {}}}\n",
+                          pixels, progress_total_pixels_, samples, skipped,
+                          rays,
+                          rays_per_sec, elapsed, eta, done ? "true" : "false");
+#ifdef WIN32
+  if (_write(progress_fd_, line.data(), static_cast<unsigned>(line.size())) < 0)
+#else
+  if (write(progress_fd_, line.data(), line.size()) < 0)
+#endif
+    spdlog::warn("RayTracer: failed to write to progress fd {}", progress_fd_);
 }
 
 
 void
 RayTracer::RenderProgressEnd()
 {
-  const std::lock_guard<std::mutex> lock(progress_bar_mutex_);
+  // stop reporter thread
+  {
+    const std::lock_guard<std::mutex> lock(progress_mutex_);
+    progress_stop_ = true;
+  }
+  progress_cv_.notify_all();
+  if (progress_thread_.joinable())
+    progress_thread_.join();
+
+  // final report
+  RenderProgressReport(true);
   if (progress_bar_)
     progress_bar_->finish();
   progress_bar_.reset();
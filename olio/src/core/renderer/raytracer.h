@@ -7,6 +7,9 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <set>
 #include <tbb/tbb.h>
 #include <opencv2/opencv.hpp>
@@ -16,10 +19,21 @@
 #include "core/geometry/surface.h"
 #include "core/camera/camera.h"
 #include "core/light/light.h"
+#include "core/sampler/sampler.h"
+#include "core/renderer/film.h"
+#include "core/renderer/wavefront_integrator.h"
 
 namespace olio {
 namespace core {
 
+//! \enum Integrator
+//! \brief Algorithm used to compute the color of camera rays
+enum class Integrator {
+  kRecursive,  //!< depth-first, one path at a time (RayColor())
+  kWavefront   //!< breadth-first, batches of paths (WavefrontIntegrator)
+};
+
+
 //! \class RayTracer
 //! \brief Main rendering class responsible for generating rays, path
 //! tracing, computing ray colors, and generating a rendered image of
@@ -34,10 +48,11 @@ public:
   //! \details The function is responsible to generating primary rays
   //!    for each pixel in the output image and determining each pixel
   //!    color. Each pixel/ray color will be determined by a call to
-  //!    RayColor(). The final color for each pixel will be stored in
-  //!    'rendered_image_'. This function is also responsible for
-  //!    allocating an initial black image for 'rendered_image_'
-  //!    before the start of the ray tracing process.
+  //!    RayColor(). Samples are accumulated in 'film_' in one or more
+  //!    passes (see SetSamplesPerPass()); the final color for each
+  //!    pixel will be stored in 'rendered_image_'. Rendering stops
+  //!    once 'samples_per_pixel_' samples have been taken for every
+  //!    pixel or when the time budget (see SetTimeBudget()) runs out.
   //! \param[in] scene Input scene to render
   //! \param[in] lights Scene lights
   //! \param[in] camera Camera used for generating rays and rendering
@@ -55,16 +70,227 @@ public:
   //! \param[in] max_ray_depth Max ray depth (bounce count)
   inline void SetMaxRayDepth(uint max_ray_depth) {max_ray_depth_= max_ray_depth;}
 
+  //! \brief Set number of samples per pixel. In progressive mode,
+  //! this is the target sample count.
+  //! \param[in] num Samples per pixel
   inline void SetNumSamplesPerPixel(uint num) {samples_per_pixel_ = num;}
 
+  //! \brief Enable progressive rendering by setting the number of
+  //! samples taken for each pixel per pass
+  //! \details After each pass, 'rendered_image_' holds the average of
+  //!    all samples taken so far.
+  //! \param[in] num Samples per pixel per pass; 0 renders all samples
+  //!            in a single pass
+  inline void SetSamplesPerPass(uint num) {samples_per_pass_ = num;}
+
+  //! \brief Set a wall-clock budget for rendering
+  //! \details The budget is checked after each pass: once it is
+  //!    exceeded, no further passes are started and the image holds
+  //!    the samples rendered so far. Single-pass renders are split
+  //!    into passes of about 1/16 of the samples.
+  //! \param[in] seconds Time budget in seconds; 0 means unlimited
+  inline void SetTimeBudget(Real seconds) {time_budget_ = seconds;}
+
+  //! \brief Restrict rendering to a region of the image
+  //! \details Only the pixels inside the region are rendered; they
+  //!    get exactly the samples they'd get in a full-frame render. If
+  //!    the film already has the image's size, the pixels outside the
+  //!    region keep their contents.
+  //! \param[in] region Region to render in camera space ((0, 0) is the
+  //!            lower left pixel); an empty region renders the whole
+  //!            image
+  inline void SetCropWindow(const cv::Rect &region) {crop_window_ = region;}
+
+  //! \brief Show/hide the console progress bar
+  //! \param[in] show True to show the progress bar
+  inline void SetShowProgressBar(bool show) {show_progress_bar_ = show;}
+
+  //! \brief Replace the accumulation buffer (e.g., with one assembled
+  //! from tiles rendered elsewhere) and resolve it to the output image
+  //! \param[in] film New accumulation buffer
+  void SetFilm(const Film &film);
+
+  //! \brief Compute the size of the rendered image
+  //! \param[in] camera Camera used for rendering
+  //! \return Image width and height (determined by 'image_height_'
+  //!         and the camera's aspect ratio)
+  Vec2i ComputeImageSize(Camera::Ptr camera) const;
+
+  //! \brief Split an image region into square tiles
+  //! \details Tiles are listed in row-major order; tiles on the right
+  //!    and top borders are clipped to the region.
+  //! \param[in] region Region to split
+  //! \param[in] tile_size Tile edge length (0: 'tile_size_')
+  //! \return List of tiles covering the whole region
+  std::vector<cv::Rect> ComputeTiles(const cv::Rect &region,
+                                     uint tile_size=0) const;
+
+  //! \brief Periodically save the render state to a checkpoint file
+  //! \details Between passes, once 'interval' seconds have passed
+  //!    since the last checkpoint, the film (color sums, sample counts,
+  //!    and adaptive sampling state) and the index of the next sample
+  //!    are written to a uniquely named temporary file that is flushed
+  //!    to disk and then replaces 'path', so the checkpoint on disk is
+  //!    always complete. A checkpoint is also written when rendering
+  //!    stops. Sampling is counter-based, so no other sampler state is
+  //!    needed. Single-pass renders are split into passes of about
+  //!    1/16 of the samples.
+  //! \param[in] path Checkpoint file; empty disables checkpoints
+  //! \param[in] interval Minimum seconds between checkpoints
+  inline void SetCheckpoint(const std::string &path, Real interval=60) {
+    checkpoint_path_ = path;
+    checkpoint_interval_ = interval;
+  }
+
+  //! \brief Continue the render saved in the checkpoint file
+  //! \details Render() loads the checkpoint (if the file exists) and
+  //!    renders only the remaining samples. The render settings and
+  //!    crop window must match the ones the checkpoint was written
+  //!    with; the result is then identical to an uninterrupted render.
+  //! \param[in] resume True to resume from the checkpoint
+  inline void SetResume(bool resume) {resume_ = resume;}
+
+  //! \brief Enable/disable variance-driven adaptive sampling
+  //! \details When enabled, 'samples_per_pixel_' becomes the maximum
+  //!    sample count: a pixel stops receiving samples once it has at
+  //!    least 'min_samples' samples and the 95% confidence interval of
+  //!    its mean luminance is narrower than 'threshold' times the
+  //!    mean (see Film::GetRelativeError()).
+  //! \param[in] threshold Relative error threshold; 0 disables
+  //!            adaptive sampling
+  //! \param[in] min_samples Samples taken before a pixel can converge
+  inline void SetAdaptiveSampling(Real threshold, uint min_samples=16) {
+    adaptive_threshold_ = threshold;
+    adaptive_min_samples_ = std::max(min_samples, 2u);
+  }
+
+  //! \brief Select the integrator used to compute ray colors
+  //! \param[in] integrator Integrator
+  inline void SetIntegrator(Integrator integrator) {integrator_ = integrator;}
+
+  //! \brief Set the max number of paths the wavefront integrator
+  //! traces together
+  //! \details Each tile is rendered in waves of up to this many
+  //!    paths (at least one sample of every pixel in the tile).
+  //! \param[in] num_paths Max paths per wave
+  inline void SetWavefrontSize(uint num_paths) {wavefront_size_ = num_paths;}
+
+  //! \brief Set the number of camera/shadow rays the wavefront
+  //! integrator traces together through the BVH as a RayPacket
+  //! \param[in] packet_size Rays per packet (0 or 1: no packets)
+  inline void SetPacketSize(uint packet_size) {packet_size_ = packet_size;}
+
+  //! \brief Enable/disable sorting the secondary rays of the wavefront
+  //! integrator by direction and origin before tracing them
+  //! \param[in] sort True to sort secondary rays
+  inline void SetSortSecondaryRays(bool sort) {sort_secondary_rays_ = sort;}
+
+  //! \brief Write intermediate images while rendering progressively
+  //! \param[in] image_name Path of the intermediate image; empty
+  //!            disables intermediate images
+  //! \param[in] every_passes Write the image every this many passes
+  //! \param[in] gamma Gamma value passed to WriteImage()
+  void SetPreviewOutput(const std::string &image_name, uint every_passes=1,
+                        Real gamma=1);
+
+  //! \brief Set the edge length (in pixels) of the square tiles the
+  //! image is split into. Tiles are the unit of work handed to the
+  //! render threads.
+  //! \param[in] tile_size Tile edge length in pixels
+  inline void SetTileSize(uint tile_size) {tile_size_ = tile_size;}
+
+  //! \brief Set the number of threads used for rendering
+  //! \param[in] num_threads Thread count; 0 uses all available cores
+  inline void SetNumThreads(uint num_threads) {num_threads_ = num_threads;}
+
+  //! \brief Set the seed of the random numbers used for sampling
+  //! \details Renders with the same seed and settings produce
+  //!    identical images, regardless of the number of threads.
+  //! \param[in] seed Sampler seed
+  inline void SetSeed(uint64_t seed) {seed_ = seed;}
+
+  //! \brief Get the sampler seed
+  //! \return Sampler seed
+  inline uint64_t GetSeed() const {return seed_;}
+
+  //! \brief Set file descriptor that receives the JSON-lines progress
+  //! stream
+  //! \details While rendering, one JSON object per line is written to
+  //!    the descriptor every progress interval, e.g.:
+  //!    {"pixels_done": 1024, "pixels_total": 921600, "samples_done": 4096,
+  //!     "samples_skipped": 0,
+  //!     "rays": 16384, "rays_per_sec": 81920.0, "elapsed_sec": 0.2,
+  //!     "eta_sec": 179.8, "done": false}
+  //!    "rays" counts camera, secondary, and shadow rays. The last line
+  //!    of a render has "done" set to true.
+  //! \param[in] fd File descriptor; a negative value disables the stream
+  inline void SetProgressFd(int fd) {progress_fd_ = fd;}
+
+  //! \brief Set how often progress is reported (progress bar redraw
+  //! and progress stream)
+  //! \param[in] seconds Report interval in seconds
+  inline void SetProgressInterval(Real seconds) {progress_interval_ = seconds;}
+
   //! \brief Get output image height
   //! \return Output image height
   inline uint GetImageHeight() const {return image_height_;}
 
+  //! \brief Get number of samples per pixel (target count)
+  //! \return Samples per pixel
+  inline uint GetNumSamplesPerPixel() const {return samples_per_pixel_;}
+
+  //! \brief Get number of samples per pixel per pass
+  //! \return Samples per pass; 0 means a single pass
+  inline uint GetSamplesPerPass() const {return samples_per_pass_;}
+
+  //! \brief Get the render time budget
+  //! \return Time budget in seconds; 0 means unlimited
+  inline Real GetTimeBudget() const {return time_budget_;}
+
+  //! \brief Get the integrator used to compute ray colors
+  //! \return Integrator
+  inline Integrator GetIntegrator() const {return integrator_;}
+
+  //! \brief Get the number of rays traced together as a RayPacket
+  //! \return Rays per packet
+  inline uint GetPacketSize() const {return packet_size_;}
+
+  //! \brief Check if the wavefront integrator sorts secondary rays
+  //! \return True if secondary rays are sorted
+  inline bool GetSortSecondaryRays() const {return sort_secondary_rays_;}
+
+  //! \brief Get secondary ray statistics of the last wavefront render
+  //! \details Times are summed over all render threads.
+  //! \return Statistics
+  inline const WavefrontStats& GetWavefrontStats() const {
+    return wavefront_stats_;
+  }
+
+  //! \brief Get wall-clock time of the last render
+  //! \return Render time in seconds
+  inline double GetRenderTime() const {return render_time_;}
+
+  //! \brief Get number of camera, secondary, and shadow rays traced
+  //! by the last render
+  //! \return Ray count
+  inline uint64_t GetNumTracedRays() const {return traced_rays_;}
+
+  //! \brief Get accumulation buffer of the last render
+  //! \return Film
+  inline const Film& GetFilm() const {return film_;}
+
   //! \brief Get maximum number of times a ray can bounce in the scene
   //! \return Max ray depth (bounce count)
   inline uint GetMaxRayDepth() const {return max_ray_depth_;}
 
+  //! \brief Get render tile edge length
+  //! \return Tile edge length in pixels
+  inline uint GetTileSize() const {return tile_size_;}
+
+  //! \brief Get the number of render threads
+  //! \return Thread count; 0 means all available cores
+  inline uint GetNumThreads() const {return num_threads_;}
+
   //! \brief Write rendered image to file. If the image extension is
   //!        exr, the image won't be gamma corrected before it's saved
   //!        (gamma is ignored).
@@ -72,6 +298,15 @@ public:
   //! \param[in] gamma Gamma value
   //! \return True on success
   bool WriteImage(const std::string &image_name, Real gamma=1) const;
+
+  //! \brief Write an image of the number of samples spent on each
+  //! pixel (useful with adaptive sampling)
+  //! \details exr images store the raw sample counts. Other formats
+  //!    store sample counts normalized by the max samples per pixel,
+  //!    i.e., white pixels received 'samples_per_pixel_' samples.
+  //! \param[in] image_name Output image path
+  //! \return True on success
+  bool WriteSampleCountImage(const std::string &image_name) const;
 protected:
   //! \brief Determine ray color by intersecting it with the scene
   //! \details The main function responsible for checking for
@@ -80,11 +315,65 @@ protected:
   //! \param[in] ray Input ray
   //! \param[in] scene Input scene
   //! \param[in] lights Scene lights
+  //! \param[in] ray_depth Current ray depth (bounce count)
+  //! \param[in] max_ray_depth Max ray depth
+  //! \param[in] sampler Sampler of the pixel sample the ray belongs to
   //! \param[out] ray_color Output ray color
   //! \return True if ray intersects a surface in the scene
   bool RayColor(const Ray &ray, Surface::Ptr scene,
                 const std::vector<Light::Ptr> &lights, uint ray_depth,
-                uint max_ray_depth, Vec3r &ray_color);
+                uint max_ray_depth, Sampler &sampler, Vec3r &ray_color);
+
+  //! \brief Render samples [sample_begin, sample_end) of all pixels
+  //! inside a tile and add them to 'film_'
+  //! \details Pixel coordinates of the tile are in camera space
+  //!    (y grows upwards). Safe to call concurrently for
+  //!    non-overlapping tiles.
+  //! \param[in] tile Tile to render
+  //! \param[in] scene Input scene
+  //! \param[in] lights Scene lights
+  //! \param[in] camera Camera used for generating primary rays
+  //! \param[in] sample_begin Index of the first sample to render
+  //! \param[in] sample_end Index past the last sample to render
+  void RenderTile(const cv::Rect &tile, Surface::Ptr scene,
+                  const std::vector<Light::Ptr> &lights, Camera::Ptr camera,
+                  uint sample_begin, uint sample_end);
+
+  //! \brief Write 'film_' and the render position to 'checkpoint_path_'
+  //! \param[in] region Rendered region (crop window clipped to the image)
+  //! \param[in] pass_samples Samples per pixel per pass
+  //! \param[in] sample_end Index of the first sample not yet rendered
+  //! \param[in] pass_count Number of rendered passes
+  //! \return True on success
+  bool WriteCheckpoint(const cv::Rect &region, uint pass_samples,
+                       uint sample_end, uint pass_count);
+
+  //! \brief Load 'film_' and the render position from 'checkpoint_path_'
+  //! \param[in] region Rendered region (crop window clipped to the image)
+  //! \param[in] pass_samples Samples per pixel per pass
+  //! \param[out] sample_begin Index of the first sample to render
+  //! \param[out] pass_count Number of rendered passes
+  //! \return True on success; false if the file can't be read or was
+  //!         written with different render settings or crop window
+  bool ReadCheckpoint(const cv::Rect &region, uint pass_samples,
+                      uint &sample_begin, uint &pass_count);
+
+  //! \brief Render samples [sample_begin, sample_end) of all pixels
+  //! inside a tile with the wavefront integrator
+  //! \details Same as RenderTile(), except that the tile's samples
+  //!    are traced in waves of up to 'wavefront_size_' paths: camera
+  //!    rays of a wave are generated first, then traced by a
+  //!    WavefrontIntegrator, and finally accumulated into 'film_'.
+  //! \param[in] tile Tile to render
+  //! \param[in] scene Input scene
+  //! \param[in] lights Scene lights
+  //! \param[in] camera Camera used for generating primary rays
+  //! \param[in] sample_begin Index of the first sample to render
+  //! \param[in] sample_end Index past the last sample to render
+  void RenderTileWavefront(const cv::Rect &tile, Surface::Ptr scene,
+                           const std::vector<Light::Ptr> &lights,
+                           Camera::Ptr camera, uint sample_begin,
+                           uint sample_end);
 
   //! \brief Gamma correct input image
   //! \details Input image is assumed to be of type CV_64FC3
@@ -106,26 +395,93 @@ protected:
   //! \return Output image of type CV_32FC3 with BGR channel ordering
   cv::Mat RGBToBGRFloat32(const cv::Mat &in_image) const;
 
-  //! \brief Start the render progress bar
+  //! \brief Start the render progress bar and the progress reporter
+  //! thread
   //! \param[in] total_pixels Total number of pixels that will be rendered
-  void RenderProgressStart(size_t total_pixels);
+  //! \param[in] total_samples Total number of samples that will be rendered
+  //! \param[in] thread_count Max number of threads that will update
+  //!            the progress counters
+  void RenderProgressStart(size_t total_pixels, size_t total_samples,
+                           size_t thread_count);
+
+  //! \brief Incremenet the number of rendered pixels and samples
+  //! \details Lock-free: only touches the counters of the calling thread
+  //! \param[in] pixels Number of pixels that have just been rendered
+  //! \param[in] samples Number of samples that have just been rendered
+  //! \param[in] skipped Number of samples that won't be rendered
+  //!            because their pixels converged
+  void RenderProgressIncDonePixels(size_t pixels, size_t samples,
+                                   size_t skipped=0);
 
-  //! \brief Incremenet the number of rendered pixels in the progress bar
-  void RenderProgressIncDonePixels();
+  //! \brief Incremenet the number of traced rays
+  //! \details Lock-free: only touches the counters of the calling thread
+  //! \param[in] rays Number of rays that have just been traced
+  void RenderProgressIncRays(size_t rays=1);
 
-  //! \brief Stop/end the render progress bar
+  //! \brief Report current progress to the progress bar and stream
+  //! \param[in] done Whether the render has finished
+  void RenderProgressReport(bool done);
+
+  //! \brief Stop the progress reporter thread and end the progress bar
   void RenderProgressEnd();
 
+  //! \struct ProgressCounter
+  //! \brief Per-thread progress counters, padded to a cache line so
+  //! threads never write to the same line
+  struct ProgressCounter {
+    std::atomic<uint64_t> pixels{0};   //!< rendered pixels
+    std::atomic<uint64_t> samples{0};  //!< rendered samples
+    std::atomic<uint64_t> rays{0};     //!< traced rays
+    std::atomic<uint64_t> skipped{0};  //!< samples skipped by adaptive sampling
+    char padding[64 - 4 * sizeof(std::atomic<uint64_t>)];
+  };
+
+  //! \brief Get the progress counters of the calling thread
+  //! \return Progress counters
+  ProgressCounter& GetThreadProgressCounter();
+
   uint image_height_{180};  //!< output image height
   cv::Mat rendered_image_;  //!< output rendered image
+  Film film_;               //!< accumulation buffer
   uint max_ray_depth_ = 5;  //!< max ray depth
-  uint samples_per_pixel_;
+  uint samples_per_pixel_{1};  //!< number of samples per pixel
+  uint tile_size_{32};          //!< render tile edge length in pixels
+  uint num_threads_{0};         //!< render thread count (0: all cores)
+  uint64_t seed_{0};            //!< sampler seed
+  uint samples_per_pass_{0};    //!< samples per pixel per pass (0: one pass)
+  Real time_budget_{0};         //!< render time budget in seconds (0: none)
+  Real adaptive_threshold_{0};  //!< adaptive sampling threshold (0: off)
+  uint adaptive_min_samples_{16};  //!< min samples before a pixel converges
+  cv::Rect crop_window_;            //!< region to render (empty: all)
+  bool show_progress_bar_{true};    //!< whether to show the progress bar
+  std::string checkpoint_path_;     //!< checkpoint file (empty: none)
+  Real checkpoint_interval_{60};    //!< min seconds between checkpoints
+  bool resume_{false};              //!< resume from checkpoint_path_
+  std::string preview_image_name_;  //!< intermediate image path
+  uint preview_every_passes_{1};    //!< passes between intermediate images
+  Real preview_gamma_{1};           //!< gamma of intermediate images
+  Integrator integrator_{Integrator::kRecursive};  //!< ray color integrator
+  uint wavefront_size_{4096};       //!< max paths per wavefront
+  uint packet_size_{16};            //!< rays per packet (wavefront only)
+  bool sort_secondary_rays_{false}; //!< sort secondary rays (wavefront only)
+  WavefrontStats wavefront_stats_;  //!< secondary ray stats of the render
+  std::mutex wavefront_stats_mutex_;  //!< guards wavefront_stats_
+  double render_time_{0};           //!< duration of the last render
+  uint64_t traced_rays_{0};         //!< rays traced by the last render
 
-  // progress bar related data members
-  std::mutex progress_bar_mutex_;        //!< progress bar mutex
+  // progress related data members
+  std::vector<ProgressCounter, tbb::cache_aligned_allocator<ProgressCounter>>
+    progress_counters_;                  //!< per-thread progress counters
   std::shared_ptr<tqdm> progress_bar_;   //!< render progress bar
-  size_t progress_bar_total_pixels_ = 0; //!< total number pixels to render
-  size_t progress_bar_done_pixels_ = 0;  //!< number of pixels that have been rendered
+  size_t progress_total_pixels_ = 0;     //!< total number pixels to render
+  size_t progress_total_samples_ = 0;    //!< total number samples to render
+  int progress_fd_ = -1;                 //!< progress stream fd (-1: off)
+  Real progress_interval_ = 0.25;        //!< report interval in seconds
+  std::chrono::steady_clock::time_point progress_start_time_; //!< start time
+  std::thread progress_thread_;          //!< progress reporter thread
+  std::mutex progress_mutex_;            //!< guards progress_stop_
+  std::condition_variable progress_cv_;  //!< wakes up the reporter thread
+  bool progress_stop_ = false;           //!< whether the reporter should stop
 };
 
 }  // namespace core
@@ -0,0 +1,377 @@
+//! \file       wavefront_integrator.cc
+//! \brief      WavefrontIntegrator class
+
+#include "core/renderer/wavefront_integrator.h"
+#include <chrono>
+#include <spdlog/spdlog.h>
+#include "core/geometry/bvh_stats.h"
+#include "core/material/phong_material.h"
+#include "core/material/phong_dielectric.h"
+
+namespace olio {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+//! Largest number of rays SortRays() can order: ray indices take the
+//! low 31 bits of the sort keys
+const size_t kMaxSortedRays = size_t{1} << 31;
+
+//! \brief Spread the lower 10 bits of a value so that there are two
+//! zero bits between each pair of bits
+//! \param[in] value Value to spread
+//! \return Spread bits
+inline uint64_t
+SpreadBits(uint64_t value)
+{
+  value &= 0x3ff;
+  value = (value | (value << 16)) & 0x30000ff;
+  value = (value | (value << 8)) & 0x300f00f;
+  value = (value | (value << 4)) & 0x30c30c3;
+  value = (value | (value << 2)) & 0x9249249;
+  return value;
+}
+
+}  // namespace
+
+
+void
+WavefrontStats::Add(const WavefrontStats &other)
+{
+  secondary_rays += other.secondary_rays;
+  sorted_rays += other.sorted_rays;
+  sort_time += other.sort_time;
+  secondary_time += other.secondary_time;
+}
+
+
+void
+RayQueue::Clear()
+{
+  origins.clear();
+  directions.clear();
+  weights.clear();
+  paths.clear();
+  dimensions.clear();
+}
+
+
+void
+RayQueue::Push(const Vec3r &origin, const Vec3r &direction, const Vec3r &weight,
+               uint path, uint dimension)
+{
+  origins.push_back(origin);
+  directions.push_back(direction);
+  weights.push_back(weight);
+  paths.push_back(path);
+  dimensions.push_back(dimension);
+}
+
+
+WavefrontIntegrator::WavefrontIntegrator(uint64_t seed) :
+  sampler_{seed}
+{
+}
+
+
+void
+WavefrontIntegrator::Clear()
+{
+  path_pixels_.clear();
+  path_samples_.clear();
+  radiance_.clear();
+  rays_.Clear();
+}
+
+
+uint
+WavefrontIntegrator::AddPath(const Ray &camera_ray, uint64_t pixel_index,
+                             uint sample_index, uint dimension)
+{
+  auto path = static_cast<uint>(radiance_.size());
+  path_pixels_.push_back(pixel_index);
+  path_samples_.push_back(sample_index);
+  radiance_.push_back(Vec3r{0, 0, 0});
+  rays_.Push(camera_ray.GetOrigin(), camera_ray.GetDirection(),
+             Vec3r{1, 1, 1}, path, dimension);
+  return path;
+}
+
+
+size_t
+WavefrontIntegrator::Trace(Surface::Ptr scene,
+                           const std::vector<Light::Ptr> &lights,
+                           uint max_ray_depth)
+{
+  size_t ray_count = 0;
+  for (uint depth = 0; depth < max_ray_depth && rays_.Size(); ++depth) {
+    ray_count += rays_.Size();
+    next_rays_.Clear();
+    shadow_rays_.Clear();
+    shadow_lights_.clear();
+
+    // only camera rays are coherent enough to be traced in packets;
+    // secondary rays are sorted instead
+    BVHStats::BeginRays(depth ? BVHRayType::kSecondary : BVHRayType::kCamera,
+                        rays_.Size());
+    if (depth == 0) {
+      Intersect(scene, true, false);
+    } else {
+      auto start_time = chrono::steady_clock::now();
+      Intersect(scene, false, sort_secondary_rays_);
+      stats_.secondary_rays += rays_.Size();
+      stats_.secondary_time += chrono::duration<double>
+        (chrono::steady_clock::now() - start_time).count();
+    }
+    Shade(lights, depth + 1 < max_ray_depth);
+    ray_count += shadow_rays_.Size();
+    TraceShadowRays(scene, lights.size());
+    swap(rays_, next_rays_);
+  }
+  rays_.Clear();
+  return ray_count;
+}
+
+
+void
+WavefrontIntegrator::Intersect(Surface::Ptr scene, bool use_packets,
+                               bool sort)
+{
+  auto ray_count = rays_.Size();
+  hits_.resize(ray_count);
+  hit_flags_.resize(ray_count);
+  if (sort && ray_count > 1 && ray_count <= kMaxSortedRays) {
+    // results are stored at the rays' queue positions, so shading
+    // still visits the rays in their original order
+    auto start_time = chrono::steady_clock::now();
+    SortRays(scene->GetBoundingBox());
+    auto sort_time = chrono::duration<double>
+      (chrono::steady_clock::now() - start_time).count();
+    stats_.sort_time += sort_time;
+    stats_.secondary_time -= sort_time;
+    stats_.sorted_rays += ray_count;
+    for (auto i : ray_order_) {
+      Ray ray{rays_.origins[i], rays_.directions[i]};
+      hit_flags_[i] = scene->Hit(ray, kEpsilon, kInfinity, hits_[i]);
+    }
+    return;
+  }
+  if (!use_packets || packet_size_ < 2) {
+    for (size_t i = 0; i < ray_count; ++i) {
+      Ray ray{rays_.origins[i], rays_.directions[i]};
+      hit_flags_[i] = scene->Hit(ray, kEpsilon, kInfinity, hits_[i]);
+    }
+    return;
+  }
+
+  // consecutive rays are neighboring camera rays of the same tile
+  RayPacket packet;
+  for (size_t begin = 0; begin < ray_count; begin += packet_size_) {
+    auto end = std::min(begin + packet_size_, ray_count);
+    packet.Clear();
+    for (size_t i = begin; i < end; ++i)
+      packet.Add(rays_.origins[i], rays_.directions[i]);
+    PacketReal tmax = PacketReal::Constant(kInfinity);
+    PacketMask hit = scene->HitPacket(packet, packet.GetLaneMask(), kEpsilon,
+                                      tmax, &hits_[begin]);
+    for (size_t i = begin; i < end; ++i)
+      hit_flags_[i] = hit[static_cast<int>(i - begin)];
+  }
+}
+
+
+void
+WavefrontIntegrator::Shade(const std::vector<Light::Ptr> &lights,
+                           bool spawn_rays)
+{
+  for (size_t i = 0; i < rays_.Size(); ++i) {
+    if (!hit_flags_[i])
+      continue;
+    const auto &hit_record = hits_[i];
+    auto hit_surface = hit_record.GetSurface();
+    if (!hit_surface)
+      continue;
+    auto material = hit_surface->GetMaterial();
+    if (!material) {
+      spdlog::error("WavefrontIntegrator: surface has no material -- "
+                    "returning black.");
+      continue;
+    }
+
+    auto path = rays_.paths[i];
+    auto dimension = rays_.dimensions[i];
+    const Vec3r &weight = rays_.weights[i];
+    Ray ray{rays_.origins[i], rays_.directions[i]};
+    auto material_type = GetMaterialType(material.get());
+    if (material_type == MaterialType::kDielectric) {  // handle glass
+      if (!spawn_rays)
+        continue;
+      auto dielectric = static_cast<const PhongDielectric*>(material.get());
+      shared_ptr<Ray> reflect_ray;
+      shared_ptr<Ray> refract_ray;
+      Real schlick_reflectance;
+      Vec3r attenuate = dielectric->Scatter(hit_record, ray, reflect_ray,
+                                            refract_ray, schlick_reflectance);
+      Vec3r scatter_weight = weight.cwiseProduct(attenuate);
+      if (refract_ray) {
+        next_rays_.Push(refract_ray->GetOrigin(), refract_ray->GetDirection(),
+                        scatter_weight * (1.0f - schlick_reflectance), path,
+                        dimension);
+      }
+      if (reflect_ray) {
+        next_rays_.Push(reflect_ray->GetOrigin(), reflect_ray->GetDirection(),
+                        scatter_weight * schlick_reflectance, path,
+                        dimension + kBranchDimensionOffset);
+      }
+    } else if (material_type == MaterialType::kPhong) {
+      // sample lights; shadow rays are traced by TraceShadowRays()
+      Vec3r view_vec = -ray.GetDirection().normalized();
+      sampler_.StartSample(path_pixels_[path], path_samples_[path], dimension);
+      for (size_t light = 0; light < lights.size(); ++light) {
+        light_samples_.clear();
+        lights[light]->Sample(hit_record, view_vec, sampler_, light_samples_);
+        for (const auto &sample : light_samples_) {
+          Vec3r radiance = weight.cwiseProduct(sample.radiance);
+          if (sample.test_visibility) {
+            shadow_rays_.Push(sample.shadow_ray.GetOrigin(),
+                              sample.shadow_ray.GetDirection(), radiance, path,
+                              0);
+            shadow_lights_.push_back(static_cast<uint>(light));
+          } else {
+            radiance_[path] += radiance;
+          }
+        }
+      }
+
+      // mirror reflections
+      if (!spawn_rays)
+        continue;
+      auto phong_material = static_cast<const PhongMaterial*>(material.get());
+      const auto &mirror = phong_material->GetMirror();
+      if (!mirror.isZero() && hit_record.IsFrontFace()) {
+        const auto &v = ray.GetDirection();
+        const auto &n = hit_record.GetNormal();
+        const Vec3r &reflect = v - 2 * v.dot(n) * n;
+        next_rays_.Push(hit_record.GetPoint(), reflect,
+                        weight.cwiseProduct(mirror), path,
+                        sampler_.GetDimension());
+      }
+    }
+  }
+}
+
+
+void
+WavefrontIntegrator::TraceShadowRays(Surface::Ptr scene, size_t num_lights)
+{
+  auto ray_count = shadow_rays_.Size();
+  shadow_flags_.resize(ray_count);
+  BVHStats::BeginRays(BVHRayType::kShadow, ray_count);
+  if (packet_size_ < 2) {
+    for (size_t i = 0; i < ray_count; ++i) {
+      Ray shadow_ray{shadow_rays_.origins[i], shadow_rays_.directions[i]};
+      shadow_flags_[i] = scene->Occluded(shadow_ray, kEpsilon, 1);
+    }
+  } else {
+    // shadow rays toward the same light are coherent: trace them
+    // together, one light at a time
+    RayPacket packet;
+    for (uint light = 0; light < num_lights; ++light) {
+      packet_rays_.clear();
+      for (size_t i = 0; i < ray_count; ++i) {
+        if (shadow_lights_[i] == light)
+          packet_rays_.push_back(static_cast<uint>(i));
+      }
+      for (size_t begin = 0; begin < packet_rays_.size();
+           begin += packet_size_) {
+        auto end = std::min(begin + packet_size_, packet_rays_.size());
+        packet.Clear();
+        for (size_t j = begin; j < end; ++j) {
+          auto i = packet_rays_[j];
+          packet.Add(shadow_rays_.origins[i], shadow_rays_.directions[i]);
+        }
+        PacketMask occluded = scene->OccludedPacket(
+          packet, packet.GetLaneMask(), kEpsilon, PacketReal::Constant(1));
+        for (size_t j = begin; j < end; ++j) {
+          shadow_flags_[packet_rays_[j]] =
+            occluded[static_cast<int>(j - begin)];
+        }
+      }
+    }
+  }
+
+  // add radiance in queue order, so that the sums don't depend on
+  // how the rays were traced
+  for (size_t i = 0; i < ray_count; ++i) {
+    if (!shadow_flags_[i])
+      radiance_[shadow_rays_.paths[i]] += shadow_rays_.weights[i];
+  }
+}
+
+
+void
+WavefrontIntegrator::SortRays(const AABB &bbox)
+{
+  // quantize origins to a 1024^3 grid over the scene bounds
+  Vec3r bmin{0, 0, 0};
+  Vec3r scale{0, 0, 0};
+  if (bbox.IsValid()) {
+    bmin = bbox.GetMin();
+    Vec3r extent = bbox.GetMax() - bmin;
+    for (int axis = 0; axis < 3; ++axis)
+      scale[axis] = extent[axis] > 0 ? 1023 / extent[axis] : 0;
+  }
+
+  auto ray_count = rays_.Size();
+  ray_keys_.resize(ray_count);
+  for (size_t i = 0; i < ray_count; ++i) {
+    ray_keys_[i] = ComputeSortKey(rays_.origins[i], rays_.directions[i], bmin,
+                                  scale, i);
+  }
+  sort(ray_keys_.begin(), ray_keys_.end());
+  ray_order_.resize(ray_count);
+  for (size_t i = 0; i < ray_count; ++i)
+    ray_order_[i] = static_cast<uint>(ray_keys_[i] & (kMaxSortedRays - 1));
+}
+
+
+uint64_t
+WavefrontIntegrator::ComputeSortKey(const Vec3r &origin, const Vec3r &direction,
+                                    const Vec3r &bmin, const Vec3r &scale,
+                                    uint64_t ray_index)
+{
+  // key: octant (bits 61-63), Morton code (bits 31-60), ray index
+  // (bits 0-30, so that sorting the keys sorts the indices)
+  uint64_t octant = (direction[0] < 0 ? 1u : 0u) |
+    (direction[1] < 0 ? 2u : 0u) | (direction[2] < 0 ? 4u : 0u);
+  uint64_t morton = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    Real cell = (origin[axis] - bmin[axis]) * scale[axis];
+    cell = cell > 0 ? std::min(cell, Real(1023)) : 0;
+    morton |= SpreadBits(static_cast<uint64_t>(cell)) <<
+      static_cast<uint>(axis);
+  }
+  return (octant << 61) | (morton << 31) | (ray_index & (kMaxSortedRays - 1));
+}
+
+
+WavefrontIntegrator::MaterialType
+WavefrontIntegrator::GetMaterialType(const Material *material)
+{
+  auto it = material_types_.find(material);
+  if (it != material_types_.end())
+    return it->second;
+
+  auto material_type = MaterialType::kNone;
+  if (dynamic_cast<const PhongDielectric*>(material))
+    material_type = MaterialType::kDielectric;
+  else if (dynamic_cast<const PhongMaterial*>(material))
+    material_type = MaterialType::kPhong;
+  material_types_[material] = material_type;
+  return material_type;
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,228 @@
+//! \file       wavefront_integrator.h
+//! \brief      WavefrontIntegrator class
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include "core/types.h"
+#include "core/ray.h"
+#include "core/ray_packet.h"
+#include "core/geometry/surface.h"
+#include "core/light/light.h"
+#include "core/material/material.h"
+#include "core/sampler/sampler.h"
+
+namespace olio {
+namespace core {
+
+//! \struct RayQueue
+//! \brief Structure-of-arrays queue holding the rays of one bounce
+//! of a wavefront
+struct RayQueue {
+  std::vector<Vec3r> origins;     //!< ray origins
+  std::vector<Vec3r> directions;  //!< ray directions
+  std::vector<Vec3r> weights;     //!< path throughput (radiance for
+                                  //!< shadow rays)
+  std::vector<uint> paths;        //!< index of the ray's path
+  std::vector<uint> dimensions;   //!< next sampler dimension of the path
+
+  //! \brief Get number of rays in the queue
+  //! \return Number of rays
+  inline size_t Size() const {return paths.size();}
+
+  //! \brief Remove all rays (keeps the allocated memory)
+  void Clear();
+
+  //! \brief Append a ray to the queue
+  //! \param[in] origin Ray origin
+  //! \param[in] direction Ray direction
+  //! \param[in] weight Path throughput or radiance carried by the ray
+  //! \param[in] path Index of the path the ray belongs to
+  //! \param[in] dimension Next sampler dimension of the path
+  void Push(const Vec3r &origin, const Vec3r &direction, const Vec3r &weight,
+            uint path, uint dimension);
+};
+
+
+//! \struct WavefrontStats
+//! \brief Cost of sorting secondary rays and time spent tracing them
+struct WavefrontStats {
+  uint64_t secondary_rays{0};    //!< traced secondary rays
+  uint64_t sorted_rays{0};       //!< secondary rays reordered before tracing
+  double sort_time{0};           //!< seconds spent computing ray order
+  double secondary_time{0};      //!< seconds spent tracing secondary rays
+                                 //!< (excluding sort_time)
+
+  //! \brief Add the statistics of another integrator
+  //! \param[in] other Statistics to add
+  void Add(const WavefrontStats &other);
+};
+
+
+//! \class WavefrontIntegrator
+//! \brief Breadth-first (wavefront) version of RayTracer::RayColor
+//! \details Instead of following one path at a time, the integrator
+//!    traces a batch of camera paths one bounce at a time. Every
+//!    bounce runs a closest-hit kernel over all rays in the queue,
+//!    then a material kernel that evaluates the lights and spawns
+//!    shadow rays and secondary rays, and finally an occlusion kernel
+//!    over the shadow rays. Each kernel loops over one structure-of-
+//!    arrays queue, so the BVH, material, and light code stay hot in
+//!    the caches while they process the whole batch.
+//!    The integrator computes the same estimate as the recursive
+//!    RayColor(), but it doesn't consume sampler dimensions in the
+//!    same order, so the two don't produce bit-identical images when
+//!    random numbers are involved (e.g., area lights).
+//!    Camera rays and shadow rays are coherent, so the closest-hit
+//!    kernel of the first bounce and the occlusion kernel trace them
+//!    in packets (see SetPacketSize()). Secondary rays (mirror
+//!    reflections and dielectric reflection/refraction) are not, so
+//!    before tracing them the closest-hit kernel can visit them in
+//!    order of direction octant and origin Morton code (see
+//!    SetSortSecondaryRays()), so that consecutive rays fetch the
+//!    same BVH nodes.
+class WavefrontIntegrator {
+public:
+  //! \brief Constructor
+  //! \param[in] seed Sampler seed of the render
+  explicit WavefrontIntegrator(uint64_t seed=0);
+
+  //! \brief Remove all paths from the wavefront
+  void Clear();
+
+  //! \brief Set number of rays traced together as a RayPacket
+  //! \details Packets are used for camera rays and for shadow rays
+  //!    (grouped by light). Values below 2 trace every ray on its own.
+  //! \param[in] packet_size Rays per packet (clamped to kMaxPacketSize)
+  inline void SetPacketSize(uint packet_size) {
+    packet_size_ = std::min(packet_size, static_cast<uint>(kMaxPacketSize));
+  }
+
+  //! \brief Get number of rays traced together as a RayPacket
+  //! \return Rays per packet
+  inline uint GetPacketSize() const {return packet_size_;}
+
+  //! \brief Enable/disable reordering secondary rays for coherence
+  //! \details Only the order in which rays are traced changes; path
+  //!    radiance is computed in the same order either way, so the
+  //!    image doesn't depend on this setting.
+  //! \param[in] sort True to sort secondary rays before tracing them
+  inline void SetSortSecondaryRays(bool sort) {sort_secondary_rays_ = sort;}
+
+  //! \brief Get secondary ray statistics accumulated by Trace()
+  //! \return Statistics
+  inline const WavefrontStats& GetStats() const {return stats_;}
+
+  //! \brief Add a path (camera ray) to the wavefront
+  //! \param[in] camera_ray Camera ray of the path
+  //! \param[in] pixel_index Index of the path's pixel
+  //! \param[in] sample_index Index of the path's sample within the pixel
+  //! \param[in] dimension First sampler dimension not yet used by the
+  //!            camera ray
+  //! \return Path index
+  uint AddPath(const Ray &camera_ray, uint64_t pixel_index, uint sample_index,
+               uint dimension);
+
+  //! \brief Get number of paths in the wavefront
+  //! \return Number of paths
+  inline size_t GetNumPaths() const {return radiance_.size();}
+
+  //! \brief Compute the key by which secondary rays are sorted
+  //! \details Bits 61-63 hold the direction octant, bits 31-60 the
+  //!    Morton code of the origin's cell in a 1024^3 grid, and bits
+  //!    0-30 the ray index, so that sorting the keys sorts the indices.
+  //! \param[in] origin Ray origin
+  //! \param[in] direction Ray direction
+  //! \param[in] bmin Lower corner of the grid
+  //! \param[in] scale Grid cells per unit length along each axis
+  //! \param[in] ray_index Ray index (below 2^31)
+  //! \return Sort key
+  static uint64_t ComputeSortKey(const Vec3r &origin, const Vec3r &direction,
+                                 const Vec3r &bmin, const Vec3r &scale,
+                                 uint64_t ray_index);
+
+  //! \brief Get radiance computed for a path by Trace()
+  //! \param[in] path Path index
+  //! \return Path radiance
+  inline const Vec3r& GetRadiance(uint path) const {return radiance_[path];}
+
+  //! \brief Trace all paths of the wavefront
+  //! \param[in] scene Scene to render
+  //! \param[in] lights Scene lights
+  //! \param[in] max_ray_depth Maximum number of ray bounces
+  //! \return Number of traced (camera, secondary, and shadow) rays
+  size_t Trace(Surface::Ptr scene, const std::vector<Light::Ptr> &lights,
+               uint max_ray_depth);
+protected:
+  //! \enum MaterialType
+  //! \brief How the material kernel shades a hit point
+  enum class MaterialType : uchar {
+    kNone,        //!< not shaded (black)
+    kPhong,       //!< direct lighting plus mirror reflection
+    kDielectric   //!< reflection and refraction
+  };
+
+  //! \brief Closest-hit kernel: intersect all rays in rays_ with the
+  //! scene and store the results in hits_ and hit_flags_
+  //! \param[in] scene Scene to render
+  //! \param[in] use_packets Whether to trace the rays in packets
+  //! \param[in] sort Whether to trace the rays in sorted order
+  void Intersect(Surface::Ptr scene, bool use_packets, bool sort);
+
+  //! \brief Compute ray_order_: indices of rays_ sorted by direction
+  //! octant first and then by the Morton code of the origin
+  //! \details Handles at most 2^31 rays; Intersect() traces larger
+  //!    queues unsorted.
+  //! \param[in] bbox Scene bounding box (quantizes the origins)
+  void SortRays(const AABB &bbox);
+
+  //! \brief Material kernel: shade all hit points, generating shadow
+  //! rays and (optionally) the rays of the next bounce
+  //! \param[in] lights Scene lights
+  //! \param[in] spawn_rays Whether to generate secondary rays
+  void Shade(const std::vector<Light::Ptr> &lights, bool spawn_rays);
+
+  //! \brief Occlusion kernel: trace the shadow rays with any-hit
+  //! queries (see Surface::Occluded()) and add the radiance of the
+  //! unoccluded ones to their paths
+  //! \param[in] scene Scene to render
+  //! \param[in] num_lights Number of scene lights
+  void TraceShadowRays(Surface::Ptr scene, size_t num_lights);
+
+  //! \brief Get (cached) material type of a material
+  //! \param[in] material Material
+  //! \return Material type
+  MaterialType GetMaterialType(const Material *material);
+
+  //! \brief Sampler dimension offset of the reflected subpath of a
+  //! dielectric, so that it doesn't reuse the numbers of the
+  //! refracted subpath
+  static const uint kBranchDimensionOffset = 1u << 16;
+
+  Sampler sampler_;                        //!< sampler of the render
+  std::vector<uint64_t> path_pixels_;      //!< pixel index of each path
+  std::vector<uint> path_samples_;         //!< sample index of each path
+  std::vector<Vec3r> radiance_;            //!< radiance of each path
+  RayQueue rays_;                          //!< rays of the current bounce
+  RayQueue next_rays_;                     //!< rays of the next bounce
+  RayQueue shadow_rays_;                   //!< shadow rays of the bounce
+  std::vector<uint> shadow_lights_;        //!< light of each shadow ray
+  std::vector<uchar> shadow_flags_;        //!< whether shadow rays are
+                                           //!< occluded
+  std::vector<uint> packet_rays_;          //!< scratch ray indices
+  uint packet_size_{0};                    //!< rays per packet
+  std::vector<uint64_t> ray_keys_;         //!< scratch sort keys
+  std::vector<uint> ray_order_;            //!< order of tracing rays_
+  bool sort_secondary_rays_{false};        //!< whether to sort rays
+  WavefrontStats stats_;                   //!< secondary ray statistics
+  std::vector<HitRecord> hits_;            //!< closest hits of rays_
+  std::vector<uchar> hit_flags_;           //!< whether rays_ hit anything
+  std::vector<LightSample> light_samples_; //!< scratch light samples
+  std::unordered_map<const Material*, MaterialType> material_types_;
+};
+
+}  // namespace core
+}  // namespace olio
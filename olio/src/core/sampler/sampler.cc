@@ -0,0 +1,17 @@
+//! \file       sampler.cc
+//! \brief      Sampler class
+
+#include "core/sampler/sampler.h"
+
+namespace olio {
+namespace core {
+
+constexpr Real Sampler::kOneMinusEpsilon;
+
+Sampler::Sampler(uint64_t seed) :
+  seed_{seed}
+{
+}
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,110 @@
+//! \file       sampler.h
+//! \brief      Sampler class
+
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include "core/types.h"
+
+namespace olio {
+namespace core {
+
+//! \class Sampler
+//! \brief Counter-based random number generator used for Monte Carlo
+//! sampling during rendering
+//! \details Every random number is a pure function of the tuple
+//!    (seed, pixel index, sample index, dimension): the tuple is
+//!    hashed with a 64-bit mixing function (the splitmix64 finalizer,
+//!    as used to seed PCG streams) instead of advancing shared
+//!    generator state. Call StartSample() before generating the
+//!    numbers of a new pixel sample; every subsequent call to Get1D()
+//!    or Get2D() consumes the next dimension(s) of that sample. Since
+//!    no state is shared between samplers, each render thread can own
+//!    one, and the rendered image does not depend on the number of
+//!    threads or the order in which pixels are scheduled.
+class Sampler {
+public:
+  //! \brief Constructor
+  //! \param[in] seed Seed shared by all samplers of a render
+  explicit Sampler(uint64_t seed=0);
+
+  //! \brief Start generating numbers for a new pixel sample
+  //! \details Resets the dimension counter to the given dimension
+  //!    (zero by default). Integrators that suspend a sample and
+  //!    resume it later pass the dimension returned by GetDimension().
+  //! \param[in] pixel_index Linear index of the pixel (y * width + x)
+  //! \param[in] sample_index Index of the sample within the pixel
+  //! \param[in] dimension First dimension to consume
+  inline void StartSample(uint64_t pixel_index, uint sample_index,
+                          uint dimension=0) {
+    pixel_index_ = pixel_index;
+    sample_index_ = sample_index;
+    dimension_ = dimension;
+  }
+
+  //! \brief Generate a uniformly distributed number in [0, 1) and
+  //! advance to the next dimension
+  //! \return Random number in [0, 1)
+  inline Real Get1D() {
+    uint64_t key = (static_cast<uint64_t>(sample_index_) << 32) | dimension_++;
+    uint64_t bits = Mix(seed_ ^ Mix(pixel_index_ + Mix(key)));
+    auto value = static_cast<Real>(static_cast<double>(bits >> 11) *
+                                   (1.0 / 9007199254740992.0));
+    return std::min(value, kOneMinusEpsilon);
+  }
+
+  //! \brief Generate a 2D point uniformly distributed in [0, 1)^2 and
+  //! advance by two dimensions
+  //! \return Random 2D point in [0, 1)^2
+  inline Vec2r Get2D() {
+    Real u = Get1D();
+    Real v = Get1D();
+    return Vec2r{u, v};
+  }
+
+  //! \brief Set sampler seed
+  //! \param[in] seed Sampler seed
+  inline void SetSeed(uint64_t seed) {seed_ = seed;}
+
+  //! \brief Get sampler seed
+  //! \return Sampler seed
+  inline uint64_t GetSeed() const {return seed_;}
+
+  //! \brief Get pixel index of the current sample
+  //! \return Pixel index
+  inline uint64_t GetPixelIndex() const {return pixel_index_;}
+
+  //! \brief Get index of the current sample within its pixel
+  //! \return Sample index
+  inline uint GetSampleIndex() const {return sample_index_;}
+
+  //! \brief Get the next dimension that will be consumed
+  //! \return Dimension index
+  inline uint GetDimension() const {return dimension_;}
+protected:
+  //! \brief 64-bit avalanche mixing function (splitmix64 finalizer)
+  //! \param[in] x Value to mix
+  //! \return Mixed value
+  static inline uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  //! \brief Largest Real value smaller than one
+  static constexpr Real kOneMinusEpsilon =
+    1 - std::numeric_limits<Real>::epsilon() / 2;
+
+  uint64_t seed_{0};         //!< render seed
+  uint64_t pixel_index_{0};  //!< index of current pixel
+  uint sample_index_{0};     //!< index of current sample within pixel
+  uint dimension_{0};        //!< next dimension to consume
+};
+
+}  // namespace core
+}  // namespace olio
@@ -0,0 +1,90 @@
+//! \file       perf_counter.cc
+//! \brief      Hardware cache-miss counter
+
+#include "core/utils/perf_counter.h"
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace olio {
+namespace core {
+namespace utils {
+
+using namespace std;
+
+CacheMissCounter::CacheMissCounter()
+{
+  // the thread that creates the counter renders too (in arena.execute)
+  int event = OpenEvent();
+  is_available_ = event >= 0;
+  if (!is_available_)
+    return;
+  events_[this_thread::get_id()] = event;
+  observe(true);
+}
+
+
+CacheMissCounter::~CacheMissCounter()
+{
+  if (is_available_)
+    observe(false);
+#ifdef __linux__
+  for (const auto &event : events_)
+    close(event.second);
+#endif
+}
+
+
+uint64_t
+CacheMissCounter::GetCount() const
+{
+  uint64_t count = 0;
+#ifdef __linux__
+  lock_guard<mutex> lock{mutex_};
+  for (const auto &event : events_) {
+    uint64_t value = 0;
+    if (read(event.second, &value, sizeof(value)) == sizeof(value))
+      count += value;
+  }
+#endif
+  return count;
+}
+
+
+void
+CacheMissCounter::on_scheduler_entry(bool /*is_worker*/)
+{
+  auto id = this_thread::get_id();
+  lock_guard<mutex> lock{mutex_};
+  if (events_.count(id))
+    return;
+  int event = OpenEvent();
+  if (event >= 0)
+    events_[id] = event;
+}
+
+
+int
+CacheMissCounter::OpenEvent()
+{
+#ifdef __linux__
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                  0));
+#else
+  return -1;
+#endif
+}
+
+}  // namespace utils
+}  // namespace core
+}  // namespace olio
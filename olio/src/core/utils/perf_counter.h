@@ -0,0 +1,53 @@
+//! \file       perf_counter.h
+//! \brief      Hardware cache-miss counter
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tbb/task_scheduler_observer.h>
+
+namespace olio {
+namespace core {
+namespace utils {
+
+//! \class CacheMissCounter
+//! \brief Counts the hardware cache misses of the threads that run TBB
+//!    tasks
+//! \details Uses Linux perf events (last-level cache misses, user space
+//!    only). Each thread that joins a TBB arena while the counter
+//!    exists gets its own event, so GetCount() covers all render
+//!    threads. The counter is unavailable on other platforms, and where
+//!    the kernel or virtual machine exposes no hardware counters.
+class CacheMissCounter : public tbb::task_scheduler_observer {
+public:
+  CacheMissCounter();
+  ~CacheMissCounter() override;
+
+  //! \brief Check if the hardware counter could be opened
+  //! \return True if GetCount() counts cache misses
+  inline bool IsAvailable() const {return is_available_;}
+
+  //! \brief Get the number of cache misses so far
+  //! \return Cache misses of all counted threads since each one joined
+  //!    (0 if the counter is unavailable)
+  uint64_t GetCount() const;
+
+  //! \brief Open the counter of a thread that joins an arena
+  //! \param[in] is_worker True for TBB worker threads
+  void on_scheduler_entry(bool is_worker) override;
+protected:
+  //! \brief Open a cache-miss event for the calling thread
+  //! \return File descriptor (-1 on failure)
+  static int OpenEvent();
+
+  bool is_available_{false};                //!< hardware counter opened
+  mutable std::mutex mutex_;                //!< guards 'events_'
+  std::map<std::thread::id, int> events_;   //!< event of each thread
+};
+
+}  // namespace utils
+}  // namespace core
+}  // namespace olio
@@ -10,8 +10,10 @@
 //! \author     Hadi Fadaifard, 2022
 
 #include <vector>
+#include <fstream>
 #include <iostream>
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
 #include <spdlog/spdlog.h>
 
 #include "core/types.h"
@@ -20,33 +22,201 @@
 #include "core/geometry/surface.h"
 #include "core/parser/raytra_parser.h"
 #include "core/renderer/raytracer.h"
+#include "core/renderer/distributed.h"
 #include "core/utils/segfault_handler.h"
 #include "core/light/light.h"
 #include "core/geometry/surface_list.h"
 #include "core/geometry/bvh_node.h"
+#include "core/geometry/trimesh_bvh.h"
+#include "core/geometry/bvh_stats.h"
 
 using namespace olio::core;
 using namespace std;
 namespace po = boost::program_options;
 
-bool ParseArguments(int argc, char **argv, std::string *input_scene_name,
-                    std::string *output_name, uint *samples_per_pixel, uint * shadow_samples) {
+//! \struct Arguments
+//! \brief Command line arguments
+struct Arguments {
+  std::string input_scene_name;   //!< input scene file
+  std::string output_name;        //!< output image file
+  uint samples_per_pixel{1};      //!< (target) samples per pixel
+  uint shadow_samples{1};         //!< area light shadow samples
+  uint tile_size{32};             //!< render tile size in pixels
+  uint num_threads{0};            //!< render threads (0: all cores)
+  uint64_t seed{123543};          //!< sampler seed
+  int progress_fd{-1};            //!< progress stream fd (-1: off)
+  uint pass_samples{0};           //!< samples per pass (0: single pass)
+  Real time_budget{0};            //!< time budget in seconds (0: none)
+  std::string preview_name;       //!< intermediate image file
+  uint preview_every{1};          //!< passes between intermediate images
+  Real adaptive_threshold{0};     //!< adaptive sampling error (0: off)
+  uint adaptive_min_samples{16};  //!< samples before a pixel may stop
+  std::string spp_aov_name;       //!< samples-per-pixel image file
+  std::string integrator{"recursive"};  //!< ray color integrator
+  uint packet_size{16};           //!< rays per packet (wavefront only)
+  bool sort_rays{false};          //!< sort secondary rays (wavefront only)
+  std::string bvh_builder{"sah"}; //!< BVH split method
+  uint bvh_bins{16};              //!< SAH bins per axis
+  uint bvh_morton_bits{63};       //!< LBVH Morton code bits
+  Real bvh_max_duplication{0.5};  //!< SBVH extra references (fraction)
+  bool bvh_packed_meshes{true};   //!< store mesh triangles in BVH leaves
+  uint bvh_leaf_size{8};          //!< maximum triangles per mesh BVH leaf
+  bool bvh_quantized{false};      //!< 8-bit mesh BVH node bounds
+  bool bvh_veb_layout{false};     //!< van Emde Boas BVH node order
+  std::string bvh_layout{"linear"};  //!< BVH memory layout
+  std::string bvh_cache_dir;      //!< mesh BVH cache (empty: none)
+  bool bvh_stats{false};          //!< log BVH statistics
+  std::string bvh_stats_json;     //!< BVH statistics file (empty: none)
+  std::string checkpoint_name;    //!< checkpoint file
+  Real checkpoint_interval{60};   //!< seconds between checkpoints
+  bool resume{false};             //!< resume from the checkpoint file
+  uint coordinator_port{0};       //!< coordinator mode port (0: local)
+  std::string worker_address;     //!< worker mode: coordinator host:port
+  std::string worker_host;        //!< host of worker_address
+  uint worker_port{0};            //!< port of worker_address
+  uint net_tile_size{64};         //!< tiles handed out to workers
+  Real tile_timeout{60};          //!< seconds before a tile is re-sent
+};
+
+
+bool ParseArguments(int argc, char **argv, Arguments *args) {
   po::options_description desc("options");
   try {
     desc.add_options()
       ("help,h", "print usage")
       ("input_scene,s",
-       po::value             (input_scene_name)->required(),
+       po::value             (&args->input_scene_name),
        "Input scene file")
       ("output,o",
-       po::value             (output_name)->required(),
+       po::value             (&args->output_name),
        "Output name")
        ("samples_per_pixel,a",
-       po::value              (samples_per_pixel)->default_value(1),
-       "Samples per pixel")
+       po::value              (&args->samples_per_pixel)->default_value(1),
+       "Samples per pixel (target count in progressive mode)")
        ("shadow_samples,d",
-       po::value             (shadow_samples)->required(),
-       "Shadow Per Samples");
+       po::value             (&args->shadow_samples),
+       "Shadow Per Samples")
+      ("tile_size,t",
+       po::value             (&args->tile_size)->default_value(32),
+       "Render tile size in pixels")
+      ("threads,j",
+       po::value             (&args->num_threads)->default_value(0),
+       "Number of render and BVH build threads (0: use all cores)")
+      ("seed",
+       po::value             (&args->seed)->default_value(123543),
+       "Seed of the random numbers used for sampling")
+      ("progress_fd",
+       po::value             (&args->progress_fd)->default_value(-1),
+       "File descriptor receiving a JSON-lines progress stream (-1: off)")
+      ("pass_samples,p",
+       po::value             (&args->pass_samples)->default_value(0),
+       "Progressive mode: samples per pixel per pass (0: single pass)")
+      ("time_budget",
+       po::value             (&args->time_budget)->default_value(0),
+       "Stop after the pass that exceeds this many seconds (0: no limit)")
+      ("preview_output",
+       po::value             (&args->preview_name),
+       "Progressive mode: path of intermediate images")
+      ("preview_every",
+       po::value             (&args->preview_every)->default_value(1),
+       "Progressive mode: write an intermediate image every N passes")
+      ("adaptive_threshold",
+       po::value             (&args->adaptive_threshold)->default_value(0),
+       "Adaptive sampling: stop sampling a pixel once its relative error "
+       "is below this value (0: off)")
+      ("adaptive_min_samples",
+       po::value             (&args->adaptive_min_samples)->default_value(16),
+       "Adaptive sampling: samples taken before a pixel may stop")
+      ("spp_aov",
+       po::value             (&args->spp_aov_name),
+       "Write an image of the samples spent per pixel")
+      ("integrator",
+       po::value             (&args->integrator)->default_value("recursive"),
+       "Integrator: recursive (depth-first) or wavefront (breadth-first)")
+      ("packet_size",
+       po::value             (&args->packet_size)->default_value(16),
+       "Wavefront integrator: camera/shadow rays traced together as a "
+       "packet (0 or 1: no packets, max 16)")
+      ("sort_rays",
+       po::value             (&args->sort_rays)->default_value(false),
+       "Wavefront integrator: sort secondary rays by direction and origin "
+       "before tracing them (0 or 1)")
+      ("bvh_builder",
+       po::value             (&args->bvh_builder)->default_value("sah"),
+       "BVH builder: sah (binned surface area heuristic), sbvh (SAH "
+       "with spatial splits of large overlapping surfaces), lbvh (Morton "
+       "code order; fastest build), or median (median split on "
+       "round-robin axes)")
+      ("bvh_bins",
+       po::value             (&args->bvh_bins)->default_value(16),
+       "SAH BVH builder: bins per axis")
+      ("bvh_morton_bits",
+       po::value             (&args->bvh_morton_bits)->default_value(63),
+       "LBVH builder: Morton code bits (30 or 63)")
+      ("bvh_max_duplication",
+       po::value             (&args->bvh_max_duplication)->default_value(0.5),
+       "SBVH builder: extra surface references from spatial splits, as "
+       "a fraction of the surface count (memory cap)")
+      ("bvh_packed_meshes",
+       po::value             (&args->bvh_packed_meshes)->default_value(true),
+       "Linear layout with sah or lbvh builder: store mesh triangles in "
+       "the BVH leaves instead of one surface object per face (0 or 1)")
+      ("bvh_leaf_size",
+       po::value             (&args->bvh_leaf_size)->default_value(8),
+       "Packed mesh BVHs: maximum triangles per leaf (2 to 64); the SAH "
+       "picks the size of each leaf")
+      ("bvh_quantized",
+       po::value             (&args->bvh_quantized)->default_value(false),
+       "Packed mesh BVHs: store 24-byte nodes with 8-bit child bounds "
+       "instead of 32-byte nodes per child; smaller, but looser bounds "
+       "(0 or 1)")
+      ("bvh_veb_layout",
+       po::value             (&args->bvh_veb_layout)->default_value(false),
+       "Wide layouts and quantized mesh BVHs: store the nodes in van "
+       "Emde Boas order instead of depth-first, so that subtrees share "
+       "cache lines and pages (0 or 1)")
+      ("bvh_layout",
+       po::value             (&args->bvh_layout)->default_value("linear"),
+       "BVH layout: linear (flat array of 32-byte nodes), wide4 or "
+       "wide8 (4 or 8 children per node), or tree (linked BVHNode "
+       "objects)")
+      ("bvh_cache_dir",
+       po::value             (&args->bvh_cache_dir),
+       "Packed mesh BVHs: read and store the BVHs of meshes in this "
+       "directory, keyed by a hash of the mesh and the builder settings")
+      ("bvh_stats",
+       po::bool_switch       (&args->bvh_stats),
+       "Log the node and leaf counts, leaf depths, SAH cost, memory, and "
+       "build time of each BVH, and the node and primitive tests per "
+       "camera, secondary, and shadow ray")
+      ("bvh_stats_json",
+       po::value             (&args->bvh_stats_json),
+       "Write the --bvh_stats statistics to this JSON file")
+      ("checkpoint",
+       po::value             (&args->checkpoint_name),
+       "Periodically save the render state to this file")
+      ("checkpoint_interval",
+       po::value             (&args->checkpoint_interval)->default_value(60),
+       "Minimum seconds between checkpoints")
+      ("resume",
+       po::bool_switch       (&args->resume),
+       "Continue the render saved in the --checkpoint file")
+      ("coordinator",
+       po::value             (&args->coordinator_port)->default_value(0),
+       "Render with workers connecting to this TCP port (0: render "
+       "locally; not with the progressive, progress stream, or "
+       "checkpoint options)")
+      ("worker",
+       po::value             (&args->worker_address),
+       "Run as a worker of the coordinator at host:port (all other "
+       "render options come from the coordinator)")
+      ("net_tile_size",
+       po::value             (&args->net_tile_size)->default_value(64),
+       "Coordinator: size of the tiles handed out to workers")
+      ("tile_timeout",
+       po::value             (&args->tile_timeout)->default_value(60),
+       "Coordinator: seconds before a tile that a worker hasn't returned "
+       "is handed out again");
 
     // parse arguments
     po::variables_map vm;
@@ -56,6 +226,69 @@ bool ParseArguments(int argc, char **argv, std::string *input_scene_name,
       return false;
     }
     po::notify(vm);
+    if (args->worker_address.empty()) {
+      for (const char *option : {"input_scene", "output", "shadow_samples"})
+        if (!vm.count(option))
+          throw po::required_option(option);
+    } else {
+      // host:port, with a port in 1..65535
+      auto colon = args->worker_address.rfind(':');
+      std::string port = colon == std::string::npos ? "" :
+        args->worker_address.substr(colon + 1);
+      if (colon == 0 || port.empty() || port.size() > 5 ||
+          port.find_first_not_of("0123456789") != std::string::npos ||
+          std::stoul(port) < 1 || std::stoul(port) > 65535)
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "worker", args->worker_address);
+      args->worker_host = args->worker_address.substr(0, colon);
+      args->worker_port = static_cast<uint>(std::stoul(port));
+    }
+    if (args->resume && args->checkpoint_name.empty())
+      throw po::error("--resume requires --checkpoint");
+
+    // coordinators render each tile once: no passes, progress stream,
+    // previews, or checkpoints
+    if (args->coordinator_port) {
+      for (const char *option : {"progress_fd", "pass_samples", "time_budget",
+                                 "preview_output", "preview_every",
+                                 "checkpoint", "checkpoint_interval",
+                                 "resume"})
+        if (vm.count(option) && !vm[option].defaulted())
+          throw po::validation_error(po::validation_error::invalid_option,
+                                     option);
+    }
+    if (args->bvh_builder != "sah" && args->bvh_builder != "sbvh" &&
+        args->bvh_builder != "lbvh" && args->bvh_builder != "median")
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_builder", args->bvh_builder);
+    if (args->bvh_morton_bits != 30 && args->bvh_morton_bits != 63)
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_morton_bits",
+                                 std::to_string(args->bvh_morton_bits));
+    if (!(args->bvh_max_duplication >= 0))
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_max_duplication",
+                                 std::to_string(args->bvh_max_duplication));
+    if (args->bvh_leaf_size < 2 || args->bvh_leaf_size > 64)
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_leaf_size",
+                                 std::to_string(args->bvh_leaf_size));
+    if (args->bvh_layout != "linear" && args->bvh_layout != "wide4" &&
+        args->bvh_layout != "wide8" && args->bvh_layout != "tree")
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "bvh_layout", args->bvh_layout);
+    if (args->integrator != "recursive" && args->integrator != "wavefront")
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "integrator", args->integrator);
+
+    // only the wavefront integrator traces packets and sorts rays
+    if (args->integrator == "recursive") {
+      for (const char *option : {"packet_size", "sort_rays"})
+        if (vm.count(option) && !vm[option].defaulted())
+          spdlog::warn("--{} only applies to the wavefront integrator; the "
+                       "recursive integrator traces every ray on its own",
+                       option);
+    }
   } catch(std::exception &e) {
     cout << desc << endl;
     spdlog::error("{}", e.what());
@@ -73,49 +306,110 @@ int
 main(int argc, char **argv)
 {
   utils::InstallSegfaultHandler();
-  srand(123543);
 
   // parse command line arguments
-  string input_scene_name, output_name;
-  uint samples_per_pixel;
-  uint shadow_samples;
-  if (!ParseArguments(argc, argv, &input_scene_name, &output_name, &samples_per_pixel, &shadow_samples))
+  Arguments args;
+  if (!ParseArguments(argc, argv, &args))
     return -1;
 
-  // parse and render raytra scene
+  // mesh BVH cache (local to this machine, also in worker mode)
+  TriMeshBVH::SetCacheDirectory(args.bvh_cache_dir);
+
+  // worker mode: render tiles for a coordinator
+  if (!args.worker_address.empty()) {
+    RenderWorker worker{args.worker_host, args.worker_port};
+    worker.SetNumThreads(args.num_threads);
+    return worker.Run() ? 0 : -1;
+  }
+
+  // parse raytra scene
+  RenderJob job;
+  job.scene_path = boost::filesystem::absolute(args.input_scene_name).string();
+  job.samples_per_pixel = args.samples_per_pixel;
+  job.shadow_samples = args.shadow_samples;
+  job.tile_size = args.tile_size;
+  job.seed = args.seed;
+  job.integrator = args.integrator == "wavefront" ? Integrator::kWavefront :
+    Integrator::kRecursive;
+  job.packet_size = args.packet_size;
+  job.sort_rays = args.sort_rays;
+  job.adaptive_threshold = args.adaptive_threshold;
+  job.adaptive_min_samples = args.adaptive_min_samples;
+  if (args.bvh_builder == "median")
+    job.bvh_options.split_method = BVHSplitMethod::kMedian;
+  else if (args.bvh_builder == "sbvh")
+    job.bvh_options.split_method = BVHSplitMethod::kSBVH;
+  else if (args.bvh_builder == "lbvh")
+    job.bvh_options.split_method = BVHSplitMethod::kLBVH;
+  else
+    job.bvh_options.split_method = BVHSplitMethod::kSAH;
+  job.bvh_options.bin_count = args.bvh_bins;
+  job.bvh_options.morton_bits = args.bvh_morton_bits;
+  job.bvh_options.max_duplication = args.bvh_max_duplication;
+  job.bvh_options.packed_meshes = args.bvh_packed_meshes;
+  job.bvh_options.max_leaf_size = args.bvh_leaf_size;
+  job.bvh_options.quantized_nodes = args.bvh_quantized;
+  job.bvh_options.veb_layout = args.bvh_veb_layout;
+  if (args.bvh_layout == "tree")
+    job.bvh_options.layout = BVHLayout::kTree;
+  else if (args.bvh_layout == "wide4")
+    job.bvh_options.layout = BVHLayout::kWide4;
+  else if (args.bvh_layout == "wide8")
+    job.bvh_options.layout = BVHLayout::kWide8;
+  else
+    job.bvh_options.layout = BVHLayout::kLinear;
+  job.bvh_options.num_threads = args.num_threads;
+  bool report_bvh_stats = args.bvh_stats || !args.bvh_stats_json.empty();
+  BVHNode::SetCollectTreeStats(report_bvh_stats);
+  BVHStats::SetCollectTraversalStats(report_bvh_stats);
   Vec2i image_size;
-  Surface::Ptr scene;
+  Surface::Ptr bvh_tree;
   vector<Light::Ptr> lights;
   Camera::Ptr camera;
-  if (!RaytraParser::ParseFile(input_scene_name, scene, lights, camera,
-      image_size) || !scene || !camera || image_size[0] <= 0 ||
-      image_size[1] <= 0) {
-    spdlog::error("Failed to parse scene file.");
+  if (!job.LoadScene(bvh_tree, lights, camera, image_size))
     return -1;
-  }
+  job.image_height = static_cast<uint>(image_size[1]);
 
-  auto scenelist_ptr = dynamic_pointer_cast<SurfaceList>(scene);
-  if(!scenelist_ptr) {
-    spdlog::error("Failed to convert to SurfaceList class.");
-    return -1;
+  // render scene
+  RayTracer rt;
+  job.Configure(rt);
+  if (args.coordinator_port) {
+    RenderCoordinator coordinator{job, args.coordinator_port};
+    coordinator.SetTileSize(args.net_tile_size);
+    coordinator.SetTileTimeout(args.tile_timeout);
+    if (!coordinator.Render(rt, camera))
+      return -1;
+  } else {
+    rt.SetNumThreads(args.num_threads);
+    rt.SetProgressFd(args.progress_fd);
+    rt.SetSamplesPerPass(args.pass_samples);
+    rt.SetTimeBudget(args.time_budget);
+    rt.SetPreviewOutput(args.preview_name, args.preview_every, 2);
+    rt.SetCheckpoint(args.checkpoint_name, args.checkpoint_interval);
+    rt.SetResume(args.resume);
+    if (!rt.Render(bvh_tree, lights, camera))
+      return -1;
   }
 
-  for(auto & light: lights) {
-    AreaLight::Ptr area_light = dynamic_pointer_cast<AreaLight>(light);
-    if(area_light) {
-      area_light->SetShadowSamples(shadow_samples);
+  // BVH statistics (traversal is only counted when rendering locally)
+  if (report_bvh_stats) {
+    auto tree_stats = BVHNode::GetTreeStats();
+    vector<BVHTraversalStats> traversal_stats;
+    if (!args.coordinator_port)
+      traversal_stats = GetTraversalStatsByRayType();
+    LogBVHStats(tree_stats, traversal_stats);
+    if (!args.bvh_stats_json.empty()) {
+      ofstream out(args.bvh_stats_json);
+      out << FormatBVHStatsJSON(tree_stats, traversal_stats);
+      if (!out)
+        spdlog::error("Failed to write BVH statistics to {}",
+                      args.bvh_stats_json);
     }
   }
-  
-  auto bvh_tree = BVHNode::BuildBVH(scenelist_ptr->GetSurfaces(), string{"Scene Objects"});
-
-  // render scene
-  RayTracer rt;
-  rt.SetNumSamplesPerPixel(samples_per_pixel);
-  rt.SetImageHeight(static_cast<uint>(image_size[1]));
-  rt.Render(bvh_tree, lights, camera);
 
   // save rendered image to file
-  rt.WriteImage(output_name, 2);
+  rt.WriteImage(args.output_name, 2);
+  if (!args.spp_aov_name.empty())
+    rt.WriteSampleCountImage(args.spp_aov_name);
   return 0;
 }
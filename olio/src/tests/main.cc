@@ -9,15 +9,1534 @@
 //! \brief      main tests file
 //! \author     Hadi Fadaifard, 2022
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
+#include <spdlog/spdlog.h>
 
 #include "core/types.h"
+#include "core/ray.h"
+#include "core/ray_packet.h"
+#include "core/geometry/sphere.h"
+#include "core/geometry/triangle.h"
+#include "core/geometry/surface_list.h"
+#include "core/geometry/trimesh.h"
+#include "core/geometry/trimesh_bvh.h"
+#include "core/geometry/instance.h"
+#include "core/geometry/bvh_layout.h"
+#include "core/geometry/bvh_node.h"
+#include "core/geometry/bvh_stats.h"
+#include "core/geometry/linear_bvh.h"
+#include "core/geometry/wide_bvh.h"
+#include "core/camera/camera.h"
+#include "core/light/light.h"
+#include "core/material/phong_material.h"
+#include "core/parser/raytra_parser.h"
+#include "core/renderer/raytracer.h"
+#include "core/renderer/distributed.h"
 
 using namespace std;
 using namespace olio::core;
 
+namespace {
+
+//! \brief Make spheres at random positions in [-10, 10]^3
+std::vector<Surface::Ptr>
+RandomSpheres(size_t count, std::mt19937 &rng)
+{
+  std::uniform_real_distribution<Real> position(-10, 10);
+  std::uniform_real_distribution<Real> radius(Real(.05), Real(.5));
+  std::vector<Surface::Ptr> spheres;
+  for (size_t i = 0; i < count; ++i)
+    spheres.push_back(Sphere::Create(Vec3r{position(rng), position(rng),
+                                           position(rng)}, radius(rng)));
+  return spheres;
+}
+
+
+//! \struct TestScene
+//! \brief Scene, lights, and camera of a small test render
+struct TestScene {
+  Surface::Ptr scene;
+  std::vector<Light::Ptr> lights;
+  Camera::Ptr camera;
+};
+
+
+//! \brief Make a few spheres on a ground sphere, lit by an area light
+//! \details The area light's jittered shadow rays and a mirror sphere
+//!    make every pixel depend on the sampler.
+TestScene
+MakeTestScene()
+{
+  auto diffuse = PhongMaterial::Create(Vec3r{.1, .1, .1}, Vec3r{.7, .6, .5},
+                                       Vec3r{.3, .3, .3}, Real(20));
+  auto mirror = PhongMaterial::Create(Vec3r{0, 0, 0}, Vec3r{.1, .1, .1},
+                                      Vec3r{.5, .5, .5}, Real(50),
+                                      Vec3r{.8, .8, .8});
+  std::vector<Surface::Ptr> spheres{
+    Sphere::Create(Vec3r{0, -101, -4}, Real(100)),
+    Sphere::Create(Vec3r{-1, 0, -4}, Real(1)),
+    Sphere::Create(Vec3r{1.2, -.3, -3.5}, Real(.7))};
+  for (auto &sphere : spheres)
+    sphere->SetMaterial(diffuse);
+  spheres[1]->SetMaterial(mirror);
+  auto light = AreaLight::Create(Vec3r{0, 4, -3}, Vec3r{0, -1, 0},
+                                 Vec3r{1, 0, 0}, Real(2), Vec3r{8, 8, 8});
+  light->SetShadowSamples(4);
+
+  TestScene test_scene;
+  test_scene.scene = SurfaceList::Create(spheres);
+  test_scene.lights = {AmbientLight::Create(Vec3r{.2, .2, .2}), light};
+  test_scene.camera = Camera::Create(Vec3r{0, 0, 0}, Vec3r{0, 0, -1},
+                                     Vec3r{0, 1, 0}, Real(60), Real(4) / 3);
+  return test_scene;
+}
+
+
+//! \brief Set up a ray tracer to render small images quietly
+void
+SetUpTestRayTracer(RayTracer &raytracer)
+{
+  raytracer.SetImageHeight(24);
+  raytracer.SetNumSamplesPerPixel(16);
+  raytracer.SetShowProgressBar(false);
+}
+
+
+//! \brief Check that two films hold exactly the same samples
+void
+RequireSameFilm(const Film &film, const Film &reference)
+{
+  REQUIRE(film.GetWidth() == reference.GetWidth());
+  REQUIRE(film.GetHeight() == reference.GetHeight());
+  for (int y = 0; y < film.GetHeight(); ++y) {
+    for (int x = 0; x < film.GetWidth(); ++x) {
+      REQUIRE(film.GetSampleCount(x, y) == reference.GetSampleCount(x, y));
+      REQUIRE(film.GetColorSum(x, y) == reference.GetColorSum(x, y));
+    }
+  }
+}
+
+
+//! \brief Make rays from random points in [-12, 12]^3 toward random
+//!    points in [-10, 10]^3
+std::vector<Ray>
+RandomRays(size_t count, std::mt19937 &rng)
+{
+  std::uniform_real_distribution<Real> origin(-12, 12);
+  std::uniform_real_distribution<Real> target(-10, 10);
+  std::vector<Ray> rays;
+  for (size_t i = 0; i < count; ++i) {
+    Vec3r from{origin(rng), origin(rng), origin(rng)};
+    Vec3r to{target(rng), target(rng), target(rng)};
+    rays.emplace_back(from, to - from);
+  }
+  return rays;
+}
+
+
+//! \brief Make a mesh of disjoint triangles with random vertices
+//! \details Each triangle has its vertices within one unit of a random
+//!    point in [-10, 10]^3.
+TriMesh::Ptr
+RandomTriangles(size_t count, std::mt19937 &rng)
+{
+  std::uniform_real_distribution<Real> position(-10, 10);
+  std::uniform_real_distribution<Real> offset(-1, 1);
+  auto mesh = TriMesh::Create();
+  mesh->request_face_normals();
+  mesh->request_vertex_normals();
+  for (size_t i = 0; i < count; ++i) {
+    Vec3r center{position(rng), position(rng), position(rng)};
+    TriMesh::VertexHandle vertices[3];
+    for (auto &vertex : vertices)
+      vertex = mesh->add_vertex(center + Vec3r{offset(rng), offset(rng),
+                                               offset(rng)});
+    mesh->add_face(vertices[0], vertices[1], vertices[2]);
+  }
+  mesh->ComputeFaceNormals();
+  mesh->ComputeVertexNormals();
+  return mesh;
+}
+
+
+//! \brief Copy a mesh's vertices and faces
+TriMesh::Ptr
+CopyTriangles(TriMesh &mesh)
+{
+  auto copy = TriMesh::Create();
+  copy->request_face_normals();
+  copy->request_vertex_normals();
+  for (auto vit = mesh.vertices_begin(); vit != mesh.vertices_end(); ++vit)
+    copy->add_vertex(mesh.point(*vit));
+  for (auto fit = mesh.faces_begin(); fit != mesh.faces_end(); ++fit) {
+    TriMesh::VertexHandle vertices[3];
+    int num_vertices = 0;
+    for (auto fvit = mesh.fv_iter(*fit); fvit.is_valid() && num_vertices < 3;
+         ++fvit)
+      vertices[num_vertices++] = *fvit;
+    copy->add_face(vertices[0], vertices[1], vertices[2]);
+  }
+  copy->ComputeFaceNormals();
+  copy->ComputeVertexNormals();
+  return copy;
+}
+
+
+//! \brief Check that two hit records describe the same hit
+//! \details A hit on 'reference_mesh' must be a hit on the same face of
+//!    'mesh'; other surfaces must be the same.
+void
+RequireSameHit(const HitRecord &hit, const HitRecord &reference_hit,
+               const Surface::Ptr &mesh=nullptr,
+               const Surface::Ptr &reference_mesh=nullptr)
+{
+  REQUIRE(hit.GetRayT() == Approx(reference_hit.GetRayT()));
+  if (reference_mesh && reference_hit.GetSurface() == reference_mesh) {
+    REQUIRE(hit.GetSurface() == mesh);
+    REQUIRE(hit.GetFaceGeoUV().GetFaceId() ==
+            reference_hit.GetFaceGeoUV().GetFaceId());
+  } else {
+    REQUIRE(hit.GetSurface() == reference_hit.GetSurface());
+  }
+}
+
+
+//! \brief Check that two surfaces have the same closest hits
+//! \details See RequireSameHit() for 'mesh' and 'reference_mesh'.
+void
+RequireSameHits(const Surface::Ptr &surface, const Surface::Ptr &reference,
+                const std::vector<Ray> &rays,
+                const Surface::Ptr &mesh=nullptr,
+                const Surface::Ptr &reference_mesh=nullptr)
+{
+  for (const auto &ray : rays) {
+    HitRecord hit, reference_hit;
+    bool is_hit = surface->Hit(ray, kEpsilon, kInfinity, hit);
+    REQUIRE(is_hit == reference->Hit(ray, kEpsilon, kInfinity,
+                                     reference_hit));
+    if (is_hit)
+      RequireSameHit(hit, reference_hit, mesh, reference_mesh);
+  }
+}
+
+
+//! \brief Check that occlusion queries agree with closest-hit queries
+//! \details Each ray is cut off at a random fraction of its length, so
+//!    that some of the surfaces it crosses lie past 'tmax'.
+void
+RequireOcclusionMatchesHits(const Surface::Ptr &surface,
+                            const std::vector<Ray> &rays, std::mt19937 &rng)
+{
+  std::uniform_real_distribution<Real> fraction(0, 1);
+  for (const auto &ray : rays) {
+    Real tmax = fraction(rng);
+    HitRecord hit;
+    REQUIRE(surface->Occluded(ray, kEpsilon, tmax) ==
+            surface->Hit(ray, kEpsilon, tmax, hit));
+  }
+}
+
+
+//! \brief Check that packet queries agree with single-ray queries
+//! \details The rays are traced in packets of kMaxPacketSize, with
+//!    random lanes inactive and a random tmax per lane.
+void
+RequirePacketsMatchRays(const Surface::Ptr &surface,
+                        const std::vector<Ray> &rays, std::mt19937 &rng)
+{
+  std::uniform_real_distribution<Real> fraction(0, 1);
+  std::bernoulli_distribution is_active(.75);
+  for (size_t first = 0; first < rays.size(); first += kMaxPacketSize) {
+    RayPacket packet;
+    PacketMask active = PacketMask::Constant(false);
+    PacketReal tmax = PacketReal::Zero();
+    for (size_t i = first; i < rays.size() && !packet.IsFull(); ++i) {
+      int lane = packet.Add(rays[i].GetOrigin(), rays[i].GetDirection());
+      active[lane] = is_active(rng);
+      tmax[lane] = fraction(rng);
+    }
+    PacketReal hit_tmax = tmax;
+    std::vector<HitRecord> hits(kMaxPacketSize);
+    PacketMask is_hit = surface->HitPacket(packet, active, kEpsilon,
+                                           hit_tmax, hits.data());
+    PacketMask is_occluded = surface->OccludedPacket(packet, active,
+                                                     kEpsilon, tmax);
+    for (int lane = 0; lane < packet.GetSize(); ++lane) {
+      const Ray &ray = rays[first + static_cast<size_t>(lane)];
+      HitRecord hit;
+      bool is_lane_hit = active[lane] &&
+        surface->Hit(ray, kEpsilon, tmax[lane], hit);
+      REQUIRE(is_hit[lane] == is_lane_hit);
+      REQUIRE(is_occluded[lane] == is_lane_hit);
+      if (is_lane_hit) {
+        RequireSameHit(hits[static_cast<size_t>(lane)], hit);
+        REQUIRE(hit_tmax[lane] == Approx(hit.GetRayT()));
+      }
+    }
+  }
+}
+
+
+//! \brief Make BVH build options with a split method and a layout
+BVHBuildOptions
+MakeBVHBuildOptions(BVHSplitMethod split_method, BVHLayout layout)
+{
+  BVHBuildOptions options;
+  options.split_method = split_method;
+  options.layout = layout;
+  return options;
+}
+
+
+//! \brief Make BVH build options for quantized mesh BVHs
+BVHBuildOptions
+MakeQuantizedBVHBuildOptions()
+{
+  auto options = MakeBVHBuildOptions(BVHSplitMethod::kSAH,
+                                     BVHLayout::kLinear);
+  options.quantized_nodes = true;
+  return options;
+}
+
+
+//! \struct BVHTestScene
+//! \brief Spheres and a triangle soup in a BVH, and a reference that
+//! traces every surface and face
+struct BVHTestScene {
+  Surface::Ptr bvh;             //!< BVH of the spheres and the mesh
+  Surface::Ptr mesh;            //!< mesh, with its own BVH
+  Surface::Ptr reference;       //!< spheres and 'reference_mesh'
+  Surface::Ptr reference_mesh;  //!< copy of the mesh without a BVH
+  std::vector<Ray> rays;        //!< random rays through the scene
+};
+
+
+//! \brief Make a BVHTestScene with the given BVH build options
+//! \details The options are also used for the mesh BVH.
+BVHTestScene
+MakeBVHTestScene(const BVHBuildOptions &options)
+{
+  BVHNode::SetBuildOptions(options);
+  TriMeshBVH::SetCacheDirectory("");
+  std::mt19937 rng{13};
+  auto surfaces = RandomSpheres(200, rng);
+  auto mesh = RandomTriangles(1000, rng);
+  auto reference_mesh = CopyTriangles(*mesh);
+  mesh->BuildBVH();
+  auto reference_surfaces = surfaces;
+  surfaces.push_back(mesh);
+  reference_surfaces.push_back(reference_mesh);
+
+  BVHTestScene test_scene;
+  test_scene.bvh = BVHNode::BuildAccelerator(surfaces, options);
+  test_scene.mesh = mesh;
+  test_scene.reference = SurfaceList::Create(reference_surfaces);
+  test_scene.reference_mesh = reference_mesh;
+  test_scene.rays = RandomRays(2000, rng);
+  BVHNode::SetBuildOptions(BVHBuildOptions{});
+  return test_scene;
+}
+
+
+//! \brief Get the TriMeshBVH of a mesh
+//! \param[in] mesh TriMesh
+//! \return Mesh BVH (nullptr if the mesh has another kind of BVH)
+TriMeshBVH::Ptr
+GetMeshBVH(const Surface::Ptr &mesh)
+{
+  auto trimesh = std::dynamic_pointer_cast<TriMesh>(mesh);
+  if (!trimesh)
+    return nullptr;
+  return std::dynamic_pointer_cast<TriMeshBVH>(trimesh->GetBVH());
+}
+
+
+//! \class TriMeshBVHAccess
+//! \brief Exposes the TriMeshBVH internals that the tests check
+//! \details Never instantiated: the members are reached through
+//!    pointers to members named in this derived class.
+class TriMeshBVHAccess : public TriMeshBVH {
+public:
+  using TriMeshBVH::PackedTriangle;
+  using TriMeshBVH::QuantizedNode;
+
+  static const LinearBVH::NodeArray& GetNodes(const TriMeshBVH &bvh) {
+    return bvh.*(&TriMeshBVHAccess::nodes_);
+  }
+
+  static const std::vector<QuantizedNode>&
+  GetQuantizedNodes(const TriMeshBVH &bvh) {
+    return bvh.*(&TriMeshBVHAccess::quantized_nodes_);
+  }
+
+  static const std::vector<PackedTriangle>&
+  GetTriangles(const TriMeshBVH &bvh) {
+    return bvh.*(&TriMeshBVHAccess::triangles_);
+  }
+
+  static LinearBVH::NodeArray Decode(const TriMeshBVH &bvh) {
+    return (bvh.*(&TriMeshBVHAccess::DecodeQuantizedNodes))();
+  }
+
+  static bool Read(TriMeshBVH &bvh, const std::string &filepath,
+                   uint64_t key,
+                   const std::vector<PackedTriangle> &triangles) {
+    return (bvh.*(&TriMeshBVHAccess::ReadCache))(filepath, key, triangles);
+  }
+
+  static bool Write(const TriMeshBVH &bvh, const std::string &filepath,
+                    uint64_t key) {
+    return (bvh.*(&TriMeshBVHAccess::WriteCache))(filepath, key);
+  }
+};
+
+
+//! \class WideBVHAccess
+//! \brief Exposes the WideBVH nodes to the tests
+//! \details Never instantiated, like TriMeshBVHAccess
+template <uint Width>
+class WideBVHAccess : public WideBVH<Width> {
+public:
+  static const typename WideBVH<Width>::NodeArray&
+  GetNodes(const WideBVH<Width> &bvh) {
+    return bvh.*(&WideBVHAccess::nodes_);
+  }
+};
+
+
+//! \brief Check that a node order is a permutation that keeps the
+//! root first and moves some other node
+//! \param[in] order New index of each node
+void
+RequireNodePermutation(const std::vector<uint32_t> &order)
+{
+  REQUIRE(!order.empty());
+  REQUIRE(order[0] == 0);
+  std::vector<uint32_t> sorted_order = order;
+  std::sort(sorted_order.begin(), sorted_order.end());
+  bool is_identity = true;
+  for (size_t i = 0; i < order.size(); ++i) {
+    REQUIRE(sorted_order[i] == i);
+    is_identity = is_identity && order[i] == i;
+  }
+  REQUIRE_FALSE(is_identity);
+}
+
+
+//! \brief Check that two wide BVHs are the same tree with the nodes
+//! of the second one in another order
+//! \param[in] bvh Wide BVH, depth-first
+//! \param[in] reordered_bvh Same BVH with the nodes reordered
+template <uint Width>
+void
+RequireReorderedWideNodes(const WideBVH<Width> &bvh,
+                          const WideBVH<Width> &reordered_bvh)
+{
+  const auto &nodes = WideBVHAccess<Width>::GetNodes(bvh);
+  const auto &reordered_nodes = WideBVHAccess<Width>::GetNodes(reordered_bvh);
+  REQUIRE(reordered_nodes.size() == nodes.size());
+
+  // walk both trees in step; leaves and child bounds must match
+  std::vector<uint32_t> order(nodes.size(), kNoChildNode);
+  std::vector<std::pair<uint32_t, uint32_t>> stack{std::make_pair(0u, 0u)};
+  while (!stack.empty()) {
+    auto entry = stack.back();
+    stack.pop_back();
+    REQUIRE(order[entry.first] == kNoChildNode);
+    order[entry.first] = entry.second;
+    const auto &node = nodes[entry.first];
+    const auto &reordered_node = reordered_nodes[entry.second];
+    REQUIRE(memcmp(reordered_node.bmin, node.bmin, sizeof(node.bmin)) == 0);
+    REQUIRE(memcmp(reordered_node.bmax, node.bmax, sizeof(node.bmax)) == 0);
+    REQUIRE(memcmp(reordered_node.count, node.count,
+                   sizeof(node.count)) == 0);
+    for (uint j = 0; j < Width; ++j) {
+      if (node.count[j])
+        REQUIRE(reordered_node.offset[j] == node.offset[j]);
+      else if (node.bmin[0][j] <= node.bmax[0][j])
+        stack.emplace_back(node.offset[j], reordered_node.offset[j]);
+    }
+  }
+  RequireNodePermutation(order);
+}
+
+
+//! \brief Check that two quantized mesh BVHs are the same tree with
+//! the nodes of the second one in another order
+//! \param[in] bvh Quantized mesh BVH, depth-first
+//! \param[in] reordered_bvh Same BVH with the nodes reordered
+void
+RequireReorderedQuantizedNodes(const TriMeshBVH &bvh,
+                               const TriMeshBVH &reordered_bvh)
+{
+  const auto &nodes = TriMeshBVHAccess::GetQuantizedNodes(bvh);
+  const auto &reordered_nodes =
+    TriMeshBVHAccess::GetQuantizedNodes(reordered_bvh);
+  REQUIRE(reordered_nodes.size() == nodes.size());
+
+  // walk both trees in step; leaves (count > 0) and child bounds must
+  // match
+  std::vector<uint32_t> order(nodes.size(), kNoChildNode);
+  std::vector<std::pair<uint32_t, uint32_t>> stack{std::make_pair(0u, 0u)};
+  while (!stack.empty()) {
+    auto entry = stack.back();
+    stack.pop_back();
+    REQUIRE(order[entry.first] == kNoChildNode);
+    order[entry.first] = entry.second;
+    const auto &node = nodes[entry.first];
+    const auto &reordered_node = reordered_nodes[entry.second];
+    REQUIRE(memcmp(reordered_node.qmin, node.qmin, sizeof(node.qmin)) == 0);
+    REQUIRE(memcmp(reordered_node.qmax, node.qmax, sizeof(node.qmax)) == 0);
+    REQUIRE(memcmp(reordered_node.count, node.count,
+                   sizeof(node.count)) == 0);
+    for (size_t c = 0; c < 2; ++c) {
+      if (node.count[c])
+        REQUIRE(reordered_node.child[c] == node.child[c]);
+      else
+        stack.emplace_back(node.child[c], reordered_node.child[c]);
+    }
+  }
+  RequireNodePermutation(order);
+}
+
+
+//! \brief Write the triangles of a mesh to an OBJ file
+//! \param[in] filepath OBJ file
+//! \param[in] mesh Mesh
+//! \param[in] xform Transform of the vertices
+void
+WriteOBJ(const std::string &filepath, TriMesh &mesh, const Mat4r &xform)
+{
+  std::ofstream out(filepath);
+  out.precision(std::numeric_limits<Real>::max_digits10);
+  for (auto vit = mesh.vertices_begin(); vit != mesh.vertices_end(); ++vit) {
+    Vec3r point = XformPoint(xform, mesh.point(*vit));
+    out << "v " << point[0] << " " << point[1] << " " << point[2] << "\n";
+  }
+  for (auto fit = mesh.faces_begin(); fit != mesh.faces_end(); ++fit) {
+    out << "f";
+    for (auto fvit = mesh.fv_iter(*fit); fvit.is_valid(); ++fvit)
+      out << " " << (*fvit).idx() + 1;
+    out << "\n";
+  }
+}
+
+
+//! \brief Read a whole file
+std::string
+ReadFile(const std::string &filepath)
+{
+  std::ifstream in(filepath, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+
+//! \brief Replace a file's contents
+void
+WriteFile(const std::string &filepath, const std::string &contents)
+{
+  std::ofstream out(filepath, std::ios::binary | std::ios::trunc);
+  out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+}
+
+}  // namespace
+
+
 TEST_CASE("DoNothing") {
 }
+
+
+TEST_CASE("Renders don't depend on thread count or tile size") {
+  spdlog::set_level(spdlog::level::warn);
+  auto test_scene = MakeTestScene();
+  RayTracer reference;
+  SetUpTestRayTracer(reference);
+  reference.SetNumThreads(1);
+  REQUIRE(reference.Render(test_scene.scene, test_scene.lights,
+                           test_scene.camera));
+
+  RayTracer raytracer;
+  SetUpTestRayTracer(raytracer);
+  raytracer.SetNumThreads(4);
+  raytracer.SetTileSize(GENERATE(5u, 32u));
+  REQUIRE(raytracer.Render(test_scene.scene, test_scene.lights,
+                           test_scene.camera));
+  RequireSameFilm(raytracer.GetFilm(), reference.GetFilm());
+}
+
+
+TEST_CASE("A time budget stops single-pass renders after a pass") {
+  spdlog::set_level(spdlog::level::warn);
+  auto test_scene = MakeTestScene();
+  RayTracer raytracer;
+  SetUpTestRayTracer(raytracer);
+  raytracer.SetNumSamplesPerPixel(64);
+  raytracer.SetTimeBudget(Real(1e-6));
+  REQUIRE(raytracer.Render(test_scene.scene, test_scene.lights,
+                           test_scene.camera));
+
+  // the render is split into passes of 64 / 16 samples
+  const auto &film = raytracer.GetFilm();
+  for (int y = 0; y < film.GetHeight(); ++y) {
+    for (int x = 0; x < film.GetWidth(); ++x)
+      REQUIRE(film.GetSampleCount(x, y) == 4);
+  }
+}
+
+
+TEST_CASE("Adaptive sampling stops sampling converged pixels") {
+  spdlog::set_level(spdlog::level::warn);
+  auto test_scene = MakeTestScene();
+  RayTracer raytracer;
+  SetUpTestRayTracer(raytracer);
+  raytracer.SetIntegrator(GENERATE(Integrator::kRecursive,
+                                   Integrator::kWavefront));
+  raytracer.SetNumSamplesPerPixel(64);
+  raytracer.SetSamplesPerPass(8);
+  raytracer.SetAdaptiveSampling(Real(.05), 8);
+  REQUIRE(raytracer.Render(test_scene.scene, test_scene.lights,
+                           test_scene.camera));
+
+  // the background is black, so its pixels converge once they have
+  // the min sample count; pixels that never converge get every sample
+  const auto &film = raytracer.GetFilm();
+  size_t background_pixels = 0, early_pixels = 0, unconverged_pixels = 0;
+  for (int y = 0; y < film.GetHeight(); ++y) {
+    for (int x = 0; x < film.GetWidth(); ++x) {
+      auto count = film.GetSampleCount(x, y);
+      if (film.GetColorSum(x, y).isZero()) {
+        REQUIRE(film.IsConverged(x, y));
+        REQUIRE(count == 8);
+        ++background_pixels;
+      } else if (film.IsConverged(x, y)) {
+        REQUIRE(count >= 8);
+        early_pixels += count < 64;
+      } else {
+        REQUIRE(count == 64);
+        ++unconverged_pixels;
+      }
+    }
+  }
+  REQUIRE(background_pixels > 0);
+  REQUIRE(early_pixels > 0);
+  REQUIRE(unconverged_pixels > 0);
+}
+
+
+#ifndef WIN32
+TEST_CASE("The progress stream writes JSON lines up to full progress") {
+  spdlog::set_level(spdlog::level::warn);
+  namespace pt = boost::property_tree;
+  auto test_scene = MakeTestScene();
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+
+  // read the stream while rendering, so that a full pipe can't block
+  // the render
+  std::string stream;
+  std::thread reader([&] {
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+      stream.append(buffer, static_cast<size_t>(count));
+  });
+  RayTracer raytracer;
+  SetUpTestRayTracer(raytracer);
+  raytracer.SetNumSamplesPerPixel(64);
+  raytracer.SetProgressInterval(Real(.01));
+  raytracer.SetProgressFd(fds[1]);
+  bool rendered = raytracer.Render(test_scene.scene, test_scene.lights,
+                                   test_scene.camera);
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+  REQUIRE(rendered);
+
+  // every line is a JSON object; progress never goes back, and the
+  // last line, and only it, reports the finished render
+  std::istringstream lines{stream};
+  std::string line;
+  uint64_t pixels_done = 0, samples_done = 0, pixels_total = 0;
+  bool done = false;
+  while (std::getline(lines, line)) {
+    REQUIRE(!done);
+    pt::ptree json;
+    std::istringstream line_text{line};
+    REQUIRE_NOTHROW(pt::read_json(line_text, json));
+    auto pixels = json.get<uint64_t>("pixels_done");
+    auto samples = json.get<uint64_t>("samples_done") +
+      json.get<uint64_t>("samples_skipped");
+    REQUIRE(pixels >= pixels_done);
+    REQUIRE(samples >= samples_done);
+    pixels_done = pixels;
+    samples_done = samples;
+    pixels_total = json.get<uint64_t>("pixels_total");
+    done = json.get<bool>("done");
+  }
+  REQUIRE(done);
+  REQUIRE(pixels_total == static_cast<uint64_t>(
+    raytracer.GetFilm().GetWidth() * raytracer.GetFilm().GetHeight()));
+  REQUIRE(pixels_done == pixels_total);
+  REQUIRE(samples_done == pixels_total * 64);
+}
+#endif
+
+
+TEST_CASE("Renders resumed from checkpoints match uninterrupted ones") {
+  spdlog::set_level(spdlog::level::off);
+  namespace fs = boost::filesystem;
+  auto test_scene = MakeTestScene();
+  auto set_up = [](RayTracer &raytracer) {
+    SetUpTestRayTracer(raytracer);
+    raytracer.SetNumSamplesPerPixel(32);
+    raytracer.SetSamplesPerPass(4);
+    raytracer.SetAdaptiveSampling(Real(.05), 8);
+  };
+  RayTracer reference;
+  set_up(reference);
+  REQUIRE(reference.Render(test_scene.scene, test_scene.lights,
+                           test_scene.camera));
+
+  auto directory = fs::temp_directory_path() /
+    fs::unique_path("olio_tests_%%%%%%%%");
+  fs::create_directories(directory);
+  auto checkpoint_path = (directory / "render.ckpt").string();
+
+  // the budget runs out after the first pass of each render; the
+  // last render finishes
+  for (int pass = 1; pass <= 3; ++pass) {
+    RayTracer raytracer;
+    set_up(raytracer);
+    raytracer.SetCheckpoint(checkpoint_path, 0);
+    raytracer.SetResume(pass > 1);
+    if (pass < 3)
+      raytracer.SetTimeBudget(Real(1e-6));
+    REQUIRE(raytracer.Render(test_scene.scene, test_scene.lights,
+                             test_scene.camera));
+    const auto &film = raytracer.GetFilm();
+    if (pass < 3)
+      REQUIRE(film.GetSampleCount(0, 0) == 4 * static_cast<uint>(pass));
+    else
+      RequireSameFilm(film, reference.GetFilm());
+  }
+
+  // the checkpoint is the only file left, and only resumes renders of
+  // the same crop window
+  size_t file_count = 0;
+  for (fs::directory_iterator it(directory), end; it != end; ++it)
+    ++file_count;
+  REQUIRE(file_count == 1);
+  RayTracer cropped;
+  set_up(cropped);
+  cropped.SetCheckpoint(checkpoint_path, 0);
+  cropped.SetResume(true);
+  cropped.SetCropWindow(cv::Rect{0, 0, 8, 8});
+  REQUIRE_FALSE(cropped.Render(test_scene.scene, test_scene.lights,
+                               test_scene.camera));
+  fs::remove_all(directory);
+}
+
+
+TEST_CASE("Films are only read back at the expected size") {
+  spdlog::set_level(spdlog::level::off);
+  Film film{4, 3};
+  film.AddSample(1, 2, Vec3r{1, 2, 3});
+  film.AddSample(3, 0, Vec3r{.5, .5, .5});
+  std::ostringstream out{std::ios::binary};
+  REQUIRE(film.Write(out));
+  auto data = out.str();
+
+  Film read_film;
+  std::istringstream in{data, std::ios::binary};
+  REQUIRE(read_film.Read(in, 4, 3));
+  RequireSameFilm(read_film, film);
+
+  // a film of another size or with missing data leaves an empty film
+  // of the expected size
+  std::istringstream other_size{data, std::ios::binary};
+  REQUIRE(!read_film.Read(other_size, 3, 4));
+  REQUIRE(read_film.GetWidth() == 3);
+  REQUIRE(read_film.GetHeight() == 4);
+  std::istringstream truncated{data.substr(0, data.size() - 1),
+                               std::ios::binary};
+  REQUIRE(!read_film.Read(truncated, 4, 3));
+  REQUIRE(read_film.GetWidth() == 4);
+  REQUIRE(read_film.GetSampleCount(1, 2) == 0);
+
+  // a damaged size is rejected before the film is resized for it
+  auto damaged = data;
+  int32_t huge_size = 1 << 30;
+  std::memcpy(&damaged[0], &huge_size, sizeof(huge_size));
+  std::memcpy(&damaged[sizeof(huge_size)], &huge_size, sizeof(huge_size));
+  std::istringstream damaged_in{damaged, std::ios::binary};
+  REQUIRE(!read_film.Read(damaged_in, 4, 3));
+  REQUIRE(read_film.GetWidth() == 4);
+  REQUIRE(read_film.GetHeight() == 3);
+}
+
+
+#ifndef WIN32
+TEST_CASE("Tiles handed out again are added to the film once") {
+  spdlog::set_level(spdlog::level::off);
+  namespace fs = boost::filesystem;
+  auto directory = fs::temp_directory_path() /
+    fs::unique_path("olio_tests_%%%%%%%%");
+  fs::create_directories(directory);
+  RenderJob job;
+  job.scene_path = (directory / "scene.scn").string();
+  WriteFile(job.scene_path,
+            "l a .2 .2 .2\n"
+            "l s 0 4 -3 0 -1 0 1 0 0 2 8 8 8\n"
+            "m .7 .6 .5 .3 .3 .3 20 0 0 0\n"
+            "s 0 -101 -4 100\n"
+            "s 1.2 -.3 -3.5 .7\n"
+            "m .1 .1 .1 .5 .5 .5 50 .8 .8 .8\n"
+            "s -1 0 -4 1\n"
+            "c 0 0 0 0 0 -1 .035 .04 .03 32 24\n");
+  job.image_height = 24;
+  job.samples_per_pixel = 4;
+  job.shadow_samples = 4;
+  job.seed = 7;
+
+  // local render
+  Surface::Ptr scene;
+  std::vector<Light::Ptr> lights;
+  Camera::Ptr camera;
+  Vec2i image_size;
+  REQUIRE(job.LoadScene(scene, lights, camera, image_size));
+  RayTracer reference;
+  job.Configure(reference);
+  reference.SetShowProgressBar(false);
+  REQUIRE(reference.Render(scene, lights, camera));
+
+  // a zero timeout hands out every tile that isn't back yet again, so
+  // both workers render some tiles twice; the workers start first, so
+  // that they retry connecting in step and both join the render
+  std::random_device random_device;
+  auto port = 20000 + random_device() % 40000;
+  bool is_worker_done[2] = {false, false};
+  std::vector<std::thread> worker_threads;
+  for (auto &is_done : is_worker_done) {
+    worker_threads.emplace_back([&is_done, port] {
+      RenderWorker worker{"localhost", port};
+      worker.SetNumThreads(1);
+      worker.SetConnectTimeout(10);
+      is_done = worker.Run();
+    });
+  }
+  RayTracer raytracer;
+  job.Configure(raytracer);
+  RenderCoordinator coordinator{job, port};
+  coordinator.SetTileSize(8);
+  coordinator.SetTileTimeout(0);
+  bool is_rendered = coordinator.Render(raytracer, camera);
+  for (auto &thread : worker_threads)
+    thread.join();
+  fs::remove_all(directory);
+  REQUIRE(is_rendered);
+  REQUIRE(is_worker_done[0]);
+  REQUIRE(is_worker_done[1]);
+  REQUIRE(coordinator.GetNumHandOuts() > 12);  // 32x24 pixels, 8x8 tiles
+  RequireSameFilm(raytracer.GetFilm(), reference.GetFilm());
+}
+#endif
+
+
+TEST_CASE("Secondary ray sort keys order octant, origin, and index") {
+  // a 1024^3 grid over [0, 1024)^3
+  const Vec3r bmin{0, 0, 0};
+  const Vec3r scale{1, 1, 1};
+  const Vec3r corner{1023, 1023, 1023};
+  const Vec3r positive{1, 1, 1};
+  const Vec3r negative{-1, -1, -1};
+  const uint64_t max_index = (uint64_t{1} << 31) - 1;
+  auto key = [&](const Vec3r &origin, const Vec3r &direction,
+                 uint64_t ray_index) {
+    return WavefrontIntegrator::ComputeSortKey(origin, direction, bmin, scale,
+                                               ray_index);
+  };
+
+  // each field fills its own bits; together they fill all 64
+  uint64_t octant_bits = key(bmin, negative, 0);
+  uint64_t morton_bits = key(corner, positive, 0);
+  uint64_t index_bits = key(bmin, positive, max_index);
+  REQUIRE(octant_bits == uint64_t{7} << 61);
+  REQUIRE(morton_bits == ((uint64_t{1} << 30) - 1) << 31);
+  REQUIRE(index_bits == max_index);
+  REQUIRE((octant_bits | morton_bits | index_bits) == ~uint64_t{0});
+  REQUIRE(key(corner, negative, max_index) == ~uint64_t{0});
+
+  // origins outside the grid are clamped to it
+  REQUIRE(key(Vec3r{-5, -5, -5}, positive, 0) == 0);
+  REQUIRE(key(Vec3r{5000, 5000, 5000}, positive, 0) == morton_bits);
+
+  // the octant comes first, then the Morton code, then the index
+  REQUIRE(key(corner, positive, max_index) <
+          key(bmin, Vec3r{-1, 1, 1}, 0));
+  REQUIRE(key(bmin, Vec3r{-1, 1, 1}, max_index) <
+          key(bmin, Vec3r{1, -1, 1}, 0));
+  REQUIRE(key(Vec3r{0, 0, 0}, positive, max_index) <
+          key(Vec3r{1, 0, 0}, positive, 0));
+  REQUIRE(key(Vec3r{1, 1, 1}, positive, max_index) <
+          key(Vec3r{2, 0, 0}, positive, 0));
+  REQUIRE(key(Vec3r{3, 5, 7}, positive, 1) < key(Vec3r{3, 5, 7}, positive, 2));
+}
+
+
+TEST_CASE("BVH refit matches a rebuilt BVH") {
+  spdlog::set_level(spdlog::level::warn);
+  std::mt19937 rng{21};
+  auto layout = GENERATE(BVHLayout::kTree, BVHLayout::kLinear,
+                         BVHLayout::kWide4, BVHLayout::kWide8);
+  auto split_method = GENERATE(BVHSplitMethod::kMedian, BVHSplitMethod::kSAH,
+                               BVHSplitMethod::kLBVH, BVHSplitMethod::kSBVH);
+  BVHBuildOptions options;
+  options.layout = layout;
+  options.split_method = split_method;
+  auto surfaces = RandomSpheres(300, rng);
+  auto rays = RandomRays(2000, rng);
+  auto bvh = BVHNode::BuildAccelerator(surfaces, options);
+  REQUIRE(bvh);
+
+  // move a few spheres a little: refit only
+  std::uniform_real_distribution<Real> offset(-1, 1);
+  for (size_t i = 0; i < surfaces.size(); i += 7) {
+    auto sphere = std::dynamic_pointer_cast<Sphere>(surfaces[i]);
+    sphere->SetCenter(sphere->GetCenter() +
+                      Vec3r{offset(rng), offset(rng), offset(rng)});
+  }
+  BVHRefitStats stats;
+  REQUIRE(BVHNode::RefitAccelerator(bvh, options, stats));
+  REQUIRE(stats.moved_surfaces == (surfaces.size() + 6) / 7);
+  REQUIRE(stats.refit_nodes > 0);
+  RequireSameHits(bvh, BVHNode::BuildAccelerator(surfaces, options), rays);
+
+  // scatter all the spheres, with a threshold that forces rebuilds
+  std::uniform_real_distribution<Real> position(-10, 10);
+  for (auto &surface : surfaces)
+    std::dynamic_pointer_cast<Sphere>(surface)->SetCenter(
+      Vec3r{position(rng), position(rng), position(rng)});
+  options.rebuild_threshold = Real(1.01);
+  REQUIRE(BVHNode::RefitAccelerator(bvh, options, stats));
+  REQUIRE(stats.moved_surfaces == surfaces.size());
+  REQUIRE(stats.rebuilt_subtrees > 0);
+  RequireSameHits(bvh, BVHNode::BuildAccelerator(surfaces, options), rays);
+}
+
+
+TEST_CASE("SBVH refits count surfaces in several leaves once") {
+  spdlog::set_level(spdlog::level::warn);
+  std::mt19937 rng{21};
+  BVHBuildOptions options;
+  options.layout = GENERATE(BVHLayout::kTree, BVHLayout::kLinear,
+                            BVHLayout::kWide4, BVHLayout::kWide8);
+  options.split_method = BVHSplitMethod::kSBVH;
+
+  // long, thin triangles across the scene get split between leaves
+  std::uniform_real_distribution<Real> position(-10, 10);
+  std::vector<Surface::Ptr> surfaces;
+  for (int i = 0; i < 300; ++i) {
+    Vec3r a{position(rng), position(rng), position(rng)};
+    Vec3r b{position(rng), position(rng), position(rng)};
+    surfaces.push_back(Triangle::Create(
+      std::vector<Vec3r>{a, b, b + Vec3r{0, Real(.1), 0}}));
+  }
+  BVHNode::SetCollectTreeStats(true);
+  auto bvh = BVHNode::BuildAccelerator(surfaces, options);
+  auto tree_stats = BVHNode::GetTreeStats();
+  BVHNode::SetCollectTreeStats(false);
+  REQUIRE(bvh);
+  REQUIRE(tree_stats.size() == 1);
+  REQUIRE(tree_stats[0].primitive_count > surfaces.size());
+
+  // all the triangles move
+  for (auto &surface : surfaces)
+    surface->SetBoundDirty(true);
+  BVHRefitStats stats;
+  REQUIRE(BVHNode::RefitAccelerator(bvh, options, stats));
+  REQUIRE(stats.moved_surfaces == surfaces.size());
+}
+
+
+TEST_CASE("Rebuilt BVH subtrees use the BVH split method") {
+  spdlog::set_level(spdlog::level::warn);
+  std::mt19937 rng{21};
+  BVHBuildOptions options;
+  options.layout = GENERATE(BVHLayout::kTree, BVHLayout::kLinear,
+                            BVHLayout::kWide4, BVHLayout::kWide8);
+  options.split_method = GENERATE(BVHSplitMethod::kMedian,
+                                  BVHSplitMethod::kSBVH);
+
+  // spheres, and long, thin triangles that SBVHs split between leaves
+  auto surfaces = RandomSpheres(300, rng);
+  std::uniform_real_distribution<Real> position(-10, 10);
+  for (int i = 0; i < 100; ++i) {
+    Vec3r a{position(rng), position(rng), position(rng)};
+    Vec3r b{position(rng), position(rng), position(rng)};
+    surfaces.push_back(Triangle::Create(
+      std::vector<Vec3r>{a, b, b + Vec3r{0, Real(.1), 0}}));
+  }
+  auto bvh = BVHNode::BuildAccelerator(surfaces, options);
+  REQUIRE(bvh);
+
+  // swap two spheres a few units apart: their subtrees degrade much
+  // more than the whole tree
+  auto first = std::dynamic_pointer_cast<Sphere>(surfaces[0]);
+  for (size_t i = 1; i < 300; ++i) {
+    auto second = std::dynamic_pointer_cast<Sphere>(surfaces[i]);
+    Vec3r center = second->GetCenter();
+    Real distance = (center - first->GetCenter()).norm();
+    if (distance > 3 && distance < 5) {
+      second->SetCenter(first->GetCenter());
+      first->SetCenter(center);
+      break;
+    }
+  }
+  options.rebuild_threshold = Real(1.01);
+  BVHRefitStats stats;
+  REQUIRE(BVHNode::RefitAccelerator(bvh, options, stats));
+  REQUIRE(stats.rebuilt_subtrees > 0);
+  REQUIRE(stats.rebuilt_surfaces < surfaces.size());
+  RequireSameHits(bvh, BVHNode::BuildAccelerator(surfaces, options),
+                  RandomRays(2000, rng));
+}
+
+
+TEST_CASE("Refitting a surface that isn't a BVH fails") {
+  spdlog::set_level(spdlog::level::off);
+  BVHRefitStats stats;
+  Surface::Ptr sphere = Sphere::Create(Vec3r{0, 0, 0}, Real(1));
+  REQUIRE_FALSE(BVHNode::RefitAccelerator(sphere, BVHBuildOptions{}, stats));
+  REQUIRE_FALSE(BVHNode::RefitAccelerator(nullptr, BVHBuildOptions{}, stats));
+}
+
+
+TEST_CASE("BVHs find the closest hits") {
+  spdlog::set_level(spdlog::level::warn);
+
+  // every builder with the tree layout, every layout with SAH and SBVH
+  // splits (SBVH leaves share surfaces), and LBVH splits with the
+  // packed mesh BVH
+  auto options = GENERATE(
+    MakeBVHBuildOptions(BVHSplitMethod::kMedian, BVHLayout::kTree),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kTree),
+    MakeBVHBuildOptions(BVHSplitMethod::kLBVH, BVHLayout::kTree),
+    MakeBVHBuildOptions(BVHSplitMethod::kSBVH, BVHLayout::kTree),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kLinear),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kWide4),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kWide8),
+    MakeBVHBuildOptions(BVHSplitMethod::kSBVH, BVHLayout::kLinear),
+    MakeBVHBuildOptions(BVHSplitMethod::kSBVH, BVHLayout::kWide4),
+    MakeBVHBuildOptions(BVHSplitMethod::kSBVH, BVHLayout::kWide8),
+    MakeBVHBuildOptions(BVHSplitMethod::kLBVH, BVHLayout::kLinear));
+  auto test_scene = MakeBVHTestScene(options);
+  REQUIRE(test_scene.bvh);
+  switch (options.layout) {
+  case BVHLayout::kTree:
+    REQUIRE(std::dynamic_pointer_cast<BVHNode>(test_scene.bvh));
+    break;
+  case BVHLayout::kLinear:
+    REQUIRE(std::dynamic_pointer_cast<LinearBVH>(test_scene.bvh));
+    break;
+  case BVHLayout::kWide4:
+    REQUIRE(std::dynamic_pointer_cast<WideBVH4>(test_scene.bvh));
+    break;
+  case BVHLayout::kWide8:
+    REQUIRE(std::dynamic_pointer_cast<WideBVH8>(test_scene.bvh));
+    break;
+  }
+  RequireSameHits(test_scene.bvh, test_scene.reference, test_scene.rays,
+                  test_scene.mesh, test_scene.reference_mesh);
+}
+
+
+TEST_CASE("Parallel BVH builds match serial builds") {
+  spdlog::set_level(spdlog::level::warn);
+  TriMeshBVH::SetCacheDirectory("");
+  std::mt19937 rng{12};
+
+  // large enough that nodes are binned and partitioned in parallel
+  auto surfaces = RandomSpheres(40000, rng);
+  auto mesh = RandomTriangles(40000, rng);
+  BVHBuildOptions options;
+  options.split_method = GENERATE(BVHSplitMethod::kMedian,
+                                  BVHSplitMethod::kSAH,
+                                  BVHSplitMethod::kLBVH,
+                                  BVHSplitMethod::kSBVH);
+  options.num_threads = 1;
+  auto serial_bvh = LinearBVH::BuildBVH(surfaces, options);
+  auto serial_mesh_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  options.num_threads = 4;
+  auto bvh = LinearBVH::BuildBVH(surfaces, options);
+  auto mesh_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+
+  const auto &nodes = bvh->GetNodes();
+  const auto &serial_nodes = serial_bvh->GetNodes();
+  REQUIRE(nodes.size() == serial_nodes.size());
+  REQUIRE(memcmp(nodes.data(), serial_nodes.data(),
+                 nodes.size() * sizeof(nodes[0])) == 0);
+  REQUIRE(bvh->GetSurfaces() == serial_bvh->GetSurfaces());
+
+  const auto &mesh_nodes = TriMeshBVHAccess::GetNodes(*mesh_bvh);
+  const auto &serial_mesh_nodes =
+    TriMeshBVHAccess::GetNodes(*serial_mesh_bvh);
+  REQUIRE(mesh_nodes.size() == serial_mesh_nodes.size());
+  REQUIRE(memcmp(mesh_nodes.data(), serial_mesh_nodes.data(),
+                 mesh_nodes.size() * sizeof(mesh_nodes[0])) == 0);
+  const auto &triangles = TriMeshBVHAccess::GetTriangles(*mesh_bvh);
+  const auto &serial_triangles =
+    TriMeshBVHAccess::GetTriangles(*serial_mesh_bvh);
+  REQUIRE(triangles.size() == serial_triangles.size());
+  for (size_t i = 0; i < triangles.size(); ++i)
+    REQUIRE(triangles[i].face == serial_triangles[i].face);
+}
+
+
+TEST_CASE("Mesh instances match transformed meshes") {
+  spdlog::set_level(spdlog::level::warn);
+  TriMeshBVH::SetCacheDirectory("");
+  namespace fs = boost::filesystem;
+  auto directory = fs::temp_directory_path() /
+    fs::unique_path("olio_tests_%%%%%%%%");
+  fs::create_directories(directory);
+
+  // a non-uniform scale and rotation, and a uniform scale of .04
+  Mat4r xforms[2];
+  xforms[0] << Real(.4), Real(-.3), 0, -5,
+               Real(.15), Real(.2), 0, 0,
+               0, 0, Real(.3), 0,
+               0, 0, 0, 1;
+  xforms[1] << Real(.04), 0, 0, 5,
+               0, Real(.04), 0, 0,
+               0, 0, Real(.04), 0,
+               0, 0, 0, 1;
+
+  // disjoint triangles, so that interpolated normals are face normals
+  std::mt19937 rng{19};
+  auto mesh = RandomTriangles(300, rng);
+  WriteOBJ((directory / "mesh.obj").string(), *mesh, Mat4r::Identity());
+  std::ostringstream instance_scene, mesh_scene;
+  instance_scene.precision(std::numeric_limits<Real>::max_digits10);
+  const char *materials[2] = {"m .7 .6 .5 .3 .3 .3 20 0 0 0\n",
+                              "m .2 .4 .6 .6 .6 .6 50 0 0 0\n"};
+  for (int i = 0; i < 2; ++i) {
+    instance_scene << materials[i] << "x mesh.obj";
+    for (int row = 0; row < 3; ++row) {
+      for (int col = 0; col < 4; ++col)
+        instance_scene << " " << xforms[i](row, col);
+    }
+    instance_scene << "\n";
+    auto mesh_file = "mesh" + std::to_string(i) + ".obj";
+    WriteOBJ((directory / mesh_file).string(), *mesh, xforms[i]);
+    mesh_scene << materials[i] << "w " << mesh_file << "\n";
+  }
+  const std::string camera = "c 0 0 0 0 0 -1 .035 .04 .03 32 24\n";
+  WriteFile((directory / "instances.scn").string(),
+            instance_scene.str() + camera);
+  WriteFile((directory / "meshes.scn").string(), mesh_scene.str() + camera);
+
+  Surface::Ptr scenes[2];
+  for (int i = 0; i < 2; ++i) {
+    std::vector<Light::Ptr> lights;
+    Camera::Ptr scene_camera;
+    Vec2i image_size;
+    auto scene_file = directory / (i ? "meshes.scn" : "instances.scn");
+    REQUIRE(RaytraParser::ParseFile(scene_file.string(), scenes[i], lights,
+                                    scene_camera, image_size));
+  }
+  fs::remove_all(directory);
+  auto instances =
+    std::dynamic_pointer_cast<SurfaceList>(scenes[0])->GetSurfaces();
+  auto meshes =
+    std::dynamic_pointer_cast<SurfaceList>(scenes[1])->GetSurfaces();
+  REQUIRE(instances.size() == 2);
+  REQUIRE(meshes.size() == 2);
+  auto instance = std::dynamic_pointer_cast<Instance>(instances[0]);
+  REQUIRE(instance);
+  REQUIRE(instance->GetSurface() ==
+          std::dynamic_pointer_cast<Instance>(instances[1])->GetSurface());
+
+  // random rays, and rays toward the small instance
+  auto rays = RandomRays(2000, rng);
+  std::uniform_real_distribution<Real> origin(-12, 12);
+  std::uniform_real_distribution<Real> offset(Real(-.4), Real(.4));
+  for (int i = 0; i < 2000; ++i) {
+    Vec3r from{origin(rng), origin(rng), origin(rng)};
+    Vec3r to{5 + offset(rng), offset(rng), offset(rng)};
+    rays.emplace_back(from, to - from);
+  }
+  size_t hit_counts[2] = {0, 0};
+  for (const auto &ray : rays) {
+    HitRecord hit, mesh_hit;
+    bool is_hit = scenes[0]->Hit(ray, kEpsilon, kInfinity, hit);
+    REQUIRE(is_hit == scenes[1]->Hit(ray, kEpsilon, kInfinity, mesh_hit));
+    if (!is_hit)
+      continue;
+    size_t index = hit.GetSurface() == instances[0] ? 0 : 1;
+    REQUIRE(hit.GetSurface() == instances[index]);
+    REQUIRE(mesh_hit.GetSurface() == meshes[index]);
+    ++hit_counts[index];
+    REQUIRE(hit.GetRayT() == Approx(mesh_hit.GetRayT()));
+    REQUIRE(hit.GetFaceGeoUV().GetFaceId() ==
+            mesh_hit.GetFaceGeoUV().GetFaceId());
+    REQUIRE(hit.IsFrontFace() == mesh_hit.IsFrontFace());
+    REQUIRE(hit.GetNormal().dot(mesh_hit.GetNormal()) ==
+            Approx(1).margin(1e-4));
+
+    // each instance has its own material, like each mesh
+    auto material = std::dynamic_pointer_cast<PhongMaterial>(
+      hit.GetSurface()->GetMaterial());
+    auto mesh_material = std::dynamic_pointer_cast<PhongMaterial>(
+      mesh_hit.GetSurface()->GetMaterial());
+    REQUIRE(material);
+    REQUIRE(mesh_material);
+    REQUIRE(material->GetSpecular() == mesh_material->GetSpecular());
+  }
+  REQUIRE(hit_counts[0] > 0);
+  REQUIRE(hit_counts[1] > 0);
+}
+
+
+TEST_CASE("Mesh BVH cache files round-trip and reject bad files") {
+  spdlog::set_level(spdlog::level::off);
+  TriMeshBVH::SetCacheDirectory("");
+  namespace fs = boost::filesystem;
+  std::mt19937 rng{13};
+  auto mesh = RandomTriangles(1000, rng);
+  BVHBuildOptions options;
+  auto bvh = TriMeshBVH::BuildBVH(*mesh, options);
+
+  // the mesh triangles, in face order
+  std::vector<TriMeshBVHAccess::PackedTriangle> triangles(
+    TriMeshBVHAccess::GetTriangles(*bvh).size());
+  for (const auto &triangle : TriMeshBVHAccess::GetTriangles(*bvh))
+    triangles[static_cast<size_t>(triangle.face)] = triangle;
+
+  auto directory = fs::temp_directory_path() /
+    fs::unique_path("olio_tests_%%%%%%%%");
+  fs::create_directories(directory);
+  auto filepath = (directory / "mesh.bvh").string();
+  const uint64_t key = 0x0123456789abcdef;
+  REQUIRE(TriMeshBVHAccess::Write(*bvh, filepath, key));
+  auto contents = ReadFile(filepath);
+  auto read_bvh = [&] {
+    auto cached_bvh = TriMeshBVH::Create();
+    return TriMeshBVHAccess::Read(*cached_bvh, filepath, key, triangles);
+  };
+
+  SECTION("round trip") {
+    auto cached_bvh = TriMeshBVH::Create();
+    REQUIRE(TriMeshBVHAccess::Read(*cached_bvh, filepath, key, triangles));
+    const auto &nodes = TriMeshBVHAccess::GetNodes(*bvh);
+    const auto &cached_nodes = TriMeshBVHAccess::GetNodes(*cached_bvh);
+    REQUIRE(cached_nodes.size() == nodes.size());
+    REQUIRE(memcmp(cached_nodes.data(), nodes.data(),
+                   nodes.size() * sizeof(nodes[0])) == 0);
+    const auto &bvh_triangles = TriMeshBVHAccess::GetTriangles(*bvh);
+    const auto &cached_triangles =
+      TriMeshBVHAccess::GetTriangles(*cached_bvh);
+    REQUIRE(cached_triangles.size() == bvh_triangles.size());
+    for (size_t i = 0; i < bvh_triangles.size(); ++i)
+      REQUIRE(cached_triangles[i].face == bvh_triangles[i].face);
+    REQUIRE(cached_bvh->GetDepth() == bvh->GetDepth());
+  }
+  SECTION("wrong key") {
+    auto cached_bvh = TriMeshBVH::Create();
+    REQUIRE_FALSE(TriMeshBVHAccess::Read(*cached_bvh, filepath, key + 1,
+                                         triangles));
+  }
+  SECTION("truncated file") {
+    fs::resize_file(filepath, contents.size() - 1);
+    REQUIRE_FALSE(read_bvh());
+    fs::resize_file(filepath, 8);
+    REQUIRE_FALSE(read_bvh());
+  }
+  SECTION("corrupted header") {
+    contents[0] ^= 0x55;
+    WriteFile(filepath, contents);
+    REQUIRE_FALSE(read_bvh());
+  }
+  SECTION("corrupted triangles") {
+    // the last triangle repeats the one before it
+    size_t size = sizeof(TriMeshBVHAccess::PackedTriangle);
+    contents.replace(contents.size() - size, size,
+                     contents.substr(contents.size() - 2 * size, size));
+    WriteFile(filepath, contents);
+    REQUIRE_FALSE(read_bvh());
+  }
+  SECTION("corrupted nodes") {
+    // the root's right child points before the root
+    auto root = TriMeshBVHAccess::GetNodes(*bvh)[0];
+    REQUIRE(root.count == 0);
+    size_t root_offset = contents.size() -
+      triangles.size() * sizeof(TriMeshBVHAccess::PackedTriangle) -
+      TriMeshBVHAccess::GetNodes(*bvh).size() * sizeof(root);
+    root.offset = 0;
+    contents.replace(root_offset, sizeof(root),
+                     reinterpret_cast<const char*>(&root), sizeof(root));
+    WriteFile(filepath, contents);
+    REQUIRE_FALSE(read_bvh());
+  }
+
+  // BuildBVH() stores the BVHs it builds and reads them back
+  TriMeshBVH::SetCacheDirectory(directory.string());
+  fs::remove(filepath);
+  auto built_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  auto cached_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  size_t file_count = 0;
+  for (fs::directory_iterator it(directory), end; it != end; ++it)
+    file_count += it->path().extension() == ".bvh";
+  REQUIRE(file_count == 1);
+  TriMeshBVH::SetCacheDirectory("");
+  fs::remove_all(directory);
+  auto rays = RandomRays(2000, rng);
+  RequireSameHits(cached_bvh, built_bvh, rays);
+}
+
+
+TEST_CASE("Quantized mesh BVHs find the closest hits") {
+  spdlog::set_level(spdlog::level::warn);
+
+  // only packed mesh BVHs (linear layout, SAH or LBVH splits) quantize
+  auto options = GENERATE(
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kLinear),
+    MakeBVHBuildOptions(BVHSplitMethod::kLBVH, BVHLayout::kLinear));
+  options.quantized_nodes = true;
+  auto test_scene = MakeBVHTestScene(options);
+  REQUIRE(test_scene.bvh);
+  auto mesh_bvh = GetMeshBVH(test_scene.mesh);
+  REQUIRE(mesh_bvh);
+  REQUIRE(mesh_bvh->IsQuantized());
+  RequireSameHits(test_scene.bvh, test_scene.reference, test_scene.rays,
+                  test_scene.mesh, test_scene.reference_mesh);
+}
+
+
+TEST_CASE("Quantized mesh BVH bounds contain the exact bounds") {
+  spdlog::set_level(spdlog::level::warn);
+  TriMeshBVH::SetCacheDirectory("");
+  std::mt19937 rng{13};
+  auto mesh = RandomTriangles(5000, rng);
+  BVHBuildOptions options;
+  options.split_method = GENERATE(BVHSplitMethod::kSAH,
+                                  BVHSplitMethod::kLBVH);
+  auto exact_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  options.quantized_nodes = true;
+  auto quantized_bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  REQUIRE(quantized_bvh->IsQuantized());
+
+  // both are depth-first over the same tree
+  const auto &exact_nodes = TriMeshBVHAccess::GetNodes(*exact_bvh);
+  auto decoded_nodes = TriMeshBVHAccess::Decode(*quantized_bvh);
+  REQUIRE(decoded_nodes.size() == exact_nodes.size());
+  for (size_t i = 0; i < exact_nodes.size(); ++i) {
+    REQUIRE(decoded_nodes[i].count == exact_nodes[i].count);
+    REQUIRE(decoded_nodes[i].offset == exact_nodes[i].offset);
+    for (int axis = 0; axis < 3; ++axis) {
+      REQUIRE(decoded_nodes[i].bmin[axis] <= exact_nodes[i].bmin[axis]);
+      REQUIRE(decoded_nodes[i].bmax[axis] >= exact_nodes[i].bmax[axis]);
+    }
+  }
+}
+
+
+TEST_CASE("Mesh BVHs with large leaves keep their linear nodes") {
+  spdlog::set_level(spdlog::level::off);
+  TriMeshBVH::SetCacheDirectory("");
+  std::mt19937 rng{13};
+  auto mesh = RandomTriangles(2000, rng);
+  auto reference_mesh = CopyTriangles(*mesh);
+
+  // costly nodes: leaves hold up to 1000 triangles
+  BVHBuildOptions options;
+  options.max_leaf_size = 1000;
+  options.traversal_cost = 1e6;
+  options.quantized_nodes = true;
+  auto bvh = TriMeshBVH::BuildBVH(*mesh, options);
+  REQUIRE(bvh->GetLeafSizeHistogram().size() > 256);
+  REQUIRE_FALSE(bvh->IsQuantized());
+  BVHNode::SetBuildOptions(options);
+  mesh->BuildBVH();
+  BVHNode::SetBuildOptions(BVHBuildOptions{});
+  RequireSameHits(mesh, reference_mesh, RandomRays(2000, rng), mesh,
+                  reference_mesh);
+}
+
+
+TEST_CASE("Van Emde Boas order only renumbers BVH nodes") {
+  spdlog::set_level(spdlog::level::warn);
+  TriMeshBVH::SetCacheDirectory("");
+  std::mt19937 rng{24};
+  BVHBuildOptions options;
+  BVHBuildOptions veb_options;
+  veb_options.veb_layout = true;
+
+  // the order only applies to wide BVHs and quantized mesh BVHs
+  SECTION("4-wide BVHs") {
+    auto surfaces = RandomSpheres(2000, rng);
+    auto bvh = WideBVH4::BuildBVH(surfaces, options);
+    auto veb_bvh = WideBVH4::BuildBVH(surfaces, veb_options);
+    RequireReorderedWideNodes(*bvh, *veb_bvh);
+    RequireSameHits(veb_bvh, bvh, RandomRays(2000, rng));
+  }
+  SECTION("8-wide BVHs") {
+    auto surfaces = RandomSpheres(2000, rng);
+    auto bvh = WideBVH8::BuildBVH(surfaces, options);
+    auto veb_bvh = WideBVH8::BuildBVH(surfaces, veb_options);
+    RequireReorderedWideNodes(*bvh, *veb_bvh);
+    RequireSameHits(veb_bvh, bvh, RandomRays(2000, rng));
+  }
+  SECTION("quantized mesh BVHs") {
+    auto mesh = RandomTriangles(2000, rng);
+    options.quantized_nodes = true;
+    veb_options.quantized_nodes = true;
+    auto bvh = TriMeshBVH::BuildBVH(*mesh, options);
+    auto veb_bvh = TriMeshBVH::BuildBVH(*mesh, veb_options);
+    REQUIRE(bvh->IsQuantized());
+    REQUIRE(veb_bvh->IsQuantized());
+    RequireReorderedQuantizedNodes(*bvh, *veb_bvh);
+    RequireSameHits(veb_bvh, bvh, RandomRays(2000, rng));
+  }
+}
+
+
+TEST_CASE("Occlusion and packet queries agree with closest hits") {
+  spdlog::set_level(spdlog::level::warn);
+
+  // each layout with its own Occluded() and packet traversals; the
+  // mesh BVH is packed with the linear layout, and quantized once
+  auto options = GENERATE(
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kTree),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kLinear),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kWide4),
+    MakeBVHBuildOptions(BVHSplitMethod::kSAH, BVHLayout::kWide8),
+    MakeQuantizedBVHBuildOptions());
+  auto test_scene = MakeBVHTestScene(options);
+  REQUIRE(test_scene.bvh);
+
+  std::mt19937 rng{25};
+  RequireOcclusionMatchesHits(test_scene.bvh, test_scene.rays, rng);
+  RequireOcclusionMatchesHits(test_scene.mesh, test_scene.rays, rng);
+  RequirePacketsMatchRays(test_scene.bvh, test_scene.rays, rng);
+  RequirePacketsMatchRays(test_scene.mesh, test_scene.rays, rng);
+}
+
+
+TEST_CASE("BVH stats reports parse as text and JSON") {
+  spdlog::set_level(spdlog::level::warn);
+  namespace pt = boost::property_tree;
+  auto test_scene = MakeTestScene();
+  auto spheres = std::dynamic_pointer_cast<SurfaceList>(test_scene.scene);
+  REQUIRE(spheres);
+  BVHNode::SetCollectTreeStats(true);
+  auto bvh = BVHNode::BuildAccelerator(spheres->GetSurfaces(), "spheres");
+  auto tree_stats = BVHNode::GetTreeStats();
+  BVHNode::SetCollectTreeStats(false);
+  REQUIRE(bvh);
+  REQUIRE(tree_stats.size() == 1);
+
+  BVHStats::ResetTraversalStats();
+  BVHStats::SetCollectTraversalStats(true);
+  RayTracer raytracer;
+  SetUpTestRayTracer(raytracer);
+  bool rendered = raytracer.Render(bvh, test_scene.lights, test_scene.camera);
+  BVHStats::SetCollectTraversalStats(false);
+  REQUIRE(rendered);
+  auto traversal_stats = GetTraversalStatsByRayType();
+  REQUIRE(traversal_stats.size() ==
+          static_cast<size_t>(BVHRayType::kCount));
+  REQUIRE(traversal_stats[static_cast<size_t>(BVHRayType::kCamera)].rays);
+  REQUIRE(traversal_stats[static_cast<size_t>(BVHRayType::kShadow)].rays);
+
+  // text: one line for the BVH, then one per ray type that was traced
+  auto lines = FormatBVHStats(tree_stats, traversal_stats);
+  std::regex tree_line{"BVH stats \\(([^,]+), ([^)]+)\\): (\\d+) "
+                       "primitives, (\\d+) nodes, (\\d+) leaves .*"};
+  std::regex traversal_line{"BVH traversal stats \\((\\w+) rays\\): "
+                            "(\\d+) rays, per ray: .*"};
+  std::smatch match;
+  REQUIRE(!lines.empty());
+  REQUIRE(std::regex_match(lines[0], match, tree_line));
+  REQUIRE(match[1] == "spheres");
+  REQUIRE(match[2] == tree_stats[0].type);
+  REQUIRE(std::stoul(match[3]) == tree_stats[0].primitive_count);
+  REQUIRE(std::stoul(match[4]) == tree_stats[0].node_count);
+  REQUIRE(std::stoul(match[5]) == tree_stats[0].leaf_count);
+  size_t line = 1;
+  for (size_t type = 0; type < traversal_stats.size(); ++type) {
+    if (!traversal_stats[type].rays)
+      continue;
+    REQUIRE(line < lines.size());
+    REQUIRE(std::regex_match(lines[line++], match, traversal_line));
+    REQUIRE(match[1] == GetRayTypeName(static_cast<BVHRayType>(type)));
+    REQUIRE(std::stoull(match[2]) == traversal_stats[type].rays);
+  }
+  REQUIRE(line == lines.size());
+
+  // JSON: the same numbers
+  pt::ptree json;
+  std::istringstream json_text{FormatBVHStatsJSON(tree_stats,
+                                                  traversal_stats)};
+  REQUIRE_NOTHROW(pt::read_json(json_text, json));
+  const auto &bvhs = json.get_child("bvhs");
+  REQUIRE(bvhs.size() == 1);
+  const auto &bvh_json = bvhs.front().second;
+  REQUIRE(bvh_json.get<std::string>("name") == "spheres");
+  REQUIRE(bvh_json.get<std::string>("type") == tree_stats[0].type);
+  REQUIRE(bvh_json.get<size_t>("primitives") ==
+          tree_stats[0].primitive_count);
+  REQUIRE(bvh_json.get<size_t>("nodes") == tree_stats[0].node_count);
+  REQUIRE(bvh_json.get<size_t>("leaves") == tree_stats[0].leaf_count);
+  REQUIRE(bvh_json.get<uint>("depth") == tree_stats[0].GetDepth());
+  REQUIRE(bvh_json.get_child("leaves_per_depth").size() ==
+          tree_stats[0].leaf_depths.size());
+  REQUIRE(bvh_json.get<double>("sah_cost") ==
+          Approx(tree_stats[0].sah_cost).margin(1e-6));
+  const auto &traversal_json = json.get_child("traversal");
+  REQUIRE(traversal_json.size() == traversal_stats.size());
+  for (size_t type = 0; type < traversal_stats.size(); ++type) {
+    const auto &stats = traversal_stats[type];
+    const auto &type_json = traversal_json.get_child(
+      GetRayTypeName(static_cast<BVHRayType>(type)));
+    REQUIRE(type_json.get<uint64_t>("rays") == stats.rays);
+    REQUIRE(type_json.get<uint64_t>("queries") == stats.queries);
+    REQUIRE(type_json.get<uint64_t>("node_visits") == stats.node_visits);
+    REQUIRE(type_json.get<uint64_t>("primitive_tests") ==
+            stats.surface_tests);
+    REQUIRE(type_json.get<uint64_t>("culled_nodes") == stats.culled_nodes);
+  }
+
+  // numbers that aren't finite are written as null
+  tree_stats[0].sah_cost = std::numeric_limits<Real>::quiet_NaN();
+  tree_stats[0].build_time = std::numeric_limits<double>::infinity();
+  pt::ptree null_json;
+  std::istringstream null_json_text{FormatBVHStatsJSON(
+    tree_stats, std::vector<BVHTraversalStats>{})};
+  REQUIRE_NOTHROW(pt::read_json(null_json_text, null_json));
+  const auto &null_bvh_json = null_json.get_child("bvhs").front().second;
+  REQUIRE(null_bvh_json.get<std::string>("sah_cost") == "null");
+  REQUIRE(null_bvh_json.get<std::string>("build_time_sec") == "null");
+  REQUIRE(null_bvh_json.get<size_t>("nodes") == tree_stats[0].node_count);
+}